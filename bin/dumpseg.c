@@ -46,6 +46,13 @@
 #include <time.h>
 #endif	/* HAVE_TIME_H */
 
+#if HAVE_LIMITS_H
+#include <limits.h>	/* UINT_MAX */
+#endif	/* HAVE_LIMITS_H */
+
+#include <errno.h>
+#include <stdarg.h>
+#include <pthread.h>
 #include "nilfs.h"
 #include "compat.h"	/* getprogname() */
 #include "segment.h"
@@ -53,26 +60,234 @@
 #ifdef _GNU_SOURCE
 #include <getopt.h>
 static const struct option long_option[] = {
+	{"format", required_argument, NULL, 'f'},
 	{"help", no_argument, NULL, 'h'},
+	{"jobs", required_argument, NULL, 'j'},
+	{"offline", no_argument, NULL, 'o'},
 	{"version", no_argument, NULL, 'V'},
 	{NULL, 0, NULL, 0}
 };
 
 #define DUMPSEG_USAGE	\
-	"Usage: %s [OPTION]... [DEVICE|NODE] SEGNUM...\n"		\
+	"Usage: %s [OPTION]... [DEVICE|NODE] SEGNUM[-[SEGNUM]]...\n"	\
+	"  -f, --format=FORMAT\toutput format (text, json, or binary)\n" \
 	"  -h, --help\t\tdisplay this help and exit\n"			\
+	"  -j, --jobs=COUNT\tdecode COUNT segments in parallel\n"	\
+	"  -o, --offline\t\tread an unmounted device\n"			\
 	"  -V, --version\t\tdisplay version and exit\n"
 #else	/* !_GNU_SOURCE */
-#define DUMPSEG_USAGE	"Usage: %s [-h] [-V] [device|node] segnum...\n"
+#define DUMPSEG_USAGE	\
+	"Usage: %s [-f format] [-h] [-j jobs] [-o] [-V]\n"		\
+	"          [device|node] segnum[-[segnum]]...\n"
 #endif	/* _GNU_SOURCE */
 
 
 #define DUMPSEG_BASE	10
 #define DUMPSEG_BUFSIZE	128
 
+#define DUMPSEG_MAX_JOBS	64
+#define DUMPSEG_WRITE_SIZE	(1UL << 20)	/* size of output writes */
+#define DUMPSEG_SLOTS_PER_JOB	4	/* segments buffered per job */
+
+/* output formats */
+enum {
+	DUMPSEG_FORMAT_TEXT,
+	DUMPSEG_FORMAT_JSON,
+	DUMPSEG_FORMAT_BINARY,
+};
+
+/**
+ * struct dumpseg_binary_header - header of the binary output
+ * @bh_magic: magic string (DUMPSEG_BINARY_MAGIC)
+ * @bh_version: format version
+ * @bh_recsize: size of a block record
+ * @bh_blocksize: block size of the file system
+ * @bh_blocks_per_segment: number of blocks per segment
+ */
+struct dumpseg_binary_header {
+	char bh_magic[8];
+	__le32 bh_version;
+	__le32 bh_recsize;
+	__le32 bh_blocksize;
+	__le32 bh_blocks_per_segment;
+};
+
+#define DUMPSEG_BINARY_MAGIC	"NILFSBLK"
+#define DUMPSEG_BINARY_VERSION	1
+
+/**
+ * struct dumpseg_block_record - block record of the binary output
+ * @br_segnum: segment number
+ * @br_pseg_blocknr: start block number of the log
+ * @br_ino: inode number
+ * @br_cno: checkpoint number (0 for the DAT file)
+ * @br_vblocknr: virtual block number (0 for the DAT file)
+ * @br_blkoff: block offset (0 for node blocks with virtual addresses)
+ * @br_blocknr: disk block number
+ * @br_flags: NILFS_BINFO_COL_* flags
+ * @br_level: B-tree level (node blocks of the DAT file only)
+ * @br_pad: padding
+ */
+struct dumpseg_block_record {
+	__le64 br_segnum;
+	__le64 br_pseg_blocknr;
+	__le64 br_ino;
+	__le64 br_cno;
+	__le64 br_vblocknr;
+	__le64 br_blkoff;
+	__le64 br_blocknr;
+	__u8 br_flags;
+	__u8 br_level;
+	__u8 br_pad[6];
+};
+
+/**
+ * struct dumpseg_buffer - growable output buffer
+ * @data: buffer memory
+ * @len: length of the stored output
+ * @size: size of the buffer memory
+ */
+struct dumpseg_buffer {
+	char *data;
+	size_t len;
+	size_t size;
+};
+
+/**
+ * struct dumpseg_range - range of segments to be dumped
+ * @start: first segment number
+ * @end: last segment number (inclusive)
+ */
+struct dumpseg_range {
+	uint64_t start;
+	uint64_t end;
+};
+
+/**
+ * struct dumpseg_slot - output of a segment decoded by a job
+ * @buf: output of the segment
+ * @done: flag indicating that @buf is ready to be written
+ * @error: errno of the failure to read the segment, or 0
+ */
+struct dumpseg_slot {
+	struct dumpseg_buffer buf;
+	int done;
+	int error;
+};
+
+/* options */
+static int format = DUMPSEG_FORMAT_TEXT;
+static unsigned int njobs = 1;
+static int offline;
+
+static struct nilfs *dumpseg_nilfs;
+static struct dumpseg_range *dumpseg_ranges;
+static size_t dumpseg_nranges;
+
+/* output accumulated until it reaches DUMPSEG_WRITE_SIZE */
+static struct dumpseg_buffer dumpseg_outbuf;
+
+/* state shared by the jobs, protected by dumpseg_lock */
+static pthread_mutex_t dumpseg_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dumpseg_cond = PTHREAD_COND_INITIALIZER;
+static struct dumpseg_slot *dumpseg_slots;
+static unsigned int dumpseg_nslots;
+static size_t dumpseg_range_index;
+static uint64_t dumpseg_next_segnum;
+static uint64_t dumpseg_nissued;
+static uint64_t dumpseg_nwritten;
+static int dumpseg_stopped;
+
 NILFS_UTILS_GITID();
 
-static void dumpseg_print_psegment_error(const struct nilfs_psegment *pseg,
+static void dumpseg_buffer_reserve(struct dumpseg_buffer *buf, size_t len)
+{
+	size_t size;
+	char *data;
+
+	if (buf->len + len <= buf->size)
+		return;
+
+	size = buf->size ? : DUMPSEG_BUFSIZE;
+	while (size < buf->len + len)
+		size <<= 1;
+	data = realloc(buf->data, size);
+	if (unlikely(data == NULL))
+		err(EXIT_FAILURE, "cannot allocate output buffer");
+	buf->data = data;
+	buf->size = size;
+}
+
+static void dumpseg_buffer_append(struct dumpseg_buffer *buf,
+				  const void *data, size_t len)
+{
+	dumpseg_buffer_reserve(buf, len);
+	memcpy(buf->data + buf->len, data, len);
+	buf->len += len;
+}
+
+static __attribute__((format(printf, 2, 3)))
+void dumpseg_printf(struct dumpseg_buffer *buf, const char *fmt, ...)
+{
+	va_list args;
+	int n;
+
+	for (;;) {
+		va_start(args, fmt);
+		n = vsnprintf(buf->data + buf->len, buf->size - buf->len,
+			      fmt, args);
+		va_end(args);
+		if (unlikely(n < 0))
+			err(EXIT_FAILURE, "cannot format output");
+		if (buf->len + n < buf->size)
+			break;
+		dumpseg_buffer_reserve(buf, n + 1);
+	}
+	buf->len += n;
+}
+
+static void dumpseg_write(const void *data, size_t len)
+{
+	const char *p = data;
+	ssize_t n;
+
+	while (len > 0) {
+		n = write(STDOUT_FILENO, p, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			err(EXIT_FAILURE, "write error");
+		}
+		p += n;
+		len -= n;
+	}
+}
+
+static void dumpseg_flush(void)
+{
+	dumpseg_write(dumpseg_outbuf.data, dumpseg_outbuf.len);
+	dumpseg_outbuf.len = 0;
+}
+
+/**
+ * dumpseg_output - write out the output of a segment
+ * @buf: output buffer of the segment
+ *
+ * Small outputs are gathered so that the output is written in chunks of
+ * DUMPSEG_WRITE_SIZE bytes.
+ */
+static void dumpseg_output(const struct dumpseg_buffer *buf)
+{
+	if (dumpseg_outbuf.len + buf->len > DUMPSEG_WRITE_SIZE)
+		dumpseg_flush();
+	if (buf->len >= DUMPSEG_WRITE_SIZE)
+		dumpseg_write(buf->data, buf->len);
+	else
+		dumpseg_buffer_append(&dumpseg_outbuf, buf->data, buf->len);
+}
+
+static void dumpseg_print_psegment_error(struct dumpseg_buffer *buf,
+					 const struct nilfs_psegment *pseg,
 					 const char *errstr)
 {
 	const struct nilfs_segment_summary *segsum = pseg->segsum;
@@ -82,39 +297,40 @@ static void dumpseg_print_psegment_error(const struct nilfs_psegment *pseg,
 	switch (pseg->error) {
 	case NILFS_PSEGMENT_ERROR_ALIGNMENT:
 		hdrsize = le16_to_cpu(segsum->ss_bytes);
-		printf("  error %d (%s) - header size = %u\n",
-		       pseg->error, errstr, hdrsize);
+		dumpseg_printf(buf, "  error %d (%s) - header size = %u\n",
+			       pseg->error, errstr, hdrsize);
 		break;
 	case NILFS_PSEGMENT_ERROR_BIGPSEG:
 		nblocks = le32_to_cpu(segsum->ss_nblocks);
 		excess = ((uint32_t)(pseg->blocknr - pseg->segment->blocknr) +
 			  nblocks) - pseg->segment->nblocks;
-		printf("  error %d (%s) - pseg blkcnt = %" PRIu32 ", "
-		       "excess blkcnt = %" PRIu32 "\n",
-		       pseg->error, errstr, nblocks, excess);
+		dumpseg_printf(buf, "  error %d (%s) - pseg blkcnt = %" PRIu32
+			       ", excess blkcnt = %" PRIu32 "\n",
+			       pseg->error, errstr, nblocks, excess);
 		break;
 	case NILFS_PSEGMENT_ERROR_BIGHDR:
 		hdrsize = le16_to_cpu(segsum->ss_bytes);
 		sumbytes = le32_to_cpu(segsum->ss_sumbytes);
-		printf("  error %d (%s) - header size = %u, summary size = %"
-		       PRIu32 "\n",
-		       pseg->error, errstr, hdrsize, sumbytes);
+		dumpseg_printf(buf, "  error %d (%s) - header size = %u, "
+			       "summary size = %" PRIu32 "\n",
+			       pseg->error, errstr, hdrsize, sumbytes);
 		break;
 	case NILFS_PSEGMENT_ERROR_BIGSUM:
 		sumbytes = le32_to_cpu(segsum->ss_sumbytes);
 		nblocks = le32_to_cpu(segsum->ss_nblocks);
-		printf("  error %d (%s) - summary size = %" PRIu32 ", "
-		       "pseg size = %" PRIu64 "\n",
-		       pseg->error, errstr, sumbytes,
-		       (uint64_t)nblocks << pseg->blkbits);
+		dumpseg_printf(buf, "  error %d (%s) - summary size = %" PRIu32
+			       ", pseg size = %" PRIu64 "\n",
+			       pseg->error, errstr, sumbytes,
+			       (uint64_t)nblocks << pseg->blkbits);
 		break;
 	default:
-		printf("  error %d (%s)\n", pseg->error, errstr);
+		dumpseg_printf(buf, "  error %d (%s)\n", pseg->error, errstr);
 		break;
 	}
 }
 
-static void dumpseg_print_file_error(const struct nilfs_file *file,
+static void dumpseg_print_file_error(struct dumpseg_buffer *buf,
+				     const struct nilfs_file *file,
 				     const char *errstr)
 {
 	const struct nilfs_psegment *pseg = file->psegment;
@@ -125,89 +341,101 @@ static void dumpseg_print_file_error(const struct nilfs_file *file,
 	case NILFS_FILE_ERROR_MANYBLKS:
 		nblocks = le32_to_cpu(file->finfo->fi_nblocks);
 		pseg_nblocks = le32_to_cpu(pseg->segsum->ss_nblocks);
-		printf("%serror %d (%s) - file blkoff = %" PRIu32 ", "
-		       "file blkcnt = %" PRIu32 ", pseg blkcnt = %" PRIu32 "\n",
-		       indent, file->error, errstr,
-		       (uint32_t)(file->blocknr - pseg->blocknr),
-		       nblocks, pseg_nblocks);
+		dumpseg_printf(buf, "%serror %d (%s) - file blkoff = %" PRIu32
+			       ", file blkcnt = %" PRIu32 ", pseg blkcnt = %"
+			       PRIu32 "\n",
+			       indent, file->error, errstr,
+			       (uint32_t)(file->blocknr - pseg->blocknr),
+			       nblocks, pseg_nblocks);
 		break;
 	case NILFS_FILE_ERROR_BLKCNT:
 		nblocks = le32_to_cpu(file->finfo->fi_nblocks);
 		ndatablk = le32_to_cpu(file->finfo->fi_ndatablk);
-		printf("%serror %d (%s) - file blkcnt = %" PRIu32 ", "
-		       "data blkcnt = %" PRIu32 "\n",
-		       indent, file->error, errstr, nblocks, ndatablk);
+		dumpseg_printf(buf, "%serror %d (%s) - file blkcnt = %" PRIu32
+			       ", data blkcnt = %" PRIu32 "\n",
+			       indent, file->error, errstr, nblocks, ndatablk);
 		break;
 	case NILFS_FILE_ERROR_OVERRUN:
 		sumbytes = le32_to_cpu(pseg->segsum->ss_sumbytes);
-		printf("%serror %d (%s) - finfo offset = %" PRIu32 ", "
-		       "finfo total size = %zu, summary size = %" PRIu32 "\n",
-		       indent, file->error, errstr, file->offset, file->sumlen,
-		       sumbytes);
+		dumpseg_printf(buf, "%serror %d (%s) - finfo offset = %" PRIu32
+			       ", finfo total size = %zu, summary size = %"
+			       PRIu32 "\n",
+			       indent, file->error, errstr, file->offset,
+			       file->sumlen, sumbytes);
 		break;
 	default:
-		printf("%serror %d (%s)\n", indent, file->error, errstr);
+		dumpseg_printf(buf, "%serror %d (%s)\n", indent, file->error,
+			       errstr);
 		break;
 	}
 }
 
-static void dumpseg_print_virtual_block(struct nilfs_block *blk)
+static void dumpseg_print_virtual_blocks(struct dumpseg_buffer *buf,
+					 const struct nilfs_binfo_columns *cols)
 {
-	__le64 *binfo = blk->binfo;
-
-	if (nilfs_block_is_data(blk)) {
-		printf("        vblocknr = %" PRIu64 ", blkoff = %" PRIu64 ", "
-		       "blocknr = %" PRIu64 "\n",
-		       (uint64_t)le64_to_cpu(binfo[0]),
-		       (uint64_t)le64_to_cpu(binfo[1]),
-		       blk->blocknr);
-	} else {
-		printf("        vblocknr = %" PRIu64 ", blocknr = %" PRIu64 "\n",
-		       (uint64_t)le64_to_cpu(binfo[0]), blk->blocknr);
+	size_t i;
+
+	for (i = 0; i < cols->count; i++) {
+		if (!(cols->flags[i] & NILFS_BINFO_COL_NODE)) {
+			dumpseg_printf(buf, "        vblocknr = %" PRIu64
+				       ", blkoff = %" PRIu64 ", blocknr = %"
+				       PRIu64 "\n",
+				       cols->vblocknr[i], cols->offset[i],
+				       cols->blocknr[i]);
+		} else {
+			dumpseg_printf(buf, "        vblocknr = %" PRIu64
+				       ", blocknr = %" PRIu64 "\n",
+				       cols->vblocknr[i], cols->blocknr[i]);
+		}
 	}
 }
 
-static void dumpseg_print_real_block(struct nilfs_block *blk)
+static void dumpseg_print_real_blocks(struct dumpseg_buffer *buf,
+				      const struct nilfs_binfo_columns *cols)
 {
-	if (nilfs_block_is_data(blk)) {
-		__le64 *binfo = blk->binfo;
-
-		printf("        blkoff = %" PRIu64 ", blocknr = %" PRIu64 "\n",
-		       (uint64_t)le64_to_cpu(binfo[0]), blk->blocknr);
-	} else {
-		struct nilfs_binfo_dat *bid = blk->binfo;
-
-		printf("        blkoff = %" PRIu64 ", level = %d, blocknr = %"
-		       PRIu64 "\n",
-		       (uint64_t)le64_to_cpu(bid->bi_blkoff), bid->bi_level,
-		       blk->blocknr);
+	size_t i;
+
+	for (i = 0; i < cols->count; i++) {
+		if (!(cols->flags[i] & NILFS_BINFO_COL_NODE)) {
+			dumpseg_printf(buf, "        blkoff = %" PRIu64
+				       ", blocknr = %" PRIu64 "\n",
+				       cols->offset[i], cols->blocknr[i]);
+		} else {
+			dumpseg_printf(buf, "        blkoff = %" PRIu64
+				       ", level = %d, blocknr = %" PRIu64 "\n",
+				       cols->offset[i], cols->level[i],
+				       cols->blocknr[i]);
+		}
 	}
 }
 
-static void dumpseg_print_file(struct nilfs_file *file)
+static void dumpseg_print_file(struct dumpseg_buffer *buf,
+			       struct nilfs_binfo_columns *cols,
+			       struct nilfs_file *file)
 {
-	struct nilfs_block blk;
 	struct nilfs_finfo *finfo = file->finfo;
 
-	printf("    finfo\n");
-	printf("      ino = %" PRIu64 ", cno = %" PRIu64 ", nblocks = %" PRIu32
-	       ", ndatblk = %" PRIu32 "\n",
-	       (uint64_t)le64_to_cpu(finfo->fi_ino),
-	       (uint64_t)le64_to_cpu(finfo->fi_cno),
-	       le32_to_cpu(finfo->fi_nblocks),
-	       le32_to_cpu(finfo->fi_ndatablk));
-	if (!nilfs_file_use_real_blocknr(file)) {
-		nilfs_block_for_each(&blk, file) {
-			dumpseg_print_virtual_block(&blk);
-		}
-	} else {
-		nilfs_block_for_each(&blk, file) {
-			dumpseg_print_real_block(&blk);
-		}
-	}
+	dumpseg_printf(buf, "    finfo\n");
+	dumpseg_printf(buf, "      ino = %" PRIu64 ", cno = %" PRIu64
+		       ", nblocks = %" PRIu32 ", ndatblk = %" PRIu32 "\n",
+		       (uint64_t)le64_to_cpu(finfo->fi_ino),
+		       (uint64_t)le64_to_cpu(finfo->fi_cno),
+		       le32_to_cpu(finfo->fi_nblocks),
+		       le32_to_cpu(finfo->fi_ndatablk));
+
+	nilfs_binfo_columns_reset(cols);
+	if (unlikely(nilfs_binfo_columns_add_file(cols, file) < 0))
+		err(EXIT_FAILURE, "cannot decode block information");
+
+	if (!nilfs_file_use_real_blocknr(file))
+		dumpseg_print_virtual_blocks(buf, cols);
+	else
+		dumpseg_print_real_blocks(buf, cols);
 }
 
-static void dumpseg_print_psegment(struct nilfs_psegment *pseg)
+static void dumpseg_print_psegment(struct dumpseg_buffer *buf,
+				   struct nilfs_binfo_columns *cols,
+				   struct nilfs_psegment *pseg)
 {
 	struct nilfs_file file;
 	struct tm tm;
@@ -215,70 +443,484 @@ static void dumpseg_print_psegment(struct nilfs_psegment *pseg)
 	char timebuf[DUMPSEG_BUFSIZE];
 	time_t t;
 
-	printf("  partial segment: blocknr = %" PRIu64 ", nblocks = %" PRIu32 "\n",
-	       pseg->blocknr, le32_to_cpu(pseg->segsum->ss_nblocks));
+	dumpseg_printf(buf, "  partial segment: blocknr = %" PRIu64
+		       ", nblocks = %" PRIu32 "\n",
+		       pseg->blocknr, le32_to_cpu(pseg->segsum->ss_nblocks));
 
 	t = (time_t)le64_to_cpu(pseg->segsum->ss_create);
 	localtime_r(&t, &tm);
 	strftime(timebuf, DUMPSEG_BUFSIZE, "%F %T", &tm);
-	printf("    creation time = %s\n", timebuf);
-	printf("    nfinfo = %" PRIu32 "\n",
-	       le32_to_cpu(pseg->segsum->ss_nfinfo));
+	dumpseg_printf(buf, "    creation time = %s\n", timebuf);
+	dumpseg_printf(buf, "    nfinfo = %" PRIu32 "\n",
+		       le32_to_cpu(pseg->segsum->ss_nfinfo));
 	nilfs_file_for_each(&file, pseg) {
-		dumpseg_print_file(&file);
+		dumpseg_print_file(buf, cols, &file);
 	}
 	if (nilfs_file_is_error(&file, &errstr))
-		dumpseg_print_file_error(&file, errstr);
+		dumpseg_print_file_error(buf, &file, errstr);
 }
 
-static void dumpseg_print_segment(const struct nilfs_segment *segment)
+static void dumpseg_print_segment(struct dumpseg_buffer *buf,
+				  struct nilfs_binfo_columns *cols,
+				  const struct nilfs_segment *segment)
 {
 	struct nilfs_psegment pseg;
 	const char *errstr;
 	uint64_t next;
 
-	printf("segment: segnum = %" PRIu64 "\n", segment->segnum);
+	dumpseg_printf(buf, "segment: segnum = %" PRIu64 "\n",
+		       segment->segnum);
 	nilfs_psegment_init(&pseg, segment, segment->nblocks);
 
 	if (!nilfs_psegment_is_end(&pseg)) {
 		next = le64_to_cpu(pseg.segsum->ss_next) /
 			segment->blocks_per_segment;
-		printf("  sequence number = %" PRIu64 ", next segnum = %" PRIu64
-		       "\n",
-		       (uint64_t)le64_to_cpu(pseg.segsum->ss_seq), next);
+		dumpseg_printf(buf, "  sequence number = %" PRIu64
+			       ", next segnum = %" PRIu64 "\n",
+			       (uint64_t)le64_to_cpu(pseg.segsum->ss_seq),
+			       next);
 		do {
-			dumpseg_print_psegment(&pseg);
+			dumpseg_print_psegment(buf, cols, &pseg);
 			nilfs_psegment_next(&pseg);
 		} while (!nilfs_psegment_is_end(&pseg));
 	}
 
 	if (nilfs_psegment_is_error(&pseg, &errstr))
-		dumpseg_print_psegment_error(&pseg, errstr);
+		dumpseg_print_psegment_error(buf, &pseg, errstr);
 }
 
-int main(int argc, char *argv[])
+static void dumpseg_json_blocks(struct dumpseg_buffer *buf,
+				const struct nilfs_binfo_columns *cols,
+				int real)
+{
+	size_t i;
+
+	for (i = 0; i < cols->count; i++) {
+		if (i > 0)
+			dumpseg_buffer_append(buf, ",", 1);
+		if (!real) {
+			dumpseg_printf(buf, "{\"vblocknr\":%" PRIu64,
+				       cols->vblocknr[i]);
+			if (!(cols->flags[i] & NILFS_BINFO_COL_NODE))
+				dumpseg_printf(buf, ",\"blkoff\":%" PRIu64,
+					       cols->offset[i]);
+		} else {
+			dumpseg_printf(buf, "{\"blkoff\":%" PRIu64,
+				       cols->offset[i]);
+			if (cols->flags[i] & NILFS_BINFO_COL_NODE)
+				dumpseg_printf(buf, ",\"level\":%d",
+					       cols->level[i]);
+		}
+		dumpseg_printf(buf, ",\"blocknr\":%" PRIu64 "}",
+			       cols->blocknr[i]);
+	}
+}
+
+/**
+ * dumpseg_json_psegment - print a log as a JSON object on a single line
+ * @buf: output buffer
+ * @cols: block information columns used for decoding
+ * @pseg: partial segment iterator
+ */
+static void dumpseg_json_psegment(struct dumpseg_buffer *buf,
+				  struct nilfs_binfo_columns *cols,
+				  struct nilfs_psegment *pseg)
+{
+	const struct nilfs_segment_summary *segsum = pseg->segsum;
+	struct nilfs_finfo *finfo;
+	struct nilfs_file file;
+	const char *errstr;
+	int first = 1;
+
+	dumpseg_printf(buf, "{\"segnum\":%" PRIu64 ",\"seq\":%" PRIu64
+		       ",\"blocknr\":%" PRIu64 ",\"nblocks\":%" PRIu32
+		       ",\"ctime\":%" PRIu64 ",\"nfinfo\":%" PRIu32
+		       ",\"files\":[",
+		       pseg->segment->segnum,
+		       (uint64_t)le64_to_cpu(segsum->ss_seq), pseg->blocknr,
+		       le32_to_cpu(segsum->ss_nblocks),
+		       (uint64_t)le64_to_cpu(segsum->ss_create),
+		       le32_to_cpu(segsum->ss_nfinfo));
+
+	nilfs_file_for_each(&file, pseg) {
+		finfo = file.finfo;
+		nilfs_binfo_columns_reset(cols);
+		if (unlikely(nilfs_binfo_columns_add_file(cols, &file) < 0))
+			err(EXIT_FAILURE, "cannot decode block information");
+
+		dumpseg_printf(buf, "%s{\"ino\":%" PRIu64 ",\"cno\":%" PRIu64
+			       ",\"nblocks\":%" PRIu32 ",\"ndatblk\":%" PRIu32
+			       ",\"blocks\":[",
+			       first ? "" : ",",
+			       (uint64_t)le64_to_cpu(finfo->fi_ino),
+			       (uint64_t)le64_to_cpu(finfo->fi_cno),
+			       le32_to_cpu(finfo->fi_nblocks),
+			       le32_to_cpu(finfo->fi_ndatablk));
+		dumpseg_json_blocks(buf, cols,
+				    nilfs_file_use_real_blocknr(&file));
+		dumpseg_printf(buf, "]}");
+		first = 0;
+	}
+	dumpseg_printf(buf, "]");
+	if (nilfs_file_is_error(&file, &errstr))
+		dumpseg_printf(buf, ",\"error\":\"%s\"", errstr);
+	dumpseg_printf(buf, "}\n");
+}
+
+static void dumpseg_json_segment(struct dumpseg_buffer *buf,
+				 struct nilfs_binfo_columns *cols,
+				 const struct nilfs_segment *segment)
+{
+	struct nilfs_psegment pseg;
+	const char *errstr;
+
+	nilfs_psegment_for_each(&pseg, segment, segment->nblocks) {
+		dumpseg_json_psegment(buf, cols, &pseg);
+	}
+	if (nilfs_psegment_is_error(&pseg, &errstr))
+		dumpseg_printf(buf, "{\"segnum\":%" PRIu64 ",\"blocknr\":%"
+			       PRIu64 ",\"error\":\"%s\"}\n",
+			       segment->segnum, pseg.blocknr, errstr);
+}
+
+static void dumpseg_binary_psegment(struct dumpseg_buffer *buf,
+				    struct nilfs_binfo_columns *cols,
+				    struct nilfs_psegment *pseg)
+{
+	struct dumpseg_block_record *rec;
+	struct nilfs_file file;
+	const char *errstr;
+	size_t i;
+
+	nilfs_binfo_columns_reset(cols);
+	if (unlikely(nilfs_binfo_columns_add_psegment(cols, pseg, &file) < 0))
+		err(EXIT_FAILURE, "cannot decode block information");
+	if (nilfs_file_is_error(&file, &errstr))
+		warnx("segment %" PRIu64 ", log at block %" PRIu64 ": %s",
+		      pseg->segment->segnum, pseg->blocknr, errstr);
+
+	dumpseg_buffer_reserve(buf, cols->count * sizeof(*rec));
+	rec = (struct dumpseg_block_record *)(buf->data + buf->len);
+	memset(rec, 0, cols->count * sizeof(*rec));
+	for (i = 0; i < cols->count; i++, rec++) {
+		rec->br_segnum = cpu_to_le64(pseg->segment->segnum);
+		rec->br_pseg_blocknr = cpu_to_le64(pseg->blocknr);
+		rec->br_ino = cpu_to_le64(cols->ino[i]);
+		rec->br_cno = cpu_to_le64(cols->cno[i]);
+		rec->br_vblocknr = cpu_to_le64(cols->vblocknr[i]);
+		rec->br_blkoff = cpu_to_le64(cols->offset[i]);
+		rec->br_blocknr = cpu_to_le64(cols->blocknr[i]);
+		rec->br_flags = cols->flags[i];
+		rec->br_level = cols->level[i];
+	}
+	buf->len += cols->count * sizeof(*rec);
+}
+
+static void dumpseg_binary_segment(struct dumpseg_buffer *buf,
+				   struct nilfs_binfo_columns *cols,
+				   const struct nilfs_segment *segment)
+{
+	struct nilfs_psegment pseg;
+	const char *errstr;
+
+	nilfs_psegment_for_each(&pseg, segment, segment->nblocks) {
+		dumpseg_binary_psegment(buf, cols, &pseg);
+	}
+	if (nilfs_psegment_is_error(&pseg, &errstr))
+		warnx("segment %" PRIu64 ", log at block %" PRIu64 ": %s",
+		      segment->segnum, pseg.blocknr, errstr);
+}
+
+static void dumpseg_binary_header(void)
+{
+	struct dumpseg_binary_header hdr;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.bh_magic, DUMPSEG_BINARY_MAGIC, sizeof(hdr.bh_magic));
+	hdr.bh_version = cpu_to_le32(DUMPSEG_BINARY_VERSION);
+	hdr.bh_recsize = cpu_to_le32(sizeof(struct dumpseg_block_record));
+	hdr.bh_blocksize = cpu_to_le32(nilfs_get_block_size(dumpseg_nilfs));
+	hdr.bh_blocks_per_segment =
+		cpu_to_le32(nilfs_get_blocks_per_segment(dumpseg_nilfs));
+	dumpseg_buffer_append(&dumpseg_outbuf, &hdr, sizeof(hdr));
+}
+
+static void dumpseg_format_segment(struct dumpseg_buffer *buf,
+				   struct nilfs_binfo_columns *cols,
+				   const struct nilfs_segment *segment)
+{
+	switch (format) {
+	case DUMPSEG_FORMAT_JSON:
+		dumpseg_json_segment(buf, cols, segment);
+		break;
+	case DUMPSEG_FORMAT_BINARY:
+		dumpseg_binary_segment(buf, cols, segment);
+		break;
+	default:
+		dumpseg_print_segment(buf, cols, segment);
+		break;
+	}
+}
+
+/**
+ * dumpseg_next_segment - pick the next segment to be dumped
+ * @segnump: place to store the segment number
+ *
+ * Return: 1 if a segment is picked, or 0 if all segments were picked.
+ */
+static int dumpseg_next_segment(uint64_t *segnump)
+{
+	const struct dumpseg_range *range;
+
+	if (dumpseg_range_index >= dumpseg_nranges)
+		return 0;
+
+	range = &dumpseg_ranges[dumpseg_range_index];
+	*segnump = dumpseg_next_segnum;
+	if (dumpseg_next_segnum < range->end) {
+		dumpseg_next_segnum++;
+	} else if (++dumpseg_range_index < dumpseg_nranges) {
+		dumpseg_next_segnum = range[1].start;
+	}
+	return 1;
+}
+
+/**
+ * dumpseg_dump_segment - read and format a segment
+ * @segnum: segment number
+ * @buf: output buffer
+ * @cols: block information columns used for decoding
+ *
+ * Return: 0 on success, or -1 with errno set if the segment cannot be
+ * read.
+ */
+static int dumpseg_dump_segment(uint64_t segnum, struct dumpseg_buffer *buf,
+				struct nilfs_binfo_columns *cols)
 {
-	struct nilfs *nilfs;
-	uint64_t segnum;
-	char *dev, *endptr;
 	struct nilfs_segment segment;
-	int c, i, status;
 	int ret;
+
+	ret = nilfs_get_segment(dumpseg_nilfs, segnum, &segment);
+	if (ret < 0)
+		return -1;
+
+	dumpseg_format_segment(buf, cols, &segment);
+
+	ret = nilfs_put_segment(&segment);
+	if (unlikely(ret < 0))
+		err(EXIT_FAILURE, "failed to release segment");
+	return 0;
+}
+
+static int dumpseg_run_serial(void)
+{
+	struct nilfs_binfo_columns cols;
+	struct dumpseg_buffer buf;
+	uint64_t segnum;
+	int status = EXIT_SUCCESS;
+
+	nilfs_binfo_columns_init(&cols);
+	memset(&buf, 0, sizeof(buf));
+
+	while (dumpseg_next_segment(&segnum)) {
+		buf.len = 0;
+		if (dumpseg_dump_segment(segnum, &buf, &cols) < 0) {
+			warn("failed to read segment");
+			status = EXIT_FAILURE;
+			break;
+		}
+		dumpseg_output(&buf);
+	}
+
+	free(buf.data);
+	nilfs_binfo_columns_destroy(&cols);
+	return status;
+}
+
+static void *dumpseg_job(void *arg)
+{
+	struct nilfs_binfo_columns cols;
+	struct dumpseg_slot *slot;
+	uint64_t segnum, seq;
+	int ret;
+
+	nilfs_binfo_columns_init(&cols);
+
+	pthread_mutex_lock(&dumpseg_lock);
+	for (;;) {
+		/* bound the output that has not been written yet */
+		while (!dumpseg_stopped &&
+		       dumpseg_nissued - dumpseg_nwritten >= dumpseg_nslots)
+			pthread_cond_wait(&dumpseg_cond, &dumpseg_lock);
+		if (dumpseg_stopped || !dumpseg_next_segment(&segnum))
+			break;
+		seq = dumpseg_nissued++;
+		slot = &dumpseg_slots[seq % dumpseg_nslots];
+		pthread_mutex_unlock(&dumpseg_lock);
+
+		ret = dumpseg_dump_segment(segnum, &slot->buf, &cols);
+
+		pthread_mutex_lock(&dumpseg_lock);
+		slot->error = ret < 0 ? errno : 0;
+		slot->done = 1;
+		pthread_cond_broadcast(&dumpseg_cond);
+	}
+	pthread_mutex_unlock(&dumpseg_lock);
+
+	nilfs_binfo_columns_destroy(&cols);
+	return NULL;
+}
+
+/**
+ * dumpseg_run_parallel - dump segments with multiple jobs
+ *
+ * The segments are decoded by njobs threads into per-segment buffers,
+ * and the calling thread writes the buffers out in the order of the
+ * segments given on the command line.
+ */
+static int dumpseg_run_parallel(void)
+{
+	struct dumpseg_slot *slot;
+	pthread_t threads[DUMPSEG_MAX_JOBS];
+	unsigned int i, nthreads;
+	int ret, status = EXIT_SUCCESS;
+
+	dumpseg_nslots = njobs * DUMPSEG_SLOTS_PER_JOB;
+	dumpseg_slots = calloc(dumpseg_nslots, sizeof(*dumpseg_slots));
+	if (unlikely(dumpseg_slots == NULL))
+		err(EXIT_FAILURE, "cannot allocate output slots");
+
+	for (nthreads = 0; nthreads < njobs; nthreads++) {
+		ret = pthread_create(&threads[nthreads], NULL, dumpseg_job,
+				     NULL);
+		if (unlikely(ret != 0)) {
+			errno = ret;
+			warn("cannot create thread");
+			status = EXIT_FAILURE;
+			break;
+		}
+	}
+
+	pthread_mutex_lock(&dumpseg_lock);
+	while (nthreads > 0 && !dumpseg_stopped) {
+		slot = &dumpseg_slots[dumpseg_nwritten % dumpseg_nslots];
+		while (!slot->done &&
+		       (dumpseg_range_index < dumpseg_nranges ||
+			dumpseg_nwritten < dumpseg_nissued))
+			pthread_cond_wait(&dumpseg_cond, &dumpseg_lock);
+		if (!slot->done)
+			break;	/* every segment has been written */
+		pthread_mutex_unlock(&dumpseg_lock);
+
+		if (slot->error) {
+			errno = slot->error;
+			warn("failed to read segment");
+			status = EXIT_FAILURE;
+		} else {
+			dumpseg_output(&slot->buf);
+		}
+
+		pthread_mutex_lock(&dumpseg_lock);
+		if (status != EXIT_SUCCESS)
+			dumpseg_stopped = 1;
+		slot->buf.len = 0;
+		slot->done = 0;
+		dumpseg_nwritten++;
+		pthread_cond_broadcast(&dumpseg_cond);
+	}
+	dumpseg_stopped = 1;
+	pthread_cond_broadcast(&dumpseg_cond);
+	pthread_mutex_unlock(&dumpseg_lock);
+
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+
+	for (i = 0; i < dumpseg_nslots; i++)
+		free(dumpseg_slots[i].buf.data);
+	free(dumpseg_slots);
+	return status;
+}
+
+/**
+ * dumpseg_parse_range - parse a segment number or a range of segments
+ * @arg: argument string in the form of N, N-M, or N-
+ * @range: place to store the range
+ *
+ * The end of a range given as N- is set to UINT64_MAX, and is clamped
+ * to the last segment once the file system is opened.
+ *
+ * Return: 0 on success, or -1 if @arg is not a valid range.
+ */
+static int dumpseg_parse_range(const char *arg, struct dumpseg_range *range)
+{
+	char *endptr;
+
+	errno = 0;
+	range->start = strtoull(arg, &endptr, DUMPSEG_BASE);
+	if (endptr == arg || errno)
+		return -1;
+	if (*endptr == '\0') {
+		range->end = range->start;
+		return 0;
+	}
+	if (*endptr != '-')
+		return -1;
+
+	arg = endptr + 1;
+	if (*arg == '\0') {
+		range->end = UINT64_MAX;
+		return 0;
+	}
+	range->end = strtoull(arg, &endptr, DUMPSEG_BASE);
+	if (endptr == arg || *endptr != '\0' || errno ||
+	    range->end < range->start)
+		return -1;
+	return 0;
+}
+
+static void dumpseg_parse_options(int argc, char *argv[])
+{
+	unsigned long val;
+	char *endptr;
+	int c;
 #ifdef _GNU_SOURCE
 	int option_index;
 #endif	/* _GNU_SOURCE */
 
 #ifdef _GNU_SOURCE
-	while ((c = getopt_long(argc, argv, "hV",
+	while ((c = getopt_long(argc, argv, "f:hj:oV",
 				long_option, &option_index)) >= 0) {
 #else	/* !_GNU_SOURCE */
-	while ((c = getopt(argc, argv, "hV")) >= 0) {
+	while ((c = getopt(argc, argv, "f:hj:oV")) >= 0) {
 #endif	/* _GNU_SOURCE */
 
 		switch (c) {
+		case 'f':
+			if (strcmp(optarg, "text") == 0)
+				format = DUMPSEG_FORMAT_TEXT;
+			else if (strcmp(optarg, "json") == 0)
+				format = DUMPSEG_FORMAT_JSON;
+			else if (strcmp(optarg, "binary") == 0)
+				format = DUMPSEG_FORMAT_BINARY;
+			else
+				errx(EXIT_FAILURE, "invalid format: %s",
+				     optarg);
+			break;
 		case 'h':
 			printf(DUMPSEG_USAGE, getprogname());
 			exit(EXIT_SUCCESS);
+		case 'j':
+			errno = 0;
+			val = strtoul(optarg, &endptr, 10);
+			if (endptr == optarg || *endptr != '\0' || errno ||
+			    val == 0 || val > DUMPSEG_MAX_JOBS)
+				errx(EXIT_FAILURE, "invalid job count: %s",
+				     optarg);
+			njobs = val;
+			break;
+		case 'o':
+			offline = 1;
+			break;
 		case 'V':
 			printf("%s (%s %s)\n", getprogname(), PACKAGE,
 			       PACKAGE_VERSION);
@@ -287,50 +929,83 @@ int main(int argc, char *argv[])
 			exit(EXIT_FAILURE);
 		}
 	}
+}
+
+int main(int argc, char *argv[])
+{
+	struct dumpseg_range range;
+	uint64_t nsegments;
+	char *dev;
+	size_t i;
+	int open_flags, status;
+
+	dumpseg_parse_options(argc, argv);
 
 	if (optind > argc - 1) {
 		errx(EXIT_FAILURE, "too few arguments");
 	} else {
-		strtoull(argv[optind], &endptr, DUMPSEG_BASE);
-		if (*endptr == '\0')
+		if (dumpseg_parse_range(argv[optind], &range) == 0)
 			dev = NULL;
 		else
 			dev = argv[optind++];
 	}
 
-	nilfs = nilfs_open(dev, NULL, NILFS_OPEN_RAW | NILFS_OPEN_SRCHDEV);
-	if (nilfs == NULL)
-		err(EXIT_FAILURE, "cannot open NILFS on %s", dev ? : "device");
-
-	if (nilfs_opt_set_mmap(nilfs) < 0)
-		warnx("cannot use mmap");
-
 	status = EXIT_SUCCESS;
-	for (i = optind; i < argc; i++) {
-		segnum = strtoull(argv[i], &endptr, DUMPSEG_BASE);
-		if (*endptr != '\0') {
-			warnx("%s: invalid segment number", argv[i]);
+	dumpseg_ranges = calloc(argc - optind + 1, sizeof(*dumpseg_ranges));
+	if (unlikely(dumpseg_ranges == NULL))
+		err(EXIT_FAILURE, "cannot allocate segment ranges");
+	for (; optind < argc; optind++) {
+		if (dumpseg_parse_range(argv[optind], &range) < 0) {
+			warnx("%s: invalid segment number", argv[optind]);
 			status = EXIT_FAILURE;
 			continue;
 		}
-		ret = nilfs_get_segment(nilfs, segnum, &segment);
-		if (ret < 0) {
-			warn("failed to read segment");
-			status = EXIT_FAILURE;
-			goto out;
-		}
+		dumpseg_ranges[dumpseg_nranges++] = range;
+	}
 
-		dumpseg_print_segment(&segment);
+	if (offline) {
+		if (!dev)
+			errx(EXIT_FAILURE, "device is required in offline mode");
+		open_flags = NILFS_OPEN_OFFLINE;
+	} else {
+		open_flags = NILFS_OPEN_RAW | NILFS_OPEN_SRCHDEV;
+	}
+
+	dumpseg_nilfs = nilfs_open(dev, NULL, open_flags);
+	if (dumpseg_nilfs == NULL)
+		err(EXIT_FAILURE, "cannot open NILFS on %s", dev ? : "device");
 
-		ret = nilfs_put_segment(&segment);
-		if (ret < 0) {
-			warn("failed to release segment");
+	if (nilfs_opt_set_mmap(dumpseg_nilfs) < 0)
+		warnx("cannot use mmap");
+	/* keep a read buffer per job in case mmap is not available */
+	if (njobs > NILFS_SEGBUF_POOL_DEFAULT)
+		nilfs_set_segbuf_pool_size(dumpseg_nilfs, njobs);
+
+	/* resolve open-ended ranges */
+	nsegments = nilfs_get_nsegments(dumpseg_nilfs);
+	for (i = 0; i < dumpseg_nranges; i++) {
+		if (dumpseg_ranges[i].end == UINT64_MAX && nsegments > 0)
+			dumpseg_ranges[i].end =
+				max_t(uint64_t, nsegments - 1,
+				      dumpseg_ranges[i].start);
+	}
+	if (dumpseg_nranges > 0)
+		dumpseg_next_segnum = dumpseg_ranges[0].start;
+
+	if (format == DUMPSEG_FORMAT_BINARY)
+		dumpseg_binary_header();
+
+	if (njobs > 1) {
+		if (dumpseg_run_parallel() != EXIT_SUCCESS)
+			status = EXIT_FAILURE;
+	} else {
+		if (dumpseg_run_serial() != EXIT_SUCCESS)
 			status = EXIT_FAILURE;
-			goto out;
-		}
 	}
+	dumpseg_flush();
 
- out:
-	nilfs_close(nilfs);
+	free(dumpseg_outbuf.data);
+	free(dumpseg_ranges);
+	nilfs_close(dumpseg_nilfs);
 	exit(status);
 }
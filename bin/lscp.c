@@ -49,6 +49,8 @@
 #include "nilfs.h"
 #include "compat.h"	/* getprogname() */
 #include "util.h"
+#include "cnormap.h"
+#include "parser.h"
 
 #undef CONFIG_PRINT_CPSTAT
 
@@ -56,34 +58,46 @@
 #include <getopt.h>
 static const struct option long_option[] = {
 	{"all", no_argument, NULL, 'a'},
+	{"aggregate", required_argument, NULL, 'A'},
 	{"show-block-count", no_argument, NULL, 'b'},
 	{"show-increment", no_argument, NULL, 'g'},
 	{"reverse", no_argument, NULL, 'r'},
 	{"snapshot", no_argument, NULL, 's'},
 	{"index", required_argument, NULL, 'i'},
 	{"lines", required_argument, NULL, 'n'},
+	{"offline", no_argument, NULL, 'o'},
+	{"since", required_argument, NULL, 'S'},
+	{"until", required_argument, NULL, 'U'},
 	{"help", no_argument, NULL, 'h'},
 	{"version", no_argument, NULL, 'V'},
 	{NULL, 0, NULL, 0}
 };
 #define LSCP_USAGE	"Usage: %s [OPTION]... [DEVICE|NODE]\n"		\
 			"  -a, --all\t\tshow all checkpoints\n"		\
+			"  -A, --aggregate=INTERVAL\tsummarize checkpoints "\
+			"per INTERVAL\n"					\
 			"  -b, --show-block-count\t\tshow block count\n"\
 			"  -g, --show-increment\t\tshow increment count\n"\
 			"  -r, --reverse\t\treverse order\n"		\
 			"  -s, --snapshot\tlist only snapshots\n"	\
 			"  -i, --index\t\tcp/ss index\n"		\
 			"  -n, --lines\t\tlines\n"			\
+			"  -o, --offline\t\tread an unmounted device\n"	\
+			"  -S, --since=TIME\tlist checkpoints created at "\
+			"or after TIME\n"				\
+			"  -U, --until=TIME\tlist checkpoints created at "\
+			"or before TIME\n"				\
 			"  -h, --help\t\tdisplay this help and exit\n"	\
 			"  -V, --version\t\tdisplay version and exit\n"
 #else
-#define LSCP_USAGE	"Usage: %s [-bgrshV] [-i cno] [-n lines] "	\
-			"[device|node]\n"
+#define LSCP_USAGE	"Usage: %s [-bgrsohV] [-A interval] [-i cno] "	\
+			"[-n lines] [-S time] [-U time] [device|node]\n"
 #endif	/* _GNU_SOURCE */
 
 #define LSCP_BUFSIZE	128
 #define LSCP_NCPINFO	512
 #define LSCP_MINDELTA	64	/* Minimum delta for reverse direction */
+#define LSCP_NCPINFO_AGGR	8192	/* cpinfo read at a time to aggregate */
 
 enum lscp_state {
 	LSCP_INIT_ST,		/* Initial state */
@@ -94,10 +108,37 @@ enum lscp_state {
 
 static uint64_t param_index;
 static uint64_t param_lines;
+static nilfs_cno_t param_since_cno;	/* lower bound of checkpoint numbers */
 static struct nilfs_cpinfo cpinfos[LSCP_NCPINFO];
 static int show_block_count = 1;
 static int show_all;
 
+/**
+ * struct lscp_bucket - summary of checkpoints created in an interval
+ * @start: start time of the interval
+ * @ncps: number of checkpoints
+ * @nminor: number of minor checkpoints
+ * @nsss: number of snapshots
+ * @nblk_inc: total number of appended blocks
+ * @last_cno: latest checkpoint number in the interval
+ * @blocks_count: number of used blocks at @last_cno
+ */
+struct lscp_bucket {
+	int64_t start;
+	uint64_t ncps;
+	uint64_t nminor;
+	uint64_t nsss;
+	uint64_t nblk_inc;
+	nilfs_cno_t last_cno;
+	uint64_t blocks_count;
+};
+
+static unsigned long aggr_interval;	/* 0 if not aggregating */
+static struct lscp_bucket *aggr_buckets;
+static size_t aggr_nbuckets;
+static size_t aggr_maxbuckets;
+static size_t aggr_current;		/* bucket hit last time */
+
 NILFS_UTILS_GITID();
 
 static void lscp_print_header(void)
@@ -125,6 +166,25 @@ static void lscp_print_cpinfo(struct nilfs_cpinfo *cpinfo)
 	       (uint64_t)cpinfo->ci_inodes_count);
 }
 
+static void lscp_print_bucket(const struct lscp_bucket *bucket,
+			      const char *label)
+{
+	struct tm tm;
+	time_t t;
+	char timebuf[LSCP_BUFSIZE];
+
+	if (!label) {
+		t = (time_t)bucket->start;
+		localtime_r(&t, &tm);
+		strftime(timebuf, LSCP_BUFSIZE, "%F %T", &tm);
+		label = timebuf;
+	}
+	printf("%19s %10" PRIu64 " %10" PRIu64 " %8" PRIu64 " %12" PRIu64
+	       " %12" PRIu64 "\n",
+	       label, bucket->ncps, bucket->nminor, bucket->nsss,
+	       bucket->nblk_inc, bucket->blocks_count);
+}
+
 #ifdef CONFIG_PRINT_CPSTAT
 static void lscp_print_cpstat(const struct nilfs_cpstat *cpstat, int mode)
 {
@@ -154,7 +214,8 @@ static int lscp_forward_cpinfo(struct nilfs *nilfs,
 
 	rest = param_lines && param_lines < cpstat->cs_ncps ? param_lines :
 		cpstat->cs_ncps;
-	sidx = param_index ? param_index : NILFS_CNO_MIN;
+	sidx = max_t(nilfs_cno_t, param_index, param_since_cno) ? :
+		NILFS_CNO_MIN;
 
 	while (rest > 0 && sidx < cpstat->cs_cno) {
 		n = lscp_get_cpinfo(nilfs, sidx, NILFS_CHECKPOINT, rest);
@@ -164,6 +225,8 @@ static int lscp_forward_cpinfo(struct nilfs *nilfs,
 			break;
 
 		for (cpi = cpinfos; cpi < cpinfos + n; cpi++) {
+			if (cpi->ci_cno >= cpstat->cs_cno)
+				return 0;
 			if (show_all || nilfs_cpinfo_snapshot(cpi) ||
 			    !nilfs_cpinfo_minor(cpi)) {
 				lscp_print_cpinfo(cpi);
@@ -182,6 +245,7 @@ static int lscp_backward_cpinfo(struct nilfs *nilfs,
 	nilfs_cno_t sidx; /* start index (inclusive) */
 	nilfs_cno_t eidx; /* end index (exclusive) */
 	nilfs_cno_t prev_head = 0;
+	nilfs_cno_t cno_min = max_t(nilfs_cno_t, NILFS_CNO_MIN, param_since_cno);
 	uint64_t rest, delta, v;
 	int state = LSCP_INIT_ST;
 	ssize_t n;
@@ -198,9 +262,9 @@ recalc_delta:
 		      max_t(uint64_t, rest, LSCP_MINDELTA));
 	v = delta;
 
-	while (eidx > NILFS_CNO_MIN) {
-		if (eidx < NILFS_CNO_MIN + v || state == LSCP_INIT_ST)
-			sidx = NILFS_CNO_MIN;
+	while (eidx > cno_min) {
+		if (eidx < cno_min + v || state == LSCP_INIT_ST)
+			sidx = cno_min;
 		else
 			sidx = eidx - v;
 
@@ -225,7 +289,7 @@ recalc_delta:
 		} else if (cpinfos[0].ci_cno == prev_head) {
 			/* No younger checkpoint was found */
 
-			if (sidx == NILFS_CNO_MIN)
+			if (sidx == cno_min)
 				break;
 
 			/* go further back */
@@ -286,6 +350,152 @@ out:
 	return 0;
 }
 
+/**
+ * lscp_aggr_lookup - find the bucket of a creation time
+ * @t: creation time of a checkpoint
+ *
+ * Buckets are aligned to the local time by nilfs_interval_start().
+ * Since checkpoints are usually created in ascending order of time, the
+ * bucket hit last time is tried first and new buckets are appended;
+ * buckets for times going back due to clock rewinds are looked up by
+ * bisection.
+ *
+ * Return: pointer to the bucket, or NULL on failure.
+ */
+static struct lscp_bucket *lscp_aggr_lookup(int64_t t)
+{
+	struct lscp_bucket *bucket;
+	int64_t start;
+	size_t lo, hi, mid;
+
+	if (aggr_nbuckets > 0) {
+		bucket = &aggr_buckets[aggr_current];
+		if (t >= bucket->start &&
+		    t - bucket->start < (int64_t)aggr_interval)
+			return bucket;
+	}
+
+	start = nilfs_interval_start(t, aggr_interval);
+
+	lo = 0;
+	hi = aggr_nbuckets;
+	if (hi > 0 && aggr_buckets[hi - 1].start < start) {
+		lo = hi;
+	} else {
+		while (lo < hi) {
+			mid = lo + (hi - lo) / 2;
+			if (aggr_buckets[mid].start < start)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		if (lo < aggr_nbuckets && aggr_buckets[lo].start == start)
+			goto found;
+	}
+
+	if (aggr_nbuckets == aggr_maxbuckets) {
+		size_t n = aggr_maxbuckets ? aggr_maxbuckets * 2 : 64;
+
+		bucket = realloc(aggr_buckets, n * sizeof(*bucket));
+		if (unlikely(bucket == NULL))
+			return NULL;
+		aggr_buckets = bucket;
+		aggr_maxbuckets = n;
+	}
+	memmove(&aggr_buckets[lo + 1], &aggr_buckets[lo],
+		(aggr_nbuckets - lo) * sizeof(*bucket));
+	memset(&aggr_buckets[lo], 0, sizeof(*bucket));
+	aggr_buckets[lo].start = start;
+	aggr_nbuckets++;
+found:
+	aggr_current = lo;
+	return &aggr_buckets[lo];
+}
+
+/**
+ * lscp_aggregate_cpinfo - print a summary of checkpoints per interval
+ * @nilfs: nilfs object
+ * @cpstat: checkpoint status
+ * @mode: NILFS_CHECKPOINT to count every checkpoint, or NILFS_SNAPSHOT
+ *        to count snapshots only
+ *
+ * Checkpoints are read in large batches in a single forward pass, and
+ * only the per-interval summary is printed.
+ */
+static int lscp_aggregate_cpinfo(struct nilfs *nilfs,
+				 struct nilfs_cpstat *cpstat, int mode)
+{
+	struct lscp_bucket *bucket, total;
+	struct nilfs_cpinfo *cpibuf, *cpi;
+	nilfs_cno_t sidx;
+	ssize_t n;
+	size_t i;
+	int ret = -1;
+
+	cpibuf = malloc(sizeof(*cpibuf) * LSCP_NCPINFO_AGGR);
+	if (unlikely(cpibuf == NULL))
+		return -1;
+
+	sidx = max_t(nilfs_cno_t, param_index, param_since_cno) ? :
+		NILFS_CNO_MIN;
+
+	while (sidx < cpstat->cs_cno) {
+		n = nilfs_get_cpinfo(nilfs, sidx, NILFS_CHECKPOINT, cpibuf,
+				     min_t(uint64_t, cpstat->cs_cno - sidx,
+					   LSCP_NCPINFO_AGGR));
+		if (unlikely(n < 0))
+			goto out;
+		if (!n)
+			break;
+
+		for (cpi = cpibuf; cpi < cpibuf + n; cpi++) {
+			if (cpi->ci_cno >= cpstat->cs_cno)
+				break;
+			if (mode == NILFS_SNAPSHOT &&
+			    !nilfs_cpinfo_snapshot(cpi))
+				continue;
+
+			bucket = lscp_aggr_lookup(cpi->ci_create);
+			if (unlikely(bucket == NULL))
+				goto out;
+			bucket->ncps++;
+			if (nilfs_cpinfo_minor(cpi))
+				bucket->nminor++;
+			if (nilfs_cpinfo_snapshot(cpi))
+				bucket->nsss++;
+			bucket->nblk_inc += cpi->ci_nblk_inc;
+			if (cpi->ci_cno >= bucket->last_cno) {
+				bucket->last_cno = cpi->ci_cno;
+				bucket->blocks_count = cpi->ci_blocks_count;
+			}
+		}
+		sidx = cpibuf[n - 1].ci_cno + 1;
+	}
+
+	printf("               START        NCP      MINOR       SS"
+	       "      NBLKINC       BLKCNT\n");
+	memset(&total, 0, sizeof(total));
+	for (i = 0; i < aggr_nbuckets; i++) {
+		bucket = &aggr_buckets[i];
+		lscp_print_bucket(bucket, NULL);
+
+		total.ncps += bucket->ncps;
+		total.nminor += bucket->nminor;
+		total.nsss += bucket->nsss;
+		total.nblk_inc += bucket->nblk_inc;
+		if (bucket->last_cno >= total.last_cno) {
+			total.last_cno = bucket->last_cno;
+			total.blocks_count = bucket->blocks_count;
+		}
+	}
+	lscp_print_bucket(&total, "total");
+	ret = 0;
+out:
+	free(cpibuf);
+	free(aggr_buckets);
+	return ret;
+}
+
 static int lscp_search_snapshot(struct nilfs *nilfs,
 				struct nilfs_cpstat *cpstat, nilfs_cno_t *sidx)
 {
@@ -321,7 +531,7 @@ static int lscp_forward_ssinfo(struct nilfs *nilfs,
 
 	rest = param_lines && param_lines < cpstat->cs_nsss ? param_lines :
 		cpstat->cs_nsss;
-	sidx = param_index;
+	sidx = max_t(nilfs_cno_t, param_index, param_since_cno);
 
 	if (!rest || sidx >= cpstat->cs_cno)
 		return 0;
@@ -342,8 +552,11 @@ static int lscp_forward_ssinfo(struct nilfs *nilfs,
 		if (!n)
 			break;
 
-		for (i = 0; i < n; i++)
+		for (i = 0; i < n; i++) {
+			if (cpinfos[i].ci_cno >= cpstat->cs_cno)
+				return 0;
 			lscp_print_cpinfo(&cpinfos[i]);
+		}
 
 		rest -= n;
 		sidx = cpinfos[n - 1].ci_next;
@@ -360,6 +573,7 @@ static int lscp_backward_ssinfo(struct nilfs *nilfs,
 	nilfs_cno_t eidx; /* end index (exclusive) */
 	uint64_t rest;
 	uint64_t rns; /* remaining number of snapshots (always rest <= rns) */
+	nilfs_cno_t cno_min = max_t(nilfs_cno_t, NILFS_CNO_MIN, param_since_cno);
 	ssize_t n;
 	int i;
 
@@ -368,12 +582,12 @@ static int lscp_backward_ssinfo(struct nilfs *nilfs,
 	eidx = param_index && param_index < cpstat->cs_cno ? param_index + 1 :
 		cpstat->cs_cno;
 
-	for ( ; rest > 0 && eidx > NILFS_CNO_MIN ; eidx = sidx) {
-		if (rns <= LSCP_NCPINFO || eidx <= NILFS_CNO_MIN + LSCP_NCPINFO)
+	for ( ; rest > 0 && eidx > cno_min ; eidx = sidx) {
+		if (rns <= LSCP_NCPINFO || eidx <= cno_min + LSCP_NCPINFO)
 			goto remainder;
 
-		sidx = (eidx >= NILFS_CNO_MIN + LSCP_NCPINFO) ?
-			eidx - LSCP_NCPINFO : NILFS_CNO_MIN;
+		sidx = (eidx >= cno_min + LSCP_NCPINFO) ?
+			eidx - LSCP_NCPINFO : cno_min;
 		n = lscp_get_cpinfo(nilfs, sidx, NILFS_CHECKPOINT, eidx - sidx);
 		if (unlikely(n < 0))
 			return n;
@@ -401,36 +615,94 @@ static int lscp_backward_ssinfo(struct nilfs *nilfs,
 	for (i = 0; i < n && rest > 0; i++) {
 		if (cpinfos[n - i - 1].ci_cno >= eidx)
 			continue;
+		if (cpinfos[n - i - 1].ci_cno < cno_min)
+			break;
 		lscp_print_cpinfo(&cpinfos[n - i - 1]);
 		rest--;
 	}
 	return 0;
 }
 
+/**
+ * lscp_set_time_range - limit the listing to a range of creation times
+ * @nilfs: nilfs object
+ * @cpstat: checkpoint status whose end checkpoint number is adjusted
+ * @has_since: flag indicating that @since is given
+ * @since: lower bound of creation times (inclusive)
+ * @has_until: flag indicating that @until is given
+ * @until: upper bound of creation times (inclusive)
+ *
+ * The times are turned into a window of checkpoint numbers with the
+ * checkpoint number reverse mapper, so that only checkpoints within
+ * the window are read.  The lower bound is stored in param_since_cno,
+ * and the exclusive upper bound replaces cs_cno of @cpstat.
+ */
+static int lscp_set_time_range(struct nilfs *nilfs,
+			       struct nilfs_cpstat *cpstat,
+			       int has_since, int64_t since,
+			       int has_until, int64_t until)
+{
+	struct nilfs_cnormap *cnormap;
+	nilfs_cno_t cno;
+	int ret = -1;
+
+	cnormap = nilfs_cnormap_create(nilfs);
+	if (unlikely(cnormap == NULL))
+		return -1;
+
+	if (has_since) {
+		if (nilfs_cnormap_lookup_time(cnormap, since, &cno) < 0)
+			goto out;
+		param_since_cno = min_t(nilfs_cno_t, cno, cpstat->cs_cno);
+	}
+	if (has_until && until < INT64_MAX) {
+		if (nilfs_cnormap_lookup_time(cnormap, until + 1, &cno) < 0)
+			goto out;
+		if (cno < cpstat->cs_cno)
+			cpstat->cs_cno = cno;
+	}
+	if (param_since_cno > cpstat->cs_cno)
+		param_since_cno = cpstat->cs_cno;
+	ret = 0;
+out:
+	nilfs_cnormap_destroy(cnormap);
+	return ret;
+}
+
 int main(int argc, char *argv[])
 {
 	struct nilfs *nilfs;
 	struct nilfs_cpstat cpstat;
 	char *dev;
-	int c, mode, rvs, status, ret;
+	int64_t since = 0, until = 0;
+	int has_since = 0, has_until = 0;
+	int c, mode, rvs, offline, status, ret;
 #ifdef _GNU_SOURCE
 	int option_index;
 #endif	/* _GNU_SOURCE */
 
 	mode = NILFS_CHECKPOINT;
 	rvs = 0;
+	offline = 0;
 
 #ifdef _GNU_SOURCE
-	while ((c = getopt_long(argc, argv, "abgrsi:n:hV",
+	while ((c = getopt_long(argc, argv, "aA:bgrsi:n:oS:U:hV",
 				long_option, &option_index)) >= 0) {
 #else
-	while ((c = getopt(argc, argv, "abgrsi:n:hV")) >= 0) {
+	while ((c = getopt(argc, argv, "aA:bgrsi:n:oS:U:hV")) >= 0) {
 #endif	/* _GNU_SOURCE */
 
 		switch (c) {
 		case 'a':
 			show_all = 1;
 			break;
+		case 'A':
+			if (nilfs_parse_protection_period(optarg,
+							  &aggr_interval) < 0 ||
+			    aggr_interval == 0 || aggr_interval > INT32_MAX)
+				errx(EXIT_FAILURE, "invalid interval: %s",
+				     optarg);
+			break;
 		case 'b':
 			show_block_count = 1;
 			break;
@@ -449,6 +721,19 @@ int main(int argc, char *argv[])
 		case 'n':
 			param_lines = (uint64_t)atoll(optarg);
 			break;
+		case 'o':
+			offline = 1;
+			break;
+		case 'S':
+			if (nilfs_parse_time(optarg, &since) < 0)
+				errx(EXIT_FAILURE, "invalid time: %s", optarg);
+			has_since = 1;
+			break;
+		case 'U':
+			if (nilfs_parse_time(optarg, &until) < 0)
+				errx(EXIT_FAILURE, "invalid time: %s", optarg);
+			has_until = 1;
+			break;
 		case 'h':
 			printf(LSCP_USAGE, getprogname());
 			exit(EXIT_SUCCESS);
@@ -468,7 +753,14 @@ int main(int argc, char *argv[])
 	else
 		dev = NULL;
 
-	nilfs = nilfs_open(dev, NULL, NILFS_OPEN_RDONLY | NILFS_OPEN_SRCHDEV);
+	if (offline) {
+		if (!dev)
+			errx(EXIT_FAILURE, "device is required in offline mode");
+		nilfs = nilfs_open(dev, NULL, NILFS_OPEN_OFFLINE);
+	} else {
+		nilfs = nilfs_open(dev, NULL,
+				   NILFS_OPEN_RDONLY | NILFS_OPEN_SRCHDEV);
+	}
 	if (nilfs == NULL)
 		err(EXIT_FAILURE, "cannot open NILFS on %s", dev ? : "device");
 
@@ -478,6 +770,18 @@ int main(int argc, char *argv[])
 	if (unlikely(ret < 0))
 		goto out;
 
+	if (has_since || has_until) {
+		ret = lscp_set_time_range(nilfs, &cpstat, has_since, since,
+					  has_until, until);
+		if (unlikely(ret < 0))
+			goto out;
+	}
+
+	if (aggr_interval) {
+		ret = lscp_aggregate_cpinfo(nilfs, &cpstat, mode);
+		goto out;
+	}
+
 #ifdef CONFIG_PRINT_CPSTAT
 	lscp_print_cpstat(&cpstat, mode);
 #endif
@@ -61,10 +61,13 @@
 #include <getopt.h>
 static const struct option long_option[] = {
 	{"all",  no_argument, NULL, 'a'},
+	{"histogram", no_argument, NULL, 'H'},
 	{"index", required_argument, NULL, 'i'},
 	{"latest-usage", no_argument, NULL, 'l' },
 	{"lines", required_argument, NULL, 'n'},
+	{"offline", no_argument, NULL, 'o'},
 	{"protection-period", required_argument, NULL, 'p'},
+	{"sample", required_argument, NULL, 's'},
 	{"help", no_argument, NULL, 'h'},
 	{"version", no_argument, NULL, 'V'},
 	{NULL, 0, NULL, 0}
@@ -74,19 +77,25 @@ static const struct option long_option[] = {
 	"Usage: %s [OPTION]... [DEVICE|NODE]\n"				\
 	"  -a, --all\t\t\tdo not hide clean segments\n"			\
 	"  -h, --help\t\t\tdisplay this help and exit\n"		\
+	"  -H, --histogram\t\tprint histogram of utilization and age\n" \
 	"  -i, --index\t\t\tskip index segments at start of inputs\n"	\
 	"  -l, --latest-usage\t\tprint usage status of the moment\n"	\
 	"  -n, --lines\t\t\tlist only lines input segments\n"		\
+	"  -o, --offline\t\t\tread an unmounted device\n"		\
 	"  -p, --protection-period\tspecify protection period\n"	\
+	"  -s, --sample=N\t\tcount only every Nth segment\n"	\
 	"  -V, --version\t\t\tdisplay version and exit\n"
 #else	/* !_GNU_SOURCE */
 #include <unistd.h>
 #define LSSU_USAGE \
-	"Usage: %s [-alhV] [-i index] [-n lines] [-p period] [device|node]\n"
+	"Usage: %s [-aHlohV] [-i index] [-n lines] [-p period] [-s N]\n" \
+	"          [device|node]\n"
 #endif	/* _GNU_SOURCE */
 
 #define LSSU_BUFSIZE	128
 #define LSSU_NSEGS	512
+#define LSSU_NASSESS	32	/* segments assessed at a time */
+#define LSSU_NRATIOS	10	/* utilization classes of histogram */
 
 enum lssu_mode {
 	LSSU_MODE_NORMAL,
@@ -109,17 +118,52 @@ static const struct lssu_format lssu_format[] = {
 	}
 };
 
+/* age classes of histogram */
+static const struct lssu_age {
+	int64_t period;
+	const char *label;
+} lssu_ages[] = {
+	{ 3600, "<1h" },
+	{ 86400, "<1d" },
+	{ 604800, "<1w" },
+	{ 2592000, "<30d" },
+	{ 31536000, "<1y" },
+	{ INT64_MAX, ">=1y" },
+};
+
+#define LSSU_NAGES	ARRAY_SIZE(lssu_ages)
+
+/**
+ * struct lssu_pending - segment waiting for assessment
+ * @segnum: segment number
+ * @age: age class of the segment
+ * @nblocks: number of in-use blocks given by the segment usage
+ */
+struct lssu_pending {
+	uint64_t segnum;
+	unsigned int age;
+	uint32_t nblocks;
+};
+
 static int all;
+static int histogram;
 static int latest;
+static int offline;
 static int disp_mode;		/* display mode */
 static nilfs_cno_t protcno;
 static int64_t prottime, now;
 static uint64_t param_index;
 static uint64_t param_lines;
+static unsigned long param_sample = 1;
 
 static size_t blocks_per_segment;
 static struct nilfs_suinfo suinfos[LSSU_NSEGS];
 
+static uint64_t lssu_hist[LSSU_NAGES][LSSU_NRATIOS];
+static uint64_t lssu_hist_nseen;
+static struct lssu_pending lssu_pending[LSSU_NASSESS];
+static size_t lssu_npending;
+
 NILFS_UTILS_GITID();
 
 static void lssu_print_header(void)
@@ -225,6 +269,157 @@ skip_scan:
 	return n;
 }
 
+static unsigned int lssu_hist_age(uint64_t lastmod)
+{
+	unsigned int i;
+
+	if (lastmod == 0)
+		return LSSU_NAGES - 1;
+
+	for (i = 0; i < LSSU_NAGES - 1; i++)
+		if (now - (int64_t)lastmod < lssu_ages[i].period)
+			break;
+	return i;
+}
+
+static void lssu_hist_add(unsigned int age, size_t nliveblks)
+{
+	size_t ratio = nliveblks * LSSU_NRATIOS / blocks_per_segment;
+
+	lssu_hist[age][min_t(size_t, ratio, LSSU_NRATIOS - 1)] += param_sample;
+}
+
+static int lssu_comp_pending(const void *elem1, const void *elem2)
+{
+	const struct lssu_pending *pending1 = elem1, *pending2 = elem2;
+
+	if (pending1->segnum < pending2->segnum)
+		return -1;
+	return pending1->segnum > pending2->segnum ? 1 : 0;
+}
+
+/**
+ * lssu_hist_flush - assess pending segments and count them
+ * @nilfs: nilfs object
+ * @protseq: start of sequence number of protected segments
+ *
+ * The pending segments are registered in ascending order of segment
+ * numbers, and are assessed with a single library call.  Segments that
+ * turn out to be protected are counted with their NBLOCKS value.
+ */
+static int lssu_hist_flush(struct nilfs *nilfs, uint64_t protseq)
+{
+	struct nilfs_reclaim_params params = {
+		.flags = NILFS_RECLAIM_PARAM_PROTSEQ,
+		.protseq = protseq
+	};
+	uint64_t segnums[LSSU_NASSESS];
+	size_t nliveblks[LSSU_NASSESS];
+	struct lssu_pending key, *pending;
+	ssize_t n, i;
+
+	if (lssu_npending == 0)
+		return 0;
+
+	if (protcno != NILFS_CNO_MAX) {
+		params.flags |= NILFS_RECLAIM_PARAM_PROTCNO;
+		params.protcno = protcno;
+	}
+
+	for (i = 0; i < lssu_npending; i++)
+		segnums[i] = lssu_pending[i].segnum;
+
+	n = nilfs_assess_segment_usage(nilfs, segnums, lssu_npending, &params,
+				       nliveblks);
+	if (unlikely(n < 0)) {
+		warn("failed to get usage");
+		return -1;
+	}
+
+	for (i = 0; i < lssu_npending; i++) {
+		key.segnum = segnums[i];
+		pending = bsearch(&key, lssu_pending, lssu_npending,
+				  sizeof(key), lssu_comp_pending);
+		if (unlikely(!pending))
+			continue;
+		lssu_hist_add(pending->age,
+			      i < n ? nliveblks[i] : pending->nblocks);
+	}
+	lssu_npending = 0;
+	return 0;
+}
+
+static ssize_t lssu_hist_suinfo(struct nilfs *nilfs, uint64_t segnum,
+				ssize_t nsi, uint64_t protseq)
+{
+	const struct nilfs_suinfo *si;
+	struct lssu_pending *pending;
+	unsigned int age;
+	ssize_t i, n = 0;
+
+	for (i = 0; i < nsi; i++, segnum++) {
+		si = &suinfos[i];
+		if (!all && nilfs_suinfo_clean(si))
+			continue;
+		n++;
+
+		if (lssu_hist_nseen++ % param_sample != 0)
+			continue;
+
+		age = lssu_hist_age(si->sui_lastmod);
+		if (!latest) {
+			lssu_hist_add(age, si->sui_nblocks);
+			continue;
+		}
+		if (!nilfs_suinfo_dirty(si) || nilfs_suinfo_error(si)) {
+			lssu_hist_add(age, 0);
+			continue;
+		}
+
+		pending = &lssu_pending[lssu_npending++];
+		pending->segnum = segnum;
+		pending->age = age;
+		pending->nblocks = si->sui_nblocks;
+		if (lssu_npending == LSSU_NASSESS &&
+		    unlikely(lssu_hist_flush(nilfs, protseq) < 0))
+			return -1;
+	}
+	return n;
+}
+
+static void lssu_hist_print(void)
+{
+	uint64_t rtotal[LSSU_NRATIOS] = { 0 };
+	uint64_t atotal, total = 0;
+	unsigned int age, ratio;
+
+	printf("%-5s", "AGE");
+	for (ratio = 0; ratio < LSSU_NRATIOS; ratio++)
+		printf(" %8u%%", ratio * 100 / LSSU_NRATIOS);
+	printf(" %10s\n", "TOTAL");
+
+	for (age = 0; age < LSSU_NAGES; age++) {
+		atotal = 0;
+		printf("%-5s", lssu_ages[age].label);
+		for (ratio = 0; ratio < LSSU_NRATIOS; ratio++) {
+			printf(" %9" PRIu64, lssu_hist[age][ratio]);
+			atotal += lssu_hist[age][ratio];
+			rtotal[ratio] += lssu_hist[age][ratio];
+		}
+		printf(" %10" PRIu64 "\n", atotal);
+		total += atotal;
+	}
+
+	printf("%-5s", "TOTAL");
+	for (ratio = 0; ratio < LSSU_NRATIOS; ratio++)
+		printf(" %9" PRIu64, rtotal[ratio]);
+	printf(" %10" PRIu64 "\n", total);
+
+	if (param_sample > 1)
+		printf("(estimated by sampling 1 in %lu segments)\n",
+		       param_sample);
+}
+
 static int lssu_list_suinfo(struct nilfs *nilfs)
 {
 	struct nilfs_sustat sustat;
@@ -232,7 +427,8 @@ static int lssu_list_suinfo(struct nilfs *nilfs)
 	ssize_t nsi, n;
 	int ret;
 
-	lssu_print_header();
+	if (!histogram)
+		lssu_print_header();
 	ret = nilfs_get_sustat(nilfs, &sustat);
 	if (unlikely(ret < 0))
 		return EXIT_FAILURE;
@@ -246,12 +442,22 @@ static int lssu_list_suinfo(struct nilfs *nilfs)
 		if (unlikely(nsi < 0))
 			return EXIT_FAILURE;
 
-		n = lssu_print_suinfo(nilfs, segnum, nsi, sustat.ss_prot_seq);
+		if (histogram)
+			n = lssu_hist_suinfo(nilfs, segnum, nsi,
+					     sustat.ss_prot_seq);
+		else
+			n = lssu_print_suinfo(nilfs, segnum, nsi,
+					      sustat.ss_prot_seq);
 		if (unlikely(n < 0))
 			return EXIT_FAILURE;
 		segnum += nsi;
 	}
 
+	if (histogram) {
+		if (unlikely(lssu_hist_flush(nilfs, sustat.ss_prot_seq) < 0))
+			return EXIT_FAILURE;
+		lssu_hist_print();
+	}
 	return EXIT_SUCCESS;
 }
 
@@ -276,6 +482,9 @@ static int lssu_get_protcno(struct nilfs *nilfs,
 		return -1;
 	}
 
+	/* Use the checkpoint time index of cleanerd if available */
+	nilfs_cnormap_set_index(cnormap, NULL, NILFS_CNORMAP_INDEX_RDONLY);
+
 	ret = nilfs_cnormap_track_back(cnormap, protection_period, protcnop);
 	if (unlikely(ret < 0))
 		warn("failed to get checkpoint number from protection period (%lu)",
@@ -288,7 +497,7 @@ static int lssu_get_protcno(struct nilfs *nilfs,
 int main(int argc, char *argv[])
 {
 	struct nilfs *nilfs;
-	char *dev;
+	char *dev, *endptr;
 	int c, status;
 	int open_flags;
 	unsigned long protection_period = ULONG_MAX;
@@ -298,16 +507,19 @@ int main(int argc, char *argv[])
 #endif	/* _GNU_SOURCE */
 
 #ifdef _GNU_SOURCE
-	while ((c = getopt_long(argc, argv, "ai:ln:hp:V",
+	while ((c = getopt_long(argc, argv, "aHi:ln:ohp:s:V",
 				long_option, &option_index)) >= 0) {
 #else	/* !_GNU_SOURCE */
-	while ((c = getopt(argc, argv, "ai:ln:hp:V")) >= 0) {
+	while ((c = getopt(argc, argv, "aHi:ln:ohp:s:V")) >= 0) {
 #endif	/* _GNU_SOURCE */
 
 		switch (c) {
 		case 'a':
 			all = 1;
 			break;
+		case 'H':
+			histogram = 1;
+			break;
 		case 'i':
 			param_index = (uint64_t)atoll(optarg);
 			break;
@@ -317,6 +529,9 @@ int main(int argc, char *argv[])
 		case 'n':
 			param_lines = (uint64_t)atoll(optarg);
 			break;
+		case 'o':
+			offline = 1;
+			break;
 		case 'h':
 			printf(LSSU_USAGE, getprogname());
 			exit(EXIT_SUCCESS);
@@ -332,6 +547,14 @@ int main(int argc, char *argv[])
 
 			errx(EXIT_FAILURE, "invalid protection period: %s",
 			     optarg);
+		case 's':
+			errno = 0;
+			param_sample = strtoul(optarg, &endptr, 10);
+			if (endptr == optarg || *endptr != '\0' || errno ||
+			    param_sample == 0)
+				errx(EXIT_FAILURE, "invalid sampling interval: %s",
+				     optarg);
+			break;
 		case 'V':
 			printf("%s (%s %s)\n", getprogname(), PACKAGE,
 			       PACKAGE_VERSION);
@@ -348,15 +571,23 @@ int main(int argc, char *argv[])
 	else
 		errx(EXIT_FAILURE, "too many arguments");
 
-	open_flags = NILFS_OPEN_RDONLY | NILFS_OPEN_SRCHDEV;
+	if (offline) {
+		if (!dev)
+			errx(EXIT_FAILURE, "device is required in offline mode");
+		open_flags = NILFS_OPEN_OFFLINE;
+	} else {
+		open_flags = NILFS_OPEN_RDONLY | NILFS_OPEN_SRCHDEV;
+	}
 	if (latest)
 		open_flags |= NILFS_OPEN_RAW | NILFS_OPEN_GCLK;
+	else if (histogram)
+		open_flags |= NILFS_OPEN_RAW;	/* for the segment size */
 
 	nilfs = nilfs_open(dev, NULL, open_flags);
 	if (nilfs == NULL)
 		err(EXIT_FAILURE, "cannot open NILFS on %s", dev ? : "device");
 
-	if (latest) {
+	if (latest || histogram) {
 		struct timeval tv;
 
 		ret = gettimeofday(&tv, NULL);
@@ -368,6 +599,9 @@ int main(int argc, char *argv[])
 		now = tv.tv_sec;
 
 		blocks_per_segment = nilfs_get_blocks_per_segment(nilfs);
+	}
+
+	if (latest) {
 		disp_mode = LSSU_MODE_LATEST_USAGE;
 
 		ret = lssu_get_protcno(nilfs, protection_period, &prottime,
@@ -43,6 +43,10 @@
 
 #include <stdarg.h>
 
+#if HAVE_TIME_H
+#include <time.h>
+#endif	/* HAVE_TIME_H */
+
 #if HAVE_LIMITS_H
 #include <limits.h>
 #endif	/* HAVE_LIMITS_H */
@@ -65,6 +69,7 @@ static const struct option long_options[] = {
 	{"force", no_argument, NULL, 'f'},
 	{"interactive", no_argument, NULL, 'i'},
 	{"help", no_argument, NULL, 'h'},
+	{"verbose", no_argument, NULL, 'v'},
 	{"version", no_argument, NULL, 'V'},
 	{NULL, 0, NULL, 0}
 };
@@ -73,9 +78,10 @@ static const struct option long_options[] = {
 	"  -f, --force\t\tignore snapshots or nonexistent checkpoints\n" \
 	"  -i, --interactive\tprompt before any removal\n"		\
 	"  -h, --help\t\tdisplay this help and exit\n"			\
+	"  -v, --verbose\t\treport the number and rate of removals\n"	\
 	"  -V, --version\t\tdisplay version and exit\n"
 #else	/* !_GNU_SOURCE */
-#define RMCP_USAGE	"Usage: %s [-fihV] [device|node] cno...\n"
+#define RMCP_USAGE	"Usage: %s [-fihvV] [device|node] cno...\n"
 #endif	/* _GNU_SOURCE */
 
 #define CHCP_PROMPT							\
@@ -86,6 +92,21 @@ static const struct option long_options[] = {
 
 static int force;
 static int interactive;
+static int verbose;
+
+/**
+ * struct rmcp_progress - progress of removing a checkpoint range
+ * @end: last checkpoint number of the range
+ * @start: time when the removal started
+ * @last: time when the progress was last reported
+ * @shown: flag indicating that a progress line has been printed
+ */
+struct rmcp_progress {
+	nilfs_cno_t end;
+	struct timespec start;
+	struct timespec last;
+	int shown;
+};
 
 NILFS_UTILS_GITID();
 
@@ -99,38 +120,118 @@ static int rmcp_confirm(const char *arg)
 	return 0;
 }
 
+static double rmcp_elapsed(const struct rmcp_progress *progress,
+			   struct timespec *now)
+{
+	struct timespec delta;
+
+	clock_gettime(CLOCK_MONOTONIC, now);
+	timespecsub(now, &progress->start, &delta);
+	return delta.tv_sec + delta.tv_nsec / 1e9;
+}
+
+/**
+ * rmcp_show_progress - print progress of a long removal
+ * @progress: progress state
+ * @cno: checkpoint number being examined
+ * @nd: number of removed checkpoints
+ *
+ * A progress line is updated on the terminal about once a second, and
+ * only after the removal has taken more than a second.
+ */
+static void rmcp_show_progress(struct rmcp_progress *progress,
+			       nilfs_cno_t cno, size_t nd)
+{
+	struct timespec now, delta;
+	double elapsed;
+
+	elapsed = rmcp_elapsed(progress, &now);
+	timespecsub(&now, &progress->last, &delta);
+	if (delta.tv_sec < 1)
+		return;
+
+	progress->last = now;
+	progress->shown = 1;
+	fprintf(stderr,
+		"\r%s: removed %zu checkpoints, at %" PRIcno "/%" PRIcno
+		" (%.0f/s)", getprogname(), nd, cno, progress->end,
+		nd / elapsed);
+}
+
+static void rmcp_end_progress(struct rmcp_progress *progress, size_t nd)
+{
+	struct timespec now;
+	double elapsed;
+
+	if (progress->shown)
+		fputc('\n', stderr);
+	if (!verbose && !progress->shown)
+		return;
+
+	elapsed = rmcp_elapsed(progress, &now);
+	fprintf(stderr, "%s: removed %zu checkpoints in %.1f seconds",
+		getprogname(), nd, elapsed);
+	if (elapsed > 0)
+		fprintf(stderr, " (%.0f/s)", nd / elapsed);
+	fputc('\n', stderr);
+}
+
+/**
+ * rmcp_report - report a skipped snapshot or the progress of a removal
+ * @stat: result of the removal so far
+ * @snapshot: flag indicating that @stat->cno is a skipped snapshot
+ * @arg: progress state
+ */
+static void rmcp_report(const struct nilfs_cpdel_stat *stat, int snapshot,
+			void *arg)
+{
+	struct rmcp_progress *progress = arg;
+
+	if (snapshot) {
+		if (!force)
+			warnx("%" PRIcno ": cannot remove snapshot", stat->cno);
+	} else if (isatty(STDERR_FILENO)) {
+		rmcp_show_progress(progress, stat->cno, stat->ndeleted);
+	}
+}
+
+/**
+ * rmcp_remove_range - remove existing checkpoints in a range
+ * @nilfs: nilfs object
+ * @start: first checkpoint number of the range
+ * @end: last checkpoint number of the range
+ * @ndeleted: place to store the number of removed checkpoints
+ * @nsnapshots: place to store the number of snapshots in the range
+ *
+ * The checkpoints that exist in the range are removed with
+ * nilfs_delete_checkpoints(), which skips snapshots and the holes in
+ * the range.
+ */
 static int rmcp_remove_range(struct nilfs *nilfs,
 			     nilfs_cno_t start, nilfs_cno_t end,
 			     size_t *ndeleted, size_t *nsnapshots)
 {
-	nilfs_cno_t cno;
-	int nocp = 0, nd = 0, nss = 0;
-	int ret = 0;
-
-	for (cno = start; cno <= end; cno++) {
-		if (likely(nilfs_delete_checkpoint(nilfs, cno) == 0)) {
-			nd++;
-			continue;
-		}
-		if (errno == EBUSY) {
-			nss++;
-			if (!force)
-				warnx("%" PRIcno ": cannot remove snapshot",
-				      cno);
-
-		} else if (errno == ENOENT) {
-			nocp++;
-		} else {
-			warn("%" PRIcno ": cannot remove checkpoint", cno);
-			ret = -1;
-			goto out;
-		}
-	}
-	if (!force && (nss > 0 || (nocp > 0 && nd == 0)))
+	struct rmcp_progress progress;
+	struct nilfs_cpdel_stat stat;
+	int ret;
+
+	memset(&progress, 0, sizeof(progress));
+	progress.end = end;
+	clock_gettime(CLOCK_MONOTONIC, &progress.start);
+	progress.last = progress.start;
+
+	ret = nilfs_delete_checkpoints(nilfs, start, end, &stat, rmcp_report,
+				       &progress);
+	if (unlikely(ret < 0))
+		warn("%" PRIcno ": cannot remove checkpoint", stat.cno);
+	else if (!force && (stat.nsnapshots > 0 ||
+			    (stat.nfound < end - start + 1 &&
+			     stat.ndeleted == 0)))
 		ret = 1;
- out:
-	*ndeleted = nd;
-	*nsnapshots = nss;
+
+	rmcp_end_progress(&progress, stat.ndeleted);
+	*ndeleted = stat.ndeleted;
+	*nsnapshots = stat.nsnapshots;
 	return ret;
 }
 
@@ -147,10 +248,10 @@ int main(int argc, char *argv[])
 #endif	/* _GNU_SOURCE */
 
 #ifdef _GNU_SOURCE
-	while ((c = getopt_long(argc, argv, "fihV",
+	while ((c = getopt_long(argc, argv, "fihvV",
 				long_options, &option_index)) >= 0) {
 #else	/* !_GNU_SOURCE */
-	while ((c = getopt(argc, argv, "fihV")) >= 0) {
+	while ((c = getopt(argc, argv, "fihvV")) >= 0) {
 #endif	/* _GNU_SOURCE */
 
 		switch (c) {
@@ -162,6 +263,9 @@ int main(int argc, char *argv[])
 			force = 0;
 			interactive = 1;
 			break;
+		case 'v':
+			verbose = 1;
+			break;
 		case 'h':
 			printf(RMCP_USAGE, getprogname());
 			exit(EXIT_SUCCESS);
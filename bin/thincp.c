@@ -0,0 +1,453 @@
+/*
+ * thincp.c - NILFS command of thinning out checkpoints by age.
+ *
+ * Licensed under GPLv2: the complete text of the GNU General Public
+ * License can be found in COPYING file of the nilfs-utils package.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif	/* HAVE_CONFIG_H */
+
+#include <stdio.h>
+
+#if HAVE_STDLIB_H
+#include <stdlib.h>
+#endif	/* HAVE_STDLIB_H */
+
+#if HAVE_ERR_H
+#include <err.h>
+#endif	/* HAVE_ERR_H */
+
+#if HAVE_STRING_H
+#include <string.h>
+#endif	/* HAVE_STRING_H */
+
+#if HAVE_TIME_H
+#include <time.h>
+#endif	/* HAVE_TIME_H */
+
+#include <errno.h>
+#include <signal.h>
+#include "nilfs.h"
+#include "compat.h"	/* getprogname(), timespec macros */
+#include "util.h"
+#include "cnormap.h"
+#include "parser.h"
+
+#ifdef _GNU_SOURCE
+#include <getopt.h>
+static const struct option long_option[] = {
+	{"keep", required_argument, NULL, 'k'},
+	{"dry-run", no_argument, NULL, 'n'},
+	{"rate", required_argument, NULL, 'r'},
+	{"verbose", no_argument, NULL, 'v'},
+	{"help", no_argument, NULL, 'h'},
+	{"version", no_argument, NULL, 'V'},
+	{NULL, 0, NULL, 0}
+};
+#define THINCP_USAGE							\
+	"Usage: %s [OPTION]... -k RULES [DEVICE|NODE]\n"		\
+	"  -k, --keep=RULES\tkeep checkpoints by SPAN[:INTERVAL],...\n"	\
+	"  -n, --dry-run\t\tonly report checkpoints to be removed\n"	\
+	"  -r, --rate=COUNT\tremove at most COUNT checkpoints a second\n" \
+	"  -v, --verbose\t\tlist removed checkpoints\n"		\
+	"  -h, --help\t\tdisplay this help and exit\n"			\
+	"  -V, --version\t\tdisplay version and exit\n"
+#else	/* !_GNU_SOURCE */
+#define THINCP_USAGE							\
+	"Usage: %s [-nvhV] [-r count] -k rules [device|node]\n"
+#endif	/* _GNU_SOURCE */
+
+#define THINCP_NCPINFO		4096	/* cpinfo read at a time */
+#define THINCP_NRULES_MAX	16
+#define THINCP_DELETE_CHUNK	32	/* removals between rate checks */
+#define THINCP_BUFSIZE		128
+
+/**
+ * struct thincp_rule - retention rule
+ * @span: age up to which this rule applies, in seconds
+ * @interval: length of the interval in which a checkpoint is kept
+ *            (0 to keep all checkpoints)
+ */
+struct thincp_rule {
+	unsigned long span;
+	unsigned long interval;
+};
+
+/**
+ * struct thincp_candidate - checkpoint kept so far in the current interval
+ * @cno: checkpoint number
+ * @create: creation time of the checkpoint
+ * @rule: index of the applied rule
+ * @start: start time of the interval
+ * @valid: flag indicating that the other fields are valid
+ */
+struct thincp_candidate {
+	nilfs_cno_t cno;
+	int64_t create;
+	int rule;
+	int64_t start;
+	int valid;
+};
+
+static struct thincp_rule thincp_rules[THINCP_NRULES_MAX];
+static int thincp_nrules;
+static int dry_run;
+static int verbose;
+static unsigned long rate;
+
+static struct nilfs_cpinfo cpinfos[THINCP_NCPINFO];
+static nilfs_cno_t thincp_targets[THINCP_NCPINFO + 1];
+static int64_t thincp_target_times[THINCP_NCPINFO + 1];
+
+static volatile sig_atomic_t thincp_interrupted;
+
+/* statistics */
+static uint64_t thincp_nscanned;
+static uint64_t thincp_nremoved;
+static uint64_t thincp_nsnapshots;
+static struct timespec thincp_start;
+
+NILFS_UTILS_GITID();
+
+static void thincp_handle_signal(int signum)
+{
+	thincp_interrupted = 1;
+}
+
+/**
+ * thincp_parse_rules - parse retention rules
+ * @arg: comma separated list of SPAN[:INTERVAL] rules
+ *
+ * Each rule keeps the newest checkpoint of every INTERVAL among the
+ * checkpoints younger than SPAN and not covered by the preceding rules,
+ * or all of them if INTERVAL is omitted.  Spans must be given in
+ * ascending order.
+ */
+static int thincp_parse_rules(const char *arg)
+{
+	struct thincp_rule *rule;
+	char *buf, *item, *interval, *saveptr;
+	int ret = -1;
+
+	buf = strdup(arg);
+	if (unlikely(!buf))
+		err(EXIT_FAILURE, "cannot allocate memory");
+
+	thincp_nrules = 0;
+	for (item = strtok_r(buf, ",", &saveptr); item;
+	     item = strtok_r(NULL, ",", &saveptr)) {
+		if (thincp_nrules == THINCP_NRULES_MAX)
+			goto out;
+		rule = &thincp_rules[thincp_nrules];
+
+		interval = strchr(item, ':');
+		if (interval)
+			*interval++ = '\0';
+
+		if (nilfs_parse_protection_period(item, &rule->span) < 0 ||
+		    rule->span == 0)
+			goto out;
+		if (thincp_nrules > 0 && rule->span <= rule[-1].span)
+			goto out;
+
+		rule->interval = 0;
+		if (interval &&
+		    (nilfs_parse_protection_period(interval,
+						   &rule->interval) < 0 ||
+		     rule->interval == 0))
+			goto out;
+		thincp_nrules++;
+	}
+	if (thincp_nrules > 0)
+		ret = 0;
+out:
+	free(buf);
+	return ret;
+}
+
+static double thincp_elapsed(void)
+{
+	struct timespec now, delta;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	timespecsub(&now, &thincp_start, &delta);
+	return delta.tv_sec + delta.tv_nsec / 1e9;
+}
+
+/**
+ * thincp_throttle - keep the rate of removals
+ *
+ * Sleeps until the number of removed checkpoints is within the limit
+ * given by the --rate option.
+ */
+static void thincp_throttle(void)
+{
+	struct timespec ts;
+	double delay;
+
+	delay = (double)thincp_nremoved / rate - thincp_elapsed();
+	if (delay <= 0)
+		return;
+
+	ts.tv_sec = (time_t)delay;
+	ts.tv_nsec = (long)((delay - ts.tv_sec) * 1e9);
+	while (nanosleep(&ts, &ts) < 0 && errno == EINTR &&
+	       !thincp_interrupted)
+		;
+}
+
+static void thincp_print_target(nilfs_cno_t cno, int64_t create)
+{
+	char timebuf[THINCP_BUFSIZE];
+	struct tm tm;
+	time_t t = (time_t)create;
+
+	localtime_r(&t, &tm);
+	strftime(timebuf, sizeof(timebuf), "%F %T", &tm);
+	printf("%20" PRIcno "  %s\n", cno, timebuf);
+}
+
+/**
+ * thincp_remove - remove the checkpoints selected in a batch
+ * @nilfs: nilfs object
+ * @n: number of selected checkpoints
+ */
+static int thincp_remove(struct nilfs *nilfs, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n && !thincp_interrupted; i++) {
+		if (verbose)
+			thincp_print_target(thincp_targets[i],
+					    thincp_target_times[i]);
+		if (dry_run) {
+			thincp_nremoved++;
+			continue;
+		}
+
+		if (unlikely(nilfs_delete_checkpoint(nilfs,
+						     thincp_targets[i]) < 0)) {
+			if (errno == EBUSY) {
+				/* turned into a snapshot, or mounted */
+				warnx("%" PRIcno ": checkpoint is busy",
+				      thincp_targets[i]);
+				continue;
+			} else if (errno == ENOENT) {
+				continue;
+			}
+			warn("%" PRIcno ": cannot remove checkpoint",
+			     thincp_targets[i]);
+			return -1;
+		}
+		thincp_nremoved++;
+
+		if (rate && thincp_nremoved % THINCP_DELETE_CHUNK == 0)
+			thincp_throttle();
+	}
+	return 0;
+}
+
+/**
+ * thincp_scan_end - get the end of checkpoints to be examined
+ * @nilfs: nilfs object
+ * @cpstat: checkpoint status
+ * @now: current time
+ *
+ * The latest checkpoint is never removed.  If the first rule keeps all
+ * checkpoints, the checkpoints created within its span are not read at
+ * all; the first of them is looked up with the reverse mapper.
+ *
+ * Return: the checkpoint number that ends the scan (exclusive).
+ */
+static nilfs_cno_t thincp_scan_end(struct nilfs *nilfs,
+				   const struct nilfs_cpstat *cpstat,
+				   int64_t now)
+{
+	struct nilfs_cnormap *cnormap;
+	nilfs_cno_t end = cpstat->cs_cno - 1, cno;
+
+	if (thincp_rules[0].interval != 0)
+		return end;
+
+	cnormap = nilfs_cnormap_create(nilfs);
+	if (unlikely(!cnormap)) {
+		warn("cannot create checkpoint number reverse mapper");
+		return end;
+	}
+	/* the first checkpoint younger than the span */
+	if (nilfs_cnormap_lookup_time(cnormap, now - thincp_rules[0].span + 1,
+				      &cno) == 0 && cno < end)
+		end = cno;
+	nilfs_cnormap_destroy(cnormap);
+	return end;
+}
+
+static int thincp_run(struct nilfs *nilfs)
+{
+	struct nilfs_cpstat cpstat;
+	struct thincp_candidate cand = { .valid = 0 };
+	const struct nilfs_cpinfo *cpi;
+	const struct thincp_rule *rule;
+	nilfs_cno_t cno, end;
+	int64_t now, age, start;
+	size_t ntargets;
+	ssize_t n, i;
+	int r;
+
+	if (unlikely(nilfs_get_cpstat(nilfs, &cpstat) < 0)) {
+		warn("cannot get checkpoint status");
+		return -1;
+	}
+	now = time(NULL);
+	end = thincp_scan_end(nilfs, &cpstat, now);
+
+	cno = nilfs_get_oldest_cno(nilfs);
+	while (cno < end && !thincp_interrupted) {
+		n = nilfs_get_cpinfo(nilfs, cno, NILFS_CHECKPOINT, cpinfos,
+				     THINCP_NCPINFO);
+		if (unlikely(n < 0)) {
+			warn("cannot get checkpoint information");
+			return -1;
+		}
+		if (n == 0)
+			break;
+
+		ntargets = 0;
+		for (i = 0, cpi = cpinfos; i < n; i++, cpi++) {
+			if (cpi->ci_cno >= end)
+				break;
+			if (nilfs_cpinfo_snapshot(cpi)) {
+				thincp_nsnapshots++;
+				continue;
+			}
+			thincp_nscanned++;
+
+			age = now - (int64_t)cpi->ci_create;
+			for (r = 0; r < thincp_nrules; r++)
+				if (age < (int64_t)thincp_rules[r].span)
+					break;
+
+			if (r == thincp_nrules) {
+				/* older than all rules */
+				thincp_targets[ntargets] = cpi->ci_cno;
+				thincp_target_times[ntargets++] =
+					cpi->ci_create;
+				continue;
+			}
+
+			rule = &thincp_rules[r];
+			if (rule->interval == 0) {
+				cand.valid = 0;
+				continue;
+			}
+
+			start = nilfs_interval_start(cpi->ci_create,
+						     rule->interval);
+			if (cand.valid && cand.rule == r &&
+			    cand.start == start) {
+				/* a newer one supersedes the candidate */
+				thincp_targets[ntargets] = cand.cno;
+				thincp_target_times[ntargets++] = cand.create;
+			}
+			cand.cno = cpi->ci_cno;
+			cand.create = cpi->ci_create;
+			cand.rule = r;
+			cand.start = start;
+			cand.valid = 1;
+		}
+		cno = cpinfos[n - 1].ci_cno + 1;
+
+		if (unlikely(thincp_remove(nilfs, ntargets) < 0))
+			return -1;
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct nilfs *nilfs;
+	char *dev, *endptr;
+	double elapsed;
+	int c, status;
+#ifdef _GNU_SOURCE
+	int option_index;
+#endif	/* _GNU_SOURCE */
+
+#ifdef _GNU_SOURCE
+	while ((c = getopt_long(argc, argv, "k:nr:vhV",
+				long_option, &option_index)) >= 0) {
+#else	/* !_GNU_SOURCE */
+	while ((c = getopt(argc, argv, "k:nr:vhV")) >= 0) {
+#endif	/* _GNU_SOURCE */
+		switch (c) {
+		case 'k':
+			if (thincp_parse_rules(optarg) < 0)
+				errx(EXIT_FAILURE, "invalid retention rules: %s",
+				     optarg);
+			break;
+		case 'n':
+			dry_run = 1;
+			break;
+		case 'r':
+			errno = 0;
+			rate = strtoul(optarg, &endptr, 10);
+			if (endptr == optarg || *endptr != '\0' || errno ||
+			    rate == 0)
+				errx(EXIT_FAILURE, "invalid rate: %s", optarg);
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		case 'h':
+			printf(THINCP_USAGE, getprogname());
+			exit(EXIT_SUCCESS);
+		case 'V':
+			printf("%s (%s %s)\n", getprogname(), PACKAGE,
+			       PACKAGE_VERSION);
+			exit(EXIT_SUCCESS);
+		default:
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (thincp_nrules == 0)
+		errx(EXIT_FAILURE, "no retention rules specified");
+
+	if (optind > argc - 1)
+		dev = NULL;
+	else if (optind == argc - 1)
+		dev = argv[optind++];
+	else
+		errx(EXIT_FAILURE, "too many arguments");
+
+	nilfs = nilfs_open(dev, NULL, (dry_run ? NILFS_OPEN_RDONLY :
+				       NILFS_OPEN_RDWR) | NILFS_OPEN_SRCHDEV);
+	if (nilfs == NULL)
+		err(EXIT_FAILURE, "cannot open NILFS on %s", dev ? : "device");
+
+	signal(SIGINT, thincp_handle_signal);
+	signal(SIGTERM, thincp_handle_signal);
+
+	clock_gettime(CLOCK_MONOTONIC, &thincp_start);
+	status = thincp_run(nilfs) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+
+	elapsed = thincp_elapsed();
+	printf("%s %" PRIu64 " of %" PRIu64 " examined checkpoints",
+	       dry_run ? "would remove" : "removed", thincp_nremoved,
+	       thincp_nscanned);
+	if (thincp_nsnapshots > 0)
+		printf(", kept %" PRIu64 " snapshots", thincp_nsnapshots);
+	if (!dry_run && elapsed > 0)
+		printf(" in %.1f seconds (%.0f/s)", elapsed,
+		       thincp_nremoved / elapsed);
+	putchar('\n');
+	if (thincp_interrupted) {
+		warnx("interrupted");
+		status = EXIT_FAILURE;
+	}
+
+	nilfs_close(nilfs);
+	exit(status);
+}
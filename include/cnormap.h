@@ -14,9 +14,22 @@
 
 struct nilfs_cnormap;
 
+#define NILFS_CNORMAP_INDEX_RDONLY	0x0001	/* Do not update index file */
+
+enum nilfs_cnormap_lookup_mode {
+	NILFS_CNORMAP_LOOKUP_WALK = 0,	/* Walk checkpoint history */
+	NILFS_CNORMAP_LOOKUP_BISECT,	/* Bisect checkpoint numbers */
+};
+
 struct nilfs_cnormap *nilfs_cnormap_create(struct nilfs *nilfs);
 void nilfs_cnormap_destroy(struct nilfs_cnormap *cnormap);
+int nilfs_cnormap_set_index(struct nilfs_cnormap *cnormap, const char *dir,
+			    int flags);
+void nilfs_cnormap_clear_index(struct nilfs_cnormap *cnormap);
+int nilfs_cnormap_set_lookup_mode(struct nilfs_cnormap *cnormap, int mode);
 int nilfs_cnormap_track_back(struct nilfs_cnormap *cnormap, uint64_t period,
 			     nilfs_cno_t *cnop);
+int nilfs_cnormap_lookup_time(struct nilfs_cnormap *cnormap, int64_t time,
+			      nilfs_cno_t *cnop);
 
 #endif /* NILFS_CNORMAP_H */
@@ -77,6 +77,8 @@ struct nilfs_layout {
 #define NILFS_OPEN_RDWR		0x0008	/* Open NILFS API in read/write mode */
 #define NILFS_OPEN_GCLK		0x1000	/* Open GC lock primitive */
 #define NILFS_OPEN_SRCHDEV	0x2000	/* Search device bound to the node */
+#define NILFS_OPEN_IMAGE	0x4000	/* Emulate NILFS API on an image */
+#define NILFS_OPEN_OFFLINE	0x8000	/* Read metadata of unmounted device */
 
 
 struct nilfs *nilfs_open(const char *dev, const char *dir, int flags);
@@ -106,11 +108,14 @@ static inline int nilfs_opt_clear_##name(struct nilfs *nilfs)		\
 
 NILFS_OPT_FNS(mmap, 0)
 NILFS_OPT_FNS(set_suinfo, 1)
+NILFS_OPT_FNS(direct_io, 2)
 
 nilfs_cno_t nilfs_get_oldest_cno(struct nilfs *nilfs);
 
 ssize_t nilfs_get_layout(const struct nilfs *nilfs,
 			 struct nilfs_layout *layout, size_t layout_size);
+int nilfs_get_uuid(const struct nilfs *nilfs, unsigned char *uuid,
+		   size_t size);
 
 int nilfs_lock(struct nilfs *nilfs, unsigned int index);
 int nilfs_trylock(struct nilfs *nilfs, unsigned int index);
@@ -149,6 +154,7 @@ int nilfs_sb_write(int devfd, struct nilfs_super_block *sbp, int mask);
  * @seed: crc seed
  * @mmapped: flag to indicate that @addr is mapped with mmap()
  * @adjusted: flag to indicate that @addr is adjusted to page boundary
+ * @pooled: flag to indicate that @addr belongs to the segment buffer pool
  */
 struct nilfs_segment {
 	void *addr;
@@ -162,13 +168,57 @@ struct nilfs_segment {
 	uint32_t seed;
 	unsigned int mmapped : 1;
 	unsigned int adjusted : 1;
+	unsigned int pooled : 1;
 };
 
+/**
+ * struct nilfs_segbuf_stat - statistics of segment buffer pool
+ * @hits: number of segment reads that reused a pooled buffer
+ * @misses: number of segment reads that allocated a new buffer
+ * @nbufs: number of free buffers currently kept in the pool
+ * @capacity: maximum number of free buffers kept in the pool
+ */
+struct nilfs_segbuf_stat {
+	uint64_t hits;
+	uint64_t misses;
+	uint32_t nbufs;
+	uint32_t capacity;
+};
+
+#define NILFS_SEGBUF_POOL_DEFAULT	2	/* Default pool capacity */
+
+/**
+ * struct nilfs_segread - request of raw segment read
+ * @segnum: segment number
+ * @offset: byte offset in the segment
+ * @length: number of bytes to read (zero reads up to the segment end)
+ * @buf: buffer to store data (NULL only issues readahead)
+ * @result: number of bytes read, or a negative error number
+ */
+struct nilfs_segread {
+	uint64_t segnum;
+	uint64_t offset;
+	size_t length;
+	void *buf;
+	ssize_t result;
+};
+
+#define NILFS_READ_DEPTH_DEFAULT	8	/* Default read queue depth */
+
 int nilfs_get_segment(struct nilfs *nilfs, uint64_t segnum,
 		      struct nilfs_segment *segment);
 int nilfs_put_segment(struct nilfs_segment *segment);
 int nilfs_get_segment_seqnum(const struct nilfs *nilfs, uint64_t segnum,
 			     uint64_t *seqnum);
+int nilfs_get_segment_seqnums(struct nilfs *nilfs, const uint64_t *segnums,
+			      const uint64_t *lastmods, uint64_t *seqnums,
+			      size_t nsegs);
+int nilfs_set_segbuf_pool_size(struct nilfs *nilfs, unsigned int nbufs);
+int nilfs_read_segments(struct nilfs *nilfs, struct nilfs_segread *reqs,
+			size_t nreqs);
+int nilfs_set_read_depth(struct nilfs *nilfs, unsigned int depth);
+int nilfs_get_segbuf_stat(const struct nilfs *nilfs,
+			  struct nilfs_segbuf_stat *stat);
 
 size_t nilfs_get_block_size(const struct nilfs *nilfs);
 uint64_t nilfs_get_nsegments(const struct nilfs *nilfs);
@@ -179,9 +229,33 @@ int nilfs_change_cpmode(struct nilfs *nilfs, nilfs_cno_t cno, int mode);
 ssize_t nilfs_get_cpinfo(struct nilfs *nilfs, nilfs_cno_t cno, int mode,
 			 struct nilfs_cpinfo *cpinfo, size_t nci);
 int nilfs_delete_checkpoint(struct nilfs *nilfs, nilfs_cno_t cno);
+
+/**
+ * struct nilfs_cpdel_stat - result of deleting a range of checkpoints
+ * @cno: checkpoint number last examined, or the one on which an error occurred
+ * @nfound: number of checkpoints found in the range
+ * @ndeleted: number of deleted checkpoints
+ * @nsnapshots: number of snapshots skipped
+ */
+struct nilfs_cpdel_stat {
+	nilfs_cno_t cno;
+	uint64_t nfound;
+	uint64_t ndeleted;
+	uint64_t nsnapshots;
+};
+
+typedef void nilfs_cpdel_report_t(const struct nilfs_cpdel_stat *stat,
+				  int snapshot, void *arg);
+
+int nilfs_delete_checkpoints(struct nilfs *nilfs, nilfs_cno_t start,
+			     nilfs_cno_t end, struct nilfs_cpdel_stat *stat,
+			     nilfs_cpdel_report_t *report, void *arg);
 int nilfs_get_cpstat(const struct nilfs *nilfs, struct nilfs_cpstat *cpstat);
 ssize_t nilfs_get_suinfo(const struct nilfs *nilfs, uint64_t segnum,
 			 struct nilfs_suinfo *suinfo, size_t nsi);
+ssize_t nilfs_get_suinfo_batch(const struct nilfs *nilfs,
+			       const uint64_t *segnums, size_t nsegs,
+			       struct nilfs_suinfo *si);
 int nilfs_set_suinfo(const struct nilfs *nilfs,
 		     struct nilfs_suinfo_update *sup, size_t nsup);
 int nilfs_get_sustat(const struct nilfs *nilfs, struct nilfs_sustat *sustat);
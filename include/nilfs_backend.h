@@ -0,0 +1,70 @@
+/*
+ * nilfs_backend.h - NILFS library backend interface
+ *
+ * Licensed under LGPLv2: the complete text of the GNU Lesser General
+ * Public License can be found in COPYING file of the nilfs-utils
+ * package.
+ */
+
+#ifndef NILFS_BACKEND_H
+#define NILFS_BACKEND_H
+
+#include <sys/types.h>	/* ssize_t */
+#include <stdint.h>	/* uint64_t */
+
+#include "nilfs.h"
+
+/**
+ * struct nilfs_backend_ops - operations replacing the NILFS ioctls
+ * @get_cpstat: emulate NILFS_IOCTL_GET_CPSTAT
+ * @get_cpinfo: emulate NILFS_IOCTL_GET_CPINFO
+ * @change_cpmode: emulate NILFS_IOCTL_CHANGE_CPMODE
+ * @delete_checkpoint: emulate NILFS_IOCTL_DELETE_CHECKPOINT
+ * @get_sustat: emulate NILFS_IOCTL_GET_SUSTAT
+ * @get_suinfo: emulate NILFS_IOCTL_GET_SUINFO
+ * @set_suinfo: emulate NILFS_IOCTL_SET_SUINFO
+ * @get_vinfo: emulate NILFS_IOCTL_GET_VINFO
+ * @get_bdescs: emulate NILFS_IOCTL_GET_BDESCS
+ * @clean_segments: emulate NILFS_IOCTL_CLEAN_SEGMENTS
+ * @sync: emulate NILFS_IOCTL_SYNC
+ * @release: free the private data of the backend
+ *
+ * Every operation returns -1 and sets errno on failure, in the same
+ * way as the ioctl it replaces.  The ones returning ssize_t return the
+ * number of items stored on success.
+ */
+struct nilfs_backend_ops {
+	int (*get_cpstat)(void *priv, struct nilfs_cpstat *cpstat);
+	ssize_t (*get_cpinfo)(void *priv, nilfs_cno_t cno, int mode,
+			      struct nilfs_cpinfo *cpinfo, size_t nci);
+	int (*change_cpmode)(void *priv, nilfs_cno_t cno, int mode);
+	int (*delete_checkpoint)(void *priv, nilfs_cno_t cno);
+	int (*get_sustat)(void *priv, struct nilfs_sustat *sustat);
+	ssize_t (*get_suinfo)(void *priv, uint64_t segnum,
+			      struct nilfs_suinfo *si, size_t nsi);
+	int (*set_suinfo)(void *priv, const struct nilfs_suinfo_update *sup,
+			  size_t nsup);
+	ssize_t (*get_vinfo)(void *priv, struct nilfs_vinfo *vinfo,
+			     size_t nvi);
+	ssize_t (*get_bdescs)(void *priv, struct nilfs_bdesc *bdescs,
+			      size_t nbdescs);
+	int (*clean_segments)(void *priv,
+			      const struct nilfs_vdesc *vdescs, size_t nvdescs,
+			      const struct nilfs_period *periods,
+			      size_t nperiods,
+			      const uint64_t *vblocknrs, size_t nvblocknrs,
+			      const struct nilfs_bdesc *bdescs, size_t nbdescs,
+			      const uint64_t *segnums, size_t nsegs);
+	int (*sync)(void *priv, nilfs_cno_t *cnop);
+	void (*release)(void *priv);
+};
+
+/* image.c */
+#define NILFS_IMAGE_RDONLY	0x0001	/* Refuse requests modifying the model */
+
+extern const struct nilfs_backend_ops nilfs_image_ops;
+
+void *nilfs_image_open(int devfd, const struct nilfs_super_block *sb,
+		       int flags);
+
+#endif /* NILFS_BACKEND_H */
@@ -76,6 +76,11 @@ int nilfs_xreclaim_segment(struct nilfs *nilfs,
 int nilfs_segment_is_protected(struct nilfs *nilfs, uint64_t segnum,
 			       uint64_t protseq);
 
+ssize_t nilfs_assess_segment_usage(struct nilfs *nilfs,
+				   uint64_t *segnums, size_t nsegs,
+				   const struct nilfs_reclaim_params *params,
+				   size_t *live_blks);
+
 static inline int
 nilfs_assess_segment(struct nilfs *nilfs,
 		     uint64_t *segnums, size_t nsegs,
@@ -0,0 +1,75 @@
+/*
+ * nilfs_scrub.h - NILFS segment scrubber
+ *
+ * Licensed under LGPLv2: the complete text of the GNU Lesser General
+ * Public License can be found in COPYING file of the nilfs-utils
+ * package.
+ */
+
+#ifndef NILFS_SCRUB_H
+#define NILFS_SCRUB_H
+
+#include <sys/types.h>	/* ssize_t */
+#include <stdint.h>	/* uint64_t */
+#include "nilfs.h"	/* struct nilfs */
+
+struct nilfs_scrub;
+
+#define NILFS_SCRUB_PROGRESS_RDONLY	0x0001	/* Do not update progress */
+#define NILFS_SCRUB_PROGRESS_RESET	0x0002	/* Ignore saved progress */
+
+/**
+ * struct nilfs_scrub_error - corrupted log found by the scrubber
+ * @segnum: segment number
+ * @blocknr: start block number of the partial segment
+ * @nblocks: number of blocks in the partial segment (0 if unknown)
+ * @inos: numbers of the inodes having blocks in the partial segment
+ * @ninos: number of elements in @inos
+ * @errstr: description of the problem
+ */
+struct nilfs_scrub_error {
+	uint64_t segnum;
+	uint64_t blocknr;
+	uint32_t nblocks;
+	const uint64_t *inos;
+	size_t ninos;
+	const char *errstr;
+};
+
+/**
+ * struct nilfs_scrub_stat - statistics of the scrubber
+ * @nsegs: number of verified segments
+ * @nlogs: number of verified partial segments
+ * @nbytes: number of bytes read for verification
+ * @nskipped: number of segments skipped because they changed
+ * @nerrors: number of corrupted logs found
+ * @npasses: number of passes completed over the whole volume
+ */
+struct nilfs_scrub_stat {
+	uint64_t nsegs;
+	uint64_t nlogs;
+	uint64_t nbytes;
+	uint64_t nskipped;
+	uint64_t nerrors;
+	uint64_t npasses;
+};
+
+typedef void nilfs_scrub_report_t(const struct nilfs_scrub_error *error,
+				  void *arg);
+
+struct nilfs_scrub *nilfs_scrub_create(struct nilfs *nilfs);
+void nilfs_scrub_destroy(struct nilfs_scrub *scrub);
+int nilfs_scrub_set_progress(struct nilfs_scrub *scrub, const char *dir,
+			     int flags);
+int nilfs_scrub_save_progress(struct nilfs_scrub *scrub);
+void nilfs_scrub_set_bandwidth(struct nilfs_scrub *scrub, uint64_t rate);
+int nilfs_scrub_set_jobs(struct nilfs_scrub *scrub, unsigned int njobs);
+void nilfs_scrub_set_reporter(struct nilfs_scrub *scrub,
+			      nilfs_scrub_report_t *report, void *arg);
+uint64_t nilfs_scrub_get_cursor(const struct nilfs_scrub *scrub);
+void nilfs_scrub_get_stat(const struct nilfs_scrub *scrub,
+			  struct nilfs_scrub_stat *stat);
+ssize_t nilfs_scrub_run(struct nilfs_scrub *scrub, uint64_t nsegs);
+void nilfs_scrub_stop(struct nilfs_scrub *scrub);
+
+#endif /* NILFS_SCRUB_H */
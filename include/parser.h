@@ -17,5 +17,8 @@ nilfs_cno_t nilfs_parse_cno(const char *arg, char **endptr, int base);
 int nilfs_parse_cno_range(const char *arg, uint64_t *start, uint64_t *end,
 			  int base);
 int nilfs_parse_protection_period(const char *arg, unsigned long *period);
+int nilfs_parse_size(const char *arg, uint64_t *sizep);
+int nilfs_parse_time(const char *arg, int64_t *timep);
+int64_t nilfs_interval_start(int64_t t, unsigned long interval);
 
 #endif /* NILFS_PARSER_H */
@@ -9,6 +9,7 @@
 #ifndef NILFS_SEGMENT_H
 #define NILFS_SEGMENT_H
 
+#include <sys/types.h>	/* ssize_t */
 #include <stdint.h>	/* uint32_t, etc */
 #include <linux/types.h>
 
@@ -105,6 +106,38 @@ struct nilfs_block {
 	unsigned int nsize;
 };
 
+/**
+ * struct nilfs_binfo_columns - block information decoded into columns
+ * @ino: inode number of each block
+ * @cno: checkpoint number (0 for blocks of the DAT file)
+ * @vblocknr: virtual block number (0 for blocks of the DAT file)
+ * @offset: file block offset (0 for node blocks with virtual addresses)
+ * @blocknr: disk block number
+ * @flags: NILFS_BINFO_COL_* flags
+ * @level: btree level (only meaningful for node blocks of the DAT file)
+ * @count: number of decoded blocks
+ * @capacity: number of blocks the columns can hold
+ *
+ * The i-th element of every column describes the same block.  Keeping
+ * each attribute in its own array lets consumers scan just the fields
+ * they need and lets the decoder fill them with simple loops.
+ */
+struct nilfs_binfo_columns {
+	uint64_t *ino;
+	uint64_t *cno;
+	uint64_t *vblocknr;
+	uint64_t *offset;
+	uint64_t *blocknr;
+	uint8_t *flags;
+	uint8_t *level;
+	size_t count;
+	size_t capacity;
+};
+
+/* Flags of block information columns */
+#define NILFS_BINFO_COL_NODE	0x01	/* B-tree node block */
+#define NILFS_BINFO_COL_REAL	0x02	/* Not translated with DAT */
+
 
 struct nilfs;
 struct nilfs_segment;
@@ -115,6 +148,7 @@ void nilfs_psegment_init(struct nilfs_psegment *pseg,
 int nilfs_psegment_is_end(struct nilfs_psegment *pseg);
 void nilfs_psegment_next(struct nilfs_psegment *pseg);
 const char *nilfs_psegment_strerror(int errnum);
+int nilfs_psegment_verify_datasum(const struct nilfs_psegment *pseg);
 
 #define nilfs_psegment_for_each(pseg, seg, blkcnt)			\
 	for (nilfs_psegment_init(pseg, seg, blkcnt);			\
@@ -177,5 +211,19 @@ static inline int nilfs_block_is_node(const struct nilfs_block *blk)
 	for (nilfs_block_init(blk, file); !nilfs_block_is_end(blk);	\
 	     nilfs_block_next(blk))
 
+/* bulk decoder */
+void nilfs_binfo_columns_init(struct nilfs_binfo_columns *cols);
+void nilfs_binfo_columns_destroy(struct nilfs_binfo_columns *cols);
+ssize_t nilfs_binfo_columns_add_file(struct nilfs_binfo_columns *cols,
+				     const struct nilfs_file *file);
+ssize_t nilfs_binfo_columns_add_psegment(struct nilfs_binfo_columns *cols,
+					 const struct nilfs_psegment *pseg,
+					 struct nilfs_file *file);
+
+static inline void nilfs_binfo_columns_reset(struct nilfs_binfo_columns *cols)
+{
+	cols->count = 0;
+}
+
 
 #endif /* NILFS_SEGMENT_H */
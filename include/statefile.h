@@ -0,0 +1,18 @@
+/*
+ * statefile.h - per file system state files
+ *
+ * Licensed under LGPLv2: the complete text of the GNU Lesser General
+ * Public License can be found in COPYING file of the nilfs-utils
+ * package.
+ */
+
+#ifndef NILFS_STATEFILE_H
+#define NILFS_STATEFILE_H
+
+#include <sys/uio.h>	/* struct iovec */
+
+char *nilfs_state_path(const char *dir, const unsigned char *uuid,
+		       const char *suffix, int create);
+int nilfs_state_save(const char *path, const struct iovec *iov, int iovcnt);
+
+#endif /* NILFS_STATEFILE_H */
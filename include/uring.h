@@ -0,0 +1,38 @@
+/*
+ * uring.h - batched asynchronous reads with io_uring
+ *
+ * Licensed under LGPLv2: the complete text of the GNU Lesser General
+ * Public License can be found in COPYING file of the nilfs-utils
+ * package.
+ */
+
+#ifndef NILFS_URING_H
+#define NILFS_URING_H
+
+#include <sys/types.h>	/* off_t, ssize_t */
+#include <sys/uio.h>	/* struct iovec */
+
+struct nilfs_uring;
+
+/**
+ * struct nilfs_uring_io - read request
+ * @buf: buffer to store data
+ * @len: number of bytes to read
+ * @offset: file offset to read from
+ * @result: number of bytes read, or a negative error number
+ * @iov: io vector passed to the kernel (private)
+ */
+struct nilfs_uring_io {
+	void *buf;
+	size_t len;
+	off_t offset;
+	ssize_t result;
+	struct iovec iov;
+};
+
+struct nilfs_uring *nilfs_uring_create(unsigned int depth);
+void nilfs_uring_destroy(struct nilfs_uring *ring);
+int nilfs_uring_read(struct nilfs_uring *ring, int fd,
+		     struct nilfs_uring_io *ios, size_t nios);
+
+#endif /* NILFS_URING_H */
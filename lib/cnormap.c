@@ -18,6 +18,14 @@
 #include <stdlib.h>
 #endif	/* HAVE_STDLIB_H */
 
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif	/* HAVE_UNISTD_H */
+
+#if HAVE_FCNTL_H
+#include <fcntl.h>
+#endif	/* HAVE_FCNTL_H */
+
 #if HAVE_STRING_H
 #include <string.h>	/* memset() */
 #endif	/* HAVE_STRING_H */
@@ -26,11 +34,16 @@
 #include <time.h>	/* clock_gettime() */
 #endif	/* HAVE_TIME_H */
 
+#if HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif	/* HAVE_SYS_STAT_H */
+
 #include <errno.h>
 #include "compat.h"
 #include "util.h"
 #include "cnormap.h"
 #include "vector.h"
+#include "statefile.h"
 
 
 /* Checkpoint number and the corresponding clock time */
@@ -53,6 +66,29 @@ struct nilfs_cpspan {
 					 * where rewind occurs.
 					 */
 
+#define NILFS_CPINDEX_MAGIC	0x43504958	/* "CPIX" */
+#define NILFS_CPINDEX_VERSION	1
+
+/**
+ * struct nilfs_cpindex_header - header of checkpoint time index file
+ * @magic: magic number (NILFS_CPINDEX_MAGIC)
+ * @version: format version of the index file
+ * @span_size: size of a span record
+ * @uuid: 128-bit uuid of the file system
+ * @nspans: number of span records following the header
+ *
+ * Span records are stored in the host byte order in ascending order of
+ * checkpoint number.  The index file is a cache; a file which fails to
+ * validate is silently discarded and rebuilt.
+ */
+struct nilfs_cpindex_header {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t span_size;
+	unsigned char uuid[16];
+	uint64_t nspans;
+};
+
 /* Checkpoint number/time reverse mapper */
 struct nilfs_cnormap {
 	struct nilfs *nilfs;
@@ -61,6 +97,14 @@ struct nilfs_cnormap {
 	int64_t base_time;		/* Base time */
 	int64_t base_clock;		/* Monotonic clock at the base time */
 
+	/* Persistent checkpoint time index (optional) */
+	struct nilfs_vector *cpindex;	/* Spans in ascending order of cno */
+	char *cpindex_path;		/* Path of the index file */
+	int cpindex_flags;		/* NILFS_CNORMAP_INDEX_* flags */
+
+	int lookup_mode;		/* NILFS_CNORMAP_LOOKUP_* mode */
+	unsigned char uuid[16];		/* uuid of the file system */
+
 	/* Clock feature flags */
 	unsigned int has_clock_boottime : 1;
 		/* clock_gettime(CLOCK_BOOTTIME, ) is available */
@@ -111,10 +155,175 @@ struct nilfs_cnormap *nilfs_cnormap_create(struct nilfs *nilfs)
 
 void nilfs_cnormap_destroy(struct nilfs_cnormap *cnormap)
 {
+	if (cnormap->cpindex)
+		nilfs_vector_destroy(cnormap->cpindex);
+	free(cnormap->cpindex_path);
 	nilfs_vector_destroy(cnormap->cphist);
 	free(cnormap);
 }
 
+static int nilfs_cnormap_index_load(struct nilfs_cnormap *cnormap)
+{
+	struct nilfs_cpindex_header hdr;
+	struct nilfs_cpspan *spans, *cpspan;
+	size_t size;
+	ssize_t nr;
+	int fd;
+
+	fd = open(cnormap->cpindex_path, O_RDONLY);
+	if (fd < 0)
+		return errno == ENOENT ? 0 : -1;
+
+	nr = read(fd, &hdr, sizeof(hdr));
+	if (nr != sizeof(hdr) || hdr.magic != NILFS_CPINDEX_MAGIC ||
+	    hdr.version != NILFS_CPINDEX_VERSION ||
+	    hdr.span_size != sizeof(struct nilfs_cpspan) ||
+	    memcmp(hdr.uuid, cnormap->uuid, sizeof(hdr.uuid)) != 0 ||
+	    hdr.nspans == 0 || hdr.nspans > UINT32_MAX)
+		goto discard;
+
+	spans = nilfs_vector_insert_elements(cnormap->cpindex, 0, hdr.nspans);
+	if (unlikely(!spans)) {
+		close(fd);
+		return -1;
+	}
+
+	size = hdr.nspans * sizeof(*spans);
+	nr = read(fd, spans, size);
+	if (nr < 0 || (size_t)nr != size)
+		goto discard;
+
+	for (cpspan = spans; cpspan < spans + hdr.nspans; cpspan++) {
+		if (cpspan->start.cno < NILFS_CNO_MIN ||
+		    cpspan->start.cno > cpspan->end.cno ||
+		    cpspan->start.time > cpspan->end.time ||
+		    (cpspan > spans && cpspan[-1].end.cno >= cpspan->start.cno))
+			goto discard;
+	}
+	close(fd);
+	return 0;
+
+discard:
+	/* The index is just a cache; rebuild it from scratch */
+	nilfs_vector_clear(cnormap->cpindex);
+	close(fd);
+	return 0;
+}
+
+static int nilfs_cnormap_index_save(struct nilfs_cnormap *cnormap)
+{
+	struct nilfs_cpindex_header hdr;
+	struct iovec iov[2];
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = NILFS_CPINDEX_MAGIC;
+	hdr.version = NILFS_CPINDEX_VERSION;
+	hdr.span_size = sizeof(struct nilfs_cpspan);
+	memcpy(hdr.uuid, cnormap->uuid, sizeof(hdr.uuid));
+	hdr.nspans = nilfs_vector_get_size(cnormap->cpindex);
+
+	iov[0].iov_base = &hdr;
+	iov[0].iov_len = sizeof(hdr);
+	iov[1].iov_base = nilfs_vector_get_data(cnormap->cpindex);
+	iov[1].iov_len = hdr.nspans * sizeof(struct nilfs_cpspan);
+
+	return nilfs_state_save(cnormap->cpindex_path, iov, 2);
+}
+
+/**
+ * nilfs_cnormap_set_index - enable persistent checkpoint time index
+ * @cnormap: nilfs_cnormap struct
+ * @dir: directory of index files [optional]
+ * @flags: NILFS_CNORMAP_INDEX_* flags
+ *
+ * nilfs_cnormap_set_index() makes @cnormap keep a sparse index of
+ * checkpoint creation times in a file named after the uuid of the file
+ * system under @dir (or the default directory if @dir is NULL).  The
+ * index is validated and extended on the first lookup, so that a cold
+ * start does not have to enumerate the checkpoint history again.  The
+ * nilfs object must have been opened with NILFS_OPEN_RAW.
+ *
+ * Return: 0 on success, or -1 with errno set on failure.
+ */
+int nilfs_cnormap_set_index(struct nilfs_cnormap *cnormap, const char *dir,
+			    int flags)
+{
+	char *path;
+	int ret;
+
+	ret = nilfs_get_uuid(cnormap->nilfs, cnormap->uuid,
+			     sizeof(cnormap->uuid));
+	if (unlikely(ret < 0))
+		return -1;
+
+	path = nilfs_state_path(dir, cnormap->uuid, "cpidx",
+				!(flags & NILFS_CNORMAP_INDEX_RDONLY));
+	if (unlikely(!path))
+		return -1;
+
+	if (!cnormap->cpindex) {
+		cnormap->cpindex =
+			nilfs_vector_create(sizeof(struct nilfs_cpspan));
+		if (unlikely(!cnormap->cpindex)) {
+			free(path);
+			return -1;
+		}
+	} else {
+		nilfs_vector_clear(cnormap->cpindex);
+	}
+
+	free(cnormap->cpindex_path);
+	cnormap->cpindex_path = path;
+	cnormap->cpindex_flags = flags;
+
+	return nilfs_cnormap_index_load(cnormap);
+}
+
+/**
+ * nilfs_cnormap_clear_index - disable persistent checkpoint time index
+ * @cnormap: nilfs_cnormap struct
+ *
+ * nilfs_cnormap_clear_index() drops the index enabled by
+ * nilfs_cnormap_set_index().  The index file is left as it is, so that
+ * it can be reused when the index is enabled again.
+ */
+void nilfs_cnormap_clear_index(struct nilfs_cnormap *cnormap)
+{
+	if (cnormap->cpindex) {
+		nilfs_vector_destroy(cnormap->cpindex);
+		cnormap->cpindex = NULL;
+	}
+	free(cnormap->cpindex_path);
+	cnormap->cpindex_path = NULL;
+	cnormap->cpindex_flags = 0;
+}
+
+/**
+ * nilfs_cnormap_set_lookup_mode - select lookup method of cnormap
+ * @cnormap: nilfs_cnormap struct
+ * @mode: NILFS_CNORMAP_LOOKUP_WALK or NILFS_CNORMAP_LOOKUP_BISECT
+ *
+ * NILFS_CNORMAP_LOOKUP_WALK, the default, maintains a history of
+ * checkpoint spans by enumerating checkpoints, which is cheap for
+ * successive lookups with a steady period.  NILFS_CNORMAP_LOOKUP_BISECT
+ * bisects checkpoint numbers with single checkpoint probes, which bounds
+ * the number of ioctls per lookup to O(log ncp) regardless of how the
+ * period changes.
+ *
+ * Return: 0 on success, or -1 with errno set to EINVAL if @mode is
+ * invalid.
+ */
+int nilfs_cnormap_set_lookup_mode(struct nilfs_cnormap *cnormap, int mode)
+{
+	if (unlikely(mode != NILFS_CNORMAP_LOOKUP_WALK &&
+		     mode != NILFS_CNORMAP_LOOKUP_BISECT)) {
+		errno = EINVAL;
+		return -1;
+	}
+	cnormap->lookup_mode = mode;
+	return 0;
+}
+
 /**
  * nilfs_enum_cpinfo_forward - enumrate checkpoints forward
  * @nilfs: nilfs object
@@ -815,6 +1024,289 @@ out:
 }
 
 
+static int nilfs_cpindex_scan_forward(const struct nilfs_cpinfo *cpinfo,
+				      void *arg)
+{
+	struct nilfs_vector *cpindex = arg;
+	struct nilfs_cpspan *cpspan;
+	size_t n = nilfs_vector_get_size(cpindex);
+
+	if (n > 0) {
+		cpspan = nilfs_vector_get_element(cpindex, n - 1);
+		if (cpinfo->ci_create == cpspan->end.time ||
+		    (cpinfo->ci_create > cpspan->end.time &&
+		     cpspan->approx_ncp < NCP_PER_SPAN)) {
+			cpspan->end.cno = cpinfo->ci_cno;
+			cpspan->end.time = cpinfo->ci_create;
+			cpspan->approx_ncp++;
+			return 1; /* Get next */
+		}
+	}
+
+	/* Start a new span on a clock rewind or when the span is full */
+	cpspan = nilfs_vector_get_new_element(cpindex);
+	if (unlikely(!cpspan))
+		return -1;
+	cpspan->start.cno = cpinfo->ci_cno;
+	cpspan->start.time = cpinfo->ci_create;
+	cpspan->end.cno = cpinfo->ci_cno;
+	cpspan->end.time = cpinfo->ci_create;
+	cpspan->approx_ncp = 1;
+	return 1; /* Get next */
+}
+
+/**
+ * nilfs_cnormap_index_update - validate and extend checkpoint time index
+ * @cnormap: nilfs_cnormap struct
+ * @cpstat: pointer to cpstat struct
+ *
+ * The index is discarded if its newest span does not match the current
+ * checkpoints, spans of deleted checkpoints are dropped, and then spans
+ * are appended for checkpoints created after the index was saved.  If
+ * the index changed, it is written back unless it is read-only.
+ */
+static int nilfs_cnormap_index_update(struct nilfs_cnormap *cnormap,
+				      const struct nilfs_cpstat *cpstat)
+{
+	struct nilfs_vector *cpindex = cnormap->cpindex;
+	struct nilfs_cpspan *cpspan;
+	struct nilfs_cpinfo cpinfo;
+	nilfs_cno_t oldest, start_cno = NILFS_CNO_MIN, end_cno = 0;
+	unsigned int i;
+	size_t n;
+	ssize_t nci;
+	int changed = 0;
+	int errsv;
+	int ret;
+
+	n = nilfs_vector_get_size(cpindex);
+	if (n == 0)
+		goto extend;
+
+	cpspan = nilfs_vector_get_element(cpindex, n - 1);
+	if (cpspan->end.cno >= cpstat->cs_cno)
+		goto rebuild; /* Stale index */
+
+	nci = nilfs_get_cpinfo(cnormap->nilfs, cpspan->end.cno,
+			       NILFS_CHECKPOINT, &cpinfo, 1);
+	if (unlikely(nci < 0))
+		return -1;
+	if (nci > 0 && cpinfo.ci_cno == cpspan->end.cno &&
+	    cpinfo.ci_create != cpspan->end.time)
+		goto rebuild; /* Inconsistent index */
+
+	/* Drop spans of deleted checkpoints */
+	oldest = nilfs_get_oldest_cno(cnormap->nilfs);
+	for (i = 0; i < n; i++) {
+		cpspan = nilfs_vector_get_element(cpindex, i);
+		if (cpspan->end.cno >= oldest)
+			break;
+	}
+	if (i > 0) {
+		nilfs_vector_delete_elements(cpindex, 0, i);
+		n -= i;
+		changed = 1;
+	}
+	if (n > 0) {
+		cpspan = nilfs_vector_get_element(cpindex, n - 1);
+		end_cno = cpspan->end.cno;
+		start_cno = end_cno + 1;
+	}
+	goto extend;
+
+rebuild:
+	nilfs_vector_clear(cpindex);
+	n = 0;
+	changed = 1;
+extend:
+	ret = nilfs_enum_cpinfo_forward(cnormap->nilfs, cpstat, start_cno, 0,
+					nilfs_cpindex_scan_forward, cpindex);
+	if (unlikely(ret < 0))
+		return -1;
+
+	n = nilfs_vector_get_size(cpindex);
+	if (n > 0) {
+		cpspan = nilfs_vector_get_element(cpindex, n - 1);
+		if (cpspan->end.cno != end_cno)
+			changed = 1;
+	}
+
+	if (changed && !(cnormap->cpindex_flags & NILFS_CNORMAP_INDEX_RDONLY)) {
+		/* Failing to save the index is not fatal */
+		errsv = errno;
+		nilfs_cnormap_index_save(cnormap);
+		errno = errsv;
+	}
+	return 0;
+}
+
+/**
+ * nilfs_cnormap_cphist_seed - generate cphist from checkpoint time index
+ * @cnormap: nilfs_cnormap struct
+ * @cpstat: pointer to cpstat struct
+ * @monotonic_clock: the current value of system clock (monotonic clock)
+ * @period: period to be tracked back
+ *
+ * nilfs_cnormap_cphist_seed() copies spans of the checkpoint time index
+ * to cphist from the newest one until they cover @period, so that the
+ * following lookup on cphist only needs to refine a single span.  If
+ * the file system has no checkpoints, or a read-only index is not
+ * available, cphist is left empty.
+ */
+static int nilfs_cnormap_cphist_seed(struct nilfs_cnormap *cnormap,
+				     const struct nilfs_cpstat *cpstat,
+				     int64_t monotonic_clock, uint64_t period)
+{
+	struct nilfs_cpspan *src, *dst, *newer;
+	int64_t realtime_clock;
+	uint64_t elapsed_time = 0;
+	unsigned int i;
+	int ret;
+
+	if (nilfs_vector_get_size(cnormap->cpindex) == 0 &&
+	    (cnormap->cpindex_flags & NILFS_CNORMAP_INDEX_RDONLY))
+		return 0; /* Building a volatile index does not pay */
+
+	ret = nilfs_cnormap_index_update(cnormap, cpstat);
+	if (unlikely(ret < 0))
+		return -1;
+
+	i = nilfs_vector_get_size(cnormap->cpindex);
+	if (i == 0)
+		return 0;
+
+	ret = nilfs_cnormap_get_realtime_clock(cnormap, &realtime_clock);
+	if (unlikely(ret < 0))
+		return -1;
+
+	src = nilfs_vector_get_element(cnormap->cpindex, i - 1);
+	if (realtime_clock > src->end.time)
+		period -= min_t(uint64_t, period,
+				realtime_clock - src->end.time);
+
+	newer = NULL;
+	while (i-- > 0) {
+		src = nilfs_vector_get_element(cnormap->cpindex, i);
+		if (newer)
+			elapsed_time += gap_of_spans(src->end.time,
+						     newer->start.time);
+		elapsed_time += src->end.time - src->start.time;
+
+		dst = nilfs_vector_get_new_element(cnormap->cphist);
+		if (unlikely(!dst)) {
+			nilfs_vector_clear(cnormap->cphist);
+			return -1;
+		}
+		*dst = *src;
+		if (elapsed_time > period)
+			break;
+		newer = src;
+	}
+
+	cnormap->cphist_elapsed_time = elapsed_time;
+	cnormap->base_time = realtime_clock;
+	cnormap->base_clock = monotonic_clock;
+	return 0;
+}
+
+
+/**
+ * nilfs_cnormap_probe - get the first checkpoint at or after a number
+ * @cnormap: nilfs_cnormap struct
+ * @cno: checkpoint number to start looking up
+ * @cptime: buffer to store the number and time of the found checkpoint
+ *
+ * Return: 1 if a checkpoint was found, 0 if not, or -1 on error.
+ */
+static int nilfs_cnormap_probe(struct nilfs_cnormap *cnormap, nilfs_cno_t cno,
+			       struct nilfs_cptime *cptime)
+{
+	struct nilfs_cpinfo cpinfo;
+	ssize_t n;
+
+	n = nilfs_get_cpinfo(cnormap->nilfs, cno, NILFS_CHECKPOINT, &cpinfo, 1);
+	if (unlikely(n < 0))
+		return -1;
+	if (n == 0)
+		return 0;
+
+	cptime->cno = cpinfo.ci_cno;
+	cptime->time = cpinfo.ci_create;
+	return 1;
+}
+
+/**
+ * nilfs_cnormap_bisect - find min. inclusive checkpoint by bisection
+ * @cnormap: nilfs_cnormap struct
+ * @cpstat: pointer to cpstat struct
+ * @time: clock time to be looked up
+ * @cnop: buffer to store the minimum included checkpoint number
+ *
+ * nilfs_cnormap_bisect() looks for the oldest checkpoint created at or
+ * after @time by bisecting checkpoint numbers, relying on creation times
+ * of checkpoints being monotonic.  Each probe returns the first
+ * existing checkpoint at or after the probed number, so gaps of deleted
+ * checkpoints narrow the search range instead of breaking it.  A probe
+ * whose time lies outside the times of the current bounds reveals a
+ * clock rewind; in that case the lookup is abandoned.
+ *
+ * Return: 0 on success, 1 if a clock rewind was detected, or -1 on
+ * error.
+ */
+static int nilfs_cnormap_bisect(struct nilfs_cnormap *cnormap,
+				const struct nilfs_cpstat *cpstat,
+				int64_t time, nilfs_cno_t *cnop)
+{
+	struct nilfs_cptime lo, hi, mid;	/* lo: excluded, hi: included */
+	nilfs_cno_t cno, ub;	/* No checkpoints in [ub, hi.cno) */
+	int ret;
+
+	ret = nilfs_cnormap_probe(cnormap, NILFS_CNO_MIN, &lo);
+	if (unlikely(ret < 0))
+		return -1;
+	if (ret == 0 || cpstat->cs_cno <= NILFS_CNO_MIN) {
+		*cnop = NILFS_CNO_MAX;
+		return 0;
+	}
+	if (lo.time >= time) {
+		*cnop = lo.cno;
+		return 0;
+	}
+
+	ret = nilfs_cnormap_probe(cnormap, cpstat->cs_cno - 1, &hi);
+	if (unlikely(ret < 0))
+		return -1;
+	if (ret == 0 || hi.time < time) {
+		*cnop = NILFS_CNO_MAX;
+		return 0;
+	}
+
+	ub = hi.cno;
+	while (ub - lo.cno > 1) {
+		cno = lo.cno + (ub - lo.cno) / 2;
+
+		ret = nilfs_cnormap_probe(cnormap, cno, &mid);
+		if (unlikely(ret < 0))
+			return -1;
+		if (ret == 0 || mid.cno >= ub) {
+			ub = cno; /* No checkpoints in [cno, ub) */
+			continue;
+		}
+		if (unlikely(mid.time < lo.time || mid.time > hi.time))
+			return 1; /* Clock rewind */
+
+		if (mid.time >= time) {
+			hi = mid;
+			ub = mid.cno;
+		} else {
+			lo = mid;
+		}
+	}
+	*cnop = hi.cno;
+	return 0;
+}
+
+
 /**
  * nilfs_cnormap_track_back - get checkpoint number back for a period of time
  * @cnormap: nilfs_cnormap struct
@@ -844,14 +1336,43 @@ int nilfs_cnormap_track_back(struct nilfs_cnormap *cnormap, uint64_t period,
 	if (unlikely(ret < 0))
 		return -1;
 
+	if (cnormap->lookup_mode == NILFS_CNORMAP_LOOKUP_BISECT) {
+		int64_t realtime_clock;
+
+		ret = nilfs_cnormap_get_realtime_clock(cnormap,
+						       &realtime_clock);
+		if (unlikely(ret < 0))
+			return -1;
+		ret = nilfs_cnormap_bisect(
+			cnormap, &cpstat,
+			realtime_clock -
+			(int64_t)min_t(uint64_t, period, INT64_MAX), cnop);
+		if (ret <= 0)
+			return ret;
+		/*
+		 * Clock rewind was detected; fall back to history walk for
+		 * this lookup only.
+		 */
+	}
+
 	ret = nilfs_cnormap_get_monotonic_clock(cnormap, &monotonic_clock);
 	if (unlikely(ret < 0))
 		return -1;
 
 	if (nilfs_vector_get_size(cnormap->cphist) == 0) {
-		ret = nilfs_cnormap_cphist_init(cnormap, &cpstat,
-						monotonic_clock, period, cnop);
-		goto out;
+		if (cnormap->cpindex_path) {
+			ret = nilfs_cnormap_cphist_seed(cnormap, &cpstat,
+							monotonic_clock,
+							period);
+			if (unlikely(ret < 0))
+				goto out;
+		}
+		if (nilfs_vector_get_size(cnormap->cphist) == 0) {
+			ret = nilfs_cnormap_cphist_init(cnormap, &cpstat,
+							monotonic_clock,
+							period, cnop);
+			goto out;
+		}
 	}
 
 	latest = nilfs_vector_get_element(cnormap->cphist, 0);
@@ -903,3 +1424,51 @@ int nilfs_cnormap_track_back(struct nilfs_cnormap *cnormap, uint64_t period,
 out:
 	return ret;
 }
+
+/**
+ * nilfs_cnormap_lookup_time - get the first checkpoint created at a time
+ * @cnormap: nilfs_cnormap struct
+ * @time: clock time in seconds since the Epoch
+ * @cnop: buffer to store resultant checkpoint number
+ *
+ * nilfs_cnormap_lookup_time() finds the oldest checkpoint created at or
+ * after @time.  Checkpoint numbers are bisected so that only a
+ * logarithmic number of checkpoints are read; if a clock rewind makes
+ * the creation times non-monotonic, checkpoints are scanned forward
+ * from the oldest one instead.  This does not depend on the lookup
+ * mode nor affect the history used by nilfs_cnormap_track_back().
+ *
+ * If no checkpoint was created at or after @time, NILFS_CNO_MAX is set
+ * in the buffer @cnop.
+ *
+ * Return: 0 on success, or -1 on error.
+ */
+int nilfs_cnormap_lookup_time(struct nilfs_cnormap *cnormap, int64_t time,
+			      nilfs_cno_t *cnop)
+{
+	struct nilfs_cpinfo_find_context ctx;
+	struct nilfs_cpstat cpstat;
+	int ret;
+
+	ret = nilfs_get_cpstat(cnormap->nilfs, &cpstat);
+	if (unlikely(ret < 0))
+		return -1;
+
+	ret = nilfs_cnormap_bisect(cnormap, &cpstat, time, cnop);
+	if (ret <= 0)
+		return ret;
+
+	/* Clock rewind was detected; scan checkpoints forward */
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.time = time;
+	ctx.end_cno = NILFS_CNO_MAX;
+	ctx.min_incl_cp.cno = NILFS_CNO_MAX;
+
+	ret = nilfs_enum_cpinfo_forward(cnormap->nilfs, &cpstat, 0, 0,
+					nilfs_cpinfo_find, &ctx);
+	if (unlikely(ret < 0))
+		return -1;
+
+	*cnop = ctx.min_incl_cp.cno;
+	return 0;
+}
@@ -84,6 +84,15 @@ static int nilfs_comp_period(const void *elem1, const void *elem2)
 		(period1->p_start == period2->p_start) ? 0 : 1;
 }
 
+static int nilfs_comp_segnum(const void *elem1, const void *elem2)
+{
+	const uint64_t *segnum1 = elem1, *segnum2 = elem2;
+
+	if (*segnum1 < *segnum2)
+		return -1;
+	return *segnum1 > *segnum2 ? 1 : 0;
+}
+
 static int nilfs_comp_bdesc(const void *elem1, const void *elem2)
 {
 	const struct nilfs_bdesc *bdesc1 = elem1, *bdesc2 = elem2;
@@ -107,62 +116,49 @@ static int nilfs_comp_bdesc(const void *elem1, const void *elem2)
 }
 
 /**
- * nilfs_acc_blocks_file - collect summary of blocks in a file
- * @file: file object
+ * nilfs_acc_blocks_columns - convert decoded block information to descriptors
+ * @cols: columns of block information
  * @vdescv: vector object to store (descriptors of) virtual block numbers
  * @bdescv: vector object to store (descriptors of) disk block numbers
  */
-static int nilfs_acc_blocks_file(struct nilfs_file *file,
-				 struct nilfs_vector *vdescv,
-				 struct nilfs_vector *bdescv)
+static int nilfs_acc_blocks_columns(const struct nilfs_binfo_columns *cols,
+				    struct nilfs_vector *vdescv,
+				    struct nilfs_vector *bdescv)
 {
-	struct nilfs_block blk;
 	struct nilfs_vdesc *vdesc;
 	struct nilfs_bdesc *bdesc;
-	union nilfs_binfo *binfo;
-	ino_t ino;
-	nilfs_cno_t cno;
-
-	ino = le64_to_cpu(file->finfo->fi_ino);
-	if (nilfs_file_use_real_blocknr(file)) {
-		nilfs_block_for_each(&blk, file) {
-			bdesc = nilfs_vector_get_new_element(bdescv);
-			if (unlikely(bdesc == NULL))
-				return -1;
-			bdesc->bd_ino = ino;
-			bdesc->bd_oblocknr = blk.blocknr;
-			if (nilfs_block_is_data(&blk)) {
-				bdesc->bd_offset =
-					le64_to_cpu(*(__le64 *)blk.binfo);
-				bdesc->bd_level = 0;
-			} else {
-				binfo = blk.binfo;
-				bdesc->bd_offset =
-					le64_to_cpu(binfo->bi_dat.bi_blkoff);
-				bdesc->bd_level = binfo->bi_dat.bi_level;
-			}
-		}
-	} else {
-		cno = le64_to_cpu(file->finfo->fi_cno);
-		nilfs_block_for_each(&blk, file) {
-			vdesc = nilfs_vector_get_new_element(vdescv);
-			if (unlikely(vdesc == NULL))
-				return -1;
-			vdesc->vd_ino = ino;
-			vdesc->vd_cno = cno;
-			vdesc->vd_blocknr = blk.blocknr;
-			if (nilfs_block_is_data(&blk)) {
-				binfo = blk.binfo;
-				vdesc->vd_vblocknr =
-					le64_to_cpu(binfo->bi_v.bi_vblocknr);
-				vdesc->vd_offset =
-					le64_to_cpu(binfo->bi_v.bi_blkoff);
-				vdesc->vd_flags = 0;	/* data */
-			} else {
-				vdesc->vd_vblocknr =
-					le64_to_cpu(*(__le64 *)blk.binfo);
-				vdesc->vd_flags = 1;	/* node */
-			}
+	size_t i, nreal = 0;
+
+	for (i = 0; i < cols->count; i++)
+		nreal += !!(cols->flags[i] & NILFS_BINFO_COL_REAL);
+
+	vdesc = nilfs_vector_insert_elements(vdescv,
+					     nilfs_vector_get_size(vdescv),
+					     cols->count - nreal);
+	if (unlikely(vdesc == NULL))
+		return -1;
+	bdesc = nilfs_vector_insert_elements(bdescv,
+					     nilfs_vector_get_size(bdescv),
+					     nreal);
+	if (unlikely(bdesc == NULL))
+		return -1;
+
+	for (i = 0; i < cols->count; i++) {
+		if (cols->flags[i] & NILFS_BINFO_COL_REAL) {
+			bdesc->bd_ino = cols->ino[i];
+			bdesc->bd_oblocknr = cols->blocknr[i];
+			bdesc->bd_offset = cols->offset[i];
+			bdesc->bd_level = cols->level[i];
+			bdesc++;
+		} else {
+			vdesc->vd_ino = cols->ino[i];
+			vdesc->vd_cno = cols->cno[i];
+			vdesc->vd_vblocknr = cols->vblocknr[i];
+			vdesc->vd_blocknr = cols->blocknr[i];
+			vdesc->vd_offset = cols->offset[i];
+			vdesc->vd_flags =
+				!!(cols->flags[i] & NILFS_BINFO_COL_NODE);
+			vdesc++;
 		}
 	}
 	return 0;
@@ -171,41 +167,44 @@ static int nilfs_acc_blocks_file(struct nilfs_file *file,
 /**
  * nilfs_acc_blocks_psegment - collect summary of blocks in a log
  * @psegment: partial segment object
+ * @cols: columns used to decode block information
  * @vdescv: vector object to store (descriptors of) virtual block numbers
  * @bdescv: vector object to store (descriptors of) disk block numbers
  */
 static int nilfs_acc_blocks_psegment(struct nilfs_psegment *psegment,
+				     struct nilfs_binfo_columns *cols,
 				     struct nilfs_vector *vdescv,
 				     struct nilfs_vector *bdescv)
 {
 	struct nilfs_file file;
 	const char *errstr;
-	int ret;
+	ssize_t ret;
 
-	nilfs_file_for_each(&file, psegment) {
-		ret = nilfs_acc_blocks_file(&file, vdescv, bdescv);
-		if (unlikely(ret < 0))
-			return -1;
-	}
-	if (nilfs_file_is_error(&file, &errstr)) {
-		nilfs_gc_logger(LOG_ERR,
-				"error %d (%s) while reading finfo at offset = %" PRIu32 " at pseg blocknr = %" PRIu64 ", segnum = %" PRIu64,
-				file.error, errstr, file.offset,
-				psegment->blocknr, psegment->segment->segnum);
+	nilfs_binfo_columns_reset(cols);
+	ret = nilfs_binfo_columns_add_psegment(cols, psegment, &file);
+	if (unlikely(ret < 0)) {
+		if (nilfs_file_is_error(&file, &errstr))
+			nilfs_gc_logger(LOG_ERR,
+					"error %d (%s) while reading finfo at offset = %" PRIu32 " at pseg blocknr = %" PRIu64 ", segnum = %" PRIu64,
+					file.error, errstr, file.offset,
+					psegment->blocknr,
+					psegment->segment->segnum);
 		return -1;
 	}
-	return 0;
+	return nilfs_acc_blocks_columns(cols, vdescv, bdescv);
 }
 
 /**
  * nilfs_acc_blocks_segment - collect summary of blocks in a segment
  * @segment: segment object
  * @nblocks: size of valid logs in the segment (per block)
+ * @cols: columns used to decode block information
  * @vdescv: vector object to store (descriptors of) virtual block numbers
  * @bdescv: vector object to store (descriptors of) disk block numbers
  */
 static int nilfs_acc_blocks_segment(const struct nilfs_segment *segment,
 				    uint32_t nblocks,
+				    struct nilfs_binfo_columns *cols,
 				    struct nilfs_vector *vdescv,
 				    struct nilfs_vector *bdescv)
 {
@@ -214,7 +213,8 @@ static int nilfs_acc_blocks_segment(const struct nilfs_segment *segment,
 	int ret;
 
 	nilfs_psegment_for_each(&psegment, segment, nblocks) {
-		ret = nilfs_acc_blocks_psegment(&psegment, vdescv, bdescv);
+		ret = nilfs_acc_blocks_psegment(&psegment, cols, vdescv,
+						bdescv);
 		if (unlikely(ret < 0))
 			return -1;
 	}
@@ -231,23 +231,56 @@ static int nilfs_acc_blocks_segment(const struct nilfs_segment *segment,
 /**
  * nilfs_deselect_segment - deselect a segment
  * @segnums: array of selected segments
+ * @si: array of segment usage of the selected segments
  * @nsegs: size of @segnums array
  * @nr: index number for @segnums array to be deselected
  */
-static ssize_t nilfs_deselect_segment(uint64_t *segnums, size_t nsegs, int nr)
+static ssize_t nilfs_deselect_segment(uint64_t *segnums,
+				      struct nilfs_suinfo *si, size_t nsegs,
+				      int nr)
 {
 	if (unlikely(nr >= nsegs || nsegs == 0))
 		return -1;
 	if (nr < nsegs - 1) {
 		uint64_t tn = segnums[nr];
+		struct nilfs_suinfo tsi = si[nr];
 
 		memmove(&segnums[nr], &segnums[nr + 1],
 			sizeof(uint64_t) * (nsegs - 1 - nr));
+		memmove(&si[nr], &si[nr + 1],
+			sizeof(struct nilfs_suinfo) * (nsegs - 1 - nr));
 		segnums[nsegs - 1] = tn;
+		si[nsegs - 1] = tsi;
 	}
 	return nsegs - 1;
 }
 
+/**
+ * nilfs_prefetch_segments - request readahead of segments to be cleaned
+ * @nilfs: nilfs object
+ * @segnums: array of segment numbers
+ * @nsegs: number of segments in @segnums
+ *
+ * This lets the device read the target segments in parallel while they
+ * are parsed one by one.  Failures are ignored since this is only a hint.
+ */
+static void nilfs_prefetch_segments(struct nilfs *nilfs,
+				    const uint64_t *segnums, size_t nsegs)
+{
+	struct nilfs_segread *reqs;
+	int errsv = errno;
+	size_t i;
+
+	reqs = calloc(nsegs, sizeof(*reqs));
+	if (likely(reqs)) {
+		for (i = 0; i < nsegs; i++)
+			reqs[i].segnum = segnums[i];
+		nilfs_read_segments(nilfs, reqs, nsegs);
+		free(reqs);
+	}
+	errno = errsv;
+}
+
 /**
  * nilfs_acc_blocks - collect summary of blocks contained in segments
  * @nilfs: nilfs object
@@ -263,28 +296,36 @@ static ssize_t nilfs_acc_blocks(struct nilfs *nilfs,
 				struct nilfs_vector *vdescv,
 				struct nilfs_vector *bdescv)
 {
-	struct nilfs_suinfo si;
+	struct nilfs_binfo_columns cols;
+	struct nilfs_suinfo *si;
 	struct nilfs_segment segment;
 	int ret, i = 0;
 	ssize_t n = nsegs;
 
-	while (i < n) {
-		ret = nilfs_get_suinfo(nilfs, segnums[i], &si, 1);
-		if (unlikely(ret < 0))
-			return -1;
+	si = malloc(sizeof(*si) * nsegs);
+	if (unlikely(!si))
+		return -1;
+	nilfs_binfo_columns_init(&cols);
+
+	nilfs_prefetch_segments(nilfs, segnums, nsegs);
 
-		if (!nilfs_suinfo_reclaimable(&si)) {
+	/* recheck the usage of all the segments with a few requests */
+	if (unlikely(nilfs_get_suinfo_batch(nilfs, segnums, nsegs, si) < 0))
+		goto failed;
+
+	while (i < n) {
+		if (!nilfs_suinfo_reclaimable(&si[i])) {
 			/*
 			 * Recheck status of the segment and drop it
 			 * if not reclaimable.  This prevents the
 			 * target segments from being cleaned twice or
 			 * more by duplicate cleaner daemons.
 			 */
-			n = nilfs_deselect_segment(segnums, n, i);
+			n = nilfs_deselect_segment(segnums, si, n, i);
 			continue;
 		}
 
-		if (nilfs_suinfo_empty(&si)) {
+		if (nilfs_suinfo_empty(&si[i])) {
 			/*
 			 * "Scrapped" segment - the information in the segment
 			 * summary is not valid because it's unwritten.
@@ -297,22 +338,29 @@ static ssize_t nilfs_acc_blocks(struct nilfs *nilfs,
 
 		ret = nilfs_get_segment(nilfs, segnums[i], &segment);
 		if (unlikely(ret < 0))
-			return -1;
+			goto failed;
 
 		if (cnt64_ge(segment.seqnum, protseq)) {
-			n = nilfs_deselect_segment(segnums, n, i);
+			n = nilfs_deselect_segment(segnums, si, n, i);
 			ret = nilfs_put_segment(&segment);
 			if (unlikely(ret < 0))
-				return -1;
+				goto failed;
 			continue;
 		}
-		ret = nilfs_acc_blocks_segment(&segment, si.sui_nblocks,
-					       vdescv, bdescv);
+		ret = nilfs_acc_blocks_segment(&segment, si[i].sui_nblocks,
+					       &cols, vdescv, bdescv);
 		if (unlikely(nilfs_put_segment(&segment) < 0 || ret < 0))
-			return -1;
+			goto failed;
 		i++;
 	}
+	nilfs_binfo_columns_destroy(&cols);
+	free(si);
 	return n;
+
+failed:
+	nilfs_binfo_columns_destroy(&cols);
+	free(si);
+	return -1;
 }
 
 /**
@@ -891,6 +939,137 @@ ssize_t nilfs_reclaim_segment(struct nilfs *nilfs,
 	return ret;
 }
 
+/**
+ * nilfs_count_live_block - count a live block for its segment
+ * @segnums: sorted array of assessed segment numbers
+ * @nsegs: number of elements in @segnums
+ * @blocks_per_segment: number of blocks per segment
+ * @blocknr: disk block number of a live block
+ * @live_blks: array of counters corresponding to @segnums
+ */
+static void nilfs_count_live_block(const uint64_t *segnums, size_t nsegs,
+				   unsigned long blocks_per_segment,
+				   uint64_t blocknr, size_t *live_blks)
+{
+	uint64_t segnum = blocknr / blocks_per_segment;
+	const uint64_t *found;
+
+	found = bsearch(&segnum, segnums, nsegs, sizeof(*segnums),
+			nilfs_comp_segnum);
+	if (likely(found))
+		live_blks[found - segnums]++;
+}
+
+/**
+ * nilfs_assess_segment_usage - count live blocks of each segment
+ * @nilfs: nilfs object
+ * @segnums: array of segment numbers to be assessed
+ * @nsegs: size of the @segnums array
+ * @params: reclaim parameters (same as nilfs_assess_segment())
+ * @live_blks: array to store the number of live blocks of each segment
+ *
+ * This function counts live blocks of multiple segments in one pass,
+ * looking up the DAT file for all their blocks with batched requests,
+ * while nilfs_assess_segment() only gives the sum over the segments.
+ *
+ * Segments that are protected or not reclaimable are deselected in the
+ * same way as nilfs_xreclaim_segment().  On success, the first n elements
+ * of @segnums are replaced with the assessed segments in ascending order
+ * and the corresponding elements of @live_blks are set, where n is the
+ * return value.  The deselected segments follow them in @segnums.
+ *
+ * Return: the number of assessed segments on success, or -1 on failure.
+ */
+ssize_t nilfs_assess_segment_usage(struct nilfs *nilfs,
+				   uint64_t *segnums, size_t nsegs,
+				   const struct nilfs_reclaim_params *params,
+				   size_t *live_blks)
+{
+	struct nilfs_vector *vdescv, *bdescv, *periodv, *vblocknrv;
+	const struct nilfs_vdesc *vdesc;
+	const struct nilfs_bdesc *bdesc;
+	unsigned long blocks_per_segment;
+	nilfs_cno_t protcno;
+	ssize_t n, ret = -1;
+	size_t i;
+
+	if (unlikely(!(params->flags & NILFS_RECLAIM_PARAM_PROTSEQ) ||
+	    (params->flags & (~0UL << __NR_NILFS_RECLAIM_PARAMS)))) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (nsegs == 0)
+		return 0;
+
+	vdescv = nilfs_vector_create(sizeof(struct nilfs_vdesc));
+	bdescv = nilfs_vector_create(sizeof(struct nilfs_bdesc));
+	periodv = nilfs_vector_create(sizeof(struct nilfs_period));
+	vblocknrv = nilfs_vector_create(sizeof(uint64_t));
+	if (unlikely(!vdescv || !bdescv || !periodv || !vblocknrv))
+		goto out_vec;
+
+	ret = nilfs_lock_cleaner(nilfs);
+	if (unlikely(ret < 0))
+		goto out_vec;
+
+	n = nilfs_acc_blocks(nilfs, segnums, nsegs, params->protseq, vdescv,
+			     bdescv);
+	if (unlikely(n < 0)) {
+		ret = n;
+		goto out_lock;
+	}
+
+	ret = nilfs_get_vdesc(nilfs, vdescv);
+	if (unlikely(ret < 0))
+		goto out_lock;
+
+	protcno = (params->flags & NILFS_RECLAIM_PARAM_PROTCNO) ?
+		params->protcno : NILFS_CNO_MAX;
+	ret = nilfs_toss_vdescs(nilfs, vdescv, periodv, vblocknrv, protcno);
+	if (unlikely(ret < 0))
+		goto out_lock;
+
+	ret = nilfs_get_bdesc(nilfs, bdescv);
+	if (unlikely(ret < 0))
+		goto out_lock;
+
+	ret = nilfs_toss_bdescs(bdescv);
+	if (unlikely(ret < 0))
+		goto out_lock;
+
+	/* attribute the remaining blocks to their segments */
+	qsort(segnums, n, sizeof(*segnums), nilfs_comp_segnum);
+	memset(live_blks, 0, sizeof(*live_blks) * n);
+	blocks_per_segment = nilfs_get_blocks_per_segment(nilfs);
+
+	for (i = 0; i < nilfs_vector_get_size(vdescv); i++) {
+		vdesc = nilfs_vector_get_element(vdescv, i);
+		nilfs_count_live_block(segnums, n, blocks_per_segment,
+				       vdesc->vd_blocknr, live_blks);
+	}
+	for (i = 0; i < nilfs_vector_get_size(bdescv); i++) {
+		bdesc = nilfs_vector_get_element(bdescv, i);
+		nilfs_count_live_block(segnums, n, blocks_per_segment,
+				       bdesc->bd_oblocknr, live_blks);
+	}
+	ret = n;
+
+out_lock:
+	if (unlikely(nilfs_unlock_cleaner(nilfs) < 0)) {
+		nilfs_gc_logger(LOG_CRIT, "failed to unlock cleaner: %s",
+				strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+out_vec:
+	nilfs_vector_destroy(vdescv);
+	nilfs_vector_destroy(bdescv);
+	nilfs_vector_destroy(periodv);
+	nilfs_vector_destroy(vblocknrv);
+	return ret;
+}
+
 /**
  * nilfs_segment_is_protected - test if the segment is in protected region
  * @nilfs: nilfs object
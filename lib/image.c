@@ -0,0 +1,1455 @@
+/*
+ * image.c - emulation of NILFS ioctls on a file system image
+ *
+ * Licensed under LGPLv2: the complete text of the GNU Lesser General
+ * Public License can be found in COPYING file of the nilfs-utils
+ * package.
+ *
+ * This backend serves the checkpoint, segment usage and DAT queries of
+ * libnilfs from the metadata files found in the latest super root of
+ * an image, without the kernel module.  Requests that modify the file
+ * system (checkpoint deletion, segment usage updates and garbage
+ * collection) are applied to an in-memory model only, or refused with
+ * EROFS if the backend is read-only; the image itself is never written.
+ *
+ * Garbage collection is simulated at the metadata level: relocated
+ * blocks are given addresses in segments allocated from the model and
+ * the DAT entries and DAT blocks they belong to are remapped there, so
+ * that later queries see the blocks moved and the victim segments free.
+ * The block contents are not copied, so a segment allocated by the
+ * model reads as whatever the image holds there.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif	/* HAVE_CONFIG_H */
+
+#if HAVE_STDLIB_H
+#include <stdlib.h>
+#endif	/* HAVE_STDLIB_H */
+
+#if HAVE_STRING_H
+#include <string.h>
+#endif	/* HAVE_STRING_H */
+
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif	/* HAVE_UNISTD_H */
+
+#if HAVE_TIME_H
+#include <time.h>
+#endif	/* HAVE_TIME_H */
+
+#if HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif	/* HAVE_SYS_MMAN_H */
+
+#if HAVE_LINUX_TYPES_H
+#include <linux/types.h>
+#endif	/* HAVE_LINUX_TYPES_H */
+
+/* compat.h must be included before on-disk definitions for sparse checks */
+#include "compat.h"
+#include <linux/nilfs2_ondisk.h>
+
+#include <errno.h>
+
+#include "nilfs.h"
+#include "nilfs_backend.h"
+#include "util.h"
+#include "crc32.h"
+
+#define NILFS_IMAGE_CACHE_SLOTS		64
+
+/* maximum number of children of the B-tree root held in i_bmap */
+#define NILFS_IMAGE_ROOT_NCHILDREN_MAX					\
+	((sizeof(__le64) * NILFS_INODE_BMAP_SIZE -			\
+	  sizeof(struct nilfs_btree_node)) / (sizeof(__le64) * 2))
+
+/* padding between the header and the keys of a non-root B-tree node */
+#define NILFS_IMAGE_NODE_EXTRA_PAD_SIZE	sizeof(__le64)
+
+/**
+ * struct nilfs_image_remap - block moved or freed in the model
+ * @key: virtual block number, or the offset and level of a DAT block
+ * @blocknr: disk block number the block has been moved to, or 0 if freed
+ */
+struct nilfs_image_remap {
+	uint64_t key;
+	uint64_t blocknr;
+};
+
+/**
+ * struct nilfs_image_remap_table - hash table of moved or freed blocks
+ * @slots: open addressing table indexed by hash of the key (0 is empty)
+ * @size: number of slots (a power of two)
+ * @count: number of used slots
+ */
+struct nilfs_image_remap_table {
+	struct nilfs_image_remap *slots;
+	size_t size;
+	size_t count;
+};
+
+/**
+ * struct nilfs_image_mdt - metadata file of an image
+ * @inode: copy of the on-disk inode taken from the super root
+ * @virtual: non-zero if the file is addressed with virtual block numbers
+ */
+struct nilfs_image_mdt {
+	struct nilfs_inode inode;
+	int virtual;
+};
+
+/**
+ * struct nilfs_image - image backend
+ * @fd: file descriptor of the image
+ * @flags: NILFS_IMAGE_* flags
+ * @blkbits: bit shift for block size
+ * @blocksize: block size
+ * @nsegments: number of segments
+ * @blocks_per_segment: number of blocks per segment
+ * @first_data_block: first block of segment 0
+ * @crc_seed: seed value of CRC calculation
+ * @node_ncmax: maximum number of children of a non-root B-tree node
+ * @last_cno: latest checkpoint number
+ * @last_seq: sequence number of the latest log
+ * @ctime: creation time of the latest log
+ * @nongc_ctime: creation time of the latest log not written by GC
+ * @active: segments the file system was writing to
+ * @dat: DAT file
+ * @cpfile: checkpoint file
+ * @sufile: segment usage file
+ * @dat_entry_size: size of a DAT entry
+ * @dat_epb: number of DAT entries per block
+ * @dat_epg: number of DAT entries per group
+ * @dat_bpg: number of blocks per group (bitmap and entry blocks)
+ * @dat_gpdb: number of groups per group descriptor block
+ * @dat_bpdb: number of blocks covered by a group descriptor block
+ * @cp_size: size of a checkpoint entry
+ * @cp_per_block: number of checkpoint entries per block
+ * @cp_first: index of the first checkpoint entry in the first block
+ * @su_size: size of a segment usage entry
+ * @su_per_block: number of segment usage entries per block
+ * @su_first: index of the first segment usage entry in the first block
+ * @map: read-only mapping of the whole image, or %NULL
+ * @mapsize: size of @map in bytes
+ * @cache: block cache used when the image cannot be mapped
+ * @cache_blocknr: block number held in each slot of @cache
+ * @ncheckpoints: number of checkpoints
+ * @nsnapshots: number of snapshots
+ * @ssl_next: first checkpoint number on the snapshot list
+ * @deleted: sorted array of deleted checkpoint ranges
+ * @ndeleted: number of items in @deleted
+ * @maxdeleted: capacity of @deleted
+ * @suinfo: segment usage model, loaded on first use
+ * @ncleansegs: number of clean segments
+ * @ndirtysegs: number of dirty segments
+ * @last_alloc: last segment allocated
+ * @gcseg: segment receiving relocated blocks, or @nsegments if none
+ * @vremap: DAT entries moved or freed by the model
+ * @bremap: DAT blocks moved by the model
+ */
+struct nilfs_image {
+	int fd;
+	int flags;
+	unsigned int blkbits;
+	size_t blocksize;
+	uint64_t nsegments;
+	uint32_t blocks_per_segment;
+	uint64_t first_data_block;
+	uint32_t crc_seed;
+	unsigned int node_ncmax;
+	nilfs_cno_t last_cno;
+	uint64_t last_seq;
+	uint64_t ctime;
+	uint64_t nongc_ctime;
+	uint64_t active[2];
+
+	struct nilfs_image_mdt dat;
+	struct nilfs_image_mdt cpfile;
+	struct nilfs_image_mdt sufile;
+
+	size_t dat_entry_size;
+	unsigned long dat_epb;
+	unsigned long dat_epg;
+	unsigned long dat_bpg;
+	unsigned long dat_gpdb;
+	unsigned long dat_bpdb;
+	size_t cp_size;
+	unsigned long cp_per_block;
+	unsigned long cp_first;
+	size_t su_size;
+	unsigned long su_per_block;
+	unsigned long su_first;
+
+	void *map;
+	size_t mapsize;
+	void *cache;
+	uint64_t cache_blocknr[NILFS_IMAGE_CACHE_SLOTS];
+
+	uint64_t ncheckpoints;
+	uint64_t nsnapshots;
+	nilfs_cno_t ssl_next;
+	struct nilfs_period *deleted;
+	size_t ndeleted;
+	size_t maxdeleted;
+
+	struct nilfs_suinfo *suinfo;
+	uint64_t ncleansegs;
+	uint64_t ndirtysegs;
+	uint64_t last_alloc;
+	uint64_t gcseg;
+	struct nilfs_image_remap_table vremap;
+	struct nilfs_image_remap_table bremap;
+};
+
+/**
+ * nilfs_image_read_block - read a block of the image
+ * @img: image backend
+ * @blocknr: disk block number
+ *
+ * The block is taken from the mapping of the image if there is one, or
+ * read through the block cache otherwise.  In the latter case, the
+ * returned buffer stays valid until the next read of the cache.
+ */
+static const void *nilfs_image_read_block(struct nilfs_image *img,
+					  uint64_t blocknr)
+{
+	unsigned int slot = blocknr % NILFS_IMAGE_CACHE_SLOTS;
+	void *buf;
+	ssize_t ret;
+
+	if (unlikely(blocknr == 0 ||
+		     blocknr >= img->nsegments * img->blocks_per_segment)) {
+		errno = EIO;
+		return NULL;
+	}
+
+	if (img->map) {
+		if (unlikely(blocknr >= img->mapsize >> img->blkbits)) {
+			errno = EIO;
+			return NULL;
+		}
+		return img->map + ((size_t)blocknr << img->blkbits);
+	}
+
+	buf = img->cache + ((size_t)slot << img->blkbits);
+	if (img->cache_blocknr[slot] == blocknr)
+		return buf;
+
+	img->cache_blocknr[slot] = 0;	/* blocknr 0 is never cached */
+	ret = pread(img->fd, buf, img->blocksize,
+		    (off_t)blocknr << img->blkbits);
+	if (unlikely(ret < 0))
+		return NULL;
+	if (unlikely(ret < img->blocksize)) {
+		errno = EIO;
+		return NULL;
+	}
+	img->cache_blocknr[slot] = blocknr;
+	return buf;
+}
+
+/**
+ * nilfs_image_node_lookup - search a key in a B-tree node
+ * @keys: key array of the node
+ * @nchildren: number of children
+ * @level: level of the node
+ * @key: key to search
+ * @indexp: place to store the index of the child to follow
+ *
+ * This mirrors nilfs_btree_node_lookup() of the kernel: on an
+ * intermediate node the index points to the child covering @key, and on
+ * a bottom node it points to the place @key would be inserted.
+ *
+ * Return: 1 if @key was found, 0 otherwise.
+ */
+static int nilfs_image_node_lookup(const __le64 *keys, int nchildren,
+				   int level, uint64_t key, int *indexp)
+{
+	int low = 0, high = nchildren - 1, index = 0, s = 0, found = 0;
+	uint64_t nkey;
+
+	while (low <= high) {
+		index = (low + high) / 2;
+		nkey = le64_to_cpu(keys[index]);
+		if (nkey == key) {
+			s = 0;
+			found = 1;
+			break;
+		} else if (nkey < key) {
+			low = index + 1;
+			s = -1;
+		} else {
+			high = index - 1;
+			s = 1;
+		}
+	}
+
+	if (level > NILFS_BTREE_LEVEL_NODE_MIN) {
+		if (s > 0 && index > 0)
+			index--;
+	} else if (s < 0) {
+		index++;
+	}
+	*indexp = index;
+	return found;
+}
+
+static int nilfs_image_translate(struct nilfs_image *img, uint64_t vblocknr,
+				 uint64_t *blocknrp);
+
+/**
+ * nilfs_image_bmap_lookup - look up a block of a metadata file
+ * @img: image backend
+ * @mdt: metadata file
+ * @key: block offset, or the first key of a node if @minlevel > 1
+ * @minlevel: level of the pointer to look up (1 for data blocks)
+ * @ptrp: place to store the pointer
+ *
+ * The pointer is returned as recorded in the block mapping, so it is a
+ * virtual block number for files other than DAT.
+ *
+ * Return: 0 on success, or -1 with errno set.  errno is %ENOENT if
+ * nothing is mapped at @key.
+ */
+static int nilfs_image_bmap_lookup(struct nilfs_image *img,
+				   const struct nilfs_image_mdt *mdt,
+				   uint64_t key, int minlevel, uint64_t *ptrp)
+{
+	const struct nilfs_btree_node *node;
+	const __le64 *keys;
+	unsigned int ncmax;
+	int level, nchildren, index, found = 0;
+	uint64_t ptr;
+
+	node = (const struct nilfs_btree_node *)mdt->inode.i_bmap;
+	if (!(node->bn_flags & NILFS_BTREE_NODE_ROOT)) {
+		/* direct mapping */
+		if (key >= NILFS_INODE_BMAP_SIZE - 1 ||
+		    minlevel != NILFS_BTREE_LEVEL_NODE_MIN)
+			goto not_found;
+		ptr = le64_to_cpu(mdt->inode.i_bmap[key + 1]);
+		if (ptr == 0)
+			goto not_found;
+		goto out;
+	}
+
+	level = node->bn_level;
+	keys = (const __le64 *)(node + 1);
+	ncmax = NILFS_IMAGE_ROOT_NCHILDREN_MAX;
+	if (level < minlevel)
+		goto not_found;
+
+	for (;;) {
+		nchildren = le16_to_cpu(node->bn_nchildren);
+		if (unlikely(nchildren <= 0 || nchildren > ncmax)) {
+			errno = EINVAL;
+			return -1;
+		}
+		if (!found)
+			found = nilfs_image_node_lookup(keys, nchildren, level,
+							key, &index);
+		else
+			index = 0;
+		if (index >= nchildren)
+			goto not_found;
+		ptr = le64_to_cpu(keys[ncmax + index]);
+
+		if (--level < minlevel)
+			break;
+
+		if (mdt->virtual && nilfs_image_translate(img, ptr, &ptr) < 0)
+			return -1;
+		node = nilfs_image_read_block(img, ptr);
+		if (unlikely(!node))
+			return -1;
+		if (unlikely(node->bn_level != level)) {
+			errno = EINVAL;
+			return -1;
+		}
+		keys = (const __le64 *)((const char *)(node + 1) +
+					NILFS_IMAGE_NODE_EXTRA_PAD_SIZE);
+		ncmax = img->node_ncmax;
+	}
+	if (!found)
+		goto not_found;
+out:
+	*ptrp = ptr;
+	return 0;
+
+not_found:
+	errno = ENOENT;
+	return -1;
+}
+
+/**
+ * nilfs_image_dat_entry - read an entry of the DAT
+ * @img: image backend
+ * @vblocknr: virtual block number
+ * @entry: buffer to store the entry in
+ */
+static int nilfs_image_dat_entry(struct nilfs_image *img, uint64_t vblocknr,
+				 struct nilfs_dat_entry *entry)
+{
+	unsigned long group, group_offset;
+	uint64_t blkoff, blocknr;
+	const void *buf;
+
+	group = vblocknr / img->dat_epg;
+	group_offset = vblocknr % img->dat_epg;
+	blkoff = (group / img->dat_gpdb) * img->dat_bpdb + 1 +
+		(group % img->dat_gpdb) * img->dat_bpg + 1 +
+		group_offset / img->dat_epb;
+
+	if (nilfs_image_bmap_lookup(img, &img->dat, blkoff,
+				    NILFS_BTREE_LEVEL_NODE_MIN, &blocknr) < 0)
+		return -1;
+	buf = nilfs_image_read_block(img, blocknr);
+	if (unlikely(!buf))
+		return -1;
+	memcpy(entry, buf + (group_offset % img->dat_epb) * img->dat_entry_size,
+	       sizeof(*entry));
+	return 0;
+}
+
+static int nilfs_image_translate(struct nilfs_image *img, uint64_t vblocknr,
+				 uint64_t *blocknrp)
+{
+	struct nilfs_dat_entry entry;
+
+	if (nilfs_image_dat_entry(img, vblocknr, &entry) < 0)
+		return -1;
+	*blocknrp = le64_to_cpu(entry.de_blocknr);
+	if (unlikely(*blocknrp == 0)) {
+		errno = ENOENT;
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * nilfs_image_mdt_block - read a data block of a metadata file
+ * @img: image backend
+ * @mdt: metadata file
+ * @blkoff: block offset in the file
+ *
+ * Return: the block contents, or NULL with errno set.  errno is %ENOENT
+ * for a hole.
+ */
+static const void *nilfs_image_mdt_block(struct nilfs_image *img,
+					 const struct nilfs_image_mdt *mdt,
+					 uint64_t blkoff)
+{
+	uint64_t blocknr;
+
+	if (nilfs_image_bmap_lookup(img, mdt, blkoff,
+				    NILFS_BTREE_LEVEL_NODE_MIN, &blocknr) < 0)
+		return NULL;
+	if (mdt->virtual && nilfs_image_translate(img, blocknr, &blocknr) < 0)
+		return NULL;
+	return nilfs_image_read_block(img, blocknr);
+}
+
+/**
+ * nilfs_image_checkpoint - read a checkpoint entry
+ * @img: image backend
+ * @cno: checkpoint number
+ *
+ * The returned entry stays valid until the next read of the cache.
+ */
+static const struct nilfs_checkpoint *
+nilfs_image_checkpoint(struct nilfs_image *img, nilfs_cno_t cno)
+{
+	uint64_t tcno = cno + img->cp_first - 1;
+	const void *buf;
+
+	buf = nilfs_image_mdt_block(img, &img->cpfile,
+				    tcno / img->cp_per_block);
+	if (unlikely(!buf))
+		return NULL;
+	return buf + (tcno % img->cp_per_block) * img->cp_size;
+}
+
+static int nilfs_image_cp_deleted(const struct nilfs_image *img,
+				  nilfs_cno_t cno)
+{
+	size_t low = 0, high = img->ndeleted, mid;
+
+	while (low < high) {
+		mid = (low + high) / 2;
+		if (cno < img->deleted[mid].p_start)
+			high = mid;
+		else if (cno >= img->deleted[mid].p_end)
+			low = mid + 1;
+		else
+			return 1;
+	}
+	return 0;
+}
+
+static int nilfs_image_period_cmp(const void *a, const void *b)
+{
+	const struct nilfs_period *pa = a, *pb = b;
+
+	return pa->p_start < pb->p_start ? -1 : pa->p_start > pb->p_start;
+}
+
+/**
+ * nilfs_image_cp_delete_range - record deletion of checkpoints
+ * @img: image backend
+ * @start: first checkpoint number (inclusive)
+ * @end: last checkpoint number (exclusive)
+ *
+ * Snapshots, invalid checkpoints and the latest checkpoint in the range
+ * are left alone, as the kernel does.
+ */
+static int nilfs_image_cp_delete_range(struct nilfs_image *img,
+				       nilfs_cno_t start, nilfs_cno_t end)
+{
+	const struct nilfs_checkpoint *cp;
+	struct nilfs_period *periods;
+	nilfs_cno_t cno;
+	size_t i, n;
+
+	if (end > img->last_cno)
+		end = img->last_cno;
+	if (start < NILFS_CNO_MIN)
+		start = NILFS_CNO_MIN;
+	if (start >= end)
+		return 0;
+
+	for (cno = start; cno < end; cno++) {
+		if (nilfs_image_cp_deleted(img, cno))
+			continue;
+		cp = nilfs_image_checkpoint(img, cno);
+		if (!cp) {
+			if (errno != ENOENT)
+				return -1;
+			continue;
+		}
+		if (!nilfs_checkpoint_invalid(cp) &&
+		    !nilfs_checkpoint_snapshot(cp) && img->ncheckpoints > 0)
+			img->ncheckpoints--;
+	}
+
+	if (img->ndeleted == img->maxdeleted) {
+		n = img->maxdeleted ? img->maxdeleted * 2 : 16;
+		periods = realloc(img->deleted, n * sizeof(*periods));
+		if (unlikely(!periods))
+			return -1;
+		img->deleted = periods;
+		img->maxdeleted = n;
+	}
+	img->deleted[img->ndeleted].p_start = start;
+	img->deleted[img->ndeleted].p_end = end;
+	img->ndeleted++;
+	qsort(img->deleted, img->ndeleted, sizeof(*img->deleted),
+	      nilfs_image_period_cmp);
+
+	/* merge overlapping or adjacent ranges */
+	for (i = 1, n = 0; i < img->ndeleted; i++) {
+		if (img->deleted[i].p_start <= img->deleted[n].p_end) {
+			if (img->deleted[i].p_end > img->deleted[n].p_end)
+				img->deleted[n].p_end = img->deleted[i].p_end;
+		} else {
+			img->deleted[++n] = img->deleted[i];
+		}
+	}
+	img->ndeleted = n + 1;
+	return 0;
+}
+
+static void nilfs_image_cp_to_cpinfo(const struct nilfs_checkpoint *cp,
+				     struct nilfs_cpinfo *ci)
+{
+	ci->ci_flags = le32_to_cpu(cp->cp_flags);
+	ci->ci_pad = 0;
+	ci->ci_cno = le64_to_cpu(cp->cp_cno);
+	ci->ci_create = le64_to_cpu(cp->cp_create);
+	ci->ci_nblk_inc = le64_to_cpu(cp->cp_nblk_inc);
+	ci->ci_inodes_count = le64_to_cpu(cp->cp_inodes_count);
+	ci->ci_blocks_count = le64_to_cpu(cp->cp_blocks_count);
+	ci->ci_next = le64_to_cpu(cp->cp_snapshot_list.ssl_next);
+}
+
+/**
+ * nilfs_image_load_sufile - load segment usage into the in-memory model
+ * @img: image backend
+ */
+static int nilfs_image_load_sufile(struct nilfs_image *img)
+{
+	const struct nilfs_segment_usage *su;
+	struct nilfs_suinfo *suinfo;
+	const void *buf = NULL;
+	uint64_t segnum, blkoff, prev = UINT64_MAX;
+	unsigned long offset;
+
+	if (img->suinfo)
+		return 0;
+
+	suinfo = malloc(img->nsegments * sizeof(*suinfo));
+	if (unlikely(!suinfo))
+		return -1;
+
+	for (segnum = 0; segnum < img->nsegments; segnum++) {
+		blkoff = (segnum + img->su_first) / img->su_per_block;
+		offset = (segnum + img->su_first) % img->su_per_block;
+		if (blkoff != prev) {
+			buf = nilfs_image_mdt_block(img, &img->sufile, blkoff);
+			if (unlikely(!buf && errno != ENOENT)) {
+				free(suinfo);
+				return -1;
+			}
+			prev = blkoff;
+		}
+		if (!buf) {
+			memset(&suinfo[segnum], 0, sizeof(*suinfo));
+			continue;
+		}
+		su = buf + offset * img->su_size;
+		suinfo[segnum].sui_lastmod = le64_to_cpu(su->su_lastmod);
+		suinfo[segnum].sui_nblocks = le32_to_cpu(su->su_nblocks);
+		suinfo[segnum].sui_flags = le32_to_cpu(su->su_flags) &
+			~(1UL << NILFS_SEGMENT_USAGE_ACTIVE);
+	}
+	img->suinfo = suinfo;
+	return 0;
+}
+
+static int nilfs_image_segment_is_active(const struct nilfs_image *img,
+					 uint64_t segnum)
+{
+	return segnum == img->active[0] || segnum == img->active[1];
+}
+
+/**
+ * nilfs_image_segment_range - get the block range of a segment
+ * @img: image backend
+ * @segnum: segment number
+ * @startp: place to store the first block (inclusive)
+ * @endp: place to store the last block (exclusive)
+ */
+static void nilfs_image_segment_range(const struct nilfs_image *img,
+				      uint64_t segnum, uint64_t *startp,
+				      uint64_t *endp)
+{
+	*startp = segnum * img->blocks_per_segment;
+	*endp = *startp + img->blocks_per_segment;
+	if (segnum == 0)
+		*startp = img->first_data_block;
+}
+
+static size_t nilfs_image_remap_index(const struct nilfs_image_remap_table *t,
+				      uint64_t key)
+{
+	size_t i = (key * 0x9e3779b97f4a7c15ULL) >> 32;
+
+	for (i &= t->size - 1; t->slots[i].key != 0 && t->slots[i].key != key;
+	     i = (i + 1) & (t->size - 1))
+		;
+	return i;
+}
+
+/**
+ * nilfs_image_remap_reserve - make room for entries in a remap table
+ * @t: remap table
+ * @n: number of entries to be added
+ *
+ * Reserving the room in advance lets an emulated request fail before it
+ * changes anything.
+ */
+static int nilfs_image_remap_reserve(struct nilfs_image_remap_table *t,
+				     size_t n)
+{
+	struct nilfs_image_remap *slots;
+	size_t size, i, j;
+
+	for (size = t->size ? t->size : 1024; (t->count + n) * 2 > size;
+	     size *= 2)
+		;
+	if (size == t->size)
+		return 0;
+
+	slots = calloc(size, sizeof(*slots));
+	if (unlikely(!slots))
+		return -1;
+	for (i = 0; i < t->size; i++) {
+		if (t->slots[i].key == 0)
+			continue;
+		j = (t->slots[i].key * 0x9e3779b97f4a7c15ULL) >> 32;
+		for (j &= size - 1; slots[j].key != 0; j = (j + 1) & (size - 1))
+			;
+		slots[j] = t->slots[i];
+	}
+	free(t->slots);
+	t->slots = slots;
+	t->size = size;
+	return 0;
+}
+
+/* the room must have been reserved with nilfs_image_remap_reserve() */
+static void nilfs_image_remap_set(struct nilfs_image_remap_table *t,
+				  uint64_t key, uint64_t blocknr)
+{
+	size_t i = nilfs_image_remap_index(t, key);
+
+	if (t->slots[i].key == 0) {
+		t->slots[i].key = key;
+		t->count++;
+	}
+	t->slots[i].blocknr = blocknr;
+}
+
+static int nilfs_image_remap_get(const struct nilfs_image_remap_table *t,
+				 uint64_t key, uint64_t *blocknrp)
+{
+	size_t i;
+
+	if (t->count == 0)
+		return 0;
+	i = nilfs_image_remap_index(t, key);
+	if (t->slots[i].key == 0)
+		return 0;
+	*blocknrp = t->slots[i].blocknr;
+	return 1;
+}
+
+/* key of a DAT block in the bremap table (never zero) */
+static inline uint64_t nilfs_image_bremap_key(uint64_t offset, int level)
+{
+	return (offset << 4) | (level + 1);
+}
+
+/**
+ * nilfs_image_alloc_segment - allocate a clean segment in the model
+ * @img: image backend
+ * @now: modification time given to the segment
+ */
+static int nilfs_image_alloc_segment(struct nilfs_image *img, uint64_t now)
+{
+	uint64_t segnum = img->last_alloc, i;
+	struct nilfs_suinfo *si;
+
+	for (i = 0; i < img->nsegments; i++) {
+		if (++segnum >= img->nsegments)
+			segnum = 0;
+		si = &img->suinfo[segnum];
+		if (si->sui_flags != 0 ||
+		    nilfs_image_segment_is_active(img, segnum))
+			continue;
+
+		si->sui_flags = 1UL << NILFS_SEGMENT_USAGE_DIRTY;
+		si->sui_nblocks = 0;
+		si->sui_lastmod = now;
+		img->ncleansegs--;
+		img->ndirtysegs++;
+		img->last_alloc = segnum;
+		img->gcseg = segnum;
+		return 0;
+	}
+	errno = ENOSPC;
+	return -1;
+}
+
+/**
+ * nilfs_image_gc_block - give a relocated block an address in the model
+ * @img: image backend
+ * @now: modification time given to the segment receiving the block
+ * @blocknrp: place to store the new disk block number
+ */
+static int nilfs_image_gc_block(struct nilfs_image *img, uint64_t now,
+				uint64_t *blocknrp)
+{
+	struct nilfs_suinfo *si;
+	uint64_t start, end;
+
+	if (img->gcseg < img->nsegments) {
+		nilfs_image_segment_range(img, img->gcseg, &start, &end);
+		if (start + img->suinfo[img->gcseg].sui_nblocks >= end)
+			img->gcseg = img->nsegments;
+	}
+	if (img->gcseg >= img->nsegments) {
+		if (nilfs_image_alloc_segment(img, now) < 0)
+			return -1;
+		nilfs_image_segment_range(img, img->gcseg, &start, &end);
+	}
+	si = &img->suinfo[img->gcseg];
+	*blocknrp = start + si->sui_nblocks++;
+	si->sui_lastmod = now;
+	return 0;
+}
+
+static int nilfs_image_get_cpstat(void *priv, struct nilfs_cpstat *cpstat)
+{
+	struct nilfs_image *img = priv;
+
+	cpstat->cs_cno = img->last_cno + 1;
+	cpstat->cs_ncps = img->ncheckpoints;
+	cpstat->cs_nsss = img->nsnapshots;
+	return 0;
+}
+
+static ssize_t nilfs_image_get_cpinfo(void *priv, nilfs_cno_t cno, int mode,
+				      struct nilfs_cpinfo *cpinfo, size_t nci)
+{
+	struct nilfs_image *img = priv;
+	const struct nilfs_checkpoint *cp;
+	const void *buf;
+	uint64_t tcno, blkoff;
+	size_t n = 0;
+
+	if (mode == NILFS_SNAPSHOT) {
+		if (cno == 0)
+			cno = img->ssl_next;
+		while (n < nci && cno != 0 && cno <= img->last_cno) {
+			cp = nilfs_image_checkpoint(img, cno);
+			if (unlikely(!cp))
+				return -1;
+			if (!nilfs_checkpoint_invalid(cp))
+				nilfs_image_cp_to_cpinfo(cp, &cpinfo[n++]);
+			cno = le64_to_cpu(cp->cp_snapshot_list.ssl_next);
+		}
+		return n;
+	} else if (unlikely(mode != NILFS_CHECKPOINT)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* slot 0 of the cpfile holds the header, not a checkpoint */
+	if (cno < NILFS_CNO_MIN)
+		cno = NILFS_CNO_MIN;
+
+	while (n < nci && cno <= img->last_cno) {
+		tcno = cno + img->cp_first - 1;
+		blkoff = tcno / img->cp_per_block;
+		buf = nilfs_image_mdt_block(img, &img->cpfile, blkoff);
+		if (!buf) {
+			if (unlikely(errno != ENOENT))
+				return -1;
+			/* skip the hole */
+			cno = (blkoff + 1) * img->cp_per_block -
+				img->cp_first + 1;
+			continue;
+		}
+		for (cp = buf + (tcno % img->cp_per_block) * img->cp_size;
+		     (void *)cp < buf + img->blocksize &&
+			     n < nci && cno <= img->last_cno;
+		     cp = (void *)cp + img->cp_size, cno++) {
+			if (nilfs_checkpoint_invalid(cp))
+				continue;
+			if (!nilfs_checkpoint_snapshot(cp) &&
+			    nilfs_image_cp_deleted(img, cno))
+				continue;
+			nilfs_image_cp_to_cpinfo(cp, &cpinfo[n++]);
+		}
+	}
+	return n;
+}
+
+static int nilfs_image_change_cpmode(void *priv, nilfs_cno_t cno, int mode)
+{
+	struct nilfs_image *img = priv;
+
+	errno = (img->flags & NILFS_IMAGE_RDONLY) ? EROFS : ENOTSUP;
+	return -1;
+}
+
+static int nilfs_image_delete_checkpoint(void *priv, nilfs_cno_t cno)
+{
+	struct nilfs_image *img = priv;
+	const struct nilfs_checkpoint *cp;
+
+	if (img->flags & NILFS_IMAGE_RDONLY) {
+		errno = EROFS;
+		return -1;
+	}
+	if (cno < NILFS_CNO_MIN || cno > img->last_cno) {
+		errno = ENOENT;
+		return -1;
+	}
+	cp = nilfs_image_checkpoint(img, cno);
+	if (!cp)
+		return -1;	/* ENOENT for a hole */
+	if (nilfs_checkpoint_invalid(cp)) {
+		errno = ENOENT;
+		return -1;
+	}
+	/* snapshots are never recorded as deleted, so check them first */
+	if (nilfs_checkpoint_snapshot(cp) || cno == img->last_cno) {
+		errno = EBUSY;
+		return -1;
+	}
+	if (nilfs_image_cp_deleted(img, cno)) {
+		errno = ENOENT;
+		return -1;
+	}
+	return nilfs_image_cp_delete_range(img, cno, cno + 1);
+}
+
+static int nilfs_image_get_sustat(void *priv, struct nilfs_sustat *sustat)
+{
+	struct nilfs_image *img = priv;
+
+	sustat->ss_nsegs = img->nsegments;
+	sustat->ss_ncleansegs = img->ncleansegs;
+	sustat->ss_ndirtysegs = img->ndirtysegs;
+	sustat->ss_ctime = img->ctime;
+	sustat->ss_nongc_ctime = img->nongc_ctime;
+	sustat->ss_prot_seq = img->last_seq;
+	return 0;
+}
+
+static ssize_t nilfs_image_get_suinfo(void *priv, uint64_t segnum,
+				      struct nilfs_suinfo *si, size_t nsi)
+{
+	struct nilfs_image *img = priv;
+	size_t i;
+
+	if (nilfs_image_load_sufile(img) < 0)
+		return -1;
+	if (segnum >= img->nsegments)
+		return 0;
+	if (nsi > img->nsegments - segnum)
+		nsi = img->nsegments - segnum;
+
+	memcpy(si, &img->suinfo[segnum], nsi * sizeof(*si));
+	for (i = 0; i < nsi; i++) {
+		if (nilfs_image_segment_is_active(img, segnum + i))
+			si[i].sui_flags |= 1UL << NILFS_SUINFO_ACTIVE;
+	}
+	return nsi;
+}
+
+static int nilfs_image_set_suinfo(void *priv,
+				  const struct nilfs_suinfo_update *sup,
+				  size_t nsup)
+{
+	struct nilfs_image *img = priv;
+	struct nilfs_suinfo *si;
+	uint32_t flags;
+	int cleansi, cleansu, dirtysi, dirtysu;
+	size_t i;
+
+	if (img->flags & NILFS_IMAGE_RDONLY) {
+		errno = EROFS;
+		return -1;
+	}
+	if (nilfs_image_load_sufile(img) < 0)
+		return -1;
+
+	for (i = 0; i < nsup; i++) {
+		if (unlikely(sup[i].sup_segnum >= img->nsegments ||
+			     (sup[i].sup_flags &
+			      (~0UL << __NR_NILFS_SUINFO_UPDATE_FIELDS)) ||
+			     (nilfs_suinfo_update_nblocks(&sup[i]) &&
+			      sup[i].sup_sui.sui_nblocks >
+			      img->blocks_per_segment))) {
+			errno = EINVAL;
+			return -1;
+		}
+	}
+
+	for (i = 0; i < nsup; i++) {
+		si = &img->suinfo[sup[i].sup_segnum];
+		if (nilfs_suinfo_update_lastmod(&sup[i]))
+			si->sui_lastmod = sup[i].sup_sui.sui_lastmod;
+		if (nilfs_suinfo_update_nblocks(&sup[i]))
+			si->sui_nblocks = sup[i].sup_sui.sui_nblocks;
+		if (nilfs_suinfo_update_flags(&sup[i])) {
+			/* the active flag is not recorded on disk */
+			flags = sup[i].sup_sui.sui_flags &
+				~(1UL << NILFS_SUINFO_ACTIVE);
+			cleansi = flags == 0;
+			cleansu = si->sui_flags == 0;
+			dirtysi = !!(flags & (1UL << NILFS_SUINFO_DIRTY));
+			dirtysu = !!(si->sui_flags &
+				     (1UL << NILFS_SUINFO_DIRTY));
+			img->ncleansegs += cleansi - cleansu;
+			img->ndirtysegs += dirtysi - dirtysu;
+			si->sui_flags = flags;
+		}
+	}
+	return 0;
+}
+
+static ssize_t nilfs_image_get_vinfo(void *priv, struct nilfs_vinfo *vinfo,
+				     size_t nvi)
+{
+	struct nilfs_image *img = priv;
+	struct nilfs_dat_entry entry;
+	uint64_t blocknr;
+	size_t i;
+
+	for (i = 0; i < nvi; i++) {
+		if (nilfs_image_dat_entry(img, vinfo[i].vi_vblocknr,
+					  &entry) < 0)
+			return -1;
+		vinfo[i].vi_start = le64_to_cpu(entry.de_start);
+		vinfo[i].vi_end = le64_to_cpu(entry.de_end);
+		vinfo[i].vi_blocknr = le64_to_cpu(entry.de_blocknr);
+
+		if (nilfs_image_remap_get(&img->vremap, vinfo[i].vi_vblocknr,
+					  &blocknr)) {
+			vinfo[i].vi_blocknr = blocknr;
+			if (blocknr == 0) {
+				/* as nilfs_dat_commit_free() leaves it */
+				vinfo[i].vi_start = NILFS_CNO_MIN;
+				vinfo[i].vi_end = NILFS_CNO_MIN;
+			}
+		}
+	}
+	return nvi;
+}
+
+static ssize_t nilfs_image_get_bdescs(void *priv, struct nilfs_bdesc *bdescs,
+				      size_t nbdescs)
+{
+	struct nilfs_image *img = priv;
+	uint64_t blocknr;
+	size_t i;
+
+	for (i = 0; i < nbdescs; i++) {
+		if (nilfs_image_bmap_lookup(img, &img->dat,
+					    bdescs[i].bd_offset,
+					    bdescs[i].bd_level + 1,
+					    &blocknr) < 0) {
+			if (unlikely(errno != ENOENT))
+				return -1;
+			blocknr = 0;
+		}
+		if (blocknr)
+			nilfs_image_remap_get(&img->bremap,
+					      nilfs_image_bremap_key(
+						      bdescs[i].bd_offset,
+						      bdescs[i].bd_level),
+					      &blocknr);
+		bdescs[i].bd_blocknr = blocknr;
+	}
+	return nbdescs;
+}
+
+/**
+ * nilfs_image_clean_segments - simulate a garbage collection operation
+ *
+ * As the kernel does, the checkpoint ranges in @periods are deleted, the
+ * blocks given by @vdescs and @bdescs are moved to newly allocated
+ * segments, the DAT entries in @vblocknrs are freed, and the segments in
+ * @segnums are made clean.  Moves and frees are recorded in the remap
+ * tables of the model.
+ */
+static int nilfs_image_clean_segments(void *priv,
+				      const struct nilfs_vdesc *vdescs,
+				      size_t nvdescs,
+				      const struct nilfs_period *periods,
+				      size_t nperiods,
+				      const uint64_t *vblocknrs,
+				      size_t nvblocknrs,
+				      const struct nilfs_bdesc *bdescs,
+				      size_t nbdescs,
+				      const uint64_t *segnums, size_t nsegs)
+{
+	struct nilfs_image *img = priv;
+	struct nilfs_suinfo *si;
+	uint64_t nblocks, room, capacity, blocknr, start, end;
+	uint64_t now = time(NULL);
+	size_t i;
+
+	if (img->flags & NILFS_IMAGE_RDONLY) {
+		errno = EROFS;
+		return -1;
+	}
+	if (nilfs_image_load_sufile(img) < 0)
+		return -1;
+
+	for (i = 0; i < nsegs; i++) {
+		if (unlikely(segnums[i] >= img->nsegments)) {
+			errno = EINVAL;
+			return -1;
+		}
+		if (unlikely(nilfs_image_segment_is_active(img,
+							   segnums[i]))) {
+			errno = EBUSY;
+			return -1;
+		}
+	}
+
+	/* check free space and memory before changing anything */
+	nblocks = nvdescs + nbdescs;
+	room = 0;
+	if (img->gcseg < img->nsegments) {
+		nilfs_image_segment_range(img, img->gcseg, &start, &end);
+		room = end - start - img->suinfo[img->gcseg].sui_nblocks;
+	}
+	/* segment 0 is the smallest one */
+	capacity = img->blocks_per_segment - img->first_data_block;
+	if (nblocks > room &&
+	    DIV_ROUND_UP(nblocks - room, capacity) > img->ncleansegs) {
+		errno = ENOSPC;
+		return -1;
+	}
+	if (nilfs_image_remap_reserve(&img->vremap, nvdescs + nvblocknrs) < 0 ||
+	    nilfs_image_remap_reserve(&img->bremap, nbdescs) < 0)
+		return -1;
+
+	for (i = 0; i < nperiods; i++) {
+		if (nilfs_image_cp_delete_range(img, periods[i].p_start,
+						periods[i].p_end) < 0)
+			return -1;
+	}
+
+	for (i = 0; i < nvdescs; i++) {
+		if (nilfs_image_gc_block(img, now, &blocknr) < 0)
+			return -1;
+		nilfs_image_remap_set(&img->vremap, vdescs[i].vd_vblocknr,
+				      blocknr);
+	}
+	for (i = 0; i < nbdescs; i++) {
+		if (nilfs_image_gc_block(img, now, &blocknr) < 0)
+			return -1;
+		nilfs_image_remap_set(&img->bremap,
+				      nilfs_image_bremap_key(
+					      bdescs[i].bd_offset,
+					      bdescs[i].bd_level),
+				      blocknr);
+	}
+	for (i = 0; i < nvblocknrs; i++)
+		nilfs_image_remap_set(&img->vremap, vblocknrs[i], 0);
+
+	for (i = 0; i < nsegs; i++) {
+		si = &img->suinfo[segnums[i]];
+		if (si->sui_flags == 0)
+			continue;
+		if (si->sui_flags & (1UL << NILFS_SUINFO_DIRTY))
+			img->ndirtysegs--;
+		img->ncleansegs++;
+		memset(si, 0, sizeof(*si));
+		if (segnums[i] == img->gcseg)
+			img->gcseg = img->nsegments;
+	}
+	img->ctime = now;
+	return 0;
+}
+
+static int nilfs_image_sync(void *priv, nilfs_cno_t *cnop)
+{
+	struct nilfs_image *img = priv;
+
+	if (cnop)
+		*cnop = img->last_cno;
+	return 0;
+}
+
+static void nilfs_image_release(void *priv)
+{
+	struct nilfs_image *img = priv;
+
+	free(img->suinfo);
+	free(img->deleted);
+	free(img->vremap.slots);
+	free(img->bremap.slots);
+	if (img->map)
+		munmap(img->map, img->mapsize);
+	free(img->cache);
+	free(img);
+}
+
+const struct nilfs_backend_ops nilfs_image_ops = {
+	.get_cpstat		= nilfs_image_get_cpstat,
+	.get_cpinfo		= nilfs_image_get_cpinfo,
+	.change_cpmode		= nilfs_image_change_cpmode,
+	.delete_checkpoint	= nilfs_image_delete_checkpoint,
+	.get_sustat		= nilfs_image_get_sustat,
+	.get_suinfo		= nilfs_image_get_suinfo,
+	.set_suinfo		= nilfs_image_set_suinfo,
+	.get_vinfo		= nilfs_image_get_vinfo,
+	.get_bdescs		= nilfs_image_get_bdescs,
+	.clean_segments		= nilfs_image_clean_segments,
+	.sync			= nilfs_image_sync,
+	.release		= nilfs_image_release,
+};
+
+/**
+ * nilfs_image_load_summary - validate a segment summary
+ * @img: image backend
+ * @pseg: first block of the partial segment
+ * @seq: expected sequence number
+ * @end: end block of the segment (exclusive)
+ *
+ * The checksum is computed block by block so that summaries spanning
+ * several blocks can be verified through the block cache.
+ *
+ * Return: the first block of the summary if it is valid, NULL
+ * otherwise.
+ */
+static const struct nilfs_segment_summary *
+nilfs_image_load_summary(struct nilfs_image *img, uint64_t pseg,
+			 uint64_t seq, uint64_t end)
+{
+	const struct nilfs_segment_summary *ss;
+	const unsigned char *buf;
+	uint32_t sumbytes, nblocks, sumsum, crc, len;
+	size_t offset;
+	uint64_t blocknr;
+
+	ss = nilfs_image_read_block(img, pseg);
+	if (!ss)
+		return NULL;
+
+	offset = offsetofend(struct nilfs_segment_summary, ss_sumsum);
+	sumbytes = le32_to_cpu(ss->ss_sumbytes);
+	nblocks = le32_to_cpu(ss->ss_nblocks);
+	if (le32_to_cpu(ss->ss_magic) != NILFS_SEGSUM_MAGIC ||
+	    le64_to_cpu(ss->ss_seq) != seq || sumbytes < offset ||
+	    nblocks == 0 || pseg + nblocks > end ||
+	    DIV_ROUND_UP(sumbytes, img->blocksize) >= nblocks)
+		return NULL;
+	sumsum = le32_to_cpu(ss->ss_sumsum);
+
+	crc = img->crc_seed;
+	for (blocknr = pseg; sumbytes > offset; blocknr++) {
+		buf = nilfs_image_read_block(img, blocknr);
+		if (!buf)
+			return NULL;
+		len = min_t(uint32_t, sumbytes, img->blocksize) - offset;
+		crc = crc32_le(crc, buf + offset, len);
+		sumbytes -= min_t(uint32_t, sumbytes, img->blocksize);
+		offset = 0;
+	}
+	if (crc != sumsum)
+		return NULL;
+
+	return nilfs_image_read_block(img, pseg);
+}
+
+/**
+ * nilfs_image_load_super_root - load the metadata files of a log
+ * @img: image backend
+ * @blocknr: block number of the super root
+ * @inode_size: size of on-disk inodes
+ *
+ * Return: 0 on success, 1 if the super root is broken, or -1 on error.
+ */
+static int nilfs_image_load_super_root(struct nilfs_image *img,
+				       uint64_t blocknr, size_t inode_size)
+{
+	const struct nilfs_super_root *sr;
+	size_t sr_bytes;
+
+	sr = nilfs_image_read_block(img, blocknr);
+	if (unlikely(!sr))
+		return -1;
+	sr_bytes = le16_to_cpu(sr->sr_bytes);
+	if (sr_bytes < NILFS_SR_BYTES(inode_size) ||
+	    sr_bytes > img->blocksize ||
+	    crc32_le(img->crc_seed, (unsigned char *)sr + sizeof(sr->sr_sum),
+		     sr_bytes - sizeof(sr->sr_sum)) !=
+	    le32_to_cpu(sr->sr_sum))
+		return 1;
+
+	img->nongc_ctime = le64_to_cpu(sr->sr_nongc_ctime);
+	memcpy(&img->dat.inode, (void *)sr + NILFS_SR_DAT_OFFSET(inode_size),
+	       sizeof(struct nilfs_inode));
+	memcpy(&img->cpfile.inode,
+	       (void *)sr + NILFS_SR_CPFILE_OFFSET(inode_size),
+	       sizeof(struct nilfs_inode));
+	memcpy(&img->sufile.inode,
+	       (void *)sr + NILFS_SR_SUFILE_OFFSET(inode_size),
+	       sizeof(struct nilfs_inode));
+	return 0;
+}
+
+/**
+ * nilfs_image_find_super_root - search the latest valid super root
+ * @img: image backend
+ * @sb: super block
+ *
+ * Starting from the log the super block points to, this follows the
+ * chain of logs in the same way as the recovery code of the kernel and
+ * picks the last one carrying a valid super root.  Nothing is rolled
+ * forward, so data only updates written after that log are ignored.
+ */
+static int nilfs_image_find_super_root(struct nilfs_image *img,
+				       const struct nilfs_super_block *sb)
+{
+	const struct nilfs_segment_summary *ss;
+	size_t inode_size = le16_to_cpu(sb->s_inode_size);
+	uint64_t pseg, seq, segnum, nextnum, start, end, nsegs = 0;
+	uint32_t nblocks;
+	int found = 0, empty = 0, ret;
+
+	pseg = le64_to_cpu(sb->s_last_pseg);
+	seq = le64_to_cpu(sb->s_last_seq);
+	segnum = pseg / img->blocks_per_segment;
+	nextnum = segnum;
+	nilfs_image_segment_range(img, segnum, &start, &end);
+
+	for (;;) {
+		ss = nilfs_image_load_summary(img, pseg, seq, end);
+		if (!ss) {
+			if (!found)
+				goto failed;
+			goto next_segment;
+		}
+		empty = 0;
+		nblocks = le32_to_cpu(ss->ss_nblocks);
+		nextnum = le64_to_cpu(ss->ss_next) / img->blocks_per_segment;
+
+		if (le16_to_cpu(ss->ss_flags) & NILFS_SS_SR) {
+			uint64_t cno = le64_to_cpu(ss->ss_cno);
+			uint64_t create = le64_to_cpu(ss->ss_create);
+
+			ret = nilfs_image_load_super_root(
+				img, pseg + nblocks - 1, inode_size);
+			if (unlikely(ret < 0))
+				return -1;
+			if (ret == 0) {
+				found = 1;
+				img->last_cno = cno;
+				img->last_seq = seq;
+				img->ctime = create;
+				img->active[0] = segnum;
+				img->active[1] = nextnum;
+			}
+		}
+
+		pseg += nblocks;
+		if (pseg < end)
+			continue;
+next_segment:
+		if (empty++ || ++nsegs > img->nsegments)
+			break;
+		seq++;
+		segnum = nextnum;
+		if (segnum >= img->nsegments)
+			break;
+		nilfs_image_segment_range(img, segnum, &start, &end);
+		pseg = start;
+	}
+
+	if (!found)
+		goto failed;
+
+	img->dat.virtual = 0;
+	img->cpfile.virtual = 1;
+	img->sufile.virtual = 1;
+	return 0;
+
+failed:
+	errno = EINVAL;
+	return -1;
+}
+
+/**
+ * nilfs_image_open - create an image backend
+ * @devfd: file descriptor of the image
+ * @sb: super block of the image
+ * @flags: NILFS_IMAGE_* flags
+ *
+ * Return: private data to be passed to the operations of
+ * nilfs_image_ops, or NULL with errno set.
+ */
+void *nilfs_image_open(int devfd, const struct nilfs_super_block *sb,
+		       int flags)
+{
+	const struct nilfs_cpfile_header *cph;
+	const struct nilfs_sufile_header *suh;
+	struct nilfs_image *img;
+	size_t inode_size;
+	off_t devsize;
+
+	img = malloc(sizeof(*img));
+	if (unlikely(!img))
+		return NULL;
+	memset(img, 0, sizeof(*img));
+
+	img->fd = devfd;
+	img->flags = flags;
+	img->blkbits = le32_to_cpu(sb->s_log_block_size) + 10;
+	img->blocksize = 1UL << img->blkbits;
+	img->nsegments = le64_to_cpu(sb->s_nsegments);
+	img->blocks_per_segment = le32_to_cpu(sb->s_blocks_per_segment);
+	img->first_data_block = le64_to_cpu(sb->s_first_data_block);
+	img->crc_seed = le32_to_cpu(sb->s_crc_seed);
+
+	inode_size = le16_to_cpu(sb->s_inode_size);
+	img->dat_entry_size = le16_to_cpu(sb->s_dat_entry_size);
+	img->cp_size = le16_to_cpu(sb->s_checkpoint_size);
+	img->su_size = le16_to_cpu(sb->s_segment_usage_size);
+	if (unlikely(img->blocksize > NILFS_MAX_BLOCK_SIZE ||
+		     img->blocks_per_segment == 0 || img->nsegments == 0 ||
+		     inode_size < NILFS_MIN_INODE_SIZE ||
+		     img->dat_entry_size < NILFS_MIN_DAT_ENTRY_SIZE ||
+		     img->cp_size < NILFS_MIN_CHECKPOINT_SIZE ||
+		     img->su_size < NILFS_MIN_SEGMENT_USAGE_SIZE ||
+		     inode_size > img->blocksize ||
+		     img->dat_entry_size > img->blocksize ||
+		     img->cp_size > img->blocksize ||
+		     img->su_size > img->blocksize)) {
+		errno = EINVAL;
+		goto failed;
+	}
+
+	img->node_ncmax = (img->blocksize - sizeof(struct nilfs_btree_node) -
+			   NILFS_IMAGE_NODE_EXTRA_PAD_SIZE) /
+		(sizeof(__le64) * 2);
+
+	img->dat_epb = img->blocksize / img->dat_entry_size;
+	img->dat_epg = img->blocksize * 8;
+	img->dat_bpg = DIV_ROUND_UP(img->dat_epg, img->dat_epb) + 1;
+	img->dat_gpdb = img->blocksize /
+		sizeof(struct nilfs_palloc_group_desc);
+	img->dat_bpdb = img->dat_gpdb * img->dat_bpg + 1;
+
+	img->cp_per_block = img->blocksize / img->cp_size;
+	img->cp_first = DIV_ROUND_UP(sizeof(struct nilfs_cpfile_header),
+				     img->cp_size);
+	img->su_per_block = img->blocksize / img->su_size;
+	img->su_first = DIV_ROUND_UP(sizeof(struct nilfs_sufile_header),
+				     img->su_size);
+
+	/*
+	 * Map the whole image so that metadata blocks are paged in on
+	 * demand; fall back to a block cache if that is not possible.
+	 */
+	devsize = lseek(devfd, 0, SEEK_END);
+	if (devsize > 0 && (uint64_t)devsize == (size_t)devsize) {
+		img->map = mmap(NULL, devsize, PROT_READ, MAP_SHARED,
+				devfd, 0);
+		if (img->map == MAP_FAILED)
+			img->map = NULL;
+		else
+			img->mapsize = devsize;
+	}
+	if (!img->map) {
+		img->cache = malloc(NILFS_IMAGE_CACHE_SLOTS * img->blocksize);
+		if (unlikely(!img->cache))
+			goto failed;
+	}
+
+	if (nilfs_image_find_super_root(img, sb) < 0)
+		goto failed;
+
+	cph = nilfs_image_mdt_block(img, &img->cpfile, 0);
+	if (unlikely(!cph))
+		goto failed;
+	img->ncheckpoints = le64_to_cpu(cph->ch_ncheckpoints);
+	img->nsnapshots = le64_to_cpu(cph->ch_nsnapshots);
+	img->ssl_next = le64_to_cpu(cph->ch_snapshot_list.ssl_next);
+
+	suh = nilfs_image_mdt_block(img, &img->sufile, 0);
+	if (unlikely(!suh))
+		goto failed;
+	img->ncleansegs = le64_to_cpu(suh->sh_ncleansegs);
+	img->ndirtysegs = le64_to_cpu(suh->sh_ndirtysegs);
+	img->last_alloc = le64_to_cpu(suh->sh_last_alloc);
+	img->gcseg = img->nsegments;
+	return img;
+
+failed:
+	if (img->map)
+		munmap(img->map, img->mapsize);
+	free(img->cache);
+	free(img);
+	return NULL;
+}
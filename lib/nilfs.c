@@ -77,12 +77,15 @@
 #include <errno.h>
 #include <assert.h>
 #include <mntent.h>	/* setmntent, getmntent_r, endmntent, etc */
+#include <pthread.h>
 
 #include "nilfs.h"
 #include "util.h"
 #include "pathnames.h"
 #include "realpath.h"
 #include "lookup_device.h"	/* nilfs_lookup_device() */
+#include "nilfs_backend.h"
+#include "uring.h"
 
 /**
  * struct nilfs - nilfs object
@@ -90,9 +93,18 @@
  * @n_dev: device file
  * @n_ioc: ioctl file
  * @n_devfd: file descriptor of device file
+ * @n_dirfd: file descriptor of device file opened with O_DIRECT
  * @n_iocfd: file descriptor of ioctl file
  * @n_opts: options
  * @n_mincno: the minimum of valid checkpoint numbers
+ * @n_segpool: pool of buffers for segment reads
+ * @n_segpool_capacity: maximum number of free buffers kept in @n_segpool
+ * @n_read_depth: number of reads kept in flight by nilfs_read_segments()
+ * @n_uring: io_uring instance of nilfs_read_segments(), set up on demand
+ * @n_uring_failed: flag indicating that io_uring is unavailable
+ * @n_seqcache: cache of segment sequence numbers, allocated on demand
+ * @n_backend_ops: operations used in place of ioctls, or %NULL
+ * @n_backend: private data of the backend
  * @n_sems: array of semaphores
  *     sems[0] protects garbage collection process
  */
@@ -102,15 +114,106 @@ struct nilfs {
 	/* char *n_mnt; */
 	char *n_ioc;
 	int n_devfd;
+	int n_dirfd;
 	int n_iocfd;
 	int n_opts;
 	nilfs_cno_t n_mincno;
+	struct nilfs_segbuf_pool *n_segpool;
+	unsigned int n_segpool_capacity;
+	unsigned int n_read_depth;
+	struct nilfs_uring *n_uring;
+	int n_uring_failed;
+	struct nilfs_seqcache_entry *n_seqcache;
+	const struct nilfs_backend_ops *n_backend_ops;
+	void *n_backend;
 	sem_t *n_sems[1];
 };
 
+/**
+ * struct nilfs_segbuf_pool - pool of segment-sized buffers
+ * @refcnt: reference count (one for the owner plus one per lent buffer)
+ * @capacity: maximum number of free buffers kept in the pool
+ * @nfree: number of free buffers
+ * @bufsize: size of the data area of each buffer
+ * @hits: number of allocations that reused a free buffer
+ * @misses: number of allocations that made a new buffer
+ * @free: list of free buffers
+ *
+ * The pool is reference counted so that a buffer put after
+ * nilfs_close() can still find and release it.  All the fields, as well
+ * as the n_segpool pointer of the owner, are protected by
+ * nilfs_segbuf_lock, so that segments can be got and put from several
+ * threads at once.
+ */
+struct nilfs_segbuf_pool {
+	unsigned int refcnt;
+	unsigned int capacity;
+	unsigned int nfree;
+	size_t bufsize;
+	uint64_t hits;
+	uint64_t misses;
+	struct nilfs_segbuf *free;
+};
+
+/**
+ * struct nilfs_segbuf - header of a pooled segment buffer
+ * @pool: pool that the buffer belongs to
+ * @base: start address of the allocated region
+ * @next: next free buffer
+ *
+ * The header is placed just before the page-aligned data area.
+ */
+struct nilfs_segbuf {
+	struct nilfs_segbuf_pool *pool;
+	void *base;
+	struct nilfs_segbuf *next;
+};
+
+/**
+ * struct nilfs_seqcache_entry - cached sequence number of a segment
+ * @segnum: segment number
+ * @lastmod: modification time of the segment when @seqnum was read
+ * @seqnum: sequence number read from the summary of the segment
+ *
+ * A segment gets a new sequence number only when it is reallocated,
+ * which updates its modification time.  Since the modification time
+ * only has a resolution of one second, an entry is made only if the
+ * summary was read in a later second than @lastmod; a reallocation
+ * after the read then always changes the modification time, so the
+ * entry stays valid as long as the segment usage reports the same
+ * @lastmod.
+ */
+struct nilfs_seqcache_entry {
+	uint64_t segnum;
+	uint64_t lastmod;
+	uint64_t seqnum;
+};
+
+#define NILFS_SEQCACHE_SIZE	4096	/* number of cache entries */
+
+/**
+ * struct nilfs_segidx - segment number tagged with its position
+ * @segnum: segment number
+ * @index: index of @segnum in the array given by the caller
+ */
+struct nilfs_segidx {
+	uint64_t segnum;
+	size_t index;
+};
+
+/*
+ * nilfs_segbuf_lock is held only while a buffer is taken from or given
+ * back to a pool, never across the read of a segment.
+ */
+static pthread_mutex_t nilfs_segbuf_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define NILFS_SUINFO_BATCH_GAP	64	/* max. gap merged into one request */
+#define NILFS_SUINFO_BATCH_MAX	512	/* max. number of items per request */
+
 enum {
 	NILFS_OPT_MMAP,
 	NILFS_OPT_SET_SUINFO,
+	NILFS_OPT_DIRECT_IO,
 	__NR_NILFS_OPT,
 };
 
@@ -251,6 +354,33 @@ ssize_t nilfs_get_layout(const struct nilfs *nilfs,
 	return sizeof(struct nilfs_layout);
 }
 
+/**
+ * nilfs_get_uuid - get uuid of the file system
+ * @nilfs: nilfs object
+ * @uuid: buffer to store the 128-bit uuid
+ * @size: size of @uuid buffer in bytes
+ *
+ * Return: 0 on success, or -1 with errno set on failure.
+ */
+int nilfs_get_uuid(const struct nilfs *nilfs, unsigned char *uuid,
+		   size_t size)
+{
+	const struct nilfs_super_block *sb = nilfs->n_sb;
+
+	if (unlikely(size < sizeof(sb->s_uuid))) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (unlikely(sb == NULL)) {
+		errno = EPERM;
+		return -1;
+	}
+
+	memcpy(uuid, sb->s_uuid, sizeof(sb->s_uuid));
+	return 0;
+}
+
 /**
  * nilfs_get_block_size - get block size of the file system
  * @nilfs: nilfs object
@@ -313,6 +443,27 @@ static int __nilfs_opt_set_mmap(struct nilfs *nilfs)
 	return 0;
 }
 
+static int __nilfs_opt_set_direct_io(struct nilfs *nilfs)
+{
+	if (unlikely(nilfs->n_sb == NULL)) {
+		errno = EPERM;
+		return -1;
+	}
+
+	if (nilfs->n_dirfd < 0) {
+		int errsv = errno;
+
+		/*
+		 * If the device does not support O_DIRECT, segments are
+		 * read with buffered I/O and dropped from the page cache
+		 * right after being read.
+		 */
+		nilfs->n_dirfd = open(nilfs->n_dev, O_RDONLY | O_DIRECT);
+		errno = errsv;
+	}
+	return 0;
+}
+
 /**
  * nilfs_opt_test - test whether the specified option is set or not
  * @nilfs: nilfs object
@@ -345,6 +496,10 @@ int nilfs_opt_set(struct nilfs *nilfs, unsigned int index)
 		ret = __nilfs_opt_set_mmap(nilfs);
 		if (ret < 0)
 			return ret;
+	} else if (index == NILFS_OPT_DIRECT_IO) {
+		ret = __nilfs_opt_set_direct_io(nilfs);
+		if (ret < 0)
+			return ret;
 	}
 	nilfs->n_opts |= (1 << index);
 	return 0;
@@ -365,6 +520,158 @@ int nilfs_opt_clear(struct nilfs *nilfs, unsigned int index)
 	return 0;
 }
 
+/**
+ * nilfs_segbuf_pool_shrink - release free buffers exceeding a limit
+ * @pool: segment buffer pool
+ * @nbufs: number of free buffers to be kept
+ *
+ * Must be called with nilfs_segbuf_lock held.
+ *
+ * Return: list of the detached buffers, to be freed with
+ * nilfs_segbuf_destroy() after the lock is released.
+ */
+static struct nilfs_segbuf *
+nilfs_segbuf_pool_shrink(struct nilfs_segbuf_pool *pool, unsigned int nbufs)
+{
+	struct nilfs_segbuf *segbuf, *list = NULL;
+
+	while (pool->nfree > nbufs) {
+		segbuf = pool->free;
+		pool->free = segbuf->next;
+		pool->nfree--;
+		pool->refcnt--;
+		segbuf->next = list;
+		list = segbuf;
+	}
+	return list;
+}
+
+static void nilfs_segbuf_destroy(struct nilfs_segbuf *list)
+{
+	struct nilfs_segbuf *segbuf;
+
+	while (list) {
+		segbuf = list;
+		list = segbuf->next;
+		free(segbuf->base);
+	}
+}
+
+static void nilfs_segbuf_pool_release(struct nilfs *nilfs)
+{
+	struct nilfs_segbuf_pool *pool;
+	struct nilfs_segbuf *list = NULL;
+
+	pthread_mutex_lock(&nilfs_segbuf_lock);
+	pool = nilfs->n_segpool;
+	if (pool) {
+		pool->capacity = 0;
+		list = nilfs_segbuf_pool_shrink(pool, 0);
+		if (--pool->refcnt > 0)
+			pool = NULL;
+		nilfs->n_segpool = NULL;
+	}
+	pthread_mutex_unlock(&nilfs_segbuf_lock);
+
+	nilfs_segbuf_destroy(list);
+	free(pool);
+}
+
+/**
+ * nilfs_segbuf_alloc - get a segment buffer from the pool
+ * @nilfs: nilfs object
+ * @size: required size of the buffer
+ *
+ * Return: page-aligned data area of the buffer, or NULL on failure.
+ */
+static void *nilfs_segbuf_alloc(struct nilfs *nilfs, size_t size)
+{
+	struct nilfs_segbuf_pool *pool;
+	struct nilfs_segbuf *segbuf;
+	long pagesize;
+	void *base;
+	int ret;
+
+	pagesize = sysconf(_SC_PAGESIZE);
+	if (unlikely(pagesize < (long)sizeof(*segbuf))) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	pthread_mutex_lock(&nilfs_segbuf_lock);
+	pool = nilfs->n_segpool;
+	if (unlikely(!pool)) {
+		pool = malloc(sizeof(*pool));
+		if (unlikely(!pool))
+			goto failed;
+		memset(pool, 0, sizeof(*pool));
+		pool->refcnt = 1;
+		pool->capacity = nilfs->n_segpool_capacity;
+		pool->bufsize = size;
+		nilfs->n_segpool = pool;
+	}
+
+	if (unlikely(size > pool->bufsize)) {
+		errno = EINVAL;
+		goto failed;
+	}
+
+	if (pool->free) {
+		segbuf = pool->free;
+		pool->free = segbuf->next;
+		pool->nfree--;
+		pool->hits++;
+		pthread_mutex_unlock(&nilfs_segbuf_lock);
+		return segbuf + 1;
+	}
+	/* Count the buffer in advance so the pool outlives it */
+	pool->refcnt++;
+	pool->misses++;
+	size = pool->bufsize;
+	pthread_mutex_unlock(&nilfs_segbuf_lock);
+
+	ret = posix_memalign(&base, pagesize, pagesize + size);
+	if (unlikely(ret != 0)) {
+		pthread_mutex_lock(&nilfs_segbuf_lock);
+		if (--pool->refcnt > 0)
+			pool = NULL;
+		pthread_mutex_unlock(&nilfs_segbuf_lock);
+		free(pool);
+		errno = ret;
+		return NULL;
+	}
+	segbuf = base + pagesize - sizeof(*segbuf);
+	segbuf->pool = pool;
+	segbuf->base = base;
+	segbuf->next = NULL;
+	return segbuf + 1;
+
+failed:
+	pthread_mutex_unlock(&nilfs_segbuf_lock);
+	return NULL;
+}
+
+static void nilfs_segbuf_free(void *addr)
+{
+	struct nilfs_segbuf *segbuf = (struct nilfs_segbuf *)addr - 1;
+	struct nilfs_segbuf_pool *pool = segbuf->pool;
+
+	pthread_mutex_lock(&nilfs_segbuf_lock);
+	if (pool->nfree < pool->capacity) {
+		segbuf->next = pool->free;
+		pool->free = segbuf;
+		pool->nfree++;
+		pthread_mutex_unlock(&nilfs_segbuf_lock);
+		return;
+	}
+	if (--pool->refcnt > 0)
+		pool = NULL;
+	pthread_mutex_unlock(&nilfs_segbuf_lock);
+
+	free(segbuf->base);
+	free(pool);
+}
+
 static int nilfs_open_sem(struct nilfs *nilfs)
 {
 	char semnambuf[NAME_MAX - 4];
@@ -415,6 +722,17 @@ struct nilfs *nilfs_open(const char *dev, const char *dir, int flags)
 	uint64_t features;
 	int ret;
 
+	if (flags & (NILFS_OPEN_IMAGE | NILFS_OPEN_OFFLINE)) {
+		/* an image has no mount point to issue ioctls on */
+		if (unlikely(dev == NULL ||
+			     (flags & (NILFS_OPEN_RDONLY | NILFS_OPEN_WRONLY |
+				       NILFS_OPEN_RDWR)))) {
+			errno = EINVAL;
+			return NULL;
+		}
+		flags |= NILFS_OPEN_RAW;
+	}
+
 	if (unlikely(!(flags & (NILFS_OPEN_RAW | NILFS_OPEN_RDONLY |
 				NILFS_OPEN_WRONLY | NILFS_OPEN_RDWR)))) {
 		errno = EINVAL;
@@ -427,11 +745,20 @@ struct nilfs *nilfs_open(const char *dev, const char *dir, int flags)
 
 	nilfs->n_sb = NULL;
 	nilfs->n_devfd = -1;
+	nilfs->n_dirfd = -1;
 	nilfs->n_iocfd = -1;
 	nilfs->n_dev = NULL;
 	nilfs->n_ioc = NULL;
 	nilfs->n_opts = 0;
 	nilfs->n_mincno = NILFS_CNO_MIN;
+	nilfs->n_segpool = NULL;
+	nilfs->n_segpool_capacity = NILFS_SEGBUF_POOL_DEFAULT;
+	nilfs->n_read_depth = NILFS_READ_DEPTH_DEFAULT;
+	nilfs->n_uring = NULL;
+	nilfs->n_uring_failed = 0;
+	nilfs->n_seqcache = NULL;
+	nilfs->n_backend_ops = NULL;
+	nilfs->n_backend = NULL;
 	memset(nilfs->n_sems, 0, sizeof(nilfs->n_sems));
 	backdev = NULL;
 
@@ -468,6 +795,15 @@ struct nilfs *nilfs_open(const char *dev, const char *dir, int flags)
 		}
 	}
 
+	if (flags & (NILFS_OPEN_IMAGE | NILFS_OPEN_OFFLINE)) {
+		nilfs->n_backend = nilfs_image_open(
+			nilfs->n_devfd, nilfs->n_sb,
+			(flags & NILFS_OPEN_IMAGE) ? 0 : NILFS_IMAGE_RDONLY);
+		if (unlikely(nilfs->n_backend == NULL))
+			goto out_fd;
+		nilfs->n_backend_ops = &nilfs_image_ops;
+	}
+
 	if (flags &
 	    (NILFS_OPEN_RDONLY | NILFS_OPEN_WRONLY | NILFS_OPEN_RDWR)) {
 		struct stat iocst, devst;
@@ -517,6 +853,8 @@ struct nilfs *nilfs_open(const char *dev, const char *dir, int flags)
 
 	/* error */
 out_fd:
+	if (nilfs->n_backend_ops)
+		nilfs->n_backend_ops->release(nilfs->n_backend);
 	if (nilfs->n_devfd >= 0)
 		close(nilfs->n_devfd);
 	if (nilfs->n_iocfd >= 0)
@@ -536,10 +874,18 @@ out_fd:
  */
 void nilfs_close(struct nilfs *nilfs)
 {
+	nilfs_segbuf_pool_release(nilfs);
+	if (nilfs->n_uring)
+		nilfs_uring_destroy(nilfs->n_uring);
+	free(nilfs->n_seqcache);
+	if (nilfs->n_backend_ops)
+		nilfs->n_backend_ops->release(nilfs->n_backend);
 	if (nilfs->n_sems[0] != NULL)
 		sem_close(nilfs->n_sems[0]);
 	if (nilfs->n_devfd >= 0)
 		close(nilfs->n_devfd);
+	if (nilfs->n_dirfd >= 0)
+		close(nilfs->n_dirfd);
 	if (nilfs->n_iocfd >= 0)
 		close(nilfs->n_iocfd);
 
@@ -635,7 +981,7 @@ int nilfs_change_cpmode(struct nilfs *nilfs, nilfs_cno_t cno, int mode)
 {
 	struct nilfs_cpmode cpmode;
 
-	if (unlikely(nilfs->n_iocfd < 0)) {
+	if (unlikely(nilfs->n_iocfd < 0 && !nilfs->n_backend_ops)) {
 		errno = EBADF;
 		return -1;
 	}
@@ -643,6 +989,9 @@ int nilfs_change_cpmode(struct nilfs *nilfs, nilfs_cno_t cno, int mode)
 		errno = EINVAL;
 		return -1;
 	}
+	if (nilfs->n_backend_ops)
+		return nilfs->n_backend_ops->change_cpmode(nilfs->n_backend,
+							   cno, mode);
 
 	cpmode.cm_cno = cno;
 	cpmode.cm_mode = mode;
@@ -662,9 +1011,10 @@ ssize_t nilfs_get_cpinfo(struct nilfs *nilfs, nilfs_cno_t cno, int mode,
 			 struct nilfs_cpinfo *cpinfo, size_t nci)
 {
 	struct nilfs_argv argv;
+	ssize_t n;
 	int ret;
 
-	if (unlikely(nilfs->n_iocfd < 0)) {
+	if (unlikely(nilfs->n_iocfd < 0 && !nilfs->n_backend_ops)) {
 		errno = EBADF;
 		return -1;
 	}
@@ -676,20 +1026,27 @@ ssize_t nilfs_get_cpinfo(struct nilfs *nilfs, nilfs_cno_t cno, int mode,
 			cno = nilfs->n_mincno;
 	}
 
-	argv.v_base = (unsigned long)cpinfo;
-	argv.v_nmembs = nci;
-	argv.v_size = sizeof(struct nilfs_cpinfo);
-	argv.v_index = cno;
-	argv.v_flags = mode;
-	ret = ioctl(nilfs->n_iocfd, NILFS_IOCTL_GET_CPINFO, &argv);
-	if (unlikely(ret < 0))
-		return -1;
-	if (mode == NILFS_CHECKPOINT && argv.v_nmembs > 0 &&
-	    cno == nilfs->n_mincno) {
+	if (nilfs->n_backend_ops) {
+		n = nilfs->n_backend_ops->get_cpinfo(nilfs->n_backend, cno,
+						     mode, cpinfo, nci);
+		if (unlikely(n < 0))
+			return -1;
+	} else {
+		argv.v_base = (unsigned long)cpinfo;
+		argv.v_nmembs = nci;
+		argv.v_size = sizeof(struct nilfs_cpinfo);
+		argv.v_index = cno;
+		argv.v_flags = mode;
+		ret = ioctl(nilfs->n_iocfd, NILFS_IOCTL_GET_CPINFO, &argv);
+		if (unlikely(ret < 0))
+			return -1;
+		n = argv.v_nmembs;
+	}
+	if (mode == NILFS_CHECKPOINT && n > 0 && cno == nilfs->n_mincno) {
 		if (cpinfo[0].ci_cno > nilfs->n_mincno)
 			nilfs->n_mincno = cpinfo[0].ci_cno;
 	}
-	return argv.v_nmembs;
+	return n;
 }
 
 /**
@@ -699,6 +1056,9 @@ ssize_t nilfs_get_cpinfo(struct nilfs *nilfs, nilfs_cno_t cno, int mode,
  */
 int nilfs_delete_checkpoint(struct nilfs *nilfs, nilfs_cno_t cno)
 {
+	if (nilfs->n_backend_ops)
+		return nilfs->n_backend_ops->delete_checkpoint(nilfs->n_backend,
+							       cno);
 	if (unlikely(nilfs->n_iocfd < 0)) {
 		errno = EBADF;
 		return -1;
@@ -706,6 +1066,93 @@ int nilfs_delete_checkpoint(struct nilfs *nilfs, nilfs_cno_t cno)
 	return ioctl(nilfs->n_iocfd, NILFS_IOCTL_DELETE_CHECKPOINT, &cno);
 }
 
+#define NILFS_CPDEL_NCPINFO	512
+
+/**
+ * nilfs_delete_checkpoints - delete the checkpoints in a range
+ * @nilfs: nilfs object
+ * @start: first checkpoint number of the range (inclusive)
+ * @end: last checkpoint number of the range (inclusive)
+ * @stat: place to store the result
+ * @report: function called on each skipped snapshot and batch [optional]
+ * @arg: argument passed to @report
+ *
+ * nilfs_delete_checkpoints() enumerates the checkpoints that exist in the
+ * range with batched nilfs_get_cpinfo() calls, so that the holes in the
+ * range cost no deletion requests, and deletes them.  Snapshots, including
+ * checkpoints that turn into snapshots meanwhile, are skipped and counted
+ * in @stat->nsnapshots; checkpoints deleted by someone else are not counted
+ * as found.  @report is called with @snapshot set for each skipped
+ * snapshot, and with @snapshot cleared after each batch, with @stat->cno
+ * set to the checkpoint number concerned.
+ *
+ * Return: 0 on success, or -1 with errno set on failure, in which case
+ * @stat->cno tells the checkpoint number on which the failure occurred.
+ */
+int nilfs_delete_checkpoints(struct nilfs *nilfs, nilfs_cno_t start,
+			     nilfs_cno_t end, struct nilfs_cpdel_stat *stat,
+			     nilfs_cpdel_report_t *report, void *arg)
+{
+	struct nilfs_cpinfo *cpinfos;
+	const struct nilfs_cpinfo *cpi;
+	nilfs_cno_t cno = start;
+	ssize_t n, i;
+	int ret = 0;
+
+	memset(stat, 0, sizeof(*stat));
+	stat->cno = start;
+
+	cpinfos = malloc(sizeof(*cpinfos) * NILFS_CPDEL_NCPINFO);
+	if (unlikely(!cpinfos))
+		return -1;
+
+	while (cno <= end) {
+		stat->cno = cno;
+		n = nilfs_get_cpinfo(nilfs, cno, NILFS_CHECKPOINT, cpinfos,
+				     min_t(uint64_t, end - cno + 1,
+					   NILFS_CPDEL_NCPINFO));
+		if (unlikely(n < 0)) {
+			ret = -1;
+			break;
+		}
+		if (n == 0)
+			break;
+
+		for (i = 0, cpi = cpinfos; i < n; i++, cpi++) {
+			if (cpi->ci_cno > end)
+				goto out;
+			stat->cno = cpi->ci_cno;
+			stat->nfound++;
+
+			if (!nilfs_cpinfo_snapshot(cpi)) {
+				if (likely(nilfs_delete_checkpoint(
+						   nilfs, cpi->ci_cno) == 0)) {
+					stat->ndeleted++;
+					continue;
+				}
+				if (errno == ENOENT) {
+					/* deleted by someone else */
+					stat->nfound--;
+					continue;
+				}
+				if (errno != EBUSY) {
+					ret = -1;
+					goto out;
+				}
+			}
+			stat->nsnapshots++;
+			if (report)
+				report(stat, 1, arg);
+		}
+		cno = cpinfos[n - 1].ci_cno + 1;
+		if (report)
+			report(stat, 0, arg);
+	}
+out:
+	free(cpinfos);
+	return ret;
+}
+
 /**
  * nilfs_get_cpstat - get checkpoint statistics
  * @nilfs: nilfs object
@@ -713,6 +1160,9 @@ int nilfs_delete_checkpoint(struct nilfs *nilfs, nilfs_cno_t cno)
  */
 int nilfs_get_cpstat(const struct nilfs *nilfs, struct nilfs_cpstat *cpstat)
 {
+	if (nilfs->n_backend_ops)
+		return nilfs->n_backend_ops->get_cpstat(nilfs->n_backend,
+							cpstat);
 	if (unlikely(nilfs->n_iocfd < 0)) {
 		errno = EBADF;
 		return -1;
@@ -733,6 +1183,9 @@ ssize_t nilfs_get_suinfo(const struct nilfs *nilfs, uint64_t segnum,
 	struct nilfs_argv argv;
 	int ret;
 
+	if (nilfs->n_backend_ops)
+		return nilfs->n_backend_ops->get_suinfo(nilfs->n_backend,
+							segnum, si, nsi);
 	if (unlikely(nilfs->n_iocfd < 0)) {
 		errno = EBADF;
 		return -1;
@@ -749,6 +1202,90 @@ ssize_t nilfs_get_suinfo(const struct nilfs *nilfs, uint64_t segnum,
 	return argv.v_nmembs;
 }
 
+static int nilfs_segidx_cmp(const void *a, const void *b)
+{
+	const struct nilfs_segidx *ia = a, *ib = b;
+
+	return ia->segnum < ib->segnum ? -1 : ia->segnum > ib->segnum;
+}
+
+/**
+ * nilfs_get_suinfo_batch - get segment usage of arbitrary segments
+ * @nilfs: nilfs object
+ * @segnums: array of segment numbers, in any order
+ * @nsegs: number of items in @segnums
+ * @si: array of nilfs_suinfo structs to store information in, in the
+ *      same order as @segnums
+ *
+ * nilfs_get_suinfo_batch() sorts the segment numbers and merges nearby
+ * ones into ranges, so that the usage of all the segments is fetched
+ * with a few nilfs_get_suinfo() calls instead of one per segment.
+ * Segments lying in the gap between two requested ones are read along
+ * and discarded.
+ *
+ * Return: @nsegs on success, or -1 with errno set on failure.
+ */
+ssize_t nilfs_get_suinfo_batch(const struct nilfs *nilfs,
+			       const uint64_t *segnums, size_t nsegs,
+			       struct nilfs_suinfo *si)
+{
+	uint64_t nsegments = nilfs_get_nsegments(nilfs), start;
+	struct nilfs_segidx *order;
+	struct nilfs_suinfo *buf = NULL;
+	size_t i, j, k;
+	ssize_t n, ret = -1;
+
+	for (i = 0; i < nsegs; i++) {
+		if (unlikely(segnums[i] >= nsegments)) {
+			errno = EINVAL;
+			return -1;
+		}
+	}
+	if (nsegs == 0)
+		return 0;
+
+	order = malloc(sizeof(*order) * nsegs);
+	if (unlikely(!order))
+		return -1;
+	buf = malloc(sizeof(*buf) * NILFS_SUINFO_BATCH_MAX);
+	if (unlikely(!buf))
+		goto out;
+
+	for (i = 0; i < nsegs; i++) {
+		order[i].segnum = segnums[i];
+		order[i].index = i;
+	}
+	qsort(order, nsegs, sizeof(*order), nilfs_segidx_cmp);
+
+	for (i = 0; i < nsegs; i = j) {
+		start = order[i].segnum;
+		for (j = i + 1; j < nsegs; j++) {
+			if (order[j].segnum - order[j - 1].segnum >
+			    NILFS_SUINFO_BATCH_GAP ||
+			    order[j].segnum - start >= NILFS_SUINFO_BATCH_MAX)
+				break;
+		}
+
+		n = nilfs_get_suinfo(nilfs, start, buf,
+				     order[j - 1].segnum - start + 1);
+		if (unlikely(n < 0))
+			goto out;
+
+		for (k = i; k < j; k++) {
+			if (unlikely(order[k].segnum - start >= n)) {
+				errno = EIO;
+				goto out;
+			}
+			si[order[k].index] = buf[order[k].segnum - start];
+		}
+	}
+	ret = nsegs;
+out:
+	free(buf);
+	free(order);
+	return ret;
+}
+
 /**
  * nilfs_set_suinfo - sets segment usage info
  * @nilfs: nilfs object
@@ -766,6 +1303,9 @@ int nilfs_set_suinfo(const struct nilfs *nilfs,
 {
 	struct nilfs_argv argv;
 
+	if (nilfs->n_backend_ops)
+		return nilfs->n_backend_ops->set_suinfo(nilfs->n_backend,
+							sup, nsup);
 	if (unlikely(nilfs->n_iocfd < 0)) {
 		errno = EBADF;
 		return -1;
@@ -787,6 +1327,9 @@ int nilfs_set_suinfo(const struct nilfs *nilfs,
  */
 int nilfs_get_sustat(const struct nilfs *nilfs, struct nilfs_sustat *sustat)
 {
+	if (nilfs->n_backend_ops)
+		return nilfs->n_backend_ops->get_sustat(nilfs->n_backend,
+							sustat);
 	if (unlikely(nilfs->n_iocfd < 0)) {
 		errno = EBADF;
 		return -1;
@@ -807,6 +1350,9 @@ ssize_t nilfs_get_vinfo(const struct nilfs *nilfs,
 	struct nilfs_argv argv;
 	int ret;
 
+	if (nilfs->n_backend_ops)
+		return nilfs->n_backend_ops->get_vinfo(nilfs->n_backend,
+						       vinfo, nvi);
 	if (unlikely(nilfs->n_iocfd < 0)) {
 		errno = EBADF;
 		return -1;
@@ -835,6 +1381,9 @@ ssize_t nilfs_get_bdescs(const struct nilfs *nilfs,
 	struct nilfs_argv argv;
 	int ret;
 
+	if (nilfs->n_backend_ops)
+		return nilfs->n_backend_ops->get_bdescs(nilfs->n_backend,
+							bdescs, nbdescs);
 	if (unlikely(nilfs->n_iocfd < 0)) {
 		errno = EBADF;
 		return -1;
@@ -874,6 +1423,11 @@ int nilfs_clean_segments(struct nilfs *nilfs,
 {
 	struct nilfs_argv argv[5];
 
+	if (nilfs->n_backend_ops)
+		return nilfs->n_backend_ops->clean_segments(
+			nilfs->n_backend, vdescs, nvdescs, periods, nperiods,
+			vblocknrs, nvblocknrs, bdescs, nbdescs,
+			segnums, nsegs);
 	if (unlikely(nilfs->n_iocfd < 0)) {
 		errno = EBADF;
 		return -1;
@@ -905,6 +1459,8 @@ int nilfs_clean_segments(struct nilfs *nilfs,
  */
 int nilfs_sync(const struct nilfs *nilfs, nilfs_cno_t *cnop)
 {
+	if (nilfs->n_backend_ops)
+		return nilfs->n_backend_ops->sync(nilfs->n_backend, cnop);
 	if (unlikely(nilfs->n_iocfd < 0)) {
 		errno = EBADF;
 		return -1;
@@ -985,6 +1541,9 @@ int nilfs_thaw(struct nilfs *nilfs)
  * @nilfs: nilfs object
  * @segnum: segment number
  * @segment: pointer to a segment object (nilfs_segment struct)
+ *
+ * nilfs_get_segment() and nilfs_put_segment() may be called on the same
+ * @nilfs from several threads at once; the reads are not serialized.
  */
 int nilfs_get_segment(struct nilfs *nilfs, uint64_t segnum,
 		      struct nilfs_segment *segment)
@@ -998,6 +1557,7 @@ int nilfs_get_segment(struct nilfs *nilfs, uint64_t segnum,
 	off_t segstart;
 	void *addr;
 	ssize_t ret;
+	int fd;
 
 	if (unlikely(nilfs->n_devfd < 0 || sb == NULL)) {
 		errno = EBADF;
@@ -1037,7 +1597,7 @@ int nilfs_get_segment(struct nilfs *nilfs, uint64_t segnum,
 	segstart = segblocknr << blkbits;
 
 #ifdef HAVE_MMAP
-	if (nilfs_opt_test_mmap(nilfs)) {
+	if (nilfs_opt_test_mmap(nilfs) && !nilfs_opt_test_direct_io(nilfs)) {
 		size_t alloc_size, page_offset;
 		int errsv = errno;
 
@@ -1048,6 +1608,7 @@ int nilfs_get_segment(struct nilfs *nilfs, uint64_t segnum,
 			    nilfs->n_devfd, segstart - page_offset);
 		if (likely(addr != MAP_FAILED)) {
 			segment->mmapped = 1;
+			segment->pooled = 0;
 			segment->adjusted = (page_offset != 0 ||
 					     alloc_size != pagesize);
 			goto success;
@@ -1063,17 +1624,33 @@ int nilfs_get_segment(struct nilfs *nilfs, uint64_t segnum,
 	}
 #endif	/* HAVE_MMAP */
 
-	addr = malloc(segsize);
+	addr = nilfs_segbuf_alloc(nilfs, (size_t)blocks_per_segment << blkbits);
 	if (unlikely(addr == NULL))
 		return -1;
 
-	ret = pread(nilfs->n_devfd, addr, segsize, segstart);
+	fd = nilfs->n_devfd;
+	if (nilfs_opt_test_direct_io(nilfs) && nilfs->n_dirfd >= 0)
+		fd = nilfs->n_dirfd;
+
+	ret = pread(fd, addr, segsize, segstart);
+	if (ret < 0 && fd != nilfs->n_devfd && errno == EINVAL) {
+		/* The request is not aligned for direct I/O */
+		fd = nilfs->n_devfd;
+		ret = pread(fd, addr, segsize, segstart);
+	}
 	if (unlikely(ret < 0)) {
-		free(addr);
+		nilfs_segbuf_free(addr);
 		return -1;
 	}
+#if HAVE_POSIX_FADVISE
+	if (nilfs_opt_test_direct_io(nilfs) && fd == nilfs->n_devfd) {
+		/* Do not let the segment push out hot pages */
+		posix_fadvise(fd, segstart, segsize, POSIX_FADV_DONTNEED);
+	}
+#endif	/* HAVE_POSIX_FADVISE */
 	segment->mmapped = 0;
 	segment->adjusted = 0;
+	segment->pooled = 1;
 
 success:
 	segment->addr = addr;
@@ -1120,7 +1697,292 @@ int nilfs_put_segment(struct nilfs_segment *segment)
 #endif	/* HAVE_MMAP */
 	}
 
-	free(segment->addr);
+	if (segment->pooled)
+		nilfs_segbuf_free(segment->addr);
+	else
+		free(segment->addr);
+	return 0;
+}
+
+/**
+ * nilfs_segread_prepare - validate a segment read request
+ * @nilfs: nilfs object
+ * @req: segment read request
+ * @startp: buffer to store the start byte offset on the device
+ *
+ * Return: 0 on success, or a negative error number if @req is invalid.
+ */
+static int nilfs_segread_prepare(const struct nilfs *nilfs,
+				 struct nilfs_segread *req, off_t *startp)
+{
+	const struct nilfs_super_block *sb = nilfs->n_sb;
+	uint32_t blocks_per_segment, blkbits;
+	uint64_t segblocknr, segsize;
+
+	if (unlikely(req->segnum >= nilfs_get_nsegments(nilfs)))
+		return -EINVAL;
+
+	blkbits = le32_to_cpu(sb->s_log_block_size) + 10;
+	blocks_per_segment = le32_to_cpu(sb->s_blocks_per_segment);
+	if (req->segnum == 0) {
+		segblocknr = le64_to_cpu(sb->s_first_data_block);
+		if (unlikely(segblocknr >= blocks_per_segment))
+			return -EINVAL;
+		segsize = (uint64_t)(blocks_per_segment - segblocknr) << blkbits;
+	} else {
+		segblocknr = (uint64_t)blocks_per_segment * req->segnum;
+		segsize = (uint64_t)blocks_per_segment << blkbits;
+	}
+
+	if (unlikely(req->offset >= segsize))
+		return -EINVAL;
+	if (req->length == 0 || req->length > segsize - req->offset)
+		req->length = segsize - req->offset;
+
+	*startp = (segblocknr << blkbits) + req->offset;
+	return 0;
+}
+
+static void nilfs_segread_advise(const struct nilfs *nilfs,
+				 const struct nilfs_segread *req, off_t start)
+{
+#if HAVE_POSIX_FADVISE
+	if (req->result == 0 && !nilfs_opt_test_direct_io(nilfs))
+		posix_fadvise(nilfs->n_devfd, start, req->length,
+			      POSIX_FADV_WILLNEED);
+#endif	/* HAVE_POSIX_FADVISE */
+}
+
+/**
+ * nilfs_read_segments_uring - read ranges of segments with io_uring
+ * @nilfs: nilfs object
+ * @reqs: array of segment read requests
+ * @starts: array of device offsets of the requests
+ * @nreqs: number of requests in @reqs
+ *
+ * The io_uring instance is set up on the first call.  If it cannot be
+ * set up or fails later, it is not used again for @nilfs.
+ *
+ * Return: 0 if the reads were issued, or -1 if io_uring is unusable and
+ * the caller has to read the ranges by itself.
+ */
+static int nilfs_read_segments_uring(struct nilfs *nilfs,
+				     struct nilfs_segread *reqs,
+				     const off_t *starts, size_t nreqs)
+{
+	struct nilfs_uring_io *ios;
+	size_t i, n;
+	int ret;
+
+	if (nilfs->n_read_depth <= 1 || nilfs->n_uring_failed)
+		return -1;
+
+	if (!nilfs->n_uring) {
+		nilfs->n_uring = nilfs_uring_create(nilfs->n_read_depth);
+		if (!nilfs->n_uring) {
+			nilfs->n_uring_failed = 1;
+			return -1;
+		}
+	}
+
+	ios = malloc(sizeof(*ios) * nreqs);
+	if (unlikely(!ios))
+		return -1;
+
+	for (i = 0, n = 0; i < nreqs; i++) {
+		if (reqs[i].result < 0 || reqs[i].buf == NULL)
+			continue;
+		ios[n].buf = reqs[i].buf;
+		ios[n].len = reqs[i].length;
+		ios[n].offset = starts[i];
+		n++;
+	}
+
+	ret = nilfs_uring_read(nilfs->n_uring, nilfs->n_devfd, ios, n);
+	if (unlikely(ret < 0)) {
+		nilfs_uring_destroy(nilfs->n_uring);
+		nilfs->n_uring = NULL;
+		nilfs->n_uring_failed = 1;
+		goto out;
+	}
+
+	for (i = 0, n = 0; i < nreqs; i++) {
+		if (reqs[i].result < 0 || reqs[i].buf == NULL)
+			continue;
+		reqs[i].result = ios[n++].result;
+	}
+out:
+	free(ios);
+	return ret;
+}
+
+/**
+ * nilfs_read_segments - read ranges of segments in a batch
+ * @nilfs: nilfs object
+ * @reqs: array of segment read requests
+ * @nreqs: number of requests in @reqs
+ *
+ * nilfs_read_segments() reads the ranges given by @reqs into their
+ * buffers.  The reads are submitted through io_uring, keeping up to the
+ * read depth (see nilfs_set_read_depth()) of them in flight, so that the
+ * device can serve them in parallel.  If io_uring is not available, the
+ * ranges are read one by one with pread() instead, after requesting
+ * readahead of the following ranges up to the read depth.  Requests
+ * without a buffer only issue readahead, which is useful to warm up
+ * segments that will be read with nilfs_get_segment() later.
+ *
+ * The result of each request is stored in its @result field.
+ *
+ * Return: 0 if all requests succeeded, or -1 with errno set to the
+ * error of the first failed request.
+ */
+int nilfs_read_segments(struct nilfs *nilfs, struct nilfs_segread *reqs,
+			size_t nreqs)
+{
+	off_t *starts;
+	size_t i, ahead;
+	ssize_t ret;
+	size_t done;
+	int err = 0;
+
+	if (unlikely(nilfs->n_devfd < 0 || nilfs->n_sb == NULL)) {
+		errno = EBADF;
+		return -1;
+	}
+	if (nreqs == 0)
+		return 0;
+
+	starts = malloc(sizeof(*starts) * nreqs);
+	if (unlikely(!starts))
+		return -1;
+
+	for (i = 0; i < nreqs; i++)
+		reqs[i].result = nilfs_segread_prepare(nilfs, &reqs[i],
+						       &starts[i]);
+
+	for (i = 0; i < nreqs; i++) {
+		if (reqs[i].buf == NULL)
+			nilfs_segread_advise(nilfs, &reqs[i], starts[i]);
+	}
+	if (nilfs_read_segments_uring(nilfs, reqs, starts, nreqs) == 0) {
+		for (i = 0; i < nreqs; i++) {
+			if (reqs[i].result < 0 && !err)
+				err = -reqs[i].result;
+		}
+		goto out;
+	}
+
+	ahead = 0;
+	for (i = 0; i < nreqs; i++) {
+		while (ahead < nreqs && ahead <= i + nilfs->n_read_depth) {
+			if (reqs[ahead].buf)
+				nilfs_segread_advise(nilfs, &reqs[ahead],
+						     starts[ahead]);
+			ahead++;
+		}
+		if (reqs[i].result < 0 || reqs[i].buf == NULL)
+			goto next;
+
+		done = 0;
+		while (done < reqs[i].length) {
+			ret = pread(nilfs->n_devfd, reqs[i].buf + done,
+				    reqs[i].length - done, starts[i] + done);
+			if (unlikely(ret < 0)) {
+				if (errno == EINTR)
+					continue;
+				reqs[i].result = -errno;
+				goto next;
+			}
+			if (ret == 0)
+				break;	/* beyond the end of device */
+			done += ret;
+		}
+		reqs[i].result = done;
+next:
+		if (reqs[i].result < 0 && !err)
+			err = -reqs[i].result;
+	}
+out:
+	free(starts);
+
+	if (err) {
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * nilfs_set_read_depth - set queue depth of nilfs_read_segments()
+ * @nilfs: nilfs object
+ * @depth: number of reads kept in flight
+ *
+ * A depth of one or less makes nilfs_read_segments() read the ranges
+ * synchronously without io_uring.
+ *
+ * Return: 0 on success.
+ */
+int nilfs_set_read_depth(struct nilfs *nilfs, unsigned int depth)
+{
+	if (nilfs->n_uring && depth != nilfs->n_read_depth) {
+		/* set up again with the new depth on the next read */
+		nilfs_uring_destroy(nilfs->n_uring);
+		nilfs->n_uring = NULL;
+	}
+	nilfs->n_read_depth = depth;
+	return 0;
+}
+
+/**
+ * nilfs_set_segbuf_pool_size - set capacity of segment buffer pool
+ * @nilfs: nilfs object
+ * @nbufs: maximum number of free buffers kept for segment reads
+ *
+ * nilfs_get_segment() reads segments into page-aligned buffers taken
+ * from a pool owned by @nilfs unless the segment is mapped with mmap(),
+ * and nilfs_put_segment() returns them to the pool.  Setting @nbufs to
+ * zero disables the reuse of buffers.
+ *
+ * Return: 0 on success.
+ */
+int nilfs_set_segbuf_pool_size(struct nilfs *nilfs, unsigned int nbufs)
+{
+	struct nilfs_segbuf *list = NULL;
+
+	pthread_mutex_lock(&nilfs_segbuf_lock);
+	nilfs->n_segpool_capacity = nbufs;
+	if (nilfs->n_segpool) {
+		nilfs->n_segpool->capacity = nbufs;
+		list = nilfs_segbuf_pool_shrink(nilfs->n_segpool, nbufs);
+	}
+	pthread_mutex_unlock(&nilfs_segbuf_lock);
+
+	nilfs_segbuf_destroy(list);
+	return 0;
+}
+
+/**
+ * nilfs_get_segbuf_stat - get statistics of segment buffer pool
+ * @nilfs: nilfs object
+ * @stat: buffer to store the statistics
+ *
+ * Return: 0 on success.
+ */
+int nilfs_get_segbuf_stat(const struct nilfs *nilfs,
+			  struct nilfs_segbuf_stat *stat)
+{
+	const struct nilfs_segbuf_pool *pool;
+
+	memset(stat, 0, sizeof(*stat));
+	pthread_mutex_lock(&nilfs_segbuf_lock);
+	pool = nilfs->n_segpool;
+	stat->capacity = nilfs->n_segpool_capacity;
+	if (pool) {
+		stat->hits = pool->hits;
+		stat->misses = pool->misses;
+		stat->nbufs = pool->nfree;
+	}
+	pthread_mutex_unlock(&nilfs_segbuf_lock);
 	return 0;
 }
 
@@ -1163,6 +2025,119 @@ int nilfs_get_segment_seqnum(const struct nilfs *nilfs, uint64_t segnum,
 	return 0;
 }
 
+/**
+ * nilfs_get_segment_seqnums - get sequence numbers of segments in a batch
+ * @nilfs: nilfs object
+ * @segnums: array of segment numbers
+ * @lastmods: array of modification times of the segments, or %NULL
+ * @seqnums: array to store the sequence numbers in
+ * @nsegs: number of items in the arrays
+ *
+ * nilfs_get_segment_seqnums() reads the sequence numbers of the
+ * segments given by @segnums in ascending order of segment number with
+ * nilfs_read_segments(), so that the reads are submitted in a batch
+ * instead of one synchronous read per segment.
+ *
+ * If @lastmods is given, the numbers are also kept in a per-object
+ * cache keyed by segment number, and an entry is reused as long as the
+ * modification time of the segment (sui_lastmod of its usage) is
+ * unchanged.  Segments whose modification time is zero, or not older
+ * than the second in which the summaries are read, are not cached,
+ * because they may be reallocated again without changing it.
+ *
+ * Return: 0 on success, or -1 with errno set on failure.
+ */
+int nilfs_get_segment_seqnums(struct nilfs *nilfs, const uint64_t *segnums,
+			      const uint64_t *lastmods, uint64_t *seqnums,
+			      size_t nsegs)
+{
+	struct nilfs_seqcache_entry *ent;
+	struct nilfs_segidx *order = NULL;
+	struct nilfs_segread *reqs = NULL;
+	__le64 *bufs = NULL;
+	uint64_t nsegments = nilfs_get_nsegments(nilfs);
+	uint64_t now;
+	size_t i, n;
+	int ret = -1;
+
+	if (unlikely(nilfs->n_devfd < 0 || nilfs->n_sb == NULL)) {
+		errno = EBADF;
+		return -1;
+	}
+	for (i = 0; i < nsegs; i++) {
+		if (unlikely(segnums[i] >= nsegments)) {
+			errno = EINVAL;
+			return -1;
+		}
+	}
+	if (nsegs == 0)
+		return 0;
+
+	if (lastmods && !nilfs->n_seqcache) {
+		/* the cache is an optimization; go on without it on failure */
+		nilfs->n_seqcache = calloc(NILFS_SEQCACHE_SIZE,
+					   sizeof(*nilfs->n_seqcache));
+	}
+
+	order = malloc(sizeof(*order) * nsegs);
+	reqs = malloc(sizeof(*reqs) * nsegs);
+	bufs = malloc(sizeof(*bufs) * nsegs);
+	if (unlikely(!order || !reqs || !bufs))
+		goto out;
+
+	for (i = 0, n = 0; i < nsegs; i++) {
+		if (lastmods && lastmods[i] && nilfs->n_seqcache) {
+			ent = &nilfs->n_seqcache[segnums[i] %
+						 NILFS_SEQCACHE_SIZE];
+			if (ent->segnum == segnums[i] &&
+			    ent->lastmod == lastmods[i]) {
+				seqnums[i] = ent->seqnum;
+				continue;
+			}
+		}
+		order[n].segnum = segnums[i];
+		order[n].index = i;
+		n++;
+	}
+	qsort(order, n, sizeof(*order), nilfs_segidx_cmp);
+
+	/* taken before the reads, so that it never exceeds their time */
+	now = time(NULL);
+
+	for (i = 0; i < n; i++) {
+		reqs[i].segnum = order[i].segnum;
+		reqs[i].offset = offsetof(struct nilfs_segment_summary,
+					  ss_seq);
+		reqs[i].length = sizeof(bufs[i]);
+		reqs[i].buf = &bufs[i];
+	}
+	if (unlikely(nilfs_read_segments(nilfs, reqs, n) < 0))
+		goto out;
+
+	for (i = 0; i < n; i++) {
+		if (unlikely(reqs[i].result < sizeof(bufs[i]))) {
+			errno = EIO;
+			goto out;
+		}
+		seqnums[order[i].index] = le64_to_cpu(bufs[i]);
+
+		if (lastmods && lastmods[order[i].index] &&
+		    lastmods[order[i].index] < now && nilfs->n_seqcache) {
+			ent = &nilfs->n_seqcache[order[i].segnum %
+						 NILFS_SEQCACHE_SIZE];
+			ent->segnum = order[i].segnum;
+			ent->lastmod = lastmods[order[i].index];
+			ent->seqnum = seqnums[order[i].index];
+		}
+	}
+	ret = 0;
+out:
+	free(bufs);
+	free(reqs);
+	free(order);
+	return ret;
+}
+
 nilfs_cno_t nilfs_get_oldest_cno(struct nilfs *nilfs)
 {
 	struct nilfs_cpinfo cpinfo[1];
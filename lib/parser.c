@@ -34,6 +34,10 @@
 #include <limits.h>
 #endif	/* HAVE_LIMITS_H */
 
+#if HAVE_TIME_H
+#include <time.h>
+#endif	/* HAVE_TIME_H */
+
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
@@ -158,3 +162,170 @@ int nilfs_parse_protection_period(const char *arg, unsigned long *period)
 out:
 	return ret;
 }
+
+/**
+ * nilfs_parse_size - parse a size in bytes
+ * @arg: string to be parsed
+ * @sizep: place to store the size in bytes
+ *
+ * nilfs_parse_size() accepts a number optionally suffixed by 'K', 'M',
+ * or 'G' for kibibytes, mebibytes, or gibibytes, respectively.
+ *
+ * Return: 0 on success, or -1 with errno set if @arg is invalid.
+ */
+int nilfs_parse_size(const char *arg, uint64_t *sizep)
+{
+	unsigned long long val;
+	char *endptr;
+	int shift = 0;
+
+	while (isspace(*arg))
+		arg++;
+
+	if (*arg == '-')
+		goto invalid;
+
+	errno = 0;
+	val = strtoull(arg, &endptr, 0);
+	if (endptr == arg)
+		goto invalid;
+	if (errno)
+		return -1;
+
+	if (endptr[0] != '\0') {
+		if (endptr[1] != '\0')
+			goto invalid;
+		switch (endptr[0]) {
+		case 'K':
+			shift = 10;
+			break;
+		case 'M':
+			shift = 20;
+			break;
+		case 'G':
+			shift = 30;
+			break;
+		default:
+			goto invalid;
+		}
+		if (val > (UINT64_MAX >> shift)) {
+			errno = ERANGE;
+			return -1;
+		}
+	}
+	*sizep = (uint64_t)val << shift;
+	return 0;
+
+invalid:
+	errno = EINVAL;
+	return -1;
+}
+
+/**
+ * nilfs_parse_time - parse a point in time
+ * @arg: string to be parsed
+ * @timep: place to store the time in seconds since the Epoch
+ *
+ * nilfs_parse_time() accepts a local date and time in the form of
+ * "YYYY-MM-DD[ HH:MM[:SS]]" (a 'T' can be used instead of the space),
+ * "@SECONDS" for seconds since the Epoch, "now", or "-INTERVAL" for a
+ * time INTERVAL before now, where INTERVAL takes the units accepted by
+ * nilfs_parse_protection_period().
+ *
+ * Return: 0 on success, or -1 with errno set if @arg is invalid.
+ */
+int nilfs_parse_time(const char *arg, int64_t *timep)
+{
+	unsigned long period;
+	long long val;
+	struct tm tm;
+	char *endptr;
+	time_t t;
+	int n = 0;
+
+	while (isspace(*arg))
+		arg++;
+
+	if (strcmp(arg, "now") == 0) {
+		*timep = time(NULL);
+		return 0;
+	}
+
+	if (*arg == '-') {
+		if (nilfs_parse_protection_period(arg + 1, &period) < 0)
+			return -1;
+		*timep = (int64_t)time(NULL) - (int64_t)period;
+		return 0;
+	}
+
+	if (*arg == '@') {
+		errno = 0;
+		val = strtoll(arg + 1, &endptr, 10);
+		if (endptr == arg + 1 || *endptr != '\0') {
+			errno = EINVAL;
+			return -1;
+		}
+		if (errno)
+			return -1;
+		*timep = val;
+		return 0;
+	}
+
+	memset(&tm, 0, sizeof(tm));
+	if (sscanf(arg, "%4d-%2d-%2d%n", &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+		   &n) != 3)
+		goto invalid;
+	arg += n;
+	if (*arg == ' ' || *arg == 'T') {
+		n = 0;
+		if (sscanf(arg + 1, "%2d:%2d%n", &tm.tm_hour, &tm.tm_min,
+			   &n) != 2)
+			goto invalid;
+		arg += n + 1;
+		if (*arg == ':') {
+			n = 0;
+			if (sscanf(arg + 1, "%2d%n", &tm.tm_sec, &n) != 1)
+				goto invalid;
+			arg += n + 1;
+		}
+	}
+	if (*arg != '\0' || tm.tm_mon < 1 || tm.tm_mon > 12 ||
+	    tm.tm_mday < 1 || tm.tm_mday > 31 || tm.tm_hour > 23 ||
+	    tm.tm_min > 59 || tm.tm_sec > 60)
+		goto invalid;
+
+	tm.tm_year -= 1900;
+	tm.tm_mon--;
+	tm.tm_isdst = -1;
+	t = mktime(&tm);
+	if (t == (time_t)-1)
+		goto invalid;
+	*timep = t;
+	return 0;
+
+invalid:
+	errno = EINVAL;
+	return -1;
+}
+
+/**
+ * nilfs_interval_start - get the start time of the interval including a time
+ * @t: time in seconds since the Epoch
+ * @interval: length of the interval in seconds
+ *
+ * Intervals are aligned to the local time so that, for instance, daily
+ * intervals start at midnight.
+ *
+ * Return: start time of the interval in seconds since the Epoch.
+ */
+int64_t nilfs_interval_start(int64_t t, unsigned long interval)
+{
+	struct tm tm;
+	time_t tt = (time_t)t;
+	int64_t local;
+
+	localtime_r(&tt, &tm);
+	local = t + tm.tm_gmtoff;
+	local -= ((local % (int64_t)interval) + interval) % interval;
+	return local - tm.tm_gmtoff;
+}
@@ -0,0 +1,794 @@
+/*
+ * scrub.c - NILFS segment scrubber
+ *
+ * Licensed under LGPLv2: the complete text of the GNU Lesser General
+ * Public License can be found in COPYING file of the nilfs-utils
+ * package.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif	/* HAVE_CONFIG_H */
+
+#if HAVE_STDLIB_H
+#include <stdlib.h>
+#endif	/* HAVE_STDLIB_H */
+
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif	/* HAVE_UNISTD_H */
+
+#if HAVE_FCNTL_H
+#include <fcntl.h>
+#endif	/* HAVE_FCNTL_H */
+
+#if HAVE_STRING_H
+#include <string.h>
+#endif	/* HAVE_STRING_H */
+
+#if HAVE_TIME_H
+#include <time.h>	/* clock_gettime(), nanosleep() */
+#endif	/* HAVE_TIME_H */
+
+#if HAVE_SYSLOG_H
+#include <syslog.h>	/* LOG_ERR */
+#endif	/* HAVE_SYSLOG_H */
+
+#include <sys/stat.h>
+#include <pthread.h>
+#include <signal.h>	/* sig_atomic_t */
+#include <errno.h>
+#include "compat.h"
+#include "util.h"
+#include "nilfs.h"
+#include "nilfs_gc.h"	/* nilfs_suinfo_reclaimable() */
+#include "nilfs_scrub.h"
+#include "segment.h"
+#include "statefile.h"
+
+#define NILFS_SCRUB_NSUINFO		512
+#define NILFS_SCRUB_MAX_JOBS		64
+#define NILFS_SCRUB_SAVE_INTERVAL	30	/* seconds */
+#define NILFS_SCRUB_IDLE		UINT64_MAX
+
+#define NILFS_SCRUB_MAGIC	0x53435242	/* "SCRB" */
+#define NILFS_SCRUB_VERSION	1
+
+/**
+ * struct nilfs_scrub_progress - contents of progress file
+ * @magic: magic number (NILFS_SCRUB_MAGIC)
+ * @version: format version of the progress file
+ * @pad: padding (zero)
+ * @uuid: 128-bit uuid of the file system
+ * @cursor: segment number from which the scrubbing resumes
+ * @npasses: number of passes completed so far
+ * @nerrors: number of corrupted logs found so far
+ *
+ * The file is written in the host byte order.  A file which fails to
+ * validate is ignored, and scrubbing starts over from segment 0.
+ */
+struct nilfs_scrub_progress {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t pad;
+	unsigned char uuid[16];
+	uint64_t cursor;
+	uint64_t npasses;
+	uint64_t nerrors;
+};
+
+/* Segment scrubber */
+struct nilfs_scrub {
+	struct nilfs *nilfs;
+	pthread_mutex_t lock;		/* Serializes calls on nilfs */
+
+	uint64_t nsegments;		/* Number of segments */
+	uint64_t cursor;		/* Next segment to be examined */
+	uint64_t nrest;			/* Remaining segments in this run */
+	uint64_t *inflight;		/* Segments being verified per job */
+	unsigned int njobs;		/* Number of parallel jobs */
+
+	struct nilfs_suinfo si[NILFS_SCRUB_NSUINFO];
+	uint64_t si_start;		/* Segment number of si[0] */
+	size_t si_count;		/* Number of valid entries in si[] */
+
+	uint64_t rate;			/* Bandwidth limit (bytes/sec) */
+	struct timespec next_slot;	/* Start time of the next read */
+
+	char *progress_path;		/* Path of the progress file */
+	int progress_flags;		/* NILFS_SCRUB_PROGRESS_* flags */
+	unsigned char uuid[16];		/* uuid of the file system */
+	struct timespec last_save;	/* Time of the last save */
+
+	nilfs_scrub_report_t *report;	/* Reporter of corrupted logs */
+	void *report_arg;		/* Argument of the reporter */
+
+	struct nilfs_scrub_stat stat;
+	uint64_t nverified;		/* Segments verified in this run */
+	int errsv;			/* First error seen by the jobs */
+	volatile sig_atomic_t stopped;	/* Stop request */
+};
+
+/**
+ * struct nilfs_scrub_job - argument of a scrubbing thread
+ * @scrub: scrubber
+ * @index: job index
+ */
+struct nilfs_scrub_job {
+	struct nilfs_scrub *scrub;
+	unsigned int index;
+};
+
+static void nilfs_scrub_default_report(const struct nilfs_scrub_error *error,
+				       void *arg)
+{
+	nilfs_gc_logger(LOG_ERR, "segment %" PRIu64 ": log at block %" PRIu64
+			": %s (%zu inodes affected)", error->segnum,
+			error->blocknr, error->errstr, error->ninos);
+}
+
+/**
+ * nilfs_scrub_create - create a segment scrubber
+ * @nilfs: nilfs object opened with NILFS_OPEN_RAW
+ *
+ * The scrubber walks the dirty segments of @nilfs in ascending order of
+ * segment number and verifies the data checksum of every log in them.
+ * While nilfs_scrub_run() is in progress, @nilfs must not be used by
+ * other threads.
+ *
+ * Return: the new scrubber on success, or NULL with errno set on failure.
+ */
+struct nilfs_scrub *nilfs_scrub_create(struct nilfs *nilfs)
+{
+	struct nilfs_scrub *scrub;
+	int ret;
+
+	scrub = malloc(sizeof(*scrub));
+	if (unlikely(!scrub))
+		return NULL;
+
+	memset(scrub, 0, sizeof(*scrub));
+	scrub->nilfs = nilfs;
+	scrub->nsegments = nilfs_get_nsegments(nilfs);
+	scrub->njobs = 1;
+	scrub->report = nilfs_scrub_default_report;
+
+	scrub->inflight = malloc(sizeof(*scrub->inflight));
+	if (unlikely(!scrub->inflight))
+		goto failed;
+	scrub->inflight[0] = NILFS_SCRUB_IDLE;
+
+	ret = pthread_mutex_init(&scrub->lock, NULL);
+	if (unlikely(ret)) {
+		errno = ret;
+		goto failed_inflight;
+	}
+	return scrub;
+
+failed_inflight:
+	free(scrub->inflight);
+failed:
+	free(scrub);
+	return NULL;
+}
+
+/**
+ * nilfs_scrub_destroy - destroy a segment scrubber
+ * @scrub: scrubber
+ */
+void nilfs_scrub_destroy(struct nilfs_scrub *scrub)
+{
+	if (scrub) {
+		pthread_mutex_destroy(&scrub->lock);
+		free(scrub->progress_path);
+		free(scrub->inflight);
+		free(scrub);
+	}
+}
+
+/**
+ * nilfs_scrub_load_progress - restore the position from the progress file
+ * @scrub: scrubber
+ */
+static int nilfs_scrub_load_progress(struct nilfs_scrub *scrub)
+{
+	struct nilfs_scrub_progress prog;
+	ssize_t nr;
+	int fd;
+
+	fd = open(scrub->progress_path, O_RDONLY);
+	if (fd < 0)
+		return errno == ENOENT ? 0 : -1;
+
+	nr = read(fd, &prog, sizeof(prog));
+	close(fd);
+	if (nr != sizeof(prog) || prog.magic != NILFS_SCRUB_MAGIC ||
+	    prog.version != NILFS_SCRUB_VERSION ||
+	    memcmp(prog.uuid, scrub->uuid, sizeof(prog.uuid)) != 0)
+		return 0;	/* start over */
+
+	/* The volume may have been shrunk since the last save */
+	scrub->cursor = prog.cursor < scrub->nsegments ? prog.cursor : 0;
+	scrub->stat.npasses = prog.npasses;
+	scrub->stat.nerrors = prog.nerrors;
+	scrub->si_count = 0;
+	return 0;
+}
+
+/**
+ * nilfs_scrub_set_progress - make scrubbing resumable
+ * @scrub: scrubber
+ * @dir: directory of progress files [optional]
+ * @flags: NILFS_SCRUB_PROGRESS_* flags
+ *
+ * nilfs_scrub_set_progress() makes @scrub record its position in a file
+ * named after the uuid of the file system under @dir (or the default
+ * directory if @dir is NULL).  The position saved by a previous run is
+ * restored unless NILFS_SCRUB_PROGRESS_RESET is given.  Unless
+ * NILFS_SCRUB_PROGRESS_RDONLY is given, the position is saved
+ * periodically while scrubbing and at the end of every nilfs_scrub_run()
+ * call.
+ *
+ * Return: 0 on success, or -1 with errno set on failure.
+ */
+int nilfs_scrub_set_progress(struct nilfs_scrub *scrub, const char *dir,
+			     int flags)
+{
+	char *path;
+	int ret;
+
+	ret = nilfs_get_uuid(scrub->nilfs, scrub->uuid, sizeof(scrub->uuid));
+	if (unlikely(ret < 0))
+		return -1;
+
+	path = nilfs_state_path(dir, scrub->uuid, "scrub",
+				!(flags & NILFS_SCRUB_PROGRESS_RDONLY));
+	if (unlikely(!path))
+		return -1;
+
+	free(scrub->progress_path);
+	scrub->progress_path = path;
+	scrub->progress_flags = flags;
+
+	if (flags & NILFS_SCRUB_PROGRESS_RESET)
+		return 0;
+	return nilfs_scrub_load_progress(scrub);
+}
+
+/**
+ * nilfs_scrub_resume_point - get the segment number to resume from
+ * @scrub: scrubber
+ *
+ * Segments being verified by jobs are not done yet, so the position to
+ * be saved is the smallest of them, or the cursor if all jobs are idle.
+ */
+static uint64_t nilfs_scrub_resume_point(const struct nilfs_scrub *scrub)
+{
+	uint64_t segnum = scrub->cursor;
+	unsigned int i;
+
+	for (i = 0; i < scrub->njobs; i++) {
+		if (scrub->inflight[i] < segnum)
+			segnum = scrub->inflight[i];
+	}
+	return segnum;
+}
+
+static int nilfs_scrub_save_progress_locked(struct nilfs_scrub *scrub)
+{
+	struct nilfs_scrub_progress prog;
+	struct iovec iov;
+
+	if (!scrub->progress_path ||
+	    (scrub->progress_flags & NILFS_SCRUB_PROGRESS_RDONLY))
+		return 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &scrub->last_save);
+
+	memset(&prog, 0, sizeof(prog));
+	prog.magic = NILFS_SCRUB_MAGIC;
+	prog.version = NILFS_SCRUB_VERSION;
+	memcpy(prog.uuid, scrub->uuid, sizeof(prog.uuid));
+	prog.cursor = nilfs_scrub_resume_point(scrub);
+	prog.npasses = scrub->stat.npasses;
+	prog.nerrors = scrub->stat.nerrors;
+
+	iov.iov_base = &prog;
+	iov.iov_len = sizeof(prog);
+	return nilfs_state_save(scrub->progress_path, &iov, 1);
+}
+
+/**
+ * nilfs_scrub_save_progress - save the current position of the scrubber
+ * @scrub: scrubber
+ *
+ * Return: 0 on success, or -1 with errno set on failure.
+ */
+int nilfs_scrub_save_progress(struct nilfs_scrub *scrub)
+{
+	int ret;
+
+	pthread_mutex_lock(&scrub->lock);
+	ret = nilfs_scrub_save_progress_locked(scrub);
+	pthread_mutex_unlock(&scrub->lock);
+	return ret;
+}
+
+/**
+ * nilfs_scrub_set_bandwidth - limit the read bandwidth of the scrubber
+ * @scrub: scrubber
+ * @rate: bytes per second, or 0 for no limit
+ */
+void nilfs_scrub_set_bandwidth(struct nilfs_scrub *scrub, uint64_t rate)
+{
+	scrub->rate = rate;
+	timespecclear(&scrub->next_slot);
+}
+
+/**
+ * nilfs_scrub_set_jobs - set the number of segments verified in parallel
+ * @scrub: scrubber
+ * @njobs: number of jobs
+ *
+ * Return: 0 on success, or -1 with errno set on failure.
+ */
+int nilfs_scrub_set_jobs(struct nilfs_scrub *scrub, unsigned int njobs)
+{
+	uint64_t *inflight;
+	unsigned int i;
+
+	if (unlikely(njobs == 0 || njobs > NILFS_SCRUB_MAX_JOBS)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	inflight = realloc(scrub->inflight, sizeof(*inflight) * njobs);
+	if (unlikely(!inflight))
+		return -1;
+
+	for (i = 0; i < njobs; i++)
+		inflight[i] = NILFS_SCRUB_IDLE;
+	scrub->inflight = inflight;
+	scrub->njobs = njobs;
+	return 0;
+}
+
+/**
+ * nilfs_scrub_set_reporter - set the callback reporting corrupted logs
+ * @scrub: scrubber
+ * @report: callback function (NULL to restore the default one)
+ * @arg: argument passed to @report
+ *
+ * @report is called with the scrubber locked, so calls are serialized
+ * even if jobs run in parallel.  The default reporter logs a message
+ * through nilfs_gc_logger.
+ */
+void nilfs_scrub_set_reporter(struct nilfs_scrub *scrub,
+			      nilfs_scrub_report_t *report, void *arg)
+{
+	scrub->report = report ? : nilfs_scrub_default_report;
+	scrub->report_arg = arg;
+}
+
+/**
+ * nilfs_scrub_get_cursor - get the segment number to be examined next
+ * @scrub: scrubber
+ */
+uint64_t nilfs_scrub_get_cursor(const struct nilfs_scrub *scrub)
+{
+	return scrub->cursor;
+}
+
+/**
+ * nilfs_scrub_get_stat - get statistics of the scrubber
+ * @scrub: scrubber
+ * @stat: buffer to store the statistics
+ */
+void nilfs_scrub_get_stat(const struct nilfs_scrub *scrub,
+			  struct nilfs_scrub_stat *stat)
+{
+	*stat = scrub->stat;
+}
+
+/**
+ * nilfs_scrub_stop - ask the running scrubber to stop
+ * @scrub: scrubber
+ *
+ * Jobs stop after finishing the segments they are verifying.  This is
+ * async-signal-safe, so it can be called from a signal handler.
+ */
+void nilfs_scrub_stop(struct nilfs_scrub *scrub)
+{
+	scrub->stopped = 1;
+}
+
+/**
+ * nilfs_scrub_lookup_suinfo - get segment usage of a segment
+ * @scrub: scrubber (locked)
+ * @segnum: segment number
+ * @si: buffer to store the segment usage
+ *
+ * Segment usages are read in batches of NILFS_SCRUB_NSUINFO entries
+ * since the scrubber examines segments in ascending order.
+ */
+static int nilfs_scrub_lookup_suinfo(struct nilfs_scrub *scrub,
+				     uint64_t segnum, struct nilfs_suinfo *si)
+{
+	ssize_t n;
+
+	if (segnum < scrub->si_start ||
+	    segnum >= scrub->si_start + scrub->si_count) {
+		n = nilfs_get_suinfo(scrub->nilfs, segnum, scrub->si,
+				     NILFS_SCRUB_NSUINFO);
+		if (unlikely(n <= 0)) {
+			scrub->si_count = 0;
+			if (n == 0)
+				errno = EINVAL;
+			return -1;
+		}
+		scrub->si_start = segnum;
+		scrub->si_count = n;
+	}
+	*si = scrub->si[segnum - scrub->si_start];
+	return 0;
+}
+
+/**
+ * nilfs_scrub_next_segment - pick the next segment to be verified
+ * @scrub: scrubber (locked)
+ * @segnump: place to store the segment number
+ * @si: place to store the segment usage of the segment
+ *
+ * Return: 1 if a segment is picked, 0 if there is nothing to do in this
+ * run, or -1 with errno set on failure.
+ */
+static int nilfs_scrub_next_segment(struct nilfs_scrub *scrub,
+				    uint64_t *segnump,
+				    struct nilfs_suinfo *si)
+{
+	uint64_t segnum;
+
+	while (!scrub->stopped && scrub->nrest > 0) {
+		if (scrub->cursor >= scrub->nsegments) {
+			/*
+			 * A pass over the whole volume has completed; end
+			 * this run for the other jobs as well.
+			 */
+			scrub->cursor = 0;
+			scrub->stat.npasses++;
+			scrub->nrest = 0;
+			return 0;
+		}
+
+		segnum = scrub->cursor;
+		if (unlikely(nilfs_scrub_lookup_suinfo(scrub, segnum, si) < 0))
+			return -1;
+		scrub->cursor++;
+
+		/*
+		 * The active segments are still being written, and the
+		 * scrapped ones have no valid logs.
+		 */
+		if (nilfs_suinfo_reclaimable(si) && !nilfs_suinfo_empty(si)) {
+			*segnump = segnum;
+			scrub->nrest--;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * nilfs_scrub_throttle - wait until the bandwidth limit allows a read
+ * @scrub: scrubber
+ * @bytes: size of the read
+ */
+static void nilfs_scrub_throttle(struct nilfs_scrub *scrub, uint64_t bytes)
+{
+	struct timespec now, wait, delta;
+	double secs;
+
+	if (scrub->rate == 0)
+		return;
+
+	secs = (double)bytes / scrub->rate;
+	delta.tv_sec = (time_t)secs;
+	delta.tv_nsec = (long)((secs - delta.tv_sec) * 1000000000);
+
+	pthread_mutex_lock(&scrub->lock);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (timespeccmp(&scrub->next_slot, &now, <))
+		scrub->next_slot = now;
+	timespecsub(&scrub->next_slot, &now, &wait);
+	timespecadd(&scrub->next_slot, &delta, &scrub->next_slot);
+	pthread_mutex_unlock(&scrub->lock);
+
+	while (timespecisset(&wait) && !scrub->stopped &&
+	       nanosleep(&wait, &wait) < 0 && errno == EINTR)
+		;
+}
+
+/**
+ * nilfs_scrub_collect_inodes - list inodes having blocks in a log
+ * @pseg: partial segment iterator
+ * @inosp: place to store the array of inode numbers
+ *
+ * Return: number of inodes stored in the newly allocated array @inosp,
+ * or 0 if the finfo array is not readable.
+ */
+static size_t nilfs_scrub_collect_inodes(const struct nilfs_psegment *pseg,
+					 uint64_t **inosp)
+{
+	struct nilfs_file file;
+	uint64_t *inos, ino;
+	size_t n = 0, i;
+
+	inos = malloc(sizeof(*inos) * le32_to_cpu(pseg->segsum->ss_nfinfo));
+	if (unlikely(!inos))
+		return 0;
+
+	nilfs_file_for_each(&file, pseg) {
+		ino = le64_to_cpu(file.finfo->fi_ino);
+		for (i = 0; i < n && inos[i] != ino; i++)
+			;
+		if (i == n)
+			inos[n++] = ino;
+	}
+	*inosp = inos;
+	return n;
+}
+
+/**
+ * nilfs_scrub_segment_changed - check if a segment was reused meanwhile
+ * @scrub: scrubber (locked)
+ * @segnum: segment number
+ * @si: segment usage read before the verification
+ *
+ * The garbage collector may free and reuse a segment while it is being
+ * verified.  Mismatches found in such a segment are not reported.
+ */
+static int nilfs_scrub_segment_changed(struct nilfs_scrub *scrub,
+				       uint64_t segnum,
+				       const struct nilfs_suinfo *si)
+{
+	struct nilfs_suinfo si2;
+
+	if (nilfs_get_suinfo(scrub->nilfs, segnum, &si2, 1) != 1)
+		return 1;
+	return !nilfs_suinfo_reclaimable(&si2) ||
+		si2.sui_lastmod != si->sui_lastmod ||
+		si2.sui_nblocks != si->sui_nblocks;
+}
+
+static void nilfs_scrub_report_error(struct nilfs_scrub *scrub,
+				     const struct nilfs_psegment *pseg,
+				     uint32_t nblocks, const char *errstr)
+{
+	struct nilfs_scrub_error error;
+	uint64_t *inos = NULL;
+
+	memset(&error, 0, sizeof(error));
+	error.segnum = pseg->segment->segnum;
+	error.blocknr = pseg->blocknr;
+	error.nblocks = nblocks;
+	error.errstr = errstr;
+	if (nblocks > 0) {
+		error.ninos = nilfs_scrub_collect_inodes(pseg, &inos);
+		error.inos = inos;
+	}
+
+	scrub->stat.nerrors++;
+	scrub->report(&error, scrub->report_arg);
+	free(inos);
+}
+
+/**
+ * struct nilfs_scrub_bad_log - log failed in verification
+ * @pseg: partial segment iterator at the log
+ * @nblocks: number of blocks in the log (0 if the summary is broken)
+ * @errstr: description of the problem
+ */
+struct nilfs_scrub_bad_log {
+	struct nilfs_psegment pseg;
+	uint32_t nblocks;
+	const char *errstr;
+};
+
+static int nilfs_scrub_add_bad_log(struct nilfs_scrub_bad_log **badp,
+				   size_t *nbadp,
+				   const struct nilfs_psegment *pseg,
+				   uint32_t nblocks, const char *errstr)
+{
+	struct nilfs_scrub_bad_log *bad;
+
+	bad = realloc(*badp, sizeof(*bad) * (*nbadp + 1));
+	if (unlikely(!bad))
+		return -1;
+	bad[*nbadp].pseg = *pseg;
+	bad[*nbadp].nblocks = nblocks;
+	bad[*nbadp].errstr = errstr;
+	*badp = bad;
+	(*nbadp)++;
+	return 0;
+}
+
+/**
+ * nilfs_scrub_segment - verify the logs in a segment
+ * @scrub: scrubber
+ * @segnum: segment number
+ * @si: segment usage of the segment
+ */
+static int nilfs_scrub_segment(struct nilfs_scrub *scrub, uint64_t segnum,
+			       const struct nilfs_suinfo *si)
+{
+	struct nilfs_scrub_bad_log *bad = NULL;
+	struct nilfs_segment segment;
+	struct nilfs_psegment pseg;
+	const char *errstr;
+	size_t nbad = 0, i;
+	uint64_t nlogs = 0;
+	uint32_t nblocks;
+	int ret;
+
+	pthread_mutex_lock(&scrub->lock);
+	ret = nilfs_get_segment(scrub->nilfs, segnum, &segment);
+	pthread_mutex_unlock(&scrub->lock);
+	if (unlikely(ret < 0))
+		return -1;
+
+	/* The checksums are computed without holding the lock */
+	nilfs_psegment_for_each(&pseg, &segment, si->sui_nblocks) {
+		nlogs++;
+		nblocks = le32_to_cpu(pseg.segsum->ss_nblocks);
+		if (unlikely(nblocks > pseg.blkcnt))
+			errstr = "log exceeds the segment usage";
+		else if (!nilfs_psegment_verify_datasum(&pseg))
+			errstr = "data checksum mismatch";
+		else
+			continue;
+
+		ret = nilfs_scrub_add_bad_log(&bad, &nbad, &pseg, nblocks,
+					      errstr);
+		if (unlikely(ret < 0))
+			goto out;
+	}
+	if (nilfs_psegment_is_error(&pseg, &errstr) || pseg.blkcnt > 0) {
+		/*
+		 * The iteration stopped before reaching the end of the
+		 * blocks recorded in the segment usage.
+		 */
+		if (!pseg.error)
+			errstr = "broken segment summary";
+		ret = nilfs_scrub_add_bad_log(&bad, &nbad, &pseg, 0, errstr);
+		if (unlikely(ret < 0))
+			goto out;
+	}
+
+	pthread_mutex_lock(&scrub->lock);
+	if (nbad > 0 && nilfs_scrub_segment_changed(scrub, segnum, si)) {
+		scrub->stat.nskipped++;
+	} else {
+		for (i = 0; i < nbad; i++)
+			nilfs_scrub_report_error(scrub, &bad[i].pseg,
+						 bad[i].nblocks,
+						 bad[i].errstr);
+		scrub->stat.nsegs++;
+		scrub->stat.nlogs += nlogs;
+		scrub->stat.nbytes +=
+			(uint64_t)si->sui_nblocks << segment.blkbits;
+		scrub->nverified++;
+	}
+	pthread_mutex_unlock(&scrub->lock);
+out:
+	free(bad);
+	pthread_mutex_lock(&scrub->lock);
+	if (unlikely(nilfs_put_segment(&segment) < 0))
+		ret = -1;
+	pthread_mutex_unlock(&scrub->lock);
+	return ret;
+}
+
+/**
+ * nilfs_scrub_worker - body of a scrubbing job
+ * @arg: nilfs_scrub_job struct
+ */
+static void *nilfs_scrub_worker(void *arg)
+{
+	struct nilfs_scrub_job *job = arg;
+	struct nilfs_scrub *scrub = job->scrub;
+	struct nilfs_suinfo si;
+	struct timespec now;
+	uint64_t segnum;
+	int ret;
+
+	for (;;) {
+		pthread_mutex_lock(&scrub->lock);
+		scrub->inflight[job->index] = NILFS_SCRUB_IDLE;
+		ret = scrub->errsv ? 0 :
+			nilfs_scrub_next_segment(scrub, &segnum, &si);
+		if (ret > 0) {
+			scrub->inflight[job->index] = segnum;
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			if (now.tv_sec - scrub->last_save.tv_sec >=
+			    NILFS_SCRUB_SAVE_INTERVAL)
+				nilfs_scrub_save_progress_locked(scrub);
+		} else if (ret < 0 && !scrub->errsv) {
+			scrub->errsv = errno;
+		}
+		pthread_mutex_unlock(&scrub->lock);
+		if (ret <= 0)
+			break;
+
+		nilfs_scrub_throttle(scrub, (uint64_t)si.sui_nblocks *
+				     nilfs_get_block_size(scrub->nilfs));
+
+		ret = nilfs_scrub_segment(scrub, segnum, &si);
+		if (unlikely(ret < 0)) {
+			pthread_mutex_lock(&scrub->lock);
+			if (!scrub->errsv)
+				scrub->errsv = errno;
+			scrub->inflight[job->index] = NILFS_SCRUB_IDLE;
+			pthread_mutex_unlock(&scrub->lock);
+			break;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * nilfs_scrub_run - verify dirty segments
+ * @scrub: scrubber
+ * @nsegs: number of segments to be verified (0 for the rest of the pass)
+ *
+ * nilfs_scrub_run() verifies the data checksums of the logs in up to
+ * @nsegs dirty segments, starting from the segment at which the previous
+ * run stopped, with as many threads as set by nilfs_scrub_set_jobs().
+ * A run also ends when the scrubber reaches the end of the volume, in
+ * which case the next run starts a new pass from segment 0.  Corrupted
+ * logs are passed to the reporter.
+ *
+ * Return: number of verified segments on success, or -1 with errno set
+ * on failure.
+ */
+ssize_t nilfs_scrub_run(struct nilfs_scrub *scrub, uint64_t nsegs)
+{
+	struct nilfs_scrub_job jobs[NILFS_SCRUB_MAX_JOBS];
+	pthread_t threads[NILFS_SCRUB_MAX_JOBS];
+	unsigned int i, nthreads = 0;
+	int ret;
+
+	scrub->nrest = nsegs ? : UINT64_MAX;
+	scrub->nverified = 0;
+	scrub->errsv = 0;
+	scrub->stopped = 0;
+	clock_gettime(CLOCK_MONOTONIC, &scrub->last_save);
+
+	for (i = 0; i < scrub->njobs; i++) {
+		jobs[i].scrub = scrub;
+		jobs[i].index = i;
+	}
+
+	/* The calling thread runs the first job by itself */
+	for (i = 1; i < scrub->njobs; i++) {
+		ret = pthread_create(&threads[i], NULL, nilfs_scrub_worker,
+				     &jobs[i]);
+		if (unlikely(ret))
+			break;	/* go on with fewer jobs */
+		nthreads = i;
+	}
+	nilfs_scrub_worker(&jobs[0]);
+	for (i = 1; i <= nthreads; i++)
+		pthread_join(threads[i], NULL);
+
+	pthread_mutex_lock(&scrub->lock);
+	ret = nilfs_scrub_save_progress_locked(scrub);
+	pthread_mutex_unlock(&scrub->lock);
+
+	if (unlikely(scrub->errsv)) {
+		errno = scrub->errsv;
+		return -1;
+	}
+	if (unlikely(ret < 0))
+		return -1;
+	return scrub->nverified;
+}
@@ -13,6 +13,10 @@
 #include <stdlib.h>
 #endif	/* HAVE_STDLIB_H */
 
+#if HAVE_STRING_H
+#include <string.h>
+#endif	/* HAVE_STRING_H */
+
 #if HAVE_LINUX_TYPES_H
 #include <linux/types.h>
 #endif	/* HAVE_LINUX_TYPES_H */
@@ -181,6 +185,32 @@ const char *nilfs_psegment_strerror(int errnum)
 	return nilfs_psegment_error_strings[errnum];
 }
 
+/**
+ * nilfs_psegment_verify_datasum() - verify data checksum of a partial segment
+ * @pseg: partial segment iterator pointing to a valid log
+ *
+ * Computes the checksum over the whole log, i.e. the summary blocks and
+ * the payload blocks following the ss_datasum field, in the same way as
+ * the log writer, and compares it with ss_datasum.  @pseg must have been
+ * validated by the partial segment iterator.
+ *
+ * Return: %1 if the checksum matches, %0 otherwise.
+ */
+int nilfs_psegment_verify_datasum(const struct nilfs_psegment *pseg)
+{
+	const size_t offset = sizeof(pseg->segsum->ss_datasum);
+	uint32_t nblocks = le32_to_cpu(pseg->segsum->ss_nblocks);
+	size_t size = (size_t)nblocks << pseg->blkbits;
+
+	if (unlikely(nblocks > pseg->blkcnt))
+		return 0;	/* the log is not entirely in the buffer */
+
+	return le32_to_cpu(pseg->segsum->ss_datasum) ==
+		crc32_le(pseg->segment->seed,
+			 (unsigned char *)pseg->segsum + offset,
+			 size - offset);
+}
+
 /* nilfs_file */
 
 /**
@@ -513,3 +543,296 @@ void nilfs_block_next(struct nilfs_block *blk)
 
 	nilfs_block_adjust_binfo_position(blk, blksize);
 }
+
+/* nilfs_binfo_columns */
+
+/* Layouts of block information entries */
+enum {
+	NILFS_BINFO_KIND_DATA,		/* struct nilfs_binfo_v */
+	NILFS_BINFO_KIND_NODE,		/* virtual block number */
+	NILFS_BINFO_KIND_DAT_DATA,	/* block offset */
+	NILFS_BINFO_KIND_DAT_NODE,	/* struct nilfs_binfo_dat */
+};
+
+#define NILFS_BINFO_COLUMNS_INIT_CAPACITY	256
+
+/**
+ * nilfs_binfo_columns_init() - initialize block information columns
+ * @cols: columns to be initialized
+ */
+void nilfs_binfo_columns_init(struct nilfs_binfo_columns *cols)
+{
+	memset(cols, 0, sizeof(*cols));
+}
+
+/**
+ * nilfs_binfo_columns_destroy() - free memory held by columns
+ * @cols: columns
+ */
+void nilfs_binfo_columns_destroy(struct nilfs_binfo_columns *cols)
+{
+	free(cols->ino);
+	free(cols->cno);
+	free(cols->vblocknr);
+	free(cols->offset);
+	free(cols->blocknr);
+	free(cols->flags);
+	free(cols->level);
+	nilfs_binfo_columns_init(cols);
+}
+
+static int nilfs_binfo_column_resize(void **column, size_t elemsize,
+				     size_t nelems)
+{
+	void *p;
+
+	p = realloc(*column, elemsize * nelems);
+	if (unlikely(!p))
+		return -1;
+	*column = p;
+	return 0;
+}
+
+/**
+ * nilfs_binfo_columns_reserve() - make room for more blocks
+ * @cols:    columns
+ * @nblocks: number of blocks to be appended
+ *
+ * Return: 0 on success, -1 on failure with errno set.
+ */
+static int nilfs_binfo_columns_reserve(struct nilfs_binfo_columns *cols,
+				       size_t nblocks)
+{
+	size_t capacity = cols->capacity;
+
+	if (likely(cols->count + nblocks <= cols->capacity))
+		return 0;
+
+	if (capacity == 0)
+		capacity = NILFS_BINFO_COLUMNS_INIT_CAPACITY;
+	while (capacity < cols->count + nblocks) {
+		if (unlikely(capacity > SIZE_MAX / 2 / sizeof(uint64_t))) {
+			errno = EOVERFLOW;
+			return -1;
+		}
+		capacity *= 2;
+	}
+
+	if (nilfs_binfo_column_resize((void **)&cols->ino, sizeof(uint64_t),
+				      capacity) < 0 ||
+	    nilfs_binfo_column_resize((void **)&cols->cno, sizeof(uint64_t),
+				      capacity) < 0 ||
+	    nilfs_binfo_column_resize((void **)&cols->vblocknr,
+				      sizeof(uint64_t), capacity) < 0 ||
+	    nilfs_binfo_column_resize((void **)&cols->offset,
+				      sizeof(uint64_t), capacity) < 0 ||
+	    nilfs_binfo_column_resize((void **)&cols->blocknr,
+				      sizeof(uint64_t), capacity) < 0 ||
+	    nilfs_binfo_column_resize((void **)&cols->flags, sizeof(uint8_t),
+				      capacity) < 0 ||
+	    nilfs_binfo_column_resize((void **)&cols->level, sizeof(uint8_t),
+				      capacity) < 0)
+		return -1;	/* columns already enlarged are kept */
+
+	cols->capacity = capacity;
+	return 0;
+}
+
+/**
+ * nilfs_binfo_decode_run() - decode binfo entries laid out back to back
+ * @binfo: pointer to the first entry
+ * @kind:  layout of the entries (NILFS_BINFO_KIND_*)
+ * @n:     number of entries
+ * @cols:  columns to store the decoded values
+ * @pos:   index of @cols at which the first entry is stored
+ *
+ * The entries of a run never straddle a block boundary, so each case is
+ * a plain strided loop that the compiler can unroll and vectorize.
+ */
+static void nilfs_binfo_decode_run(const void *binfo, int kind, uint32_t n,
+				   struct nilfs_binfo_columns *cols,
+				   size_t pos)
+{
+	const struct nilfs_binfo_v *biv = binfo;
+	const struct nilfs_binfo_dat *bid = binfo;
+	const __le64 *le = binfo;
+	uint64_t *vblocknr = cols->vblocknr + pos;
+	uint64_t *offset = cols->offset + pos;
+	uint8_t *level = cols->level + pos;
+	uint32_t i;
+
+	switch (kind) {
+	case NILFS_BINFO_KIND_DATA:
+		for (i = 0; i < n; i++) {
+			vblocknr[i] = le64_to_cpu(biv[i].bi_vblocknr);
+			offset[i] = le64_to_cpu(biv[i].bi_blkoff);
+		}
+		break;
+	case NILFS_BINFO_KIND_NODE:
+		for (i = 0; i < n; i++)
+			vblocknr[i] = le64_to_cpu(le[i]);
+		break;
+	case NILFS_BINFO_KIND_DAT_DATA:
+		for (i = 0; i < n; i++)
+			offset[i] = le64_to_cpu(le[i]);
+		break;
+	case NILFS_BINFO_KIND_DAT_NODE:
+		for (i = 0; i < n; i++) {
+			offset[i] = le64_to_cpu(bid[i].bi_blkoff);
+			level[i] = bid[i].bi_level;
+		}
+		break;
+	}
+}
+
+/**
+ * nilfs_binfo_decode() - decode an array of binfo entries
+ * @binfo:     pointer to the first entry
+ * @offsetp:   byte offset of @binfo from the beginning of partial segment
+ * @blksize:   block size in bytes
+ * @kind:      layout of the entries (NILFS_BINFO_KIND_*)
+ * @binfosize: size of an entry
+ * @count:     number of entries
+ * @cols:      columns to store the decoded values
+ * @pos:       index of @cols at which the first entry is stored
+ *
+ * Splits the array into runs at the block boundaries, skipping the
+ * padding at the tail of each summary block in the same way as
+ * nilfs_block_next().
+ *
+ * Return: pointer just past the last entry.  @offsetp is updated too.
+ */
+static const void *nilfs_binfo_decode(const void *binfo, uint32_t *offsetp,
+				      uint32_t blksize, int kind,
+				      unsigned int binfosize, uint32_t count,
+				      struct nilfs_binfo_columns *cols,
+				      size_t pos)
+{
+	uint32_t rest, n;
+
+	while (count > 0) {
+		rest = blksize - (*offsetp & (blksize - 1));
+		if (binfosize > rest) {
+			binfo += rest;
+			*offsetp += rest;
+			rest = blksize;
+		}
+		n = min_t(uint32_t, count, rest / binfosize);
+		nilfs_binfo_decode_run(binfo, kind, n, cols, pos);
+
+		binfo += n * binfosize;
+		*offsetp += n * binfosize;
+		pos += n;
+		count -= n;
+	}
+	return binfo;
+}
+
+/**
+ * nilfs_binfo_columns_add_file() - append blocks of a file to columns
+ * @cols: columns
+ * @file: file iterator pointing to a valid finfo
+ *
+ * Decodes the finfo and all the binfo entries that follow it, and appends
+ * one row per block to @cols.  @file must have been validated by the
+ * file iterator, i.e. this is intended to be called inside
+ * nilfs_file_for_each().
+ *
+ * Return: number of appended blocks on success, -1 on failure with errno
+ * set.
+ */
+ssize_t nilfs_binfo_columns_add_file(struct nilfs_binfo_columns *cols,
+				     const struct nilfs_file *file)
+{
+	const uint32_t blksize = 1UL << file->psegment->blkbits;
+	const struct nilfs_finfo *finfo = file->finfo;
+	uint32_t nblocks, ndatablk, i, offset;
+	uint64_t ino, cno, blocknr;
+	const void *binfo;
+	uint8_t flags;
+	size_t pos;
+
+	nblocks = le32_to_cpu(finfo->fi_nblocks);
+	ndatablk = le32_to_cpu(finfo->fi_ndatablk);
+	if (unlikely(nilfs_binfo_columns_reserve(cols, nblocks) < 0))
+		return -1;
+
+	pos = cols->count;
+	ino = le64_to_cpu(finfo->fi_ino);
+	cno = file->use_real_blocknr ? 0 : le64_to_cpu(finfo->fi_cno);
+	blocknr = file->blocknr;
+	flags = file->use_real_blocknr ? NILFS_BINFO_COL_REAL : 0;
+
+	/* per-file attributes */
+	for (i = 0; i < nblocks; i++) {
+		cols->ino[pos + i] = ino;
+		cols->cno[pos + i] = cno;
+		cols->blocknr[pos + i] = blocknr + i;
+		cols->level[pos + i] = 0;
+	}
+	for (i = 0; i < ndatablk; i++)
+		cols->flags[pos + i] = flags;
+	for (i = ndatablk; i < nblocks; i++)
+		cols->flags[pos + i] = flags | NILFS_BINFO_COL_NODE;
+
+	/* per-block attributes */
+	binfo = (const void *)finfo + sizeof(struct nilfs_finfo);
+	offset = file->offset + sizeof(struct nilfs_finfo);
+	if (file->use_real_blocknr) {
+		for (i = 0; i < nblocks; i++)
+			cols->vblocknr[pos + i] = 0;
+		binfo = nilfs_binfo_decode(binfo, &offset, blksize,
+					   NILFS_BINFO_KIND_DAT_DATA,
+					   NILFS_BINFO_DAT_DATA_SIZE,
+					   ndatablk, cols, pos);
+		nilfs_binfo_decode(binfo, &offset, blksize,
+				   NILFS_BINFO_KIND_DAT_NODE,
+				   NILFS_BINFO_DAT_NODE_SIZE,
+				   nblocks - ndatablk, cols, pos + ndatablk);
+	} else {
+		for (i = ndatablk; i < nblocks; i++)
+			cols->offset[pos + i] = 0;
+		binfo = nilfs_binfo_decode(binfo, &offset, blksize,
+					   NILFS_BINFO_KIND_DATA,
+					   NILFS_BINFO_DATA_SIZE,
+					   ndatablk, cols, pos);
+		nilfs_binfo_decode(binfo, &offset, blksize,
+				   NILFS_BINFO_KIND_NODE,
+				   NILFS_BINFO_NODE_SIZE,
+				   nblocks - ndatablk, cols, pos + ndatablk);
+	}
+
+	cols->count += nblocks;
+	return nblocks;
+}
+
+/**
+ * nilfs_binfo_columns_add_psegment() - append blocks of a log to columns
+ * @cols: columns
+ * @pseg: partial segment iterator pointing to a valid log
+ * @file: file iterator used for the decoding
+ *
+ * Decodes the block information of every file in the partial segment
+ * @pseg and appends it to @cols.  @file is left at the position where
+ * the iteration stopped, so that the caller can report a broken finfo
+ * with nilfs_file_is_error().
+ *
+ * Return: number of appended blocks on success, -1 on failure with errno
+ * set.
+ */
+ssize_t nilfs_binfo_columns_add_psegment(struct nilfs_binfo_columns *cols,
+					 const struct nilfs_psegment *pseg,
+					 struct nilfs_file *file)
+{
+	ssize_t n, total = 0;
+
+	nilfs_file_for_each(file, pseg) {
+		n = nilfs_binfo_columns_add_file(cols, file);
+		if (unlikely(n < 0))
+			return -1;
+		total += n;
+	}
+	if (unlikely(file->error))
+		return -1;	/* errno is set by the file iterator */
+	return total;
+}
@@ -0,0 +1,165 @@
+/*
+ * statefile.c - per file system state files
+ *
+ * Licensed under LGPLv2: the complete text of the GNU Lesser General
+ * Public License can be found in COPYING file of the nilfs-utils
+ * package.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif	/* HAVE_CONFIG_H */
+
+#include <stdio.h>
+
+#if HAVE_STDLIB_H
+#include <stdlib.h>
+#endif	/* HAVE_STDLIB_H */
+
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif	/* HAVE_UNISTD_H */
+
+#if HAVE_FCNTL_H
+#include <fcntl.h>
+#endif	/* HAVE_FCNTL_H */
+
+#if HAVE_STRING_H
+#include <string.h>
+#endif	/* HAVE_STRING_H */
+
+#if HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif	/* HAVE_SYS_STAT_H */
+
+#include <errno.h>
+#include "util.h"
+#include "statefile.h"
+
+#ifndef NILFS_STATEDIR
+#define NILFS_STATEDIR		"/var/lib/nilfs"
+#endif	/* NILFS_STATEDIR */
+
+static int nilfs_state_mkdir(const char *dir)
+{
+	char *buf, *p;
+	int ret = 0;
+
+	buf = strdup(dir);
+	if (unlikely(!buf))
+		return -1;
+
+	for (p = buf + 1; ; p++) {
+		if (*p != '/' && *p != '\0')
+			continue;
+		if (p[-1] != '/') {
+			char c = *p;
+
+			*p = '\0';
+			ret = mkdir(buf, 0755);
+			*p = c;
+			if (ret < 0 && errno != EEXIST)
+				break;
+			ret = 0;
+		}
+		if (*p == '\0')
+			break;
+	}
+	free(buf);
+	return ret;
+}
+
+/**
+ * nilfs_state_path - build the path of a state file
+ * @dir: directory of state files [optional]
+ * @uuid: 128-bit uuid of the file system
+ * @suffix: suffix of the file name
+ * @create: create @dir and its missing parents if nonzero
+ *
+ * nilfs_state_path() returns the path of the file named after @uuid with
+ * the extension @suffix under @dir, or under the default state directory
+ * if @dir is NULL.  The returned string must be freed by the caller.
+ *
+ * Return: the path on success, or NULL with errno set on failure.
+ */
+char *nilfs_state_path(const char *dir, const unsigned char *uuid,
+		       const char *suffix, int create)
+{
+	const unsigned char *u = uuid;
+	char *path;
+
+	if (!dir)
+		dir = NILFS_STATEDIR;
+
+	if (create && nilfs_state_mkdir(dir) < 0)
+		return NULL;
+
+	path = malloc(strlen(dir) + strlen(suffix) + 40);
+	if (unlikely(!path))
+		return NULL;
+	sprintf(path, "%s/%02x%02x%02x%02x-%02x%02x-%02x%02x-%02x%02x-"
+		"%02x%02x%02x%02x%02x%02x.%s", dir,
+		u[0], u[1], u[2], u[3], u[4], u[5], u[6], u[7],
+		u[8], u[9], u[10], u[11], u[12], u[13], u[14], u[15], suffix);
+	return path;
+}
+
+/**
+ * nilfs_state_save - replace a state file atomically
+ * @path: path of the state file
+ * @iov: array of buffers to be written
+ * @iovcnt: number of buffers in @iov
+ *
+ * nilfs_state_save() writes @iov to a temporary file next to @path,
+ * flushes it, and renames it over @path, so that a crash leaves either
+ * the old or the new contents in place.
+ *
+ * Return: 0 on success, or -1 with errno set on failure.
+ */
+int nilfs_state_save(const char *path, const struct iovec *iov, int iovcnt)
+{
+	char *tmppath;
+	size_t size = 0;
+	ssize_t nw;
+	int i, fd, ret = -1;
+
+	tmppath = malloc(strlen(path) + sizeof(".tmp"));
+	if (unlikely(!tmppath))
+		return -1;
+	sprintf(tmppath, "%s.tmp", path);
+
+	fd = open(tmppath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		goto out_free;
+
+	for (i = 0; i < iovcnt; i++)
+		size += iov[i].iov_len;
+
+	nw = writev(fd, iov, iovcnt);
+	if (nw < 0 || (size_t)nw != size) {
+		if (nw >= 0)
+			errno = EIO;
+		goto out_unlink;
+	}
+
+	if (fsync(fd) < 0)
+		goto out_unlink;
+
+	if (close(fd) < 0) {
+		fd = -1;
+		goto out_unlink;
+	}
+	fd = -1;
+
+	ret = rename(tmppath, path);
+	if (ret == 0)
+		goto out_free;
+
+out_unlink:
+	if (fd >= 0)
+		close(fd);
+	unlink(tmppath);
+	ret = -1;
+out_free:
+	free(tmppath);
+	return ret;
+}
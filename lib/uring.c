@@ -0,0 +1,307 @@
+/*
+ * uring.c - batched asynchronous reads with io_uring
+ *
+ * Licensed under LGPLv2: the complete text of the GNU Lesser General
+ * Public License can be found in COPYING file of the nilfs-utils
+ * package.
+ *
+ * The ring is driven through the raw system calls, so that libnilfs
+ * does not depend on liburing.  If the kernel or the build environment
+ * lacks io_uring, nilfs_uring_create() fails and callers fall back to
+ * synchronous reads.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif	/* HAVE_CONFIG_H */
+
+#if HAVE_STDLIB_H
+#include <stdlib.h>
+#endif	/* HAVE_STDLIB_H */
+
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif	/* HAVE_UNISTD_H */
+
+#if HAVE_STRING_H
+#include <string.h>
+#endif	/* HAVE_STRING_H */
+
+#if HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif	/* HAVE_SYS_MMAN_H */
+
+#include <errno.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+#include "util.h"
+#include "uring.h"
+
+#if HAVE_LINUX_IO_URING_H && defined(__NR_io_uring_setup) && \
+	defined(__NR_io_uring_enter)
+#include <linux/io_uring.h>
+
+#define NILFS_URING_MAX_DEPTH	256
+
+/**
+ * struct nilfs_uring - io_uring instance
+ * @fd: file descriptor of the ring
+ * @depth: maximum number of requests in flight
+ * @sq_ring: mapping of the submission queue ring
+ * @sq_ring_size: size of @sq_ring
+ * @cq_ring: mapping of the completion queue ring (may equal @sq_ring)
+ * @cq_ring_size: size of @cq_ring
+ * @sqes: array of submission queue entries
+ * @sqes_size: size of @sqes
+ * @sq_head: head index of the submission queue (advanced by the kernel)
+ * @sq_tail: tail index of the submission queue
+ * @sq_mask: index mask of the submission queue
+ * @sq_array: index array of the submission queue
+ * @cq_head: head index of the completion queue
+ * @cq_tail: tail index of the completion queue (advanced by the kernel)
+ * @cq_mask: index mask of the completion queue
+ * @cqes: array of completion queue entries
+ */
+struct nilfs_uring {
+	int fd;
+	unsigned int depth;
+	void *sq_ring;
+	size_t sq_ring_size;
+	void *cq_ring;
+	size_t cq_ring_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+};
+
+static int nilfs_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int nilfs_uring_enter(int fd, unsigned int to_submit,
+			     unsigned int min_complete, unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+		       NULL, 0);
+}
+
+/**
+ * nilfs_uring_create - set up an io_uring instance
+ * @depth: maximum number of requests kept in flight
+ *
+ * Return: the ring on success, or %NULL with errno set on failure.
+ */
+struct nilfs_uring *nilfs_uring_create(unsigned int depth)
+{
+	struct io_uring_params p;
+	struct nilfs_uring *ring;
+	void *ptr;
+	int errsv;
+
+	ring = calloc(1, sizeof(*ring));
+	if (unlikely(!ring))
+		return NULL;
+
+	ring->depth = min_t(unsigned int, max_t(unsigned int, depth, 1),
+			    NILFS_URING_MAX_DEPTH);
+	memset(&p, 0, sizeof(p));
+	ring->fd = nilfs_uring_setup(ring->depth, &p);
+	if (ring->fd < 0)
+		goto out_free;
+	if (ring->depth > p.sq_entries)
+		ring->depth = p.sq_entries;
+
+	ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+	ring->cq_ring_size = p.cq_off.cqes +
+		p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->sq_ring_size = max_t(size_t, ring->sq_ring_size,
+					   ring->cq_ring_size);
+		ring->cq_ring_size = 0;
+	}
+
+	ptr = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ptr == MAP_FAILED)
+		goto out_close;
+	ring->sq_ring = ptr;
+
+	if (ring->cq_ring_size) {
+		ptr = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+			   MAP_SHARED | MAP_POPULATE, ring->fd,
+			   IORING_OFF_CQ_RING);
+		if (ptr == MAP_FAILED)
+			goto out_unmap_sq;
+	}
+	ring->cq_ring = ptr;
+
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	ptr = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ptr == MAP_FAILED)
+		goto out_unmap_cq;
+	ring->sqes = ptr;
+
+	ring->sq_head = ring->sq_ring + p.sq_off.head;
+	ring->sq_tail = ring->sq_ring + p.sq_off.tail;
+	ring->sq_mask = ring->sq_ring + p.sq_off.ring_mask;
+	ring->sq_array = ring->sq_ring + p.sq_off.array;
+	ring->cq_head = ring->cq_ring + p.cq_off.head;
+	ring->cq_tail = ring->cq_ring + p.cq_off.tail;
+	ring->cq_mask = ring->cq_ring + p.cq_off.ring_mask;
+	ring->cqes = ring->cq_ring + p.cq_off.cqes;
+	return ring;
+
+out_unmap_cq:
+	errsv = errno;
+	if (ring->cq_ring_size)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	errno = errsv;
+out_unmap_sq:
+	errsv = errno;
+	munmap(ring->sq_ring, ring->sq_ring_size);
+	errno = errsv;
+out_close:
+	errsv = errno;
+	close(ring->fd);
+	errno = errsv;
+out_free:
+	free(ring);
+	return NULL;
+}
+
+/**
+ * nilfs_uring_destroy - tear down an io_uring instance
+ * @ring: ring to be destroyed
+ */
+void nilfs_uring_destroy(struct nilfs_uring *ring)
+{
+	munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ring_size)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	munmap(ring->sq_ring, ring->sq_ring_size);
+	close(ring->fd);
+	free(ring);
+}
+
+static void nilfs_uring_queue(struct nilfs_uring *ring, int fd,
+			      struct nilfs_uring_io *io, uint64_t index)
+{
+	unsigned int tail = *ring->sq_tail;
+	unsigned int i = tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[i];
+
+	io->iov.iov_base = io->buf + io->result;
+	io->iov.iov_len = io->len - io->result;
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_READV;
+	sqe->fd = fd;
+	sqe->off = io->offset + io->result;
+	sqe->addr = (unsigned long)&io->iov;
+	sqe->len = 1;
+	sqe->user_data = index;
+	ring->sq_array[i] = i;
+
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * nilfs_uring_read - read a batch of ranges
+ * @ring: ring to submit the reads to
+ * @fd: file descriptor to read from
+ * @ios: array of read requests
+ * @nios: number of requests in @ios
+ *
+ * nilfs_uring_read() keeps up to the depth of @ring requests in flight
+ * until all the requests in @ios are completed, resubmitting the rest
+ * of short reads.  A read stops short only at the end of the file.
+ * The outcome of each request is stored in its @result field.
+ *
+ * Return: 0 if the requests were processed, or -1 with errno set if the
+ * ring failed, in which case the results are undefined.
+ */
+int nilfs_uring_read(struct nilfs_uring *ring, int fd,
+		     struct nilfs_uring_io *ios, size_t nios)
+{
+	struct nilfs_uring_io *io;
+	struct io_uring_cqe *cqe;
+	unsigned int head, pending;
+	size_t i, next = 0, inflight = 0;
+	int res, ret;
+
+	for (i = 0; i < nios; i++)
+		ios[i].result = 0;
+
+	while (next < nios || inflight > 0) {
+		while (next < nios && inflight < ring->depth) {
+			nilfs_uring_queue(ring, fd, &ios[next], next);
+			next++;
+			inflight++;
+		}
+
+		pending = *ring->sq_tail -
+			__atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+		ret = nilfs_uring_enter(ring->fd, pending, 1,
+					IORING_ENTER_GETEVENTS);
+		if (unlikely(ret < 0) && errno != EINTR && errno != EAGAIN &&
+		    errno != EBUSY)
+			return -1;
+
+		head = *ring->cq_head;
+		while (head != __atomic_load_n(ring->cq_tail,
+					       __ATOMIC_ACQUIRE)) {
+			cqe = &ring->cqes[head & *ring->cq_mask];
+			io = &ios[cqe->user_data];
+			res = cqe->res;
+			head++;
+
+			if (res == -EINTR || res == -EAGAIN) {
+				nilfs_uring_queue(ring, fd, io,
+						  cqe->user_data);
+				continue;
+			}
+			if (res < 0) {
+				io->result = res;
+			} else if (res > 0) {
+				io->result += res;
+				if ((size_t)io->result < io->len) {
+					nilfs_uring_queue(ring, fd, io,
+							  cqe->user_data);
+					continue;
+				}
+			}
+			inflight--;
+		}
+		__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+	}
+	return 0;
+}
+
+#else	/* io_uring is not available */
+
+struct nilfs_uring *nilfs_uring_create(unsigned int depth)
+{
+	errno = ENOSYS;
+	return NULL;
+}
+
+void nilfs_uring_destroy(struct nilfs_uring *ring)
+{
+}
+
+int nilfs_uring_read(struct nilfs_uring *ring, int fd,
+		     struct nilfs_uring_io *ios, size_t nios)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+#endif	/* io_uring is not available */
@@ -447,6 +447,60 @@ nilfs_cldconfig_handle_mc_nsegments_per_clean(struct nilfs_cldconfig *config,
 	return 0;
 }
 
+static int
+nilfs_cldconfig_handle_scrub_interval(struct nilfs_cldconfig *config,
+				      char **tokens, size_t ntoks,
+				      struct nilfs *nilfs)
+{
+	return nilfs_cldconfig_get_time_argument(
+		tokens, ntoks, &config->cf_scrub_interval);
+}
+
+static int
+nilfs_cldconfig_handle_nsegments_per_scrub(struct nilfs_cldconfig *config,
+					   char **tokens, size_t ntoks,
+					   struct nilfs *nilfs)
+{
+	unsigned long n;
+
+	if (nilfs_cldconfig_get_ulong_argument(tokens, ntoks, &n) < 0)
+		return 0;
+
+	if (n == 0) {
+		syslog(LOG_WARNING, "%s: %s: invalid number of segments",
+		       tokens[0], tokens[1]);
+		return 0;
+	}
+	if (n > NILFS_CLDCONFIG_NSEGMENTS_PER_SCRUB_MAX) {
+		syslog(LOG_WARNING, "%s: %s: too large, use the maximum value",
+		       tokens[0], tokens[1]);
+		n = NILFS_CLDCONFIG_NSEGMENTS_PER_SCRUB_MAX;
+	}
+
+	config->cf_nsegments_per_scrub = n;
+	return 0;
+}
+
+static int
+nilfs_cldconfig_handle_scrub_bandwidth(struct nilfs_cldconfig *config,
+				       char **tokens, size_t ntoks,
+				       struct nilfs *nilfs)
+{
+	struct nilfs_param param;
+
+	if (nilfs_cldconfig_get_size_argument(tokens, ntoks, &param) < 0)
+		return 0;
+
+	if (param.unit == NILFS_SIZE_UNIT_PERCENT) {
+		syslog(LOG_WARNING, "%s: %s: bad expression",
+		       tokens[0], tokens[1]);
+		return 0;
+	}
+
+	config->cf_scrub_bandwidth = nilfs_convert_units_to_bytes(&param);
+	return 0;
+}
+
 static uint32_t
 nilfs_convert_size_to_blocks_per_segment(struct nilfs *nilfs,
 					 struct nilfs_param *param,
@@ -550,6 +604,38 @@ static int nilfs_cldconfig_handle_use_set_suinfo(struct nilfs_cldconfig *config,
 	return 0;
 }
 
+static int nilfs_cldconfig_handle_use_direct_io(struct nilfs_cldconfig *config,
+						char **tokens, size_t ntoks,
+						struct nilfs *nilfs)
+{
+	config->cf_use_direct_io = true;
+	return 0;
+}
+
+static int
+nilfs_cldconfig_handle_use_checkpoint_index(struct nilfs_cldconfig *config,
+					    char **tokens, size_t ntoks,
+					    struct nilfs *nilfs)
+{
+	config->cf_use_cpindex = true;
+	return 0;
+}
+
+static int
+nilfs_cldconfig_handle_checkpoint_lookup(struct nilfs_cldconfig *config,
+					 char **tokens, size_t ntoks,
+					 struct nilfs *nilfs)
+{
+	if (strcmp(tokens[1], "walk") == 0)
+		config->cf_checkpoint_lookup = NILFS_CNORMAP_LOOKUP_WALK;
+	else if (strcmp(tokens[1], "bisect") == 0)
+		config->cf_checkpoint_lookup = NILFS_CNORMAP_LOOKUP_BISECT;
+	else
+		syslog(LOG_WARNING, "%s: %s: unknown lookup method",
+		       tokens[0], tokens[1]);
+	return 0;
+}
+
 static const struct nilfs_cldconfig_log_priority
 nilfs_cldconfig_log_priority_table[] = {
 	{"emerg",	LOG_EMERG},
@@ -645,6 +731,30 @@ nilfs_cldconfig_keyword_table[] = {
 		"use_set_suinfo", 1, 1,
 		nilfs_cldconfig_handle_use_set_suinfo
 	},
+	{
+		"use_direct_io", 1, 1,
+		nilfs_cldconfig_handle_use_direct_io
+	},
+	{
+		"use_checkpoint_index", 1, 1,
+		nilfs_cldconfig_handle_use_checkpoint_index
+	},
+	{
+		"checkpoint_lookup", 2, 2,
+		nilfs_cldconfig_handle_checkpoint_lookup
+	},
+	{
+		"scrub_interval", 2, 2,
+		nilfs_cldconfig_handle_scrub_interval
+	},
+	{
+		"nsegments_per_scrub", 2, 2,
+		nilfs_cldconfig_handle_nsegments_per_scrub
+	},
+	{
+		"scrub_bandwidth", 2, 2,
+		nilfs_cldconfig_handle_scrub_bandwidth
+	},
 };
 
 static int nilfs_cldconfig_handle_keyword(struct nilfs_cldconfig *config,
@@ -704,8 +814,15 @@ static void nilfs_cldconfig_set_default(struct nilfs_cldconfig *config,
 	config->cf_mc_cleaning_interval.tv_nsec = 0;
 	config->cf_retry_interval.tv_sec = NILFS_CLDCONFIG_RETRY_INTERVAL;
 	config->cf_retry_interval.tv_nsec = 0;
+	config->cf_scrub_interval.tv_sec = NILFS_CLDCONFIG_SCRUB_INTERVAL;
+	config->cf_scrub_interval.tv_nsec = 0;
+	config->cf_nsegments_per_scrub = NILFS_CLDCONFIG_NSEGMENTS_PER_SCRUB;
+	config->cf_scrub_bandwidth = NILFS_CLDCONFIG_SCRUB_BANDWIDTH;
 	config->cf_use_mmap = NILFS_CLDCONFIG_USE_MMAP;
 	config->cf_use_set_suinfo = NILFS_CLDCONFIG_USE_SET_SUINFO;
+	config->cf_use_cpindex = NILFS_CLDCONFIG_USE_CPINDEX;
+	config->cf_use_direct_io = NILFS_CLDCONFIG_USE_DIRECT_IO;
+	config->cf_checkpoint_lookup = NILFS_CLDCONFIG_CHECKPOINT_LOOKUP;
 	config->cf_log_priority = NILFS_CLDCONFIG_LOG_PRIORITY;
 
 	param.num = NILFS_CLDCONFIG_MIN_RECLAIMABLE_BLOCKS;
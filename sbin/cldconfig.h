@@ -21,6 +21,7 @@
 #include <stdint.h>	/* uint64_t */
 #include <stdbool.h>
 #include <syslog.h>
+#include "cnormap.h"	/* NILFS_CNORMAP_LOOKUP_* */
 
 /**
  * struct nilfs_param - parameter with unit suffix
@@ -66,8 +67,14 @@ enum nilfs_size_unit {
  * @cf_mc_cleaning_interval: cleaning interval
  * if clean segments < min_clean_segments
  * @cf_retry_interval: retry interval
+ * @cf_scrub_interval: interval of segment scrubbing (zero to disable)
+ * @cf_nsegments_per_scrub: number of segments verified per scrub cycle
+ * @cf_scrub_bandwidth: read bandwidth limit of scrubbing (bytes/sec, 0 = none)
  * @cf_use_mmap: flag that indicate using mmap
  * @cf_use_set_suinfo: flag that indicates the use of the set_suinfo ioctl
+ * @cf_use_cpindex: flag that indicates the use of checkpoint time index
+ * @cf_use_direct_io: flag that indicates the use of direct I/O
+ * @cf_checkpoint_lookup: lookup method of protected checkpoint number
  * @cf_log_priority: log priority level
  * @cf_min_reclaimable_blocks: minimum reclaimable blocks for cleaning
  * @cf_mc_min_reclaimable_blocks: minimum reclaimable blocks for cleaning
@@ -84,11 +91,17 @@ struct nilfs_cldconfig {
 	struct timespec cf_cleaning_interval;
 	struct timespec cf_mc_cleaning_interval;
 	struct timespec cf_retry_interval;
+	struct timespec cf_scrub_interval;
+	unsigned int cf_nsegments_per_scrub;
+	uint64_t cf_scrub_bandwidth;
 
 	/* Boolean bitfields */
 	bool cf_use_mmap : 1;
 	bool cf_use_set_suinfo : 1;
+	bool cf_use_cpindex : 1;
+	bool cf_use_direct_io : 1;
 
+	int cf_checkpoint_lookup;
 	int cf_log_priority;
 	uint32_t cf_min_reclaimable_blocks;
 	uint32_t cf_mc_min_reclaimable_blocks;
@@ -110,8 +123,14 @@ enum nilfs_selection_policy {
 #define NILFS_CLDCONFIG_CLEANING_INTERVAL		5
 #define NILFS_CLDCONFIG_MC_CLEANING_INTERVAL		1
 #define NILFS_CLDCONFIG_RETRY_INTERVAL			60
+#define NILFS_CLDCONFIG_SCRUB_INTERVAL			0
+#define NILFS_CLDCONFIG_NSEGMENTS_PER_SCRUB		1
+#define NILFS_CLDCONFIG_SCRUB_BANDWIDTH			0
 #define NILFS_CLDCONFIG_USE_MMAP			true
 #define NILFS_CLDCONFIG_USE_SET_SUINFO			false
+#define NILFS_CLDCONFIG_USE_CPINDEX			false
+#define NILFS_CLDCONFIG_USE_DIRECT_IO			false
+#define NILFS_CLDCONFIG_CHECKPOINT_LOOKUP		NILFS_CNORMAP_LOOKUP_WALK
 #define NILFS_CLDCONFIG_LOG_PRIORITY			LOG_INFO
 #define NILFS_CLDCONFIG_MIN_RECLAIMABLE_BLOCKS		10
 #define NILFS_CLDCONFIG_MIN_RECLAIMABLE_BLOCKS_UNIT	NILFS_SIZE_UNIT_PERCENT
@@ -119,6 +138,7 @@ enum nilfs_selection_policy {
 #define NILFS_CLDCONFIG_MC_MIN_RECLAIMABLE_BLOCKS_UNIT	NILFS_SIZE_UNIT_PERCENT
 
 #define NILFS_CLDCONFIG_NSEGMENTS_PER_CLEAN_MAX	32
+#define NILFS_CLDCONFIG_NSEGMENTS_PER_SCRUB_MAX	64
 
 struct nilfs;
 
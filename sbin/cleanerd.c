@@ -86,6 +86,7 @@
 #include "vector.h"
 #include "nilfs_gc.h"
 #include "nilfs_cleaner.h"
+#include "nilfs_scrub.h"
 #include "cleaner_msg.h"
 #include "cldconfig.h"
 #include "cnormap.h"
@@ -99,6 +100,7 @@
 
 #define NILFS_CLEANERD_NSUINFO	512
 #define NILFS_CLEANERD_NULLTIME INT64_MAX
+#define NILFS_CLEANERD_SCRUB_BATCH	4	/* segments scrubbed per loop */
 
 #ifdef _GNU_SOURCE
 #include <getopt.h>
@@ -128,6 +130,7 @@ static const struct option long_option[] = {
  * struct nilfs_cleanerd - nilfs cleaner daemon
  * @nilfs: nilfs object
  * @cnormap: checkpoint number reverse mapper
+ * @scrub: segment scrubber
  * @config: config structure
  * @conffile: configuration file name
  * @running: running state
@@ -141,6 +144,8 @@ static const struct option long_option[] = {
  * @cleaning_interval: cleaning interval
  * @target: target time for sleeping (monotonic time)
  * @timeout: timeout value for sleeping
+ * @scrub_target: target time of the next scrub cycle (monotonic time)
+ * @scrub_nrest: number of segments left to verify in the current scrub cycle
  * @min_reclaimable_blocks: min. number of reclaimable blocks
  * @prev_nongc_ctime: previous nongc ctime
  * @recvq: receive queue
@@ -161,6 +166,7 @@ static const struct option long_option[] = {
 struct nilfs_cleanerd {
 	struct nilfs *nilfs;
 	struct nilfs_cnormap *cnormap;
+	struct nilfs_scrub *scrub;
 	struct nilfs_cldconfig config;
 	char *conffile;
 
@@ -177,6 +183,8 @@ struct nilfs_cleanerd {
 	struct timespec cleaning_interval;
 	struct timespec target;
 	struct timespec timeout;
+	struct timespec scrub_target;
+	unsigned int scrub_nrest;
 	uint32_t min_reclaimable_blocks;
 	uint64_t prev_nongc_ctime;
 	mqd_t recvq;
@@ -293,6 +301,74 @@ skip_monotonic_clock:
 	syslog(LOG_DEBUG, "=================================================");
 }
 
+/**
+ * nilfs_cleanerd_scrub_report - log a corrupted log found by the scrubber
+ * @error: description of the corrupted log
+ * @arg: unused
+ */
+static void nilfs_cleanerd_scrub_report(const struct nilfs_scrub_error *error,
+					void *arg)
+{
+	char buf[128];
+	size_t i, len = 0;
+	int n;
+
+	buf[0] = '\0';
+	for (i = 0; i < error->ninos; i++) {
+		n = snprintf(buf + len, sizeof(buf) - len, " %" PRIu64,
+			     error->inos[i]);
+		if (n < 0 || n >= sizeof(buf) - len) {
+			buf[len] = '\0';
+			break;
+		}
+		len += n;
+	}
+
+	syslog(LOG_CRIT, "segment %" PRIu64 ", log at block %" PRIu64
+	       ": %s%s%s%s", error->segnum, error->blocknr, error->errstr,
+	       error->ninos > 0 ? ", inodes" : "", buf,
+	       i < error->ninos ? " ..." : "");
+}
+
+/**
+ * nilfs_cleanerd_setup_scrub - create or remove the segment scrubber
+ * @cleanerd: cleanerd object
+ *
+ * The scrubber and its progress file are set up only while scrubbing
+ * is enabled by scrub_interval, and are released when it is disabled
+ * by a reload.
+ */
+static void nilfs_cleanerd_setup_scrub(struct nilfs_cleanerd *cleanerd)
+{
+	const struct nilfs_cldconfig *config = &cleanerd->config;
+	int ret;
+
+	if (!timespecisset(&config->cf_scrub_interval)) {
+		if (cleanerd->scrub) {
+			nilfs_scrub_destroy(cleanerd->scrub);
+			cleanerd->scrub = NULL;
+			timespecclear(&cleanerd->scrub_target);
+			cleanerd->scrub_nrest = 0;
+		}
+		return;
+	}
+
+	if (!cleanerd->scrub) {
+		cleanerd->scrub = nilfs_scrub_create(cleanerd->nilfs);
+		if (unlikely(cleanerd->scrub == NULL)) {
+			syslog(LOG_ERR, "failed to create segment scrubber: %m");
+			return;
+		}
+		nilfs_scrub_set_reporter(cleanerd->scrub,
+					 nilfs_cleanerd_scrub_report, NULL);
+		ret = nilfs_scrub_set_progress(cleanerd->scrub, NULL, 0);
+		if (unlikely(ret < 0))
+			syslog(LOG_WARNING,
+			       "cannot set up scrub progress file: %m");
+	}
+	nilfs_scrub_set_bandwidth(cleanerd->scrub, config->cf_scrub_bandwidth);
+}
+
 /**
  * nilfs_cleanerd_config() - load configuration file
  * @cleanerd: cleanerd object
@@ -327,6 +403,24 @@ static int nilfs_cleanerd_config(struct nilfs_cleanerd *cleanerd,
 	else
 		nilfs_opt_clear_set_suinfo(cleanerd->nilfs);
 
+	if (config->cf_use_direct_io)
+		nilfs_opt_set_direct_io(cleanerd->nilfs);
+	else
+		nilfs_opt_clear_direct_io(cleanerd->nilfs);
+
+	if (config->cf_use_cpindex) {
+		ret = nilfs_cnormap_set_index(cleanerd->cnormap, NULL, 0);
+		if (unlikely(ret < 0))
+			syslog(LOG_WARNING,
+			       "cannot use checkpoint time index: %m");
+	} else {
+		nilfs_cnormap_clear_index(cleanerd->cnormap);
+	}
+	nilfs_cnormap_set_lookup_mode(cleanerd->cnormap,
+				      config->cf_checkpoint_lookup);
+
+	nilfs_cleanerd_setup_scrub(cleanerd);
+
 	nilfs_cleanerd_set_log_priority(cleanerd);
 
 	if (protection_period != ULONG_MAX) {
@@ -523,12 +617,14 @@ nilfs_cleanerd_create(const char *dev, const char *dir, const char *conffile)
 	ret = nilfs_cleanerd_open_queue(cleanerd,
 					nilfs_get_dev(cleanerd->nilfs));
 	if (unlikely(ret < 0))
-		goto out_conffile;
+		goto out_scrub;
 
 	/* success */
 	return cleanerd;
 
 	/* error */
+out_scrub:
+	nilfs_scrub_destroy(cleanerd->scrub);
 out_conffile:
 	free(cleanerd->conffile);
 out_cnormap:
@@ -544,6 +640,7 @@ out_cleanerd:
 static void nilfs_cleanerd_destroy(struct nilfs_cleanerd *cleanerd)
 {
 	nilfs_cleanerd_close_queue(cleanerd);
+	nilfs_scrub_destroy(cleanerd->scrub);
 	free(cleanerd->conffile);
 	nilfs_cnormap_destroy(cleanerd->cnormap);
 	nilfs_close(cleanerd->nilfs);
@@ -622,22 +719,47 @@ static int nilfs_segments_still_reclaimable(struct nilfs *nilfs,
 					    unsigned long nsegs,
 					    uint64_t protseq)
 {
-	struct nilfs_suinfo si;
-	int i, ret;
+	struct nilfs_suinfo *si;
+	uint64_t *segnums, *lastmods, *seqnums;
+	unsigned long i, n;
+	int have_si, ret = 0;
 
-	for (i = 0; i < nsegs; i++) {
-		if (nilfs_get_suinfo(nilfs, segnumv[i], &si, 1) == 1) {
-			if (!nilfs_suinfo_reclaimable(&si))
+	segnums = malloc((sizeof(*segnums) * 3 + sizeof(*si)) * nsegs);
+	if (unlikely(!segnums))
+		return 0;
+	lastmods = segnums + nsegs;
+	seqnums = lastmods + nsegs;
+	si = (struct nilfs_suinfo *)(seqnums + nsegs);
+
+	have_si = nilfs_get_suinfo_batch(nilfs, segnumv, nsegs, si) >= 0;
+
+	for (i = 0, n = 0; i < nsegs; i++) {
+		lastmods[n] = 0;
+		if (have_si) {
+			if (!nilfs_suinfo_reclaimable(&si[i]))
 				continue;
-			if (nilfs_suinfo_empty(&si))
-				return 1;  /* Found a scrapped segment */
+			if (nilfs_suinfo_empty(&si[i])) {
+				ret = 1;  /* Found a scrapped segment */
+				goto out;
+			}
+			lastmods[n] = si[i].sui_lastmod;
 		}
+		segnums[n++] = segnumv[i];
+	}
 
-		ret = nilfs_segment_is_protected(nilfs, segnumv[i], protseq);
-		if (ret > 0)
-			return 1;
+	if (n > 0 &&
+	    nilfs_get_segment_seqnums(nilfs, segnums, lastmods, seqnums,
+				      n) == 0) {
+		for (i = 0; i < n; i++) {
+			if (cnt64_ge(seqnums[i], protseq)) {
+				ret = 1;
+				break;
+			}
+		}
 	}
-	return 0;
+out:
+	free(segnums);
+	return ret;
 }
 
 /**
@@ -1686,6 +1808,78 @@ out:
 	return ret;
 }
 
+/**
+ * nilfs_cleanerd_scrub - verify segments if a scrub cycle is due
+ * @cleanerd: cleanerd object
+ *
+ * This verifies the data checksums of up to nsegments_per_scrub
+ * segments once every scrub_interval, continuing from where the
+ * previous cycle stopped.  A cycle is split into batches of
+ * NILFS_CLEANERD_SCRUB_BATCH segments, one per iteration of the main
+ * loop, so that garbage collection and client requests are not held
+ * off until the whole cycle completes.  The sleep time is shortened so
+ * that the next batch or cycle is not delayed.  Nothing is done if
+ * scrubbing is disabled or the daemon is suspended manually.
+ */
+static void nilfs_cleanerd_scrub(struct nilfs_cleanerd *cleanerd)
+{
+	const struct nilfs_cldconfig *config = &cleanerd->config;
+	struct timespec curr, rest;
+	unsigned int nsegs;
+	ssize_t n;
+	int ret;
+
+	if (!cleanerd->scrub || cleanerd->running < 0)
+		return;
+
+	ret = clock_gettime(CLOCK_MONOTONIC, &curr);
+	if (unlikely(ret < 0)) {
+		syslog(LOG_ERR, "cannot get monotonic clock: %m");
+		return;
+	}
+
+	if (!timespecisset(&cleanerd->scrub_target)) {
+		/* start the first cycle one interval after launch */
+		timespecadd(&curr, &config->cf_scrub_interval,
+			    &cleanerd->scrub_target);
+	} else if (cleanerd->scrub_nrest > 0 ||
+		   !timespeccmp(&curr, &cleanerd->scrub_target, <)) {
+		if (cleanerd->scrub_nrest == 0)
+			cleanerd->scrub_nrest = config->cf_nsegments_per_scrub;
+
+		nsegs = min_t(unsigned int, cleanerd->scrub_nrest,
+			      NILFS_CLEANERD_SCRUB_BATCH);
+		n = nilfs_scrub_run(cleanerd->scrub, nsegs);
+		if (unlikely(n < 0)) {
+			syslog(LOG_WARNING, "scrubbing failed: %m");
+			cleanerd->scrub_nrest = 0;
+		} else {
+			syslog(LOG_DEBUG, "%zd segment%s scrubbed, next %" PRIu64,
+			       n, n == 1 ? "" : "s",
+			       nilfs_scrub_get_cursor(cleanerd->scrub));
+			cleanerd->scrub_nrest -= nsegs;
+		}
+
+		if (cleanerd->scrub_nrest > 0) {
+			/* continue the cycle after the next cleaning step */
+			timespecclear(&cleanerd->timeout);
+			return;
+		}
+
+		ret = clock_gettime(CLOCK_MONOTONIC, &curr);
+		if (unlikely(ret < 0)) {
+			syslog(LOG_ERR, "cannot get monotonic clock: %m");
+			return;
+		}
+		timespecadd(&curr, &config->cf_scrub_interval,
+			    &cleanerd->scrub_target);
+	}
+
+	timespecsub(&cleanerd->scrub_target, &curr, &rest);
+	if (timespeccmp(&rest, &cleanerd->timeout, <))
+		cleanerd->timeout = rest;
+}
+
 /**
  * nilfs_cleanerd_clean_loop - main loop of the cleaner daemon
  * @cleanerd: cleanerd object
@@ -1783,6 +1977,8 @@ static int nilfs_cleanerd_clean_loop(struct nilfs_cleanerd *cleanerd)
 			return -1;
 
 sleep:
+		nilfs_cleanerd_scrub(cleanerd);
+
 		ret = sigprocmask(SIG_UNBLOCK, &sigset, NULL);
 		if (unlikely(ret < 0)) {
 			syslog(LOG_ERR, "cannot set signal mask: %m");
@@ -36,6 +36,10 @@
 #include <strings.h>
 #endif	/* HAVE_STRINGS_H */
 
+#if HAVE_LIMITS_H
+#include <limits.h>	/* ULONG_MAX */
+#endif	/* HAVE_LIMITS_H */
+
 #include <stdarg.h>
 
 #if HAVE_SYS_IOCTL_H
@@ -46,9 +50,9 @@
 #include <sys/stat.h>
 #endif	/* HAVE_SYS_STAT_H */
 
-#if HAVE_SYS_WAIT_H
-#include <sys/wait.h>
-#endif	/* HAVE_SYS_WAIT_H */
+#if HAVE_TIME_H
+#include <time.h>
+#endif	/* HAVE_TIME_H */
 
 #include <uuid.h>
 
@@ -57,6 +61,7 @@
 #endif	/* HAVE_STRING_H */
 
 #include <errno.h>
+#include <pthread.h>
 
 #if HAVE_LIBBLKID
 #include <blkid.h>
@@ -70,6 +75,7 @@
 #include "pathnames.h"
 #include "crc32.h"
 #include "check_mount.h"
+#include "parser.h"
 
 
 #define nilfs_crc32(seed, data, length)  crc32_le(seed, data, length)
@@ -78,11 +84,6 @@
  * System primitives
  */
 #define LINE_BUFFER_SIZE	256  /* Line buffer size for reading mtab */
-#define BLOCKSIZE_BUFFER_SIZE	100
-
-#define BADBLOCKS_NAME		"badblocks"
-
-static const char badblocks[] = BADBLOCKSDIR "/" BADBLOCKS_NAME;
 
 NILFS_UTILS_GITID();
 
@@ -92,7 +93,10 @@ static int cflag;
 static int nflag;
 static int verbose;
 static int discard = 1;
+static int direct_io;
 static int force_overwrite;
+static unsigned int scan_jobs = 4;
+static unsigned long scan_chunk_size = 1UL << 20;
 static unsigned long blocksize = NILFS_DEF_BLOCKSIZE;
 static unsigned long blocks_per_segment = NILFS_DEF_BLKS_PER_SEG;
 static unsigned long r_segments_percentage = NILFS_DEF_RESERVED_SEGMENTS;
@@ -215,16 +219,32 @@ static inline uint64_t segment_start_blocknr(struct nilfs_disk_info *di,
 /*
  * I/O primitives
  */
-static void **disk_buffer;
+static void *disk_buffer;	/* zero-filled arena of the blocks to write */
 static unsigned long disk_buffer_size;
 
 static void init_disk_buffer(long max_blocks);
 static void destroy_disk_buffer(void);
-static void *map_disk_buffer(uint64_t blocknr, int clear_flag);
+static void *map_disk_buffer(uint64_t blocknr);
 
 static void read_disk_header(int fd, const char *device);
 static void write_disk(int fd, struct nilfs_disk_info *di);
 
+/*
+ * Timing of the formatting phases (reported in verbose mode)
+ */
+#define MAX_TIMING_PHASES	10
+
+static struct {
+	const char *name;
+	double msec;
+} timing_phases[MAX_TIMING_PHASES];
+static int nr_timing_phases;
+static struct timespec timing_start;
+
+static void start_timing(void);
+static void end_timing_phase(const char *name);
+static void report_timing(void);
+
 /*
  * Routines to format blocks
  */
@@ -286,20 +306,130 @@ static void too_small_segment(unsigned long, unsigned long);
 #define BLKDISCARDZEROES _IO(0x12, 124)
 #endif
 
+#ifndef BLKZEROOUT
+#define BLKZEROOUT	_IO(0x12, 127)
+#endif
+
+#ifndef FALLOC_FL_KEEP_SIZE
+#define FALLOC_FL_KEEP_SIZE	0x01
+#endif
+
+#ifndef FALLOC_FL_PUNCH_HOLE
+#define FALLOC_FL_PUNCH_HOLE	0x02
+#endif
+
+#ifndef FALLOC_FL_ZERO_RANGE
+#define FALLOC_FL_ZERO_RANGE	0x10
+#endif
+
+/*
+ * Large discards are split into chunks aligned to this size, which are
+ * issued by up to NILFS_MKFS_DISCARD_JOBS threads.
+ */
+#define NILFS_MKFS_DISCARD_CHUNK	(1ULL << 30)	/* 1 GiB */
+#define NILFS_MKFS_DISCARD_JOBS		4
+
+struct nilfs_mkfs_discard_job {
+	int fd;
+	uint64_t pos;		/* start of the next chunk */
+	uint64_t end;		/* end of the region */
+	int error;		/* first error number */
+	pthread_mutex_t lock;
+};
+
+static void *nilfs_mkfs_discard_worker(void *arg)
+{
+	struct nilfs_mkfs_discard_job *job = arg;
+	uint64_t range[2];
+
+	pthread_mutex_lock(&job->lock);
+	while (!job->error && job->pos < job->end) {
+		range[0] = job->pos;
+		range[1] = min_t(uint64_t, job->end,
+				 (job->pos / NILFS_MKFS_DISCARD_CHUNK + 1) *
+				 NILFS_MKFS_DISCARD_CHUNK) - job->pos;
+		job->pos += range[1];
+		pthread_mutex_unlock(&job->lock);
+
+		if (ioctl(job->fd, BLKDISCARD, &range) < 0) {
+			pthread_mutex_lock(&job->lock);
+			if (!job->error)
+				job->error = errno;
+			continue;
+		}
+		pthread_mutex_lock(&job->lock);
+	}
+	pthread_mutex_unlock(&job->lock);
+	return NULL;
+}
+
+/**
+ * nilfs_mkfs_discard_blkdev - discard a region of a block device
+ * @fd: file descriptor of the device
+ * @start: start offset of the region to discard (in bytes)
+ * @len: length of the region to discard (in bytes)
+ *
+ * Regions larger than NILFS_MKFS_DISCARD_CHUNK are discarded chunk by
+ * chunk in parallel, which shortens the discard of devices that handle
+ * one request at a time, such as thinly-provisioned volumes.
+ */
+static int nilfs_mkfs_discard_blkdev(int fd, uint64_t start, uint64_t len)
+{
+	struct nilfs_mkfs_discard_job job;
+	pthread_t threads[NILFS_MKFS_DISCARD_JOBS];
+	uint64_t nchunks;
+	unsigned int i, nthreads = 0;
+
+	job.fd = fd;
+	job.pos = start;
+	job.end = start + len;
+	job.error = 0;
+	pthread_mutex_init(&job.lock, NULL);
+
+	nchunks = (job.end - 1) / NILFS_MKFS_DISCARD_CHUNK -
+		start / NILFS_MKFS_DISCARD_CHUNK + 1;
+
+	/* The calling thread discards chunks by itself */
+	for (i = 1; i < min_t(uint64_t, nchunks, NILFS_MKFS_DISCARD_JOBS);
+	     i++) {
+		if (pthread_create(&threads[i], NULL,
+				   nilfs_mkfs_discard_worker, &job) != 0)
+			break;	/* go on with fewer threads */
+		nthreads = i;
+	}
+	nilfs_mkfs_discard_worker(&job);
+	for (i = 1; i <= nthreads; i++)
+		pthread_join(threads[i], NULL);
+
+	pthread_mutex_destroy(&job.lock);
+	if (job.error) {
+		errno = job.error;
+		return -1;
+	}
+	return 0;
+}
+
 /**
  * nilfs_mkfs_discard_range - issue discard command to the device
  * @fd: file descriptor of the device
+ * @is_file: the device is a regular file
  * @start: start offset of the region to discard (in bytes)
  * @len: length of the region to discard (in bytes)
  *
+ * A regular file is discarded by punching a hole in it.
+ *
  * Returns zero if the discard succeeds.  Otherwise, -1 is returned.
  */
-static int nilfs_mkfs_discard_range(int fd, uint64_t start, uint64_t len)
+static int nilfs_mkfs_discard_range(int fd, int is_file, uint64_t start,
+				    uint64_t len)
 {
-	uint64_t range[2] = { start, len };
 	int ret;
 
-	ret = ioctl(fd, BLKDISCARD, &range);
+	if (is_file)
+		ret = fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+				start, len);
+	else
+		ret = nilfs_mkfs_discard_blkdev(fd, start, len);
 	if (verbose) {
 		pinfo("Discard device from %" PRIu64 " to %" PRIu64 ": %s.",
 		      start, start + len, ret ? "failed" : "succeeded");
@@ -310,17 +440,53 @@ static int nilfs_mkfs_discard_range(int fd, uint64_t start, uint64_t len)
 /**
  * nilfs_mkfs_discard_zeroes_data - get if discarded blocks are zeroed or not
  * @fd: file descriptor of the device
+ * @is_file: the device is a regular file
  */
-static int nilfs_mkfs_discard_zeroes_data(int fd)
+static int nilfs_mkfs_discard_zeroes_data(int fd, int is_file)
 {
 	int discard_zeroes_data = 0;
 
+	if (is_file)
+		return 1;	/* holes are read as zeros */
+
 	ioctl(fd, BLKDISCARDZEROES, &discard_zeroes_data);
 	return discard_zeroes_data;
 }
+
+/**
+ * nilfs_mkfs_zeroout_range - have the device zero out a region
+ * @fd: file descriptor of the device
+ * @is_file: the device is a regular file
+ * @start: start offset of the region to zero out (in bytes)
+ * @len: length of the region to zero out (in bytes)
+ *
+ * Block devices are zeroed with BLKZEROOUT, which uses write-zeroes
+ * commands where the device supports them.  Regular files are zeroed
+ * with FALLOC_FL_ZERO_RANGE, or by punching a hole if discard is
+ * allowed and the file system lacks support for zeroing ranges.
+ *
+ * Returns zero if the region is zeroed.  Otherwise, -1 is returned.
+ */
+static int nilfs_mkfs_zeroout_range(int fd, int is_file, uint64_t start,
+				    uint64_t len)
+{
+	uint64_t range[2] = { start, len };
+	int ret;
+
+	if (!is_file)
+		return ioctl(fd, BLKZEROOUT, &range);
+
+	ret = fallocate(fd, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE,
+			start, len);
+	if (ret < 0 && discard)
+		ret = fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+				start, len);
+	return ret;
+}
 #else
-#define nilfs_mkfs_discard_range(fd, start, len)	1
-#define nilfs_mkfs_discard_zeroes_data(fd)		0
+#define nilfs_mkfs_discard_range(fd, is_file, start, len)	1
+#define nilfs_mkfs_discard_zeroes_data(fd, is_file)		0
+#define nilfs_mkfs_zeroout_range(fd, is_file, start, len)	(-1)
 #endif
 
 static void disk_scan(const char *device);
@@ -583,15 +749,13 @@ int main(int argc, char *argv[])
 
 	parse_options(argc, argv);
 	device = argv[optind];
+	start_timing();
 
 	if (stat(device, &statbuf) != 0)
 		perr("Error: cannot find %s: %s", device, strerror(errno));
 	else if (!S_ISREG(statbuf.st_mode) && !S_ISBLK(statbuf.st_mode))
 		perr("Error: device must be a block device or a file");
 
-	if (cflag)
-		disk_scan(device);  /* check the block device */
-
 	ret = check_mount(device);
 	if (ret < 0)
 		perr("Error checking mount status of %s: %s", device,
@@ -600,6 +764,11 @@ int main(int argc, char *argv[])
 		perr("Error: %s is currently mounted. You cannot make a filesystem on this device.",
 		     device);
 
+	if (cflag) {
+		disk_scan(device);  /* check the block device */
+		end_timing_phase("check blocks");
+	}
+
 	fd = open(device, O_RDWR);
 	if (fd < 0)
 		perr("Error: cannot open device %s: %s", device,
@@ -636,67 +805,332 @@ int main(int argc, char *argv[])
 	commit_segment();
 
 	commit_super_block(di, get_last_segment());
+	end_timing_phase("format");
 
 	write_disk(fd, di); /* Writing to the device */
 
 	close(fd);
+	report_timing();
 	exit(EXIT_SUCCESS);
 }
 
 /*
  * I/O routines & primitives
  */
-static void disk_scan(const char *device)
+
+/*
+ * Surface scan of the device (-c).  The device is split into chunks of
+ * scan_chunk_size bytes (-X), which are read, or written with test
+ * patterns and read back, by scan_jobs (-Q) threads with direct I/O.
+ * Each thread has one I/O in flight, so scan_jobs is the queue depth of
+ * the scan.
+ */
+#define NILFS_SCAN_MAX_JOBS	64
+
+static const unsigned char scan_patterns[] = { 0xaa, 0x55, 0xff, 0x00 };
+
+struct nilfs_scan_range {
+	uint64_t start;		/* first bad block */
+	uint64_t nblocks;	/* number of bad blocks */
+};
+
+struct nilfs_scan {
+	int fd;
+	int write_mode;		/* write test patterns and read them back */
+	uint64_t nblocks;	/* number of blocks to scan */
+	uint64_t chunk_blocks;	/* number of blocks per I/O */
+	uint64_t next;		/* next block to be scanned */
+	uint64_t ndone;		/* number of scanned blocks */
+	struct nilfs_scan_range *bad;
+	size_t nbad, maxbad;
+	int error;		/* fatal error number */
+	int show_progress;
+	struct timespec last_progress;
+	pthread_mutex_t lock;
+};
+
+static void nilfs_scan_add_bad_block(struct nilfs_scan *scan,
+				     uint64_t blocknr)
 {
-	struct stat statbuf;
-	pid_t pid;
-	int status;
+	struct nilfs_scan_range *range;
 
-	if (stat(badblocks, &statbuf) != 0) {
-		pinfo("Warning: %s not found.", badblocks);
+	if (scan->nbad > 0) {
+		range = &scan->bad[scan->nbad - 1];
+		if (range->start + range->nblocks == blocknr) {
+			range->nblocks++;
+			return;
+		}
+	}
+	if (scan->nbad == scan->maxbad) {
+		scan->maxbad = scan->maxbad ? scan->maxbad * 2 : 16;
+		range = realloc(scan->bad, scan->maxbad * sizeof(*range));
+		if (!range)
+			cannot_allocate_memory();
+		scan->bad = range;
+	}
+	scan->bad[scan->nbad].start = blocknr;
+	scan->bad[scan->nbad++].nblocks = 1;
+}
+
+/**
+ * nilfs_scan_blocks - test a run of blocks
+ * @scan: scan context
+ * @buf: buffer for the blocks
+ * @rbuf: buffer to read back the test patterns
+ * @blocknr: start block number
+ * @nblocks: number of blocks
+ *
+ * Returns zero if every block is read (and written) correctly.
+ * Otherwise, -1 is returned.
+ */
+static int nilfs_scan_blocks(struct nilfs_scan *scan, void *buf, void *rbuf,
+			     uint64_t blocknr, uint64_t nblocks)
+{
+	size_t count = nblocks * blocksize;
+	off_t offset = blocknr * blocksize;
+	int i;
+
+	if (!scan->write_mode)
+		return pread(scan->fd, buf, count, offset) == count ? 0 : -1;
+
+	for (i = 0; i < ARRAY_SIZE(scan_patterns); i++) {
+		memset(buf, scan_patterns[i], count);
+		if (pwrite(scan->fd, buf, count, offset) != count ||
+		    pread(scan->fd, rbuf, count, offset) != count ||
+		    memcmp(buf, rbuf, count) != 0)
+			return -1;
+	}
+	return 0;
+}
+
+static void nilfs_scan_show_progress(struct nilfs_scan *scan)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (now.tv_sec == scan->last_progress.tv_sec)
 		return;
+	scan->last_progress = now;
+	fprintf(stderr, "\rchecking blocks: %5.1f%% done, %zu bad ranges",
+		scan->ndone * 100.0 / scan->nblocks, scan->nbad);
+}
+
+static void *nilfs_scan_worker(void *arg)
+{
+	struct nilfs_scan *scan = arg;
+	size_t bufsize = scan->chunk_blocks * blocksize;
+	void *buf = NULL, *rbuf = NULL;
+	uint64_t blocknr, nblocks, i;
+	int ret;
+
+	if (posix_memalign(&buf, blocksize, bufsize) != 0 ||
+	    (scan->write_mode &&
+	     posix_memalign(&rbuf, blocksize, bufsize) != 0)) {
+		pthread_mutex_lock(&scan->lock);
+		scan->error = ENOMEM;
+		pthread_mutex_unlock(&scan->lock);
+		goto out;
+	}
+
+	pthread_mutex_lock(&scan->lock);
+	while (!scan->error && scan->next < scan->nblocks) {
+		blocknr = scan->next;
+		nblocks = min_t(uint64_t, scan->chunk_blocks,
+				scan->nblocks - blocknr);
+		scan->next += nblocks;
+		pthread_mutex_unlock(&scan->lock);
+
+		ret = nilfs_scan_blocks(scan, buf, rbuf, blocknr, nblocks);
+
+		pthread_mutex_lock(&scan->lock);
+		if (ret < 0) {
+			/* Narrow the failure down to the bad blocks */
+			for (i = 0; i < nblocks; i++) {
+				pthread_mutex_unlock(&scan->lock);
+				ret = nilfs_scan_blocks(scan, buf, rbuf,
+							blocknr + i, 1);
+				pthread_mutex_lock(&scan->lock);
+				if (ret < 0)
+					nilfs_scan_add_bad_block(scan,
+								 blocknr + i);
+			}
+		}
+		scan->ndone += nblocks;
+		if (scan->show_progress)
+			nilfs_scan_show_progress(scan);
 	}
+	pthread_mutex_unlock(&scan->lock);
+out:
+	free(buf);
+	free(rbuf);
+	return NULL;
+}
+
+static int nilfs_scan_comp_range(const void *elem1, const void *elem2)
+{
+	const struct nilfs_scan_range *r1 = elem1, *r2 = elem2;
+
+	if (r1->start == r2->start)
+		return 0;
+	return r1->start < r2->start ? -1 : 1;
+}
+
+/**
+ * nilfs_scan_open - open the device to be scanned
+ * @device: pathname of the device
+ * @write_mode: open for the write test
+ *
+ * Direct I/O is used if the device accepts it, so that the scan
+ * measures the device rather than the page cache.  As the external
+ * badblocks program used to be run with setuid and setgid privileges
+ * dropped, the device is opened with the real user and group IDs.  For
+ * the destructive write test, a block device is opened exclusively so
+ * that the test fails rather than overwrites a device in use.
+ */
+static int nilfs_scan_open(const char *device, int write_mode)
+{
+	int flags = write_mode ? O_RDWR : O_RDONLY;
+	uid_t euid = geteuid();
+	gid_t egid = getegid();
+	struct stat statbuf;
+	int fd;
+
+	if (write_mode && stat(device, &statbuf) == 0 &&
+	    S_ISBLK(statbuf.st_mode))
+		flags |= O_EXCL;
+
+	if (setegid(getgid()) < 0)
+		perr("Error: failed to drop setgid privileges");
+	if (seteuid(getuid()) < 0)
+		perr("Error: failed to drop setuid privileges");
 
+#ifdef O_DIRECT
+	fd = open(device, flags | O_DIRECT);
+	if (fd >= 0) {
+		void *buf;
+		ssize_t ret;
+
+		if (posix_memalign(&buf, blocksize, blocksize) != 0)
+			cannot_allocate_memory();
+		ret = pread(fd, buf, blocksize, 0);
+		free(buf);
+		if (ret >= 0 || errno != EINVAL)
+			goto out;
+		close(fd);
+	} else if (errno == EBUSY) {
+		goto out;
+	}
 	if (!quiet)
-		pinfo("checking blocks");
-
-	pid = fork();
-	if (pid == 0) {
-		char bszbuf[BLOCKSIZE_BUFFER_SIZE];
-		const char *args[7];
-		ssize_t n;
-		int i = 0;
-
-		if (setgid(getgid()) < 0)
-			perr("Error: failed to drop setgid privileges");
-		if (setuid(getuid()) < 0)
-			perr("Error: failed to drop setuid privileges");
-		args[i++] = badblocks;
-		args[i++] = "-b";
-		n = snprintf(bszbuf, BLOCKSIZE_BUFFER_SIZE, "%ld", blocksize);
-		if (n < 0 || n >= BLOCKSIZE_BUFFER_SIZE)
-			perr("Internal error: blocksize buffer overflow");
-		args[i++] = bszbuf;
-
-		if (!quiet)
-			args[i++] = "-s";
-		if (cflag > 1)
-			args[i++] = "-w";
-		args[i++] = device;
-		args[i] = NULL;
-		execv(badblocks, (char **)args);
-		exit(EXIT_FAILURE); /* reach only if failed */
-	} else if (pid != -1) {
-		if (wait(&status) < 0)
-			perr("Error: cannot wait child");
-		else if (!WIFEXITED(status))
-			perr("Error: check aborted");
-		else if (WEXITSTATUS(status))
-			perr("Error: check failed with status(%d)",
-			     WEXITSTATUS(status));
+		pinfo("Warning: direct I/O is not available for the check");
+#endif	/* O_DIRECT */
+	fd = open(device, flags);
+out:
+	if (fd < 0 && errno == EBUSY)
+		perr("Error: %s is in use. You cannot run the write test on this device.",
+		     device);
+	if (fd < 0)
+		perr("Error: cannot open device %s: %s", device,
+		     strerror(errno));
+	if (seteuid(euid) < 0 || setegid(egid) < 0)
+		perr("Error: failed to restore privileges");
+	return fd;
+}
+
+static void disk_scan(const char *device)
+{
+	struct nilfs_scan scan;
+	struct nilfs_scan_range *range;
+	pthread_t threads[NILFS_SCAN_MAX_JOBS];
+	struct timespec start, end;
+	struct stat statbuf;
+	uint64_t dev_size, nchunks, nbad = 0;
+	unsigned int i, nthreads = 0;
+	double sec, nbytes;
+	size_t j, n;
+
+	memset(&scan, 0, sizeof(scan));
+	scan.write_mode = cflag > 1;
+	scan.fd = nilfs_scan_open(device, scan.write_mode);
+
+	if (fstat(scan.fd, &statbuf) != 0)
+		perr("Cannot stat device (%s)", device);
+	if (S_ISBLK(statbuf.st_mode)) {
+		if (ioctl(scan.fd, BLKGETSIZE64, &dev_size) != 0)
+			perr("Error: cannot get device size! (%s)", device);
 	} else {
-		perr("Error: cannot fork: %s", strerror(errno));
+		dev_size = statbuf.st_size;
+	}
+
+	scan.nblocks = dev_size / blocksize;
+	scan.chunk_blocks = DIV_ROUND_UP(scan_chunk_size, blocksize);
+	scan.show_progress = !quiet && isatty(STDERR_FILENO);
+	pthread_mutex_init(&scan.lock, NULL);
+	if (scan.nblocks == 0)
+		goto out;
+
+	if (!quiet)
+		pinfo("checking blocks (%s test, %u jobs, %lu bytes per I/O)",
+		      scan.write_mode ? "read-write" : "read-only",
+		      scan_jobs, (unsigned long)scan.chunk_blocks * blocksize);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	/* The calling thread scans chunks by itself */
+	nchunks = DIV_ROUND_UP(scan.nblocks, scan.chunk_blocks);
+	for (i = 1; i < min_t(uint64_t, nchunks, scan_jobs); i++) {
+		if (pthread_create(&threads[i], NULL, nilfs_scan_worker,
+				   &scan) != 0)
+			break;	/* go on with fewer jobs */
+		nthreads = i;
+	}
+	nilfs_scan_worker(&scan);
+	for (i = 1; i <= nthreads; i++)
+		pthread_join(threads[i], NULL);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	if (scan.show_progress)
+		fprintf(stderr, "\r%*s\r", 50, "");
+
+	if (scan.error)
+		perr("Error: check failed: %s", strerror(scan.error));
+
+	/* Chunks finish out of order; merge adjacent bad ranges */
+	qsort(scan.bad, scan.nbad, sizeof(*scan.bad), nilfs_scan_comp_range);
+	for (j = 0, n = 0; j < scan.nbad; j++) {
+		range = &scan.bad[j];
+		if (n > 0 && scan.bad[n - 1].start + scan.bad[n - 1].nblocks ==
+		    range->start)
+			scan.bad[n - 1].nblocks += range->nblocks;
+		else
+			scan.bad[n++] = *range;
+	}
+	for (j = 0; j < n; j++) {
+		range = &scan.bad[j];
+		if (range->nblocks == 1)
+			printf("%" PRIu64 "\n", range->start);
+		else
+			printf("%" PRIu64 "-%" PRIu64 "\n", range->start,
+			       range->start + range->nblocks - 1);
+		nbad += range->nblocks;
+	}
+
+	if (!quiet) {
+		sec = (end.tv_sec - start.tv_sec) +
+			(end.tv_nsec - start.tv_nsec) / 1e9;
+		nbytes = (double)scan.nblocks * blocksize;
+		if (scan.write_mode)
+			nbytes *= 2 * ARRAY_SIZE(scan_patterns);
+		pinfo("checked %" PRIu64 " blocks in %.3f seconds (%.1f MiB/s)",
+		      scan.nblocks, sec,
+		      sec > 0 ? nbytes / sec / (1 << 20) : 0.0);
+		if (nbad > 0)
+			pinfo("Warning: %" PRIu64 " bad blocks found in %zu ranges",
+			      nbad, n);
 	}
+out:
+	pthread_mutex_destroy(&scan.lock);
+	free(scan.bad);
+	close(scan.fd);
 }
 
 #if HAVE_LIBBLKID
@@ -788,63 +1222,92 @@ abort_format:
 }
 #endif /* HAVE_LIBBLKID */
 
-static void destroy_disk_buffer(void)
+static void start_timing(void)
 {
-	if (disk_buffer) {
-		void **pb = disk_buffer, **ep = disk_buffer + disk_buffer_size;
+	clock_gettime(CLOCK_MONOTONIC, &timing_start);
+}
 
-		while (pb < ep) {
-			if (*pb)
-				free(*pb);
-			pb++;
-		}
-		free(disk_buffer);
-		disk_buffer = NULL;
+/**
+ * end_timing_phase - record the time spent since the previous phase
+ * @name: name of the phase that ends
+ */
+static void end_timing_phase(const char *name)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (nr_timing_phases < MAX_TIMING_PHASES) {
+		timing_phases[nr_timing_phases].name = name;
+		timing_phases[nr_timing_phases++].msec =
+			(now.tv_sec - timing_start.tv_sec) * 1e3 +
+			(now.tv_nsec - timing_start.tv_nsec) / 1e6;
 	}
+	timing_start = now;
 }
 
+static void report_timing(void)
+{
+	double total = 0;
+	int i;
+
+	if (!verbose)
+		return;
+
+	pinfo("Timing (msec):");
+	for (i = 0; i < nr_timing_phases; i++) {
+		pinfo("  %-20s %10.3f", timing_phases[i].name,
+		      timing_phases[i].msec);
+		total += timing_phases[i].msec;
+	}
+	pinfo("  %-20s %10.3f", "total", total);
+}
+
+static void destroy_disk_buffer(void)
+{
+	free(disk_buffer);
+	disk_buffer = NULL;
+}
+
+/**
+ * init_disk_buffer - allocate the disk image to be written
+ * @max_blocks: number of blocks from the head of the device
+ *
+ * The blocks are laid out in a single aligned arena in the order of
+ * their block numbers, so that each initial segment occupies contiguous
+ * memory and can be checksummed and written out at once.
+ */
 static void init_disk_buffer(long max_blocks)
 {
-	disk_buffer = calloc(max_blocks, sizeof(void *));
-	if (!disk_buffer)
+	if (posix_memalign(&disk_buffer, blocksize,
+			   (size_t)max_blocks * blocksize) != 0)
 		cannot_allocate_memory();
 
-	memset(disk_buffer, 0, max_blocks * sizeof(void *));
+	memset(disk_buffer, 0, (size_t)max_blocks * blocksize);
 	disk_buffer_size = max_blocks;
 
 	atexit(destroy_disk_buffer);
 }
 
-static void *map_disk_buffer(uint64_t blocknr, int clear_flag)
+static void *map_disk_buffer(uint64_t blocknr)
 {
 	if (blocknr >= disk_buffer_size)
 		perr("Internal error: illegal disk buffer access (blocknr=%"
 		     PRIu64 ")", blocknr);
 
-	if (!disk_buffer[blocknr]) {
-		if (posix_memalign(&disk_buffer[blocknr], blocksize,
-				   blocksize) != 0)
-			cannot_allocate_memory();
-		if (clear_flag)
-			memset(disk_buffer[blocknr], 0, blocksize);
-	}
-	return disk_buffer[blocknr];
+	return disk_buffer + blocknr * blocksize;
 }
 
 static void read_disk_header(int fd, const char *device)
 {
-	int i, hdr_blocks = DIV_ROUND_UP(NILFS_SB_OFFSET_BYTES, blocksize);
+	int hdr_blocks = DIV_ROUND_UP(NILFS_SB_OFFSET_BYTES, blocksize);
 
-	lseek(fd, 0, SEEK_SET);
-	for (i = 0; i < hdr_blocks; i++) {
-		if (read(fd, map_disk_buffer(i, 0), blocksize) < 0)
-			cannot_rw_device(fd, device, 1);
-	}
+	if (pread(fd, map_disk_buffer(0), hdr_blocks * blocksize, 0) < 0)
+		cannot_rw_device(fd, device, 1);
 }
 
 static int device_has_boot_sector(void)
 {
-	const __le32 *bssig = map_disk_buffer(0, 0) + 0x1fe;
+	const __le32 *bssig = map_disk_buffer(0) + 0x1fe;
 
 	return le32_to_cpu(*bssig) == 0xaa55;
 }
@@ -884,12 +1347,29 @@ static int erase_disk_range(int fd, off_t offset, size_t count)
 	return ret;
 }
 
+/**
+ * erase_disk - erase the head and tail of the device
+ * @fd: file descriptor of the device
+ * @di: disk information
+ *
+ * The whole device is discarded first unless discard is disabled.  If
+ * discarded blocks are not guaranteed to read as zeros, the head and
+ * tail of the device are zeroed out by the device itself if possible,
+ * and otherwise by writing zero-filled buffers.  The time spent by each
+ * method is recorded as a separate phase.
+ */
 static int erase_disk(int fd, struct nilfs_disk_info *di)
 {
 	const unsigned int sector_size = 512;
+	struct stat stat;
 	off_t start, end;
+	int is_file;
 	int ret;
 
+	if (fstat(fd, &stat) < 0)
+		return -1;
+	is_file = S_ISREG(stat.st_mode);
+
 	/*
 	 * Define range of the partition that nilfs uses.  This should
 	 * not depend on the type of underlying device.
@@ -901,14 +1381,29 @@ static int erase_disk(int fd, struct nilfs_disk_info *di)
 	       end - NILFS_DISK_ERASE_SIZE < start);
 
 	if (discard) {
-		ret = nilfs_mkfs_discard_range(fd, start, end - start);
-		if (!ret && nilfs_mkfs_discard_zeroes_data(fd)) {
+		ret = nilfs_mkfs_discard_range(fd, is_file, start,
+					       end - start);
+		end_timing_phase("discard");
+		if (!ret && nilfs_mkfs_discard_zeroes_data(fd, is_file)) {
 			if (verbose)
 				pinfo("Discard succeeded and will return 0s  - skip wiping");
-			goto out;
+			return 0;
 		}
 	}
 
+	ret = nilfs_mkfs_zeroout_range(fd, is_file,
+				       end - NILFS_DISK_ERASE_SIZE,
+				       NILFS_DISK_ERASE_SIZE);
+	if (ret == 0)
+		ret = nilfs_mkfs_zeroout_range(fd, is_file, start,
+					       NILFS_DISK_ERASE_SIZE - start);
+	end_timing_phase("zero out");
+	if (ret == 0) {
+		if (verbose)
+			pinfo("Zeroed out head and tail of device - skip wiping");
+		return 0;
+	}
+
 	/* Erase tail of partition */
 	ret = erase_disk_range(fd, end - NILFS_DISK_ERASE_SIZE,
 			       NILFS_DISK_ERASE_SIZE);
@@ -917,16 +1412,100 @@ static int erase_disk(int fd, struct nilfs_disk_info *di)
 		ret = erase_disk_range(fd, start,
 				       NILFS_DISK_ERASE_SIZE - start);
 	}
-out:
+	end_timing_phase("write zeros");
 	return ret;
 }
 
-static void write_disk(int fd, struct nilfs_disk_info *di)
+/**
+ * write_blocks - write out contiguous blocks of the disk buffer
+ * @fd: file descriptor
+ * @blocknr: start block number
+ * @nblocks: number of blocks
+ */
+static int write_blocks(int fd, uint64_t blocknr, unsigned long nblocks)
+{
+	const char *buf = map_disk_buffer(blocknr);
+	size_t count = (size_t)nblocks * blocksize;
+	off_t offset = (off_t)blocknr * blocksize;
+	ssize_t n;
+
+	while (count > 0) {
+		n = pwrite(fd, buf, count, offset);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (n == 0) {
+			errno = EIO;
+			return -1;
+		}
+		buf += n;
+		offset += n;
+		count -= n;
+	}
+	return 0;
+}
+
+static int set_direct_io(int fd, int on)
+{
+#ifdef O_DIRECT
+	int flags = fcntl(fd, F_GETFL);
+
+	if (flags < 0)
+		return -1;
+	flags = on ? (flags | O_DIRECT) : (flags & ~O_DIRECT);
+	return fcntl(fd, F_SETFL, flags);
+#else
+	errno = EINVAL;
+	return -1;
+#endif	/* O_DIRECT */
+}
+
+static int write_segments(int fd, struct nilfs_disk_info *di)
 {
-	uint64_t blocknr;
 	struct nilfs_segment_info *si;
-	int i;
+	int i, direct = 0;
+
+	if (direct_io) {
+		direct = set_direct_io(fd, 1) == 0;
+		if (!direct)
+			pinfo("Warning: direct I/O is not available: %s",
+			      strerror(errno));
+	}
 
+	for (i = 0, si = di->seginfo; i < di->nseginfo; i++, si++) {
+		if (write_blocks(fd, si->start_blocknr, si->nblocks) == 0)
+			continue;
+		if (!direct || errno != EINVAL)
+			return -1;
+
+		/* The device rejected the alignment; retry without it */
+		pinfo("Warning: direct I/O failed, falling back to buffered I/O");
+		direct = 0;
+		if (set_direct_io(fd, 0) < 0 ||
+		    write_blocks(fd, si->start_blocknr, si->nblocks) < 0)
+			return -1;
+	}
+
+	if (direct && set_direct_io(fd, 0) < 0)
+		return -1;
+	return 0;
+}
+
+static int write_super_blocks(int fd, struct nilfs_disk_info *di)
+{
+	/* The primary and secondary super blocks share one flush */
+	if (pwrite(fd, raw_sb, sizeof(*raw_sb), NILFS_SB_OFFSET_BYTES) !=
+	    sizeof(*raw_sb) ||
+	    pwrite(fd, raw_sb, sizeof(*raw_sb),
+		   NILFS_SB2_OFFSET_BYTES(di->dev_size)) != sizeof(*raw_sb))
+		return -1;
+	return fsync(fd);
+}
+
+static void write_disk(int fd, struct nilfs_disk_info *di)
+{
 	if (!quiet) {
 		show_version();
 		pinfo("Start writing file system initial data to the device\n"
@@ -938,32 +1517,18 @@ static void write_disk(int fd, struct nilfs_disk_info *di)
 			goto failed_to_write;
 
 		/* Writing segments */
-		for (i = 0, si = di->seginfo; i < di->nseginfo; i++, si++) {
-			lseek(fd, si->start_blocknr * blocksize, SEEK_SET);
-			for (blocknr = si->start_blocknr;
-			     blocknr < si->start_blocknr + si->nblocks;
-			     blocknr++) {
-				if (write(fd, map_disk_buffer(blocknr, 1),
-					  blocksize) < 0)
-					goto failed_to_write;
-			}
-		}
-		if (fsync(fd) < 0)
+		if (write_segments(fd, di) < 0)
 			goto failed_to_write;
+		end_timing_phase("write segments");
 
-		/* Writing primary super block */
-		if (lseek(fd, NILFS_SB_OFFSET_BYTES, SEEK_SET) < 0 ||
-		    write(fd, raw_sb, sizeof(*raw_sb)) < 0)
-			goto failed_to_write;
-
-		/* Writing secondary super block */
-		if (lseek(fd, NILFS_SB2_OFFSET_BYTES(di->dev_size),
-			  SEEK_SET) < 0 ||
-		    write(fd, raw_sb, sizeof(*raw_sb)) < 0)
+		if (fsync(fd) < 0)
 			goto failed_to_write;
+		end_timing_phase("sync segments");
 
-		if (fsync(fd) < 0)
+		/* Writing primary and secondary super blocks */
+		if (write_super_blocks(fd, di) < 0)
 			goto failed_to_write;
+		end_timing_phase("write super blocks");
 	}
 	if (!quiet)
 		pinfo("File system initialization succeeded !! ");
@@ -1039,8 +1604,9 @@ static void parse_options(int argc, char *argv[])
 {
 	int c, show_version_only = 0;
 	char *fs_features = NULL;
+	uint64_t size;
 
-	while ((c = getopt(argc, argv, "b:B:cfhKL:m:nqvO:P:V")) != EOF) {
+	while ((c = getopt(argc, argv, "b:B:cDfhKL:m:nqvO:P:Q:VX:")) != EOF) {
 		switch (c) {
 		case 'b':
 			blocksize = atol(optarg);
@@ -1052,6 +1618,9 @@ static void parse_options(int argc, char *argv[])
 		case 'c':
 			cflag++;
 			break;
+		case 'D':
+			direct_io = 1;
+			break;
 		case 'f':
 			force_overwrite = 1;
 			break;
@@ -1094,9 +1663,21 @@ static void parse_options(int argc, char *argv[])
 			creation_time = atol(optarg);
 			check_ctime(creation_time);
 			break;
+		case 'Q':
+			scan_jobs = atol(optarg);
+			if (scan_jobs < 1 || scan_jobs > NILFS_SCAN_MAX_JOBS)
+				perr("Error: invalid number of check jobs: %s",
+				     optarg);
+			break;
 		case 'V':
 			show_version_only = 1;
 			break;
+		case 'X':
+			if (nilfs_parse_size(optarg, &size) < 0 || size == 0 ||
+			    size > ULONG_MAX)
+				perr("Error: invalid check I/O size: %s", optarg);
+			scan_chunk_size = size;
+			break;
 		default:
 			usage(stderr);
 			exit(EXIT_FAILURE);
@@ -1129,9 +1710,9 @@ static void parse_options(int argc, char *argv[])
 static void usage(FILE *stream)
 {
 	fprintf(stream,
-		"Usage: %s [-b block-size] [-B blocks-per-segment] [-c] [-f]\n"
-		"       [-L volume-label] [-m reserved-segments-percentage]\n"
-		"       [-O feature[,...]]\n"
+		"Usage: %s [-b block-size] [-B blocks-per-segment] [-c] [-D]\n"
+		"       [-f] [-L volume-label] [-m reserved-segments-percentage]\n"
+		"       [-O feature[,...]] [-Q check-jobs] [-X check-io-size]\n"
 		"       [-hnqvKV] device\n",
 		getprogname());
 }
@@ -1236,7 +1817,7 @@ next_dir_entry(volatile struct nilfs_dir_entry *de)
 static void nilfs_mkfs_make_rootdir(void)
 {
 	uint64_t blocknr = nilfs.files[NILFS_ROOT_INO]->start_blocknr;
-	void *dirbuf = map_disk_buffer(blocknr, 1);
+	void *dirbuf = map_disk_buffer(blocknr);
 	volatile struct nilfs_dir_entry *de = dirbuf;
 		/* volatile keyword is inserted to prevent failure of
 		   substitution to de->inode on a certain environment. */
@@ -1281,7 +1862,7 @@ static void *map_segsum_info(uint64_t start_blocknr, unsigned long *offset,
 		*offset = ++block_offset * blocksize;
 	}
 	*offset += item_size;
-	return map_disk_buffer(start_blocknr + block_offset, 1) +
+	return map_disk_buffer(start_blocknr + block_offset) +
 		offset_in_block;
 }
 
@@ -1337,18 +1918,18 @@ static void prepare_blockgrouped_file(uint64_t blocknr)
 		blocksize / sizeof(struct nilfs_palloc_group_desc);
 	int i;
 
-	for (i = 0, desc = map_disk_buffer(blocknr, 1);
+	for (i = 0, desc = map_disk_buffer(blocknr);
 	     i < group_descs_per_block; i++, desc++)
 		desc->pg_nfrees = cpu_to_le32(blocksize * 8 /* CHAR_BIT */);
-	map_disk_buffer(blocknr + 1, 1); /* Initialize bitmap block */
+	/* the bitmap block at blocknr + 1 is zero-filled in the arena */
 }
 
 static inline void
 alloc_blockgrouped_file_entry(uint64_t blocknr, unsigned long nr)
 {
-	struct nilfs_palloc_group_desc *desc = map_disk_buffer(blocknr, 1);
+	struct nilfs_palloc_group_desc *desc = map_disk_buffer(blocknr);
 					/* always use the first group */
-	void *bitmap = map_disk_buffer(blocknr + 1, 1);
+	void *bitmap = map_disk_buffer(blocknr + 1);
 
 	if (nilfs_test_bit(nr, bitmap))
 		perr("Internal error: duplicated entry allocation");
@@ -1372,7 +1953,7 @@ static void prepare_ifile(void)
 	for (entry_block = blocknr + group_desc_blocks_per_group +
 		     bitmap_blocks_per_group;
 	     entry_block < blocknr + fi->nblocks; entry_block++) {
-		raw_inode = map_disk_buffer(entry_block, 1);
+		raw_inode = map_disk_buffer(entry_block);
 		for (i = 0; i < entries_per_block; i++, raw_inode++, ino++) {
 			if (ino < NILFS_MAX_INITIAL_INO && nilfs.files[ino] &&
 			    !nilfs.files[ino]->raw_inode)
@@ -1408,7 +1989,7 @@ static void prepare_cpfile(void)
 	uint64_t cno = 1;
 	int i;
 
-	header = map_disk_buffer(blocknr, 1);
+	header = map_disk_buffer(blocknr);
 	header->ch_ncheckpoints = cpu_to_le64(1);
 #if 0 /* these fields are cleared when mapped first */
 	header->ch_nsnapshots = 0;
@@ -1419,7 +2000,7 @@ static void prepare_cpfile(void)
 	     entry_block++) {
 		i = (entry_block == blocknr) ?
 			NILFS_CPFILE_FIRST_CHECKPOINT_OFFSET : 0;
-		cp = (struct nilfs_checkpoint *)map_disk_buffer(entry_block, 1)
+		cp = (struct nilfs_checkpoint *)map_disk_buffer(entry_block)
 			+ i;
 		for (; i < entries_per_block; i++, cp++, cno++) {
 #if 0 /* these fields are cleared when mapped first */
@@ -1467,7 +2048,7 @@ static void prepare_sufile(void)
 	unsigned long segnum = 0;
 	int i;
 
-	header = map_disk_buffer(blocknr, 1);
+	header = map_disk_buffer(blocknr);
 	header->sh_ncleansegs = cpu_to_le64(nilfs.diskinfo->nsegments -
 					    nr_initial_segments);
 	header->sh_ndirtysegs = cpu_to_le64(nr_initial_segments);
@@ -1477,7 +2058,7 @@ static void prepare_sufile(void)
 		i = (entry_block == blocknr) ?
 			NILFS_SUFILE_FIRST_SEGMENT_USAGE_OFFSET : 0;
 		su = (struct nilfs_segment_usage *)
-			map_disk_buffer(entry_block, 1) + i;
+			map_disk_buffer(entry_block) + i;
 		for (; i < entries_per_block; i++, su++, segnum++) {
 #if 0 /* these fields are cleared when mapped first */
 			su->su_lastmod = 0;
@@ -1506,7 +2087,7 @@ static void commit_sufile(void)
 		(segnum + NILFS_SUFILE_FIRST_SEGMENT_USAGE_OFFSET) /
 		entries_per_block;
 
-	su = map_disk_buffer(blocknr, 1);
+	su = map_disk_buffer(blocknr);
 	su += (segnum + NILFS_SUFILE_FIRST_SEGMENT_USAGE_OFFSET) %
 		entries_per_block;
 	su->su_lastmod = cpu_to_le64(nilfs.diskinfo->ctime);
@@ -1529,7 +2110,7 @@ static void prepare_dat(void)
 		 * only need to be filled with zeros, and no additional
 		 * formatting work is required.
 		 */
-		map_disk_buffer(entry_block, 1);
+		map_disk_buffer(entry_block);
 	}
 	/* reserve the dat entry of vblocknr=0 */
 	alloc_blockgrouped_file_entry(blocknr, 0);
@@ -1549,7 +2130,7 @@ static uint64_t assign_vblocknr(uint64_t blocknr)
 	alloc_blockgrouped_file_entry(fi->start_blocknr, vblocknr);
 
 	BUG_ON(entry_block >= fi->start_blocknr + fi->nblocks);
-	entry = map_disk_buffer(entry_block, 1);
+	entry = map_disk_buffer(entry_block);
 
 	entry += vblocknr % entries_per_block;
 	entry->de_blocknr = cpu_to_le64(blocknr);
@@ -1573,7 +2154,7 @@ static void prepare_segment(struct nilfs_segment_info *si)
 		nilfs.files[fi->ino] = fi;
 
 	/* initialize segment summary */
-	nilfs.segsum = map_disk_buffer(si->start_blocknr, 1);
+	nilfs.segsum = map_disk_buffer(si->start_blocknr);
 	nilfs.segsum->ss_magic = cpu_to_le32(NILFS_SEGSUM_MAGIC);
 	nilfs.segsum->ss_bytes =
 		cpu_to_le16(sizeof(struct nilfs_segment_summary));
@@ -1589,7 +2170,7 @@ static void prepare_segment(struct nilfs_segment_info *si)
 
 	/* initialize super root */
 	end_blocknr = si->start_blocknr + si->nblocks - 1;
-	nilfs.super_root = map_disk_buffer(end_blocknr, 1);
+	nilfs.super_root = map_disk_buffer(end_blocknr);
 	sr = nilfs.super_root;
 	sr->sr_bytes = cpu_to_le16(NILFS_SR_BYTES(sizeof(struct nilfs_inode)));
 	sr->sr_nongc_ctime = cpu_to_le64(di->ctime);
@@ -1607,8 +2188,6 @@ static void prepare_segment(struct nilfs_segment_info *si)
 
 static void fill_in_checksums(struct nilfs_segment_info *si, uint32_t crc_seed)
 {
-	uint64_t blocknr;
-	unsigned long rest_blocks;
 	int crc_offset;
 	int sr_bytes;
 	uint32_t sum;
@@ -1628,18 +2207,13 @@ static void fill_in_checksums(struct nilfs_segment_info *si, uint32_t crc_seed)
 			  sr_bytes - crc_offset);
 	nilfs.super_root->sr_sum = cpu_to_le32(sum);
 
-	/* fill in segment checksum */
+	/* fill in segment checksum over the contiguous segment image */
 	crc_offset = sizeof(nilfs.segsum->ss_datasum);
-	blocknr = si->start_blocknr;
-	rest_blocks = si->nblocks;
-	BUG_ON(!rest_blocks);
-
-	sum = nilfs_crc32(crc_seed, map_disk_buffer(blocknr, 1) + crc_offset,
-			  blocksize - crc_offset);
-	while (--rest_blocks > 0) {
-		blocknr++;
-		sum = nilfs_crc32(sum, map_disk_buffer(blocknr, 1), blocksize);
-	}
+	BUG_ON(!si->nblocks);
+
+	sum = nilfs_crc32(crc_seed,
+			  map_disk_buffer(si->start_blocknr) + crc_offset,
+			  (size_t)si->nblocks * blocksize - crc_offset);
 	nilfs.segsum->ss_datasum = cpu_to_le32(sum);
 }
 
@@ -1678,7 +2252,7 @@ static void prepare_super_block(struct nilfs_disk_info *di)
 
 	if (sizeof(struct nilfs_super_block) > blocksize)
 		perr("Internal error: too large super block");
-	raw_sb = map_disk_buffer(blocknr, 1) + offset;
+	raw_sb = map_disk_buffer(blocknr) + offset;
 	memset(raw_sb, 0, sizeof(struct nilfs_super_block));
 
 	raw_sb->s_rev_level = cpu_to_le32(NILFS_CURRENT_REV);
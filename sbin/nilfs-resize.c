@@ -69,12 +69,17 @@
 #include "util.h"
 #include "nilfs_gc.h"
 #include "check_mount.h"
+#include "statefile.h"
 
 
 #ifdef _GNU_SOURCE
 #include <getopt.h>
 static const struct option long_option[] = {
+	{"abort", no_argument, NULL, 'a'},
+	{"benchmark", no_argument, NULL, 'b'},
 	{"help", no_argument, NULL, 'h'},
+	{"plan", no_argument, NULL, 'n'},
+	{"resume", no_argument, NULL, 'r'},
 	{"verbose", no_argument, NULL, 'v'},
 	{"yes", no_argument, NULL, 'y'},
 	{"assume-yes", no_argument, NULL, 'y'},
@@ -83,14 +88,18 @@ static const struct option long_option[] = {
 };
 #define NILFS_RESIZE_USAGE						\
 	"Usage: %s [options] device [size]\n"				\
+	"  -a, --abort\t\tcancel an interrupted shrink\n"		\
+	"  -b, --benchmark\tmove a few segments to estimate shrink time\n" \
 	"  -h, --help\t\tdisplay this help and exit\n"			\
+	"  -n, --plan\t\testimate the cost of shrinking and exit\n"	\
+	"  -r, --resume\t\tresume an interrupted shrink\n"		\
 	"  -v, --verbose\t\tverbose mode\n"				\
 	"  -y, --yes,--assume-yes\n"					\
 	"            \t\tAssume Yes to all queries and do not prompt\n"	\
 	"  -V, --version\t\tdisplay version and exit\n"
 #else
 #define NILFS_RESIZE_USAGE						\
-	"Usage: %s [-h] [-v] [-y] [-V] device [size]\n"
+	"Usage: %s [-a] [-b] [-h] [-n] [-r] [-v] [-y] [-V] device [size]\n"
 #endif	/* _GNU_SOURCE */
 
 
@@ -103,6 +112,10 @@ static const struct option long_option[] = {
 static int show_version_only;
 static int verbose;
 static int assume_yes;
+static int plan_only;
+static int plan_benchmark;
+static int resume_mode;
+static int abort_mode;
 static int show_progress = 1;
 
 /* global variables */
@@ -115,6 +128,9 @@ static uint64_t trunc_start, trunc_end;
 #define NILFS_RESIZE_NSEGNUMS	256
 
 static struct nilfs_suinfo suinfo[NILFS_RESIZE_NSUINFO];
+static uint64_t seq_segnums[NILFS_RESIZE_NSUINFO];
+static uint64_t seq_lastmods[NILFS_RESIZE_NSUINFO];
+static uint64_t seqnums[NILFS_RESIZE_NSUINFO];
 static uint64_t segnums[NILFS_RESIZE_NSEGNUMS];
 
 /* filesystem parameters */
@@ -124,11 +140,73 @@ static struct nilfs_layout layout;
 static int nsegments_per_clean = 2;
 static struct timespec clean_interval = { 0, 100000000 };   /* 100 msec */
 
+/*
+ * Target duration of a reclaim batch.  The number of segments reclaimed
+ * at once starts at nsegments_per_clean and follows the measured reclaim
+ * throughput so that each batch takes about this long, up to the same
+ * limit as the nsegments_per_clean parameter of the cleaner daemon.
+ */
+#define NILFS_RESIZE_BATCH_TARGET_MSEC	500
+#define NILFS_RESIZE_BATCH_MAX		32
+
+/* segment to be evacuated from the truncation range */
+struct nilfs_resize_candidate {
+	uint64_t segnum;
+	uint32_t nblocks;	/* number of used blocks at the scan */
+};
+static struct nilfs_suinfo batch_suinfo[NILFS_RESIZE_NSEGNUMS];
+
+/* number of segments reclaimed by the benchmark of the shrink plan */
+#define NILFS_RESIZE_PLAN_NBENCH	4
+
+/*
+ * The truncation range is evacuated in windows of this many segments,
+ * and the state file records the window from which to resume.
+ */
+#define NILFS_RESIZE_WINDOW_NSEGS	65536
+
+/* state of an interrupted shrink */
+#define NILFS_RESIZE_STATE_MAGIC	0x52535a45	/* "RSZE" */
+#define NILFS_RESIZE_STATE_VERSION	1
+
+/**
+ * struct nilfs_resize_state - contents of the state file of a shrink
+ * @magic: magic number (NILFS_RESIZE_STATE_MAGIC)
+ * @version: format version of the state file
+ * @pad: padding (zero)
+ * @uuid: 128-bit uuid of the file system
+ * @newsize: target size of the shrink (in bytes)
+ * @devsize: size of the file system before the shrink (in bytes), which
+ *           is the end of the allocation range to restore on failure
+ * @cursor: segment number from which the evacuation resumes
+ * @nmoved: number of segments moved so far
+ * @elapsed: seconds spent so far
+ *
+ * The file is written in the host byte order and is named after the uuid
+ * of the file system, like the progress file of nilfs-scrub.
+ */
+struct nilfs_resize_state {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t pad;
+	unsigned char uuid[16];
+	uint64_t newsize;
+	uint64_t devsize;
+	uint64_t cursor;
+	uint64_t nmoved;
+	uint64_t elapsed;
+};
+
+static struct nilfs_resize_state rstate;
+static char *rstate_path;
+static struct timespec rstate_start;
+static volatile sig_atomic_t nilfs_resize_interrupted;
+
 /* balloon file (file for forcing active segments to move) */
 #define NILFS_RESIZE_BALLOON_FILENAME_FMT	".nilfs-balloon-%u"
 #define NILFS_RESIZE_BALLOON_FILENAME_BUFSZ	32
 
-#define NILFS_RESIZE_BALLOON_MAX_CHUNKSIZE	16392  /* chunk size (bytes) */
+#define NILFS_RESIZE_BALLOON_MAX_CHUNKSIZE	(1UL << 20)  /* chunk size (bytes) */
 
 /* progress meter */
 static int pm_width = 60;
@@ -515,129 +593,140 @@ static void nilfs_resize_restore_alloc_range(struct nilfs *nilfs)
 }
 
 /**
- * nilfs_resize_prod_fs - force the file system update to move active segments
- * @nilfs:      nilfs object
- * @nblk_write: write data size (in blocks)
+ * nilfs_resize_handle_signal - request the shrink to stop
+ * @signum: signal number
  *
- * This function creates a temporary file (balloon file) with a random pattern
- * of size @nblk_write on the root directory that @nilfs holds, writes it to
- * the log via nilfs_sync(), and then deletes it and also deletes checkpoints
- * that contain the ballon file.
- *
- * Return: 0 on success, -1 on error.
+ * The reclaim loop stops at the next batch boundary and saves the state
+ * so that the shrink can be resumed with --resume.
  */
-static int nilfs_resize_prod_fs(struct nilfs *nilfs, unsigned long nblk_write)
+static void nilfs_resize_handle_signal(int signum)
 {
-	char filename[NILFS_RESIZE_BALLOON_FILENAME_BUFSZ];
-	ssize_t rest = nblk_write * layout.blocksize;
-	const char *dev = nilfs_get_dev(nilfs);
-	const char *srcdev = "/dev/urandom";
-	int dirfd = nilfs_get_root_fd(nilfs);
-	int out_fd = -1, in_fd = -1;
-	nilfs_cno_t cno, scno, ecno;
-	sigset_t newset, sigset;
-	int read_failed = 0;
-	int ret, res = -1;
-	unsigned char *data_buf;
+	nilfs_resize_interrupted = 1;
+}
 
-	if (!nblk_write)
-		return 0;
+/**
+ * nilfs_resize_state_init - set up the state file of the file system
+ * @nilfs:  nilfs object
+ * @create: create the state directory if it does not exist
+ *
+ * Return: 0 on success, -1 on failure.
+ */
+static int nilfs_resize_state_init(struct nilfs *nilfs, int create)
+{
+	char *path;
+	int ret;
 
-	data_buf = malloc(NILFS_RESIZE_BALLOON_MAX_CHUNKSIZE);
-	if (unlikely(!data_buf))
+	ret = nilfs_get_uuid(nilfs, rstate.uuid, sizeof(rstate.uuid));
+	if (unlikely(ret < 0)) {
+		err("cannot get uuid of the file system");
 		return -1;
+	}
 
-	in_fd = open(srcdev, O_RDONLY | O_CLOEXEC);
-	if (in_fd < 0)
-		verbose_err("cannot open %s - use calculated values", srcdev);
-
-	ret = nilfs_sync(nilfs, &scno);
-	if (unlikely(ret < 0))
-		scno = 0;
-
-	/* Block signals */
-	sigemptyset(&newset);
-	sigaddset(&newset, SIGINT);
-	sigaddset(&newset, SIGTERM);
-	ret = sigprocmask(SIG_BLOCK, &newset, &sigset);
-	if (unlikely(ret < 0)) {
-		err("cannot block signals");
-		goto failed;
+	path = nilfs_state_path(NULL, rstate.uuid, "resize", create);
+	if (unlikely(!path)) {
+		err("cannot set up the state file");
+		return -1;
 	}
+	free(rstate_path);
+	rstate_path = path;
+	clock_gettime(CLOCK_MONOTONIC, &rstate_start);
+	return 0;
+}
 
-	/* Write a balloon file to the filesystem */
-	snprintf(filename, NILFS_RESIZE_BALLOON_FILENAME_BUFSZ,
-		 NILFS_RESIZE_BALLOON_FILENAME_FMT, (unsigned)getpid());
+/**
+ * nilfs_resize_load_state - read the state saved by an interrupted shrink
+ *
+ * Return: 1 if a valid state was loaded, 0 if there is none, -1 on
+ * failure.
+ */
+static int nilfs_resize_load_state(void)
+{
+	struct nilfs_resize_state state;
+	ssize_t nr;
+	int fd;
 
-	out_fd = openat(dirfd, filename, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
-			S_IWUSR | S_IRUSR);
-	if (unlikely(out_fd < 0)) {
-		err("failed to create balloon file on %s", dev);
-		goto failed_unblock_signals;
+	if (!rstate_path)
+		return 0;
+
+	fd = open(rstate_path, O_RDONLY);
+	if (fd < 0) {
+		if (errno == ENOENT)
+			return 0;
+		err("cannot open %s", rstate_path);
+		return -1;
 	}
+	nr = read(fd, &state, sizeof(state));
+	close(fd);
+	if (nr != sizeof(state) || state.magic != NILFS_RESIZE_STATE_MAGIC ||
+	    state.version != NILFS_RESIZE_STATE_VERSION ||
+	    memcmp(state.uuid, rstate.uuid, sizeof(state.uuid)) != 0)
+		return 0;
 
-	while (rest > 0) {
-		size_t request = min_t(size_t, rest,
-				       NILFS_RESIZE_BALLOON_MAX_CHUNKSIZE);
-		ssize_t count;
-		unsigned char *cp;
-
-		if (in_fd >= 0 && !read_failed) {
-			count = read(in_fd, data_buf, request);
-			if (likely(count > 0)) {
-				request = count;
-				goto inflate_balloon;
-			}
-			verbose_err("failed to read balloon data from %s", srcdev);
-			read_failed = 1;
-		}
-		/*
-		 * Fallback path.
-		 *
-		 * Since cryptographically-secure random numbers are not required,
-		 * use the old pseudo-random number function rand() instead of
-		 * getrandom() or anything else that depends on the environment.
-		 */
-		for (cp = data_buf; cp < data_buf + request; cp++)
-			*cp = rand() & 0xff;
+	rstate = state;
+	return 1;
+}
 
-	inflate_balloon:
-		count = write(out_fd, data_buf, request);
-		if (unlikely(count < 0)) {
-			err("failed to inflate balloon file on %s", dev);
-			break;
-		}
-		rest -= count;
+/**
+ * nilfs_resize_save_state - save the state of the shrink in progress
+ *
+ * The file is replaced atomically, so that an interruption at any point
+ * leaves either the previous or the new state behind.
+ *
+ * Return: 0 on success, -1 on failure.
+ */
+static int nilfs_resize_save_state(void)
+{
+	struct nilfs_resize_state state;
+	struct timespec now;
+	struct iovec iov;
+
+	if (!rstate_path)
+		return 0;	/* the shrink is not resumable */
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	state = rstate;
+	state.magic = NILFS_RESIZE_STATE_MAGIC;
+	state.version = NILFS_RESIZE_STATE_VERSION;
+	state.elapsed += now.tv_sec - rstate_start.tv_sec;
+
+	iov.iov_base = &state;
+	iov.iov_len = sizeof(state);
+	if (nilfs_state_save(rstate_path, &iov, 1) < 0) {
+		err("cannot save resize state to %s", rstate_path);
+		return -1;
 	}
+	return 0;
+}
 
-	ret = nilfs_sync(nilfs, &ecno);
-	if (unlikely(ret < 0))
-		ecno = 0;
-	close(out_fd);
+static void nilfs_resize_remove_state(void)
+{
+	if (rstate_path)
+		unlink(rstate_path);
+}
 
-	/* Delete the balloon file */
-	ret = unlinkat(dirfd, filename, 0);
-	if (unlikely(ret < 0))
-		verbose_err("Balloon file deletion on %s failed", dev);
+/**
+ * nilfs_resize_abort - cancel an interrupted shrink
+ * @nilfs:  nilfs object
+ * @device: device pathname
+ *
+ * This function makes the whole file system allocatable again and
+ * removes the state file left by an interrupted shrink.
+ *
+ * Return: %EXIT_SUCCESS on success, %EXIT_FAILURE on failure.
+ */
+static int nilfs_resize_abort(struct nilfs *nilfs, const char *device)
+{
+	int ret;
 
-	/* Delete checkpoints created during prodding */
-	if (likely(ecno > 0)) {
-		for (cno = (scno ? scno + 1 : ecno); cno <= ecno; cno++) {
-			nilfs_delete_checkpoint(nilfs, cno);
-		}
+	ret = nilfs_set_alloc_range(nilfs, 0, layout.devsize);
+	if (unlikely(ret < 0)) {
+		err("failed to restore allocation range");
+		return EXIT_FAILURE;
 	}
-	nilfs_sync(nilfs, &cno);
-	res = 0;
-
-failed_unblock_signals:
-	sigprocmask(SIG_SETMASK, &sigset, NULL);  /* Unblock signals */
-
-	nilfs_resize_update_sustat(nilfs);
-failed:
-	if (in_fd >= 0)
-		close(in_fd);
-	free(data_buf);
-	return res;
+	nilfs_resize_remove_state();
+	msg("Cancelled the interrupted shrink of %s to %" PRIu64 " bytes.\n",
+	    device, (uint64_t)rstate.newsize);
+	return EXIT_SUCCESS;
 }
 
 /**
@@ -666,40 +755,50 @@ nilfs_resize_find_movable_segments(struct nilfs *nilfs, uint64_t start,
 {
 	uint64_t segnum, *snp;
 	unsigned long rest, count;
-	ssize_t nsi, i;
+	uint64_t protseq = sustat.ss_prot_seq;
+	ssize_t nsi, i, nseq, k;
 	int ret;
 
 	assert(start <= end);
 
 	segnum = start;
 	rest = min_t(uint64_t, maxsegnums, end - start + 1);
-	for (snp = segnumv; rest > 0 && segnum <= end; ) {
+	for (snp = segnumv; rest > 0 && segnum <= end; segnum += nsi) {
 		count = min_t(unsigned long, rest, NILFS_RESIZE_NSUINFO);
 		nsi = nilfs_get_suinfo(nilfs, segnum, suinfo, count);
 		if (unlikely(nsi < 0)) {
 			err("operation failed during searching movable segments");
 			return -1;
 		}
-		for (i = 0; i < nsi; i++, segnum++) {
-			if (!nilfs_suinfo_reclaimable(&suinfo[i]))
-				continue;
 
-			if (nilfs_suinfo_empty(&suinfo[i])) {
-				/* Scrapped segments can be removed */
-				*snp++ = segnum;
-				rest--;
+		/* read sequence numbers of in-use segments in a batch */
+		for (i = 0, nseq = 0; i < nsi; i++) {
+			if (!nilfs_suinfo_reclaimable(&suinfo[i]) ||
+			    nilfs_suinfo_empty(&suinfo[i]))
 				continue;
-			}
-
-			ret = nilfs_segment_is_protected(nilfs, segnum,
-							 sustat.ss_prot_seq);
+			seq_segnums[nseq] = segnum + i;
+			seq_lastmods[nseq] = suinfo[i].sui_lastmod;
+			nseq++;
+		}
+		if (nseq > 0) {
+			ret = nilfs_get_segment_seqnums(nilfs, seq_segnums,
+							seq_lastmods, seqnums,
+							nseq);
 			if (unlikely(ret < 0)) {
 				err("failed to read segment");
 				return -1;
 			}
-			if (ret)
+		}
+
+		for (i = 0, k = 0; i < nsi; i++) {
+			if (!nilfs_suinfo_reclaimable(&suinfo[i]))
+				continue;
+
+			/* Scrapped segments can be removed */
+			if (!nilfs_suinfo_empty(&suinfo[i]) &&
+			    cnt64_ge(seqnums[k++], protseq))
 				continue;
-			*snp++ = segnum;
+			*snp++ = segnum + i;
 			rest--;
 		}
 	}
@@ -819,98 +918,151 @@ nilfs_resize_find_active_segments(struct nilfs *nilfs, uint64_t start,
 }
 
 /**
- * nilfs_resize_find_reclaimable_segments - find reclaimable segments within a
- *                                          specified range
+ * nilfs_resize_count_inuse_segments - count the number of in-use segments
+ *                                     within a specified range
  * @nilfs:      nilfs object
  * @start:      starting segment number of search range (inclusive)
  * @end:        ending segment number of search range (inclusive)
- * @segnumv:    array of 64-bit integers that stores the discovered segment
- *              numbers
- * @maxsegnums: maximum number of segments to search (maximum number of
- *              segment numbers that can be stored in @segnumv)
  *
- * This function searches for reclaimable (dirty, non-error, and non-active)
- * segments within the range of the segment sequence specified by
- * [@start, @end], and stores their numbers in @segnumv.
+ * This function counts and returns the number of in-use (dirty) segments
+ * within the range of the segment sequence specified by [@start, @end].
  *
- * Return: on success, the number of reclaimable segments discovered, -1 on
- * error.
+ * Return: number of in-use segments on success, -1 on error.
  */
 static ssize_t
-nilfs_resize_find_reclaimable_segments(struct nilfs *nilfs, uint64_t start,
-				       uint64_t end, uint64_t *segnumv,
-				       unsigned long maxsegnums)
+nilfs_resize_count_inuse_segments(struct nilfs *nilfs, uint64_t start,
+				  uint64_t end)
 {
-	uint64_t segnum, *snp;
+	uint64_t segnum;
 	unsigned long rest, count;
 	ssize_t nsi, i;
+	ssize_t nfound = 0;
 
 	assert(start <= end);
 
 	segnum = start;
-	rest = min_t(uint64_t, maxsegnums, end - start + 1);
-	for (snp = segnumv; rest > 0 && segnum <= end; ) {
+	rest = end - start + 1;
+	while (rest > 0 && segnum <= end) {
 		count = min_t(unsigned long, rest, NILFS_RESIZE_NSUINFO);
 		nsi = nilfs_get_suinfo(nilfs, segnum, suinfo, count);
 		if (unlikely(nsi < 0)) {
-			err("operation failed during searching reclaimable segments");
+			err("operation failed during counting in-use segments");
 			return -1;
 		}
 		for (i = 0; i < nsi; i++, segnum++) {
-			if (nilfs_suinfo_reclaimable(&suinfo[i])) {
-				*snp++ = segnum;
+			if (nilfs_suinfo_dirty(&suinfo[i])) {
+				nfound++;
 				rest--;
 			}
 		}
 	}
-	return snp - segnumv; /* return the number of found segments */
+	return nfound; /* return the number of found segments */
+}
+
+static int nilfs_resize_comp_candidate(const void *elem1,
+				       const void *elem2)
+{
+	const struct nilfs_resize_candidate *c1 = elem1, *c2 = elem2;
+
+	if (c1->nblocks != c2->nblocks)
+		return c1->nblocks < c2->nblocks ? -1 : 1;
+	if (c1->segnum == c2->segnum)
+		return 0;
+	return c1->segnum < c2->segnum ? -1 : 1;
 }
 
 /**
- * nilfs_resize_count_inuse_segments - count the number of in-use segments
- *                                     within a specified range
+ * nilfs_resize_scan_candidates - list reclaimable segments within a
+ *                                specified range
  * @nilfs:      nilfs object
  * @start:      starting segment number of search range (inclusive)
  * @end:        ending segment number of search range (inclusive)
+ * @candidatesp: place to store the allocated candidate array
  *
- * This function counts and returns the number of in-use (dirty) segments
- * within the range of the segment sequence specified by [@start, @end].
+ * This function scans the segment usage of the range specified by
+ * [@start, @end] once, and lists the reclaimable segments in it in
+ * ascending order of the number of used blocks, so that the segments
+ * that are cheapest to move are evacuated first.  The array stored in
+ * @candidatesp must be freed by the caller.
  *
- * Return: number of in-use segments on success, -1 on error.
+ * Return: on success, the number of listed segments, -1 on error.
  */
 static ssize_t
-nilfs_resize_count_inuse_segments(struct nilfs *nilfs, uint64_t start,
-				  uint64_t end)
+nilfs_resize_scan_candidates(struct nilfs *nilfs, uint64_t start,
+			     uint64_t end,
+			     struct nilfs_resize_candidate **candidatesp)
 {
+	struct nilfs_resize_candidate *candidates = NULL, *p;
+	size_t ncands = 0, maxcands = 0;
+	unsigned long count;
 	uint64_t segnum;
-	unsigned long rest, count;
 	ssize_t nsi, i;
-	ssize_t nfound = 0;
 
 	assert(start <= end);
 
-	segnum = start;
-	rest = end - start + 1;
-	while (rest > 0 && segnum <= end) {
-		count = min_t(unsigned long, rest, NILFS_RESIZE_NSUINFO);
+	for (segnum = start; segnum <= end; ) {
+		count = min_t(uint64_t, end - segnum + 1, NILFS_RESIZE_NSUINFO);
 		nsi = nilfs_get_suinfo(nilfs, segnum, suinfo, count);
 		if (unlikely(nsi < 0)) {
-			err("operation failed during counting in-use segments");
-			return -1;
+			err("operation failed during searching reclaimable segments");
+			goto failed;
 		}
+		if (nsi == 0)
+			break;
 		for (i = 0; i < nsi; i++, segnum++) {
-			if (nilfs_suinfo_dirty(&suinfo[i])) {
-				nfound++;
-				rest--;
+			if (!nilfs_suinfo_reclaimable(&suinfo[i]))
+				continue;
+			if (ncands == maxcands) {
+				maxcands = maxcands ? maxcands * 2 :
+					NILFS_RESIZE_NSEGNUMS;
+				p = realloc(candidates,
+					    maxcands * sizeof(*candidates));
+				if (unlikely(!p)) {
+					err("cannot allocate candidate list");
+					goto failed;
+				}
+				candidates = p;
 			}
+			candidates[ncands].segnum = segnum;
+			candidates[ncands++].nblocks = suinfo[i].sui_nblocks;
 		}
 	}
-	return nfound; /* return the number of found segments */
+	qsort(candidates, ncands, sizeof(*candidates),
+	      nilfs_resize_comp_candidate);
+	*candidatesp = candidates;
+	return ncands;
+
+failed:
+	free(candidates);
+	return -1;
 }
 
 #define	NILFS_RESIZE_SEGMENT_PROTECTED		0x01
 #define NILFS_RESIZE_SEGMENT_UNRECLAIMABLE	0x02
 
+/**
+ * nilfs_resize_segments_protected - test if queued segments are protected
+ * @nilfs: nilfs object
+ * @nseq:  number of segments queued in seq_segnums[] and seq_lastmods[]
+ *
+ * Return: 1 if at least one of the segments is protected by superblock
+ * log pointers, 0 otherwise or if their sequence numbers cannot be read.
+ */
+static int nilfs_resize_segments_protected(struct nilfs *nilfs, size_t nseq)
+{
+	uint64_t protseq = sustat.ss_prot_seq;
+	size_t i;
+
+	if (nilfs_get_segment_seqnums(nilfs, seq_segnums, seq_lastmods,
+				      seqnums, nseq) < 0)
+		return 0;
+	for (i = 0; i < nseq; i++) {
+		if (cnt64_ge(seqnums[i], protseq))
+			return 1;
+	}
+	return 0;
+}
+
 /**
  * nilfs_resize_verify_failure - check the cause of movement failure for a
  *                               segment number array
@@ -929,17 +1081,23 @@ nilfs_resize_count_inuse_segments(struct nilfs *nilfs, uint64_t start,
 static int nilfs_resize_verify_failure(struct nilfs *nilfs,
 				       uint64_t *segnumv, unsigned long nsegs)
 {
-	struct nilfs_suinfo si;
+	struct nilfs_suinfo *si;
+	uint64_t lastmod;
+	size_t nseq = 0;
 	int reason = 0;
-	int i, ret;
+	int i, have_si;
+
+	si = malloc(sizeof(*si) * nsegs);
+	have_si = si && nilfs_get_suinfo_batch(nilfs, segnumv, nsegs, si) >= 0;
 
 	for (i = 0; i < nsegs; i++) {
-		if (nilfs_get_suinfo(nilfs, segnumv[i], &si, 1) == 1) {
-			if (!nilfs_suinfo_reclaimable(&si))
+		lastmod = 0;
+		if (have_si) {
+			if (!nilfs_suinfo_reclaimable(&si[i]))
 				reason |= NILFS_RESIZE_SEGMENT_UNRECLAIMABLE;
-			else if (nilfs_suinfo_empty(&si))
+			else if (nilfs_suinfo_empty(&si[i]))
 				continue;  /* Scrapped segment */
-			if (nilfs_suinfo_active(&si)) {
+			if (nilfs_suinfo_active(&si[i])) {
 				/*
 				 * Active segments may not have been written
 				 * either, so we determine them to be protected
@@ -948,12 +1106,19 @@ static int nilfs_resize_verify_failure(struct nilfs *nilfs,
 				reason |= NILFS_RESIZE_SEGMENT_PROTECTED;
 				continue;
 			}
+			lastmod = si[i].sui_lastmod;
+		}
+		seq_segnums[nseq] = segnumv[i];
+		seq_lastmods[nseq] = lastmod;
+		if (++nseq == NILFS_RESIZE_NSUINFO) {
+			if (nilfs_resize_segments_protected(nilfs, nseq))
+				reason |= NILFS_RESIZE_SEGMENT_PROTECTED;
+			nseq = 0;
 		}
-		ret = nilfs_segment_is_protected(nilfs, segnumv[i],
-						 sustat.ss_prot_seq);
-		if (ret > 0)
-			reason |= NILFS_RESIZE_SEGMENT_PROTECTED;
 	}
+	if (nseq > 0 && nilfs_resize_segments_protected(nilfs, nseq))
+		reason |= NILFS_RESIZE_SEGMENT_PROTECTED;
+	free(si);
 	return reason;
 }
 
@@ -966,11 +1131,12 @@ static int nilfs_resize_verify_failure(struct nilfs *nilfs,
  * @reason:  place to store the reason as an OR value of bit flags, if
  *           there are segments that failed to move
  *
- * This function attempts to move each segment specified by the segment
- * number array @segnumv, and if a successfully moved (evicted) segment
- * is in the area to be truncated, it calls nilfs_resize_progress_inc()
- * to advance the displayed truncation progress by the number of successful
- * segments.
+ * This function attempts to move the segments specified by the segment
+ * number array @segnumv in a single reclaim request, and if a successfully
+ * moved (evicted) segment is in the area to be truncated, it calls
+ * nilfs_resize_progress_inc() to advance the displayed truncation progress
+ * by the number of successful segments.  The size of the request and the
+ * pacing between requests are up to the caller.
  *
  * If there are segments that fail to be moved and @reason is not %NULL, it
  * uses nilfs_resize_verify_failure() to check the reason for the failure
@@ -984,44 +1150,34 @@ static ssize_t nilfs_resize_move_segments(struct nilfs *nilfs,
 					  uint64_t *segnumv,
 					  unsigned long nsegs, int *reason)
 {
-	unsigned long rest = nsegs, nc;
-	uint64_t *snp = segnumv;
-	ssize_t nmoved = 0, i, nhits;
+	ssize_t i, nhits;
 	int rv = 0;
 	int ret;
 
-	for (snp = segnumv; rest > 0; snp += nc, rest -= nc) {
-		nc = min_t(unsigned long, rest, nsegments_per_clean);
-
-		ret = nilfs_resize_update_sustat(nilfs);
-		if (unlikely(ret < 0))
-			return -1;
-
-		ret = nilfs_reclaim_segment(nilfs, snp, nc,
-					    sustat.ss_prot_seq, 0);
-		if (unlikely(ret < 0))
-			return -1;
-
-		nmoved += ret;
-
-		/* updating progress bar */
-		for (i = 0, nhits = 0; i < ret; i++) {
-			if (snp[i] >= trunc_start && snp[i] <= trunc_end)
-				nhits++;
-		}
-		if (nhits)
-			nilfs_resize_progress_inc(nhits);
+	ret = nilfs_resize_update_sustat(nilfs);
+	if (unlikely(ret < 0))
+		return -1;
 
-		/* check reason of gc failure */
-		if (ret < nc && reason)
-			rv |= nilfs_resize_verify_failure(nilfs, snp + ret,
-							  nc - ret);
+	ret = nilfs_reclaim_segment(nilfs, segnumv, nsegs, sustat.ss_prot_seq,
+				    0);
+	if (unlikely(ret < 0))
+		return -1;
 
-		nanosleep(&clean_interval, NULL);
+	/* updating progress bar */
+	for (i = 0, nhits = 0; i < ret; i++) {
+		if (segnumv[i] >= trunc_start && segnumv[i] <= trunc_end)
+			nhits++;
 	}
+	if (nhits)
+		nilfs_resize_progress_inc(nhits);
+
+	/* check reason of gc failure */
+	if (ret < nsegs && reason)
+		rv = nilfs_resize_verify_failure(nilfs, segnumv + ret,
+						 nsegs - ret);
 	if (reason)
 		*reason = rv;
-	return nmoved;
+	return ret;
 }
 
 static int __nilfs_resize_try_update_log_cursor(struct nilfs *nilfs)
@@ -1072,6 +1228,161 @@ static int nilfs_resize_try_update_log_cursor(struct nilfs *nilfs,
 	return ret;
 }
 
+/**
+ * nilfs_resize_delete_checkpoints - delete checkpoints in a range
+ * @nilfs: nilfs object
+ * @start: first checkpoint number of the range (inclusive)
+ * @end:   last checkpoint number of the range (inclusive)
+ *
+ * Snapshots and checkpoints that are in use are left as they are.
+ */
+static void nilfs_resize_delete_checkpoints(struct nilfs *nilfs,
+					    nilfs_cno_t start, nilfs_cno_t end)
+{
+	struct nilfs_cpdel_stat stat;
+
+	if (unlikely(nilfs_delete_checkpoints(nilfs, start, end, &stat,
+					      NULL, NULL) < 0))
+		verbose_err("cannot delete checkpoint %llu",
+			    (unsigned long long)stat.cno);
+}
+
+/**
+ * nilfs_resize_prod_fs - force the file system update to move active segments
+ * @nilfs:      nilfs object
+ * @start:      starting segment number of the range to be vacated
+ * @end:        ending segment number of the range to be vacated
+ * @nblk_write: maximum write data size (in blocks)
+ *
+ * This function creates a temporary file (balloon file) on the root
+ * directory that @nilfs holds, and appends up to @nblk_write blocks of
+ * a fixed pattern to it, writing them to the log via nilfs_sync().  The
+ * data is written in steps that fill up the active segment in turn, and
+ * the writing stops as soon as no active segment is left in the range
+ * [@start, @end].  The balloon file is then deleted along with the
+ * checkpoints that contain it.
+ *
+ * Return: 0 on success, -1 on error.
+ */
+static int nilfs_resize_prod_fs(struct nilfs *nilfs, uint64_t start,
+				uint64_t end, unsigned long nblk_write)
+{
+	char filename[NILFS_RESIZE_BALLOON_FILENAME_BUFSZ];
+	unsigned long step, rest = nblk_write;
+	const char *dev = nilfs_get_dev(nilfs);
+	int dirfd = nilfs_get_root_fd(nilfs);
+	nilfs_cno_t cno, scno, ecno = 0;
+	sigset_t newset, sigset;
+	unsigned char *data_buf;
+	size_t bufsize, i;
+	uint64_t segnum;
+	ssize_t nfound;
+	int out_fd;
+	int ret, res = -1;
+
+	if (!nblk_write)
+		return 0;
+
+	bufsize = min_t(uint64_t, (uint64_t)nblk_write * layout.blocksize,
+			NILFS_RESIZE_BALLOON_MAX_CHUNKSIZE);
+	data_buf = malloc(bufsize);
+	if (unlikely(!data_buf))
+		return -1;
+
+	/*
+	 * The contents do not matter as long as they are not a hole, so
+	 * a pattern generated once with rand() is reused for every write.
+	 */
+	for (i = 0; i < bufsize; i++)
+		data_buf[i] = rand() & 0xff;
+
+	ret = nilfs_sync(nilfs, &scno);
+	if (unlikely(ret < 0))
+		scno = 0;
+
+	/* Block signals */
+	sigemptyset(&newset);
+	sigaddset(&newset, SIGINT);
+	sigaddset(&newset, SIGTERM);
+	ret = sigprocmask(SIG_BLOCK, &newset, &sigset);
+	if (unlikely(ret < 0)) {
+		err("cannot block signals");
+		goto failed;
+	}
+
+	/* Write a balloon file to the filesystem */
+	snprintf(filename, NILFS_RESIZE_BALLOON_FILENAME_BUFSZ,
+		 NILFS_RESIZE_BALLOON_FILENAME_FMT, (unsigned)getpid());
+
+	out_fd = openat(dirfd, filename, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+			S_IWUSR | S_IRUSR);
+	if (unlikely(out_fd < 0)) {
+		err("failed to create balloon file on %s", dev);
+		goto failed_unblock_signals;
+	}
+
+	/*
+	 * The first step fills up the segment being written, and each of
+	 * the following steps fills up one more segment.
+	 */
+	step = rest > layout.blocks_per_segment ?
+		rest - layout.blocks_per_segment : rest;
+	while (rest > 0) {
+		uint64_t bytes = (uint64_t)step * layout.blocksize;
+
+		while (bytes > 0) {
+			size_t request = min_t(uint64_t, bytes, bufsize);
+			ssize_t count;
+
+			count = write(out_fd, data_buf, request);
+			if (unlikely(count < 0)) {
+				err("failed to inflate balloon file on %s",
+				    dev);
+				goto out_sync;
+			}
+			bytes -= count;
+		}
+		rest -= step;
+		step = min_t(unsigned long, rest, layout.blocks_per_segment);
+
+		ret = nilfs_sync(nilfs, &ecno);
+		if (unlikely(ret < 0)) {
+			ecno = 0;
+			continue;
+		}
+		nfound = nilfs_resize_find_active_segments(
+			nilfs, start, end, &segnum, 1, NULL);
+		if (nfound == 0)
+			break;
+	}
+
+out_sync:
+	ret = nilfs_sync(nilfs, &cno);
+	if (likely(ret == 0))
+		ecno = cno;
+	close(out_fd);
+
+	/* Delete the balloon file */
+	ret = unlinkat(dirfd, filename, 0);
+	if (unlikely(ret < 0))
+		verbose_err("Balloon file deletion on %s failed", dev);
+
+	/* Delete checkpoints created during prodding */
+	if (likely(ecno > 0))
+		nilfs_resize_delete_checkpoints(nilfs, scno ? scno + 1 : ecno,
+						ecno);
+	nilfs_sync(nilfs, &cno);
+	res = 0;
+
+failed_unblock_signals:
+	sigprocmask(SIG_SETMASK, &sigset, NULL);  /* Unblock signals */
+
+	nilfs_resize_update_sustat(nilfs);
+failed:
+	free(data_buf);
+	return res;
+}
+
 /**
  * nilfs_resize_reclaim_nibble - somehow move a specified number of segments
  *                               within a specified range or in front of it
@@ -1126,6 +1437,7 @@ retry:
 		nm = nilfs_resize_move_segments(nilfs, segnumv, nfound, NULL);
 		if (unlikely(nm < 0))
 			goto failed;
+		nanosleep(&clean_interval, NULL);
 
 		nmoved += nm;
 		if (nmoved >= count) {
@@ -1168,7 +1480,8 @@ retry:
 				    "no movable segments.\n"
 				    "Try forcing a filesystem update.\n",
 				    nfound == 1 ? " is" : "s are");
-			ret = nilfs_resize_prod_fs(nilfs, max_blocks - nblocks);
+			ret = nilfs_resize_prod_fs(nilfs, start, end2,
+						   max_blocks - nblocks);
 			if (unlikely(ret < 0)) {
 				err("forced filesystem update failed");
 				goto failed;
@@ -1244,18 +1557,122 @@ static int nilfs_resize_move_out_active_segments(struct nilfs *nilfs,
 	return retrycnt > 0;
 }
 
+/**
+ * nilfs_resize_adjust_batch - size the next reclaim batch
+ * @batch:   size of the batch that has just been reclaimed
+ * @nmoved:  number of segments moved by the batch
+ * @elapsed: time taken by the batch
+ *
+ * The next batch is sized by the measured throughput so that it takes
+ * about %NILFS_RESIZE_BATCH_TARGET_MSEC, growing by at most a factor of
+ * two at a time up to %NILFS_RESIZE_BATCH_MAX segments.  A batch that
+ * moved nothing restarts from nsegments_per_clean.
+ *
+ * Return: number of segments to reclaim in the next batch.
+ */
+static unsigned long nilfs_resize_adjust_batch(unsigned long batch,
+					       ssize_t nmoved,
+					       const struct timespec *elapsed)
+{
+	double msec, next;
+
+	if (nmoved <= 0)
+		return nsegments_per_clean;
+
+	msec = elapsed->tv_sec * 1e3 + elapsed->tv_nsec / 1e6;
+	if (msec < 1)
+		msec = 1;
+	next = nmoved * NILFS_RESIZE_BATCH_TARGET_MSEC / msec;
+	if (next > batch * 2)
+		next = batch * 2;
+	if (next < nsegments_per_clean)
+		next = nsegments_per_clean;
+	if (next > NILFS_RESIZE_BATCH_MAX)
+		next = NILFS_RESIZE_BATCH_MAX;
+	return next;
+}
+
+/**
+ * nilfs_resize_prepare_batch - fill segnums[] with still reclaimable
+ *                              candidates
+ * @nilfs:      nilfs object
+ * @candidates: candidate array
+ * @ncands:     number of candidates in @candidates
+ * @nskipped:   place to store the number of candidates that have been
+ *              freed since the scan
+ *
+ * The candidates were listed by a single scan, so the usage of each batch
+ * is looked up again to leave out segments that have become clean or
+ * unreclaimable in the meantime.
+ *
+ * Return: number of segments stored in segnums[] on success, -1 on error.
+ */
+static ssize_t
+nilfs_resize_prepare_batch(struct nilfs *nilfs,
+			   const struct nilfs_resize_candidate *candidates,
+			   size_t ncands, size_t *nskipped)
+{
+	ssize_t i, n = 0;
+
+	for (i = 0; i < ncands; i++)
+		segnums[i] = candidates[i].segnum;
+	if (nilfs_get_suinfo_batch(nilfs, segnums, ncands, batch_suinfo) < 0) {
+		err("operation failed during searching reclaimable segments");
+		return -1;
+	}
+	*nskipped = 0;
+	for (i = 0; i < ncands; i++) {
+		if (nilfs_suinfo_reclaimable(&batch_suinfo[i]))
+			segnums[n++] = segnums[i];
+		else if (!nilfs_suinfo_dirty(&batch_suinfo[i]))
+			(*nskipped)++;
+	}
+	return n;
+}
+
+/**
+ * nilfs_resize_recount_progress - reevaluate the progress of evacuation
+ * @nilfs: nilfs object
+ * @start: starting segment number of the truncation range
+ * @end:   ending segment number of the truncation range
+ */
+static void nilfs_resize_recount_progress(struct nilfs *nilfs,
+					  uint64_t start, uint64_t end)
+{
+	ssize_t nuses;
+
+	if (!pm_in_progress)
+		return;
+	nuses = nilfs_resize_count_inuse_segments(nilfs, start, end);
+	if (nuses >= 0) {
+		if (nuses > pm_max)
+			pm_max = nuses;
+		nilfs_resize_progress_update(pm_max - nuses);
+	}
+}
+
 /**
  * nilfs_resize_reclaim_range - reclaim segments to shrink the file system
  *                              to a specified number of segments
  * @nilfs:    nilfs object
  * @newnsegs: target number of segments for shrink
+ * @from:     segment number from which to evacuate reclaimable segments
  *
  * This function evicts in-use segments from the range that exceeds
  * @newnsegs limit so that the used segment space stays below the @newnsegs
  * limit.
  *
  * It first tries to evict active segments from outside the range, and if
- * successful, reclaims the remaining reclaimable segments.
+ * successful, reclaims the remaining reclaimable segments.  These are
+ * listed by a single scan of the range and reclaimed in batches sized by
+ * nilfs_resize_adjust_batch() from the measured reclaim throughput; the
+ * function only sleeps to back off when a batch moves nothing.
+ *
+ * The reclaimable segments from @from onward are processed in windows of
+ * %NILFS_RESIZE_WINDOW_NSEGS segments, and the state file is updated
+ * after each window.  If the shrink is interrupted by a signal, the
+ * state is saved and the function returns early with
+ * nilfs_resize_interrupted set.
  * If part of the eviction of reclaimable segments fails due to the
  * presence of protected segments by log cursors, it attempts to remove
  * them using nilfs_resize_reclaim_nibble().
@@ -1265,10 +1682,13 @@ static int nilfs_resize_move_out_active_segments(struct nilfs *nilfs,
  *
  * Return: 0 on success, -1 on failure.
  */
-static int nilfs_resize_reclaim_range(struct nilfs *nilfs, uint64_t newnsegs)
+static int nilfs_resize_reclaim_range(struct nilfs *nilfs, uint64_t newnsegs,
+				      uint64_t from)
 {
-	unsigned long long start, end, segnum;
-	ssize_t nfound;
+	struct nilfs_resize_candidate *candidates = NULL;
+	unsigned long long start, end, wstart, wend;
+	unsigned long batch;
+	ssize_t nfound, ncands, i, nc, ntotal = 0, ncands_total = 0;
 	int ret;
 
 	ret = nilfs_resize_update_sustat(nilfs);
@@ -1289,59 +1709,375 @@ static int nilfs_resize_reclaim_range(struct nilfs *nilfs, uint64_t newnsegs)
 	ret = nilfs_resize_move_out_active_segments(nilfs, start, end);
 	if (unlikely(ret < 0))
 		goto out;
-	if (ret && pm_in_progress) {
-		nfound = nilfs_resize_count_inuse_segments(nilfs, start, end);
-		if (nfound >= 0) {
-			if (nfound > pm_max)
-				pm_max = nfound;
-			nilfs_resize_progress_update(pm_max - nfound);
+	if (ret)
+		nilfs_resize_recount_progress(nilfs, start, end);
+
+	ret = -1;
+	batch = nsegments_per_clean;
+	for (wstart = max_t(uint64_t, from, start); wstart <= end;
+	     wstart = wend + 1) {
+		wend = min_t(uint64_t, end,
+			     wstart + NILFS_RESIZE_WINDOW_NSEGS - 1);
+		ncands = nilfs_resize_scan_candidates(nilfs, wstart, wend,
+						      &candidates);
+		if (unlikely(ncands < 0))
+			goto out;
+		ncands_total += ncands;
+
+		for (i = 0; i < ncands; i += nc) {
+			struct timespec t0, t1;
+			ssize_t nmoved;
+			size_t nskipped;
+			int reason = 0;
+
+			if (nilfs_resize_interrupted) {
+				rstate.cursor = wstart;
+				goto out_save;
+			}
+
+			nc = min_t(size_t, ncands - i, batch);
+			nfound = nilfs_resize_prepare_batch(
+				nilfs, &candidates[i], nc, &nskipped);
+			if (unlikely(nfound < 0))
+				goto out_free;
+			if (nskipped)
+				nilfs_resize_progress_inc(nskipped);
+			if (nfound == 0)
+				continue;
+
+			clock_gettime(CLOCK_MONOTONIC, &t0);
+			nmoved = nilfs_resize_move_segments(
+				nilfs, segnums, nfound, &reason);
+			if (unlikely(nmoved < 0)) {
+				err("operation failed during moving reclaimable segments");
+				goto out_free;
+			}
+			clock_gettime(CLOCK_MONOTONIC, &t1);
+			timespecsub(&t1, &t0, &t1);
+			batch = nilfs_resize_adjust_batch(nfound, nmoved, &t1);
+			ntotal += nmoved;
+			rstate.nmoved += nmoved;
+
+			if (nmoved < nfound &&
+			    (reason & NILFS_RESIZE_SEGMENT_PROTECTED)) {
+				nilfs_resize_reclaim_nibble(nilfs, start, end,
+							    2, 1);
+				nilfs_resize_recount_progress(nilfs, start,
+							      end);
+			}
+			if (nmoved == 0)
+				nanosleep(&clean_interval, NULL); /* back off */
 		}
+		free(candidates);
+		candidates = NULL;
+
+		/* The window is done; resume from the next one */
+		rstate.cursor = wend + 1;
+		nilfs_resize_save_state();
 	}
+	verbose_msg("Moved %zd of %zd candidate segment%s.\n", ntotal,
+		    ncands_total, ncands_total != 1 ? "s" : "");
+	ret = 0;
+out_free:
+	free(candidates);
+out:
+	return ret;
 
-	ret = -1;
-	segnum = start;
-	while (segnum <= end) {
-		ssize_t nfound;
-		ssize_t nmoved;
-		int reason = 0;
+out_save:
+	verbose_msg("Interrupted after moving %zd segment%s.\n", ntotal,
+		    ntotal != 1 ? "s" : "");
+	nilfs_resize_save_state();
+	ret = 0;
+	goto out_free;
+}
 
-		nfound = nilfs_resize_find_reclaimable_segments(
-			nilfs, segnum, end, segnums, NILFS_RESIZE_NSEGNUMS);
-		if (unlikely(nfound < 0))
-			goto out;
+/**
+ * nilfs_resize_format_duration - format a duration for messages
+ * @sec:  duration in seconds
+ * @buf:  buffer to store the string
+ * @size: size of @buf
+ */
+static void nilfs_resize_format_duration(double sec, char *buf, size_t size)
+{
+	unsigned long long t = sec + 0.5;
+
+	if (sec < 60)
+		snprintf(buf, size, "%.1f seconds", sec);
+	else if (t < 3600)
+		snprintf(buf, size, "%llum %02llus", t / 60, t % 60);
+	else if (t < 86400)
+		snprintf(buf, size, "%lluh %02llum", t / 3600, t / 60 % 60);
+	else
+		snprintf(buf, size, "%llud %02lluh %02llum", t / 86400,
+			 t / 3600 % 24, t / 60 % 60);
+}
 
-		if (nfound == 0)
+/**
+ * struct nilfs_resize_plan - usage of the truncation range
+ * @nclean:     number of clean segments
+ * @ninuse:     number of in-use (dirty) segments
+ * @nmovable:   number of segments that can be reclaimed right away
+ * @nscrapped:  number of reclaimable segments without used blocks
+ * @nprotected: number of segments protected by the log cursors
+ * @nactive:    number of segments grabbed by the log writer
+ * @nerror:     number of erroneous segments
+ * @nactive_blocks: number of used blocks in the active segments
+ */
+struct nilfs_resize_plan {
+	uint64_t nclean;
+	uint64_t ninuse;
+	uint64_t nmovable;
+	uint64_t nscrapped;
+	uint64_t nprotected;
+	uint64_t nactive;
+	uint64_t nerror;
+	uint64_t nactive_blocks;
+};
+
+/**
+ * nilfs_resize_plan_scan - classify the segments of the truncation range
+ * @nilfs:       nilfs object
+ * @start:       starting segment number of the range (inclusive)
+ * @end:         ending segment number of the range (inclusive)
+ * @plan:        place to store the segment counts
+ * @candidatesp: place to store the allocated array of movable segments
+ *
+ * Return: number of movable segments stored in @candidatesp on success,
+ * -1 on error.
+ */
+static ssize_t
+nilfs_resize_plan_scan(struct nilfs *nilfs, uint64_t start, uint64_t end,
+		       struct nilfs_resize_plan *plan,
+		       struct nilfs_resize_candidate **candidatesp)
+{
+	struct nilfs_resize_candidate *candidates = NULL, *p;
+	uint64_t protseq = sustat.ss_prot_seq;
+	size_t maxcands = 0;
+	unsigned long count;
+	uint64_t segnum;
+	ssize_t nsi, i, nseq, k;
+	int ret;
+
+	memset(plan, 0, sizeof(*plan));
+	for (segnum = start; segnum <= end; segnum += nsi) {
+		count = min_t(uint64_t, end - segnum + 1, NILFS_RESIZE_NSUINFO);
+		nsi = nilfs_get_suinfo(nilfs, segnum, suinfo, count);
+		if (unlikely(nsi < 0)) {
+			err("operation failed during scanning segments");
+			goto failed;
+		}
+		if (nsi == 0)
 			break;
 
-		/*
-		 * Updates @segnum before calling nilfs_resize_move_segments()
-		 * because segnums may be changed during reclamation.
-		 */
-		segnum = segnums[nfound - 1] + 1;
-		nmoved = nilfs_resize_move_segments(
-			nilfs, segnums, nfound, &reason);
-		if (unlikely(nmoved < 0)) {
-			err("operation failed during moving reclaimable segments");
-			goto out;
+		/* read sequence numbers of in-use segments in a batch */
+		for (i = 0, nseq = 0; i < nsi; i++) {
+			if (!nilfs_suinfo_reclaimable(&suinfo[i]) ||
+			    nilfs_suinfo_empty(&suinfo[i]))
+				continue;
+			seq_segnums[nseq] = segnum + i;
+			seq_lastmods[nseq] = suinfo[i].sui_lastmod;
+			nseq++;
+		}
+		if (nseq > 0) {
+			ret = nilfs_get_segment_seqnums(nilfs, seq_segnums,
+							seq_lastmods, seqnums,
+							nseq);
+			if (unlikely(ret < 0)) {
+				err("failed to read segment");
+				goto failed;
+			}
 		}
 
-		if (nmoved < nfound &&
-		    (reason & NILFS_RESIZE_SEGMENT_PROTECTED)) {
-			nilfs_resize_reclaim_nibble(nilfs, start, end, 2, 1);
-			if (pm_in_progress) {
-				nfound = nilfs_resize_count_inuse_segments(
-					nilfs, start, end);
-				if (nfound >= 0) {
-					if (nfound > pm_max)
-						pm_max = nfound;
-					nilfs_resize_progress_update(
-						pm_max - nfound);
+		for (i = 0, k = 0; i < nsi; i++) {
+			if (!nilfs_suinfo_dirty(&suinfo[i])) {
+				plan->nclean++;
+				continue;
+			}
+			plan->ninuse++;
+			if (nilfs_suinfo_error(&suinfo[i])) {
+				plan->nerror++;
+				continue;
+			}
+			if (nilfs_suinfo_active(&suinfo[i])) {
+				plan->nactive++;
+				plan->nactive_blocks += suinfo[i].sui_nblocks;
+				continue;
+			}
+			if (nilfs_suinfo_empty(&suinfo[i])) {
+				plan->nscrapped++;
+				continue;
+			}
+			if (cnt64_ge(seqnums[k++], protseq)) {
+				plan->nprotected++;
+				continue;
+			}
+			if (plan->nmovable == maxcands) {
+				maxcands = maxcands ? maxcands * 2 :
+					NILFS_RESIZE_NSEGNUMS;
+				p = realloc(candidates,
+					    maxcands * sizeof(*candidates));
+				if (unlikely(!p)) {
+					err("cannot allocate segment list");
+					goto failed;
 				}
+				candidates = p;
 			}
+			candidates[plan->nmovable].segnum = segnum + i;
+			candidates[plan->nmovable++].nblocks =
+				suinfo[i].sui_nblocks;
 		}
 	}
+	*candidatesp = candidates;
+	return plan->nmovable;
+
+failed:
+	free(candidates);
+	return -1;
+}
+
+/**
+ * nilfs_resize_plan - estimate the cost of shrinking the file system
+ * @nilfs:    nilfs object
+ * @newnsegs: target number of segments for shrink
+ *
+ * This function counts the segments in the truncation range by state,
+ * and estimates the number of live blocks to be relocated by assessing
+ * an evenly spaced sample of the movable segments through the GC
+ * assessment path.  The time estimate is derived from the throughput
+ * recorded by an interrupted shrink if there is one.  Otherwise, only if
+ * --benchmark is given, it is derived from a short reclaim benchmark
+ * that moves up to %NILFS_RESIZE_PLAN_NBENCH of the sampled segments like
+ * the cleaner does.  Apart from the benchmark, the file system is only
+ * read.
+ *
+ * Return: 0 on success, -1 on failure.
+ */
+static int nilfs_resize_plan(struct nilfs *nilfs, uint64_t newnsegs)
+{
+	struct nilfs_reclaim_params params = {
+		.flags = NILFS_RECLAIM_PARAM_PROTSEQ |
+			 NILFS_RECLAIM_PARAM_PROTCNO,
+		.protseq = sustat.ss_prot_seq,
+		.protcno = 0
+	};
+	struct nilfs_resize_candidate *candidates = NULL;
+	struct nilfs_reclaim_stat stat;
+	struct nilfs_resize_plan plan;
+	size_t live_blks[NILFS_RESIZE_NSEGNUMS];
+	uint64_t start = newnsegs, end = sustat.ss_nsegs - 1;
+	uint64_t step, nlive_sampled = 0, nrelocate, nsegs;
+	struct timespec t0, t1;
+	double avg_live = 0, sec;
+	ssize_t ncands, nsampled = 0, i;
+	char buf[64];
+	int ret = -1;
+
+	ncands = nilfs_resize_plan_scan(nilfs, start, end, &plan, &candidates);
+	if (unlikely(ncands < 0))
+		return -1;
+
+	msg("Shrink plan for segments %" PRIu64 " to %" PRIu64 ":\n"
+	    "  clean segments:      %10" PRIu64 "\n"
+	    "  in-use segments:     %10" PRIu64 "\n"
+	    "    movable:           %10" PRIu64 "\n"
+	    "    scrapped:          %10" PRIu64 "\n"
+	    "    protected:         %10" PRIu64 "\n"
+	    "    active:            %10" PRIu64 "\n"
+	    "    erroneous:         %10" PRIu64 "\n",
+	    start, end, plan.nclean, plan.ninuse, plan.nmovable,
+	    plan.nscrapped, plan.nprotected, plan.nactive, plan.nerror);
+
+	if (plan.nerror > 0)
+		msg("  note: erroneous segments cannot be moved\n");
+
+	/* Assess live blocks of evenly spaced movable segments */
+	if (ncands > 0) {
+		step = DIV_ROUND_UP(ncands, NILFS_RESIZE_NSEGNUMS);
+		for (i = 0; i < ncands; i += step)
+			segnums[nsampled++] = candidates[i].segnum;
+
+		nsampled = nilfs_assess_segment_usage(nilfs, segnums, nsampled,
+						      &params, live_blks);
+		if (unlikely(nsampled < 0)) {
+			err("failed to assess segments");
+			goto out;
+		}
+		for (i = 0; i < nsampled; i++)
+			nlive_sampled += live_blks[i];
+		if (nsampled > 0)
+			avg_live = (double)nlive_sampled / nsampled;
+	}
+
+	/*
+	 * Protected segments are moved like movable ones once the log
+	 * cursors advance, and active segments are moved out as a whole.
+	 */
+	nrelocate = avg_live * (plan.nmovable + plan.nprotected) +
+		plan.nactive_blocks;
+	msg("  live blocks:         %10.1f per segment (%zd sampled)\n"
+	    "  data to relocate:    %10" PRIu64 " bytes\n",
+	    avg_live, nsampled, nrelocate << layout.blocksize_bits);
+
 	ret = 0;
+	nsegs = plan.nmovable + plan.nprotected + plan.nactive;
+	if (nsegs == 0) {
+		msg("  estimated time:      no segments need to be moved\n");
+		goto out;
+	}
+
+	if (!plan_benchmark && rstate.nmoved > 0 && rstate.elapsed > 0) {
+		/* Use the throughput of the interrupted shrink */
+		sec = (double)rstate.elapsed * nsegs / rstate.nmoved;
+		nilfs_resize_format_duration(sec, buf, sizeof(buf));
+		msg("  estimated time:      %s (at the rate of the interrupted shrink)\n",
+		    buf);
+		goto out;
+	}
+	if (!plan_benchmark) {
+		msg("  estimated time:      unknown (use --benchmark to measure)\n");
+		goto out;
+	}
+	if (nsampled == 0) {
+		msg("  estimated time:      unknown (no movable segments to measure)\n");
+		goto out;
+	}
+
+	/* Measure the reclaim speed on a few of the assessed segments */
+	ret = nilfs_resize_update_sustat(nilfs);
+	if (unlikely(ret < 0))
+		goto out;
+	params.protseq = sustat.ss_prot_seq;
+	memset(&stat, 0, sizeof(stat));
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	ret = nilfs_xreclaim_segment(nilfs, segnums,
+				     min_t(ssize_t, nsampled,
+					   NILFS_RESIZE_PLAN_NBENCH),
+				     0, &params, &stat);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	if (unlikely(ret < 0)) {
+		err("reclaim benchmark failed");
+		goto out;
+	}
+	ret = 0;
+	timespecsub(&t1, &t0, &t1);
+	sec = t1.tv_sec + t1.tv_nsec / 1e9;
+
+	msg("  reclaim benchmark:   %10zu segments, %zu blocks in %.3f seconds\n",
+	    stat.cleaned_segs, stat.live_blks, sec);
+	if (stat.cleaned_segs == 0) {
+		msg("  estimated time:      unknown (no segments were moved)\n");
+		goto out;
+	}
+
+	if (stat.live_blks > 0)
+		sec = sec * nrelocate / stat.live_blks;
+	else
+		sec = sec * nsegs / stat.cleaned_segs;
+	nilfs_resize_format_duration(sec, buf, sizeof(buf));
+	msg("  estimated time:      %s\n", buf);
 out:
+	free(candidates);
 	return ret;
 }
 
@@ -1412,8 +2148,10 @@ static int nilfs_shrink_online(struct nilfs *nilfs, const char *device,
 	int status = EXIT_FAILURE;
 	unsigned long long newsb2off; /* new offset of secondary super block */
 	uint64_t newnsegs;
+	struct sigaction sa;
 	ssize_t nuses;
 	unsigned retry;
+	int nospace;
 	int ret;
 
 	/* set logger callback */
@@ -1441,8 +2179,9 @@ static int nilfs_shrink_online(struct nilfs *nilfs, const char *device,
 	}
 
 	ret = nilfs_resize_check_free_space(nilfs, newnsegs);
-	if (ret < 0)
+	if (ret < 0 && !plan_only)
 		goto out;
+	nospace = ret < 0;
 
 	if (newnsegs < sustat.ss_nsegs) {
 		uint64_t truncsegs = sustat.ss_nsegs - newnsegs;
@@ -1459,9 +2198,19 @@ static int nilfs_shrink_online(struct nilfs *nilfs, const char *device,
 		goto out;
 	}
 
+	if (plan_only) {
+		if (newnsegs < sustat.ss_nsegs &&
+		    nilfs_resize_plan(nilfs, newnsegs) < 0)
+			goto out;
+		if (!nospace)
+			status = EXIT_SUCCESS;
+		goto out;
+	}
+
 	if (!assume_yes && nilfs_resize_prompt(newsize) < 0)
 		goto out;
 
+	/* The range may be in place already if the shrink is resumed */
 	ret = nilfs_set_alloc_range(nilfs, 0, newsize);
 	if (unlikely(ret < 0)) {
 		err("failed to limit allocation range");
@@ -1470,6 +2219,24 @@ static int nilfs_shrink_online(struct nilfs *nilfs, const char *device,
 		goto out;
 	}
 
+	if (!resume_mode) {
+		if (nilfs_resize_state_init(nilfs, 1) < 0) {
+			msg("The shrink cannot be resumed if interrupted.\n");
+			free(rstate_path);
+			rstate_path = NULL;
+		}
+		rstate.newsize = newsize;
+		rstate.devsize = layout.devsize;
+		rstate.cursor = newnsegs;
+		nilfs_resize_save_state();
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = nilfs_resize_handle_signal;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
 	if (newnsegs < sustat.ss_nsegs) {
 		trunc_start = newnsegs;
 		trunc_end = sustat.ss_nsegs - 1;
@@ -1487,9 +2254,13 @@ static int nilfs_shrink_online(struct nilfs *nilfs, const char *device,
 		int ec;
 
 		/* shrinker retry loop */
-		ret = nilfs_resize_reclaim_range(nilfs, newnsegs);
+		ret = nilfs_resize_reclaim_range(nilfs, newnsegs,
+						 retry ? newnsegs :
+						 rstate.cursor);
 		if (unlikely(ret < 0))
 			goto restore_alloc_range;
+		if (nilfs_resize_interrupted)
+			goto interrupted;
 
 		ret = nilfs_resize_lock_cleaner(nilfs, &sigset);
 		if (unlikely(ret < 0))
@@ -1502,6 +2273,7 @@ static int nilfs_shrink_online(struct nilfs *nilfs, const char *device,
 
 		nilfs_resize_unlock_cleaner(nilfs, &sigset);
 		if (likely(ret == 0)) {
+			nilfs_resize_remove_state();
 			status = EXIT_SUCCESS;
 			goto out;
 		}
@@ -1533,7 +2305,15 @@ out:
 
 restore_alloc_range:
 	nilfs_resize_restore_alloc_range(nilfs);
+	nilfs_resize_remove_state();
 	goto out;
+
+interrupted:
+	/* Keep the allocation range so that evacuated segments stay free */
+	nilfs_resize_progress_exit();
+	nilfs_resize_save_state();
+	msg("Interrupted.  Run nilfs-resize with --resume to continue.\n");
+	return status;
 }
 
 /**
@@ -1595,8 +2375,11 @@ out:
  * @newsize bytes.
  *
  * It first opens nilfs file system with nilfs_open() and reads its
- * layout information.  Then, if @newsize is larger than the current
- * device size recognized by the file system, it calls
+ * layout information.  If a shrink was interrupted, its state is
+ * loaded; it is resumed or cancelled if requested, and otherwise the
+ * resize is refused so that the truncation range excluded from
+ * allocation is not forgotten.  Then, if @newsize is larger than the
+ * current device size recognized by the file system, it calls
  * nilfs_extend_online(), or if it is smaller than the current device size,
  * calls nilfs_shrink_online().  The nilfs object is eventually closed using
  * nilfs_close().
@@ -1608,6 +2391,7 @@ static int nilfs_resize_online(const char *device, uint64_t newsize)
 	struct nilfs *nilfs;
 	nilfs_cno_t cno;
 	int status = EXIT_FAILURE;
+	int pending;
 	int ret;
 
 	nilfs = nilfs_open(device, NULL,
@@ -1621,6 +2405,62 @@ static int nilfs_resize_online(const char *device, uint64_t newsize)
 	if (unlikely(ret < 0))
 		goto out_unlock;
 
+	ret = nilfs_resize_state_init(nilfs, 0);
+	if (ret == 0)
+		ret = nilfs_resize_load_state();
+	if (ret < 0 && (resume_mode || abort_mode))
+		goto out_unlock;
+	pending = ret > 0;
+
+	if ((resume_mode || abort_mode) && !pending) {
+		errx("no interrupted shrink of %s to %s.", device,
+		     resume_mode ? "resume" : "abort");
+		goto out_unlock;
+	}
+
+	if (abort_mode) {
+		status = nilfs_resize_abort(nilfs, device);
+		goto out_unlock;
+	}
+
+	if (pending && layout.devsize == rstate.newsize) {
+		/* the shrink was completed after the state was saved */
+		nilfs_resize_remove_state();
+		pending = 0;
+		if (resume_mode && !newsize)
+			newsize = rstate.newsize;
+	} else if (pending && layout.devsize != rstate.devsize) {
+		errx("the size of the file system has changed since the"
+		     ERR_NEWLINE "interrupted shrink to %" PRIu64 " bytes."
+		     ERR_NEWLINE "Run nilfs-resize with --abort to cancel it.",
+		     (uint64_t)rstate.newsize);
+		goto out_unlock;
+	} else if (pending && !resume_mode) {
+		if (!plan_only) {
+			errx("an interrupted shrink of %s to %" PRIu64
+			     " bytes is pending." ERR_NEWLINE
+			     "Run nilfs-resize with --resume to continue it,"
+			     ERR_NEWLINE "or with --abort to cancel it.",
+			     device, (uint64_t)rstate.newsize);
+			goto out_unlock;
+		}
+		msg("An interrupted shrink to %" PRIu64 " bytes is pending.\n",
+		    (uint64_t)rstate.newsize);
+	} else if (pending) {
+		char buf[64];
+
+		if (newsize && newsize != rstate.newsize) {
+			errx("size differs from that of the interrupted shrink (%"
+			     PRIu64 " bytes).", (uint64_t)rstate.newsize);
+			goto out_unlock;
+		}
+		newsize = rstate.newsize;
+		nilfs_resize_format_duration(rstate.elapsed, buf, sizeof(buf));
+		msg("Resuming the shrink from segment %" PRIu64 " (%" PRIu64
+		    " segments moved in %s so far).\n",
+		    (uint64_t)rstate.cursor, (uint64_t)rstate.nmoved, buf);
+	}
+
 	if (newsize == layout.devsize) {
 		msg("No need to resize the filesystem on %s.\n"
 		    "It already fits the device.\n", device);
@@ -1628,20 +2468,27 @@ static int nilfs_resize_online(const char *device, uint64_t newsize)
 		goto out_unlock;
 	}
 
-	nilfs_sync(nilfs, &cno);
+	if (plan_only && newsize > layout.devsize) {
+		msg("Extending the filesystem on %s moves no data.\n", device);
+		status = EXIT_SUCCESS;
+		goto out_unlock;
+	}
+
+	if (!plan_only)
+		nilfs_sync(nilfs, &cno);
 
 	if (newsize > layout.devsize)
 		status = nilfs_extend_online(nilfs, device, newsize);
 	else
 		status = nilfs_shrink_online(nilfs, device, newsize);
 
-	if (status == EXIT_SUCCESS)
-		msg("Done.\n");
-	else
-		msg("Aborted.\n");
+	if (!plan_only)
+		msg(status == EXIT_SUCCESS ? "Done.\n" : "Aborted.\n");
 
 out_unlock:
 	nilfs_close(nilfs);
+	free(rstate_path);
+	rstate_path = NULL;
 out:
 	return status;
 }
@@ -1668,16 +2515,28 @@ static void nilfs_resize_parse_options(int argc, char *argv[])
 	int c;
 
 #ifdef _GNU_SOURCE
-	while ((c = getopt_long(argc, argv, "hvyMPV",
+	while ((c = getopt_long(argc, argv, "abhnrvyMPV",
 				long_option, &option_index)) >= 0) {
 #else
-	while ((c = getopt(argc, argv, "hvyMPV")) >= 0) {
+	while ((c = getopt(argc, argv, "abhnrvyMPV")) >= 0) {
 #endif	/* _GNU_SOURCE */
 		switch (c) {
+		case 'a':
+			abort_mode = 1;
+			break;
+		case 'b':
+			plan_benchmark = 1;
+			break;
 		case 'h':
 			nilfs_resize_usage(stdout);
 			exit(EXIT_SUCCESS);
 			break;
+		case 'n':
+			plan_only = 1;
+			break;
+		case 'r':
+			resume_mode = 1;
+			break;
 		case 'v':
 			verbose = 1;
 			break;
@@ -1806,6 +2665,19 @@ int main(int argc, char *argv[])
 	if (unlikely(ret < 0))
 		goto out;
 
+	if (abort_mode && (resume_mode || plan_only)) {
+		errx("--abort cannot be used with --resume or --plan.");
+		goto out;
+	}
+	if (plan_benchmark && !plan_only) {
+		errx("--benchmark can be used only with --plan.");
+		goto out;
+	}
+	if (abort_mode && optind != argc) {
+		errx("size cannot be specified with --abort.");
+		goto out;
+	}
+
 	if (optind != argc) {
 		ret = nilfs_resize_parse_size(argv[optind], &size);
 		if (unlikely(ret < 0)) {
@@ -1834,7 +2706,8 @@ int main(int argc, char *argv[])
 			size = size2;
 		}
 	} else {
-		size = devsize;
+		/* A resumed shrink defaults to its saved target size */
+		size = resume_mode || abort_mode ? 0 : devsize;
 	}
 
 	ret = check_mount(device);
@@ -0,0 +1,281 @@
+/*
+ * nilfs-scrub.c - verify data checksums of nilfs2 segments
+ *
+ * Licensed under GPLv2: the complete text of the GNU General Public
+ * License can be found in COPYING file of the nilfs-utils package.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif	/* HAVE_CONFIG_H */
+
+#include <stdio.h>
+
+#if HAVE_STDLIB_H
+#include <stdlib.h>
+#endif	/* HAVE_STDLIB_H */
+
+#if HAVE_ERR_H
+#include <err.h>
+#endif	/* HAVE_ERR_H */
+
+#if HAVE_STRING_H
+#include <string.h>
+#endif	/* HAVE_STRING_H */
+
+#if HAVE_LIMITS_H
+#include <limits.h>	/* UINT_MAX */
+#endif	/* HAVE_LIMITS_H */
+
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include "nls.h"
+#include "nilfs.h"
+#include "nilfs_scrub.h"
+#include "parser.h"
+#include "compat.h"	/* getprogname() */
+#include "util.h"
+
+#ifdef _GNU_SOURCE
+#include <getopt.h>
+static const struct option long_option[] = {
+	{"bandwidth", required_argument, NULL, 'b'},
+	{"help", no_argument, NULL, 'h'},
+	{"jobs", required_argument, NULL, 'j'},
+	{"nsegments", required_argument, NULL, 'n'},
+	{"offline", no_argument, NULL, 'o'},
+	{"restart", no_argument, NULL, 'r'},
+	{"verbose", no_argument, NULL, 'v'},
+	{"version", no_argument, NULL, 'V'},
+	{"no-progress", no_argument, NULL, 'x'},
+	{NULL, 0, NULL, 0}
+};
+#define NILFS_SCRUB_USAGE						\
+	"Usage: %s [options] [device]\n"				\
+	"  -b, --bandwidth=RATE\tlimit reads to RATE bytes per second\n" \
+	"  -h, --help\t\tdisplay this help and exit\n"			\
+	"  -j, --jobs=COUNT\tverify COUNT segments in parallel\n"	\
+	"  -n, --nsegments=COUNT\tstop after verifying COUNT segments\n" \
+	"  -o, --offline\t\tscrub an unmounted device\n"		\
+	"  -r, --restart\t\tstart over from the first segment\n"	\
+	"  -v, --verbose\t\tverbose mode\n"				\
+	"  -V, --version\t\tdisplay version and exit\n"			\
+	"  -x, --no-progress\tneither resume nor save progress\n"
+#else
+#define NILFS_SCRUB_USAGE						\
+	"Usage: %s [-b rate] [-h] [-j jobs] [-n nsegments] [-o] [-r]\n"	\
+	"          [-v] [-V] [-x] [device]\n"
+#endif	/* _GNU_SOURCE */
+
+/* exit status */
+#define NILFS_SCRUB_EXIT_CORRUPTED	2
+
+/* options */
+static int show_version_only;
+static int verbose;
+static int offline;
+static int progress_flags;
+static int no_progress;
+static uint64_t bandwidth;
+static unsigned int njobs = 1;
+static uint64_t nsegments;
+
+static struct nilfs_scrub *nilfs_scrub;
+static uint64_t nilfs_scrub_nreported;
+
+
+NILFS_UTILS_GITID();
+
+static void nilfs_scrub_report(const struct nilfs_scrub_error *error,
+			       void *arg)
+{
+	size_t i;
+
+	printf("segment %" PRIu64 ", log at block %" PRIu64,
+	       error->segnum, error->blocknr);
+	if (error->nblocks > 0)
+		printf(" (%" PRIu32 " blocks)", error->nblocks);
+	printf(": %s", error->errstr);
+	if (error->ninos > 0) {
+		printf(", inodes");
+		for (i = 0; i < error->ninos; i++)
+			printf(" %" PRIu64, error->inos[i]);
+	}
+	putchar('\n');
+	fflush(stdout);
+	nilfs_scrub_nreported++;
+}
+
+static void nilfs_scrub_handle_signal(int signum)
+{
+	if (nilfs_scrub)
+		nilfs_scrub_stop(nilfs_scrub);
+}
+
+static void nilfs_scrub_parse_options(int argc, char *argv[])
+{
+	unsigned long val;
+	char *endptr;
+	int c;
+#ifdef _GNU_SOURCE
+	int option_index;
+
+	while ((c = getopt_long(argc, argv, "b:hj:n:orvVx",
+				long_option, &option_index)) >= 0) {
+#else
+	while ((c = getopt(argc, argv, "b:hj:n:orvVx")) >= 0) {
+#endif	/* _GNU_SOURCE */
+		switch (c) {
+		case 'b':
+			if (nilfs_parse_size(optarg, &bandwidth) < 0)
+				errx(EXIT_FAILURE, _("invalid bandwidth: %s"),
+				     optarg);
+			break;
+		case 'h':
+			printf(NILFS_SCRUB_USAGE, getprogname());
+			exit(EXIT_SUCCESS);
+		case 'j':
+			errno = 0;
+			val = strtoul(optarg, &endptr, 10);
+			if (endptr == optarg || *endptr != '\0' || errno ||
+			    val == 0 || val > UINT_MAX)
+				errx(EXIT_FAILURE, _("invalid job count: %s"),
+				     optarg);
+			njobs = val;
+			break;
+		case 'n':
+			errno = 0;
+			nsegments = strtoull(optarg, &endptr, 10);
+			if (endptr == optarg || *endptr != '\0' || errno)
+				errx(EXIT_FAILURE,
+				     _("invalid number of segments: %s"),
+				     optarg);
+			break;
+		case 'o':
+			offline = 1;
+			break;
+		case 'r':
+			progress_flags |= NILFS_SCRUB_PROGRESS_RESET;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		case 'V':
+			show_version_only = 1;
+			break;
+		case 'x':
+			no_progress = 1;
+			break;
+		default:
+			errx(EXIT_FAILURE, _("invalid option -- %c"), optopt);
+		}
+	}
+}
+
+static int nilfs_do_scrub(const char *device)
+{
+	struct nilfs_scrub_stat stat;
+	struct nilfs *nilfs;
+	ssize_t n;
+	int open_flags, ret, status = EXIT_FAILURE;
+
+	if (offline) {
+		if (!device)
+			errx(EXIT_FAILURE,
+			     _("device is required in offline mode"));
+		open_flags = NILFS_OPEN_OFFLINE;
+	} else {
+		open_flags = NILFS_OPEN_RAW | NILFS_OPEN_RDONLY |
+			NILFS_OPEN_SRCHDEV;
+	}
+
+	nilfs = nilfs_open(device, NULL, open_flags);
+	if (nilfs == NULL) {
+		warn(_("cannot open NILFS on %s"), device ? : "device");
+		return EXIT_FAILURE;
+	}
+
+	/* mapped segments can be read by the jobs in parallel */
+	if (nilfs_opt_set_mmap(nilfs) < 0)
+		warnx(_("cannot use mmap"));
+
+	nilfs_scrub = nilfs_scrub_create(nilfs);
+	if (nilfs_scrub == NULL) {
+		warn(_("cannot create scrubber"));
+		goto out_close;
+	}
+
+	if (!no_progress) {
+		ret = nilfs_scrub_set_progress(nilfs_scrub, NULL,
+					       progress_flags);
+		if (ret < 0) {
+			warn(_("cannot set up progress file"));
+			goto out_destroy;
+		}
+	}
+	nilfs_scrub_set_bandwidth(nilfs_scrub, bandwidth);
+	if (nilfs_scrub_set_jobs(nilfs_scrub, njobs) < 0) {
+		warn(_("cannot run %u jobs"), njobs);
+		goto out_destroy;
+	}
+	nilfs_scrub_set_reporter(nilfs_scrub, nilfs_scrub_report, NULL);
+
+	if (verbose)
+		printf(_("scrubbing from segment %" PRIu64 "\n"),
+		       nilfs_scrub_get_cursor(nilfs_scrub));
+
+	signal(SIGINT, nilfs_scrub_handle_signal);
+	signal(SIGTERM, nilfs_scrub_handle_signal);
+
+	n = nilfs_scrub_run(nilfs_scrub, nsegments);
+	if (n < 0) {
+		warn(_("scrubbing failed"));
+		goto out_destroy;
+	}
+
+	if (verbose) {
+		nilfs_scrub_get_stat(nilfs_scrub, &stat);
+		printf(_("verified %zd segments (%" PRIu64 " logs, %" PRIu64
+			 " bytes), %" PRIu64 " skipped, %" PRIu64
+			 " corrupted logs\n"),
+		       n, stat.nlogs, stat.nbytes, stat.nskipped,
+		       nilfs_scrub_nreported);
+		if (nilfs_scrub_get_cursor(nilfs_scrub) == 0)
+			printf(_("completed %" PRIu64 " passes\n"),
+			       stat.npasses);
+		else
+			printf(_("next segment is %" PRIu64 "\n"),
+			       nilfs_scrub_get_cursor(nilfs_scrub));
+	}
+
+	status = nilfs_scrub_nreported > 0 ?
+		NILFS_SCRUB_EXIT_CORRUPTED : EXIT_SUCCESS;
+
+out_destroy:
+	nilfs_scrub_destroy(nilfs_scrub);
+	nilfs_scrub = NULL;
+out_close:
+	nilfs_close(nilfs);
+	return status;
+}
+
+int main(int argc, char *argv[])
+{
+	char *device = NULL;
+	int status;
+
+	nilfs_scrub_parse_options(argc, argv);
+	if (show_version_only) {
+		printf(_("%s version %s\n"), getprogname(), PACKAGE_VERSION);
+		exit(EXIT_SUCCESS);
+	}
+
+	if (optind < argc)
+		device = argv[optind++];
+	if (optind < argc)
+		errx(EXIT_FAILURE, _("too many arguments."));
+
+	status = nilfs_do_scrub(device);
+	exit(status);
+}